@@ -0,0 +1,748 @@
+/* backup.c
+ * Full and incremental backups of a drop database.  See backup.h.
+ *
+ * Notes are appended under a shared lock on the journal, and a new journal
+ * replaces the old one under an exclusive lock, the way stats.c keeps its
+ * log: a writer that was waiting on the old journal finds it unlinked and
+ * notes into the new one.  A key is only noted after its write is committed,
+ * so a backup that reads the journal and then opens the database always finds
+ * the writes behind the notes it read.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "backup.h"
+#include "db.h"
+#include "db_util.h"
+#include "dedup.h"
+#include "io.h"
+#include "layer.h"
+#include "migrate.h"
+
+/* Records written to an incremental backup per transaction. */
+#define BACKUP_BATCH 10000
+
+struct journal {
+    struct Layer base;
+    char *path;
+    char *buf;          /* notes not yet appended */
+    size_t len;
+    size_t cap;
+    bool batch;
+};
+
+/* Where a backup directory's copy is up to. */
+struct position {
+    uint64_t id;
+    uint64_t off;
+};
+
+struct changed_key {
+    const char *key;    /* into the journal read */
+    size_t klen;
+};
+
+enum ChangesStatus { CHANGES_OK, CHANGES_RESTARTED, CHANGES_FAILED };
+
+static char *
+path_with(const char *a, const char *b, const char *c) {
+    size_t len = strlen(a) + strlen(b) + strlen(c) + 1;
+    char *path = malloc(len);
+    if (path != NULL)
+        snprintf(path, len, "%s%s%s", a, b, c);
+    return path;
+}
+
+static bool
+lock_wait(int fd, short type) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    while (fcntl(fd, F_SETLKW, &fl) != 0) {
+        if (errno != EINTR)
+            return false;
+    }
+    return true;
+}
+
+static double
+seconds_since(const struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec)
+         + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Journal layer */
+
+static bool
+note(struct journal *j, const char *key, size_t klen) {
+    uint32_t len = klen;
+    size_t need = j->len + sizeof(len) + klen;
+
+    if (need > j->cap) {
+        size_t cap = j->cap ? j->cap : 4096;
+        while (cap < need)
+            cap *= 2;
+        char *buf = realloc(j->buf, cap);
+        if (buf == NULL)
+            return false;
+        j->buf = buf;
+        j->cap = cap;
+    }
+    memcpy(j->buf + j->len, &len, sizeof(len));
+    memcpy(j->buf + j->len + sizeof(len), key, klen);
+    j->len = need;
+    return true;
+}
+
+static void
+journal_lost(struct journal *j) {
+    fprintf(stderr, "Could not note a change for the next backup, which will "
+            "be a full one.\n");
+    unlink(j->path);
+    j->len = 0;
+}
+
+/* Append the notes gathered so far, when there is a journal.  Only a full
+ * backup starts one: a journal that was removed, by hand or after a failure,
+ * stays removed, and until the first backup the notes go nowhere.
+ */
+static void
+flush_notes(struct journal *j) {
+    struct stat st;
+    bool ok = false;
+    int fd;
+
+    if (j->len == 0)
+        return;
+    for (;;) {
+        if ((fd = open(j->path, O_RDWR | O_APPEND)) < 0) {
+            ok = errno == ENOENT;
+            break;
+        }
+        if (!lock_wait(fd, F_RDLCK) || fstat(fd, &st) != 0) {
+            close(fd);
+            break;
+        }
+        if (st.st_nlink > 0) {
+            ok = io_write(fd, j->buf, j->len);
+            close(fd);
+            break;
+        }
+        close(fd);  /* restarted while we waited */
+    }
+    if (!ok)
+        journal_lost(j);
+    j->len = 0;
+}
+
+/* Note key after a write through the layer.  Outside a transaction the write
+ * is already committed.
+ */
+static bool
+noted(struct journal *j, bool ok, const char *key, size_t klen) {
+    if (!ok)
+        return false;
+    if (!note(j, key, klen))
+        journal_lost(j);
+    else if (!j->batch)
+        flush_notes(j);
+    return true;
+}
+
+static bool
+journal_store(struct journal *j, char *key, char *value) {
+    struct Layer *l = &j->base;
+    return noted(j, l->dbi->store(l->db, key, value), key, strlen(key));
+}
+
+static bool
+journal_try_store(struct journal *j, char *key, char *value) {
+    struct Layer *l = &j->base;
+    return noted(j, l->dbi->try_store(l->db, key, value), key, strlen(key));
+}
+
+static bool
+journal_store_len(struct journal *j, const char *key, size_t klen,
+        const char *value, size_t vlen) {
+    struct Layer *l = &j->base;
+    return noted(j, l->dbi->store_len(l->db, key, klen, value, vlen), key,
+                 klen);
+}
+
+static bool
+journal_try_store_len(struct journal *j, const char *key, size_t klen,
+        const char *value, size_t vlen) {
+    struct Layer *l = &j->base;
+    return noted(j, l->dbi->try_store_len(l->db, key, klen, value, vlen), key,
+                 klen);
+}
+
+static bool
+journal_append(struct journal *j, const char *key, size_t klen,
+        const char *value, size_t vlen) {
+    struct Layer *l = &j->base;
+    return noted(j, l->dbi->append(l->db, key, klen, value, vlen), key, klen);
+}
+
+static bool
+journal_delete(struct journal *j, const char *key) {
+    struct Layer *l = &j->base;
+    return noted(j, l->dbi->delete(l->db, key), key, strlen(key));
+}
+
+static bool
+journal_delete_len(struct journal *j, const char *key, size_t klen) {
+    struct Layer *l = &j->base;
+    return noted(j, l->dbi->delete_len(l->db, key, klen), key, klen);
+}
+
+static bool
+journal_begin(struct journal *j) {
+    struct Layer *l = &j->base;
+    if (!l->dbi->begin(l->db))
+        return false;
+    j->batch = true;
+    return true;
+}
+
+static bool
+journal_commit(struct journal *j) {
+    struct Layer *l = &j->base;
+    bool ok = l->dbi->commit(l->db);
+    j->batch = false;
+    if (ok)
+        flush_notes(j);
+    else
+        j->len = 0;
+    return ok;
+}
+
+/* What a backend cannot roll back stays written and has to be noted. */
+static bool
+journal_abort(struct journal *j) {
+    struct Layer *l = &j->base;
+    bool ok = l->dbi->abort(l->db);
+    j->batch = false;
+    if (ok)
+        j->len = 0;
+    else
+        flush_notes(j);
+    return ok;
+}
+
+static bool
+journal_close(struct journal *j) {
+    struct DbInterface *dbi = j->base.dbi;
+    bool ok;
+
+    flush_notes(j);
+    ok = dbi->close(j->base.db);
+    free(dbi);
+    free(j->buf);
+    free(j->path);
+    free(j);
+    return ok;
+}
+
+#define NOTE(hook, type, fn) \
+    if (iface->hook != NULL) iface->hook = (type) fn
+
+void *
+changes_attach(struct DbInterface *dbi, void *db, const char *file,
+        struct DbInterface **out) {
+    struct journal *j;
+    struct DbInterface *iface;
+
+    if ((j = calloc(1, sizeof(struct journal))) == NULL)
+        return db;
+    if ((j->path = path_with(file, CHANGES_SUFFIX, "")) == NULL
+    ||  (iface = malloc(sizeof(struct DbInterface))) == NULL) {
+        free(j->path);
+        free(j);
+        return db;
+    }
+    j->base.dbi = dbi;
+    j->base.db = db;
+
+    layer_forward(iface, dbi);
+    iface->close = (close_func) journal_close;
+    NOTE(store, store_func, journal_store);
+    NOTE(try_store, try_store_func, journal_try_store);
+    NOTE(store_len, store_len_func, journal_store_len);
+    NOTE(try_store_len, try_store_len_func, journal_try_store_len);
+    NOTE(append, append_func, journal_append);
+    NOTE(delete, delete_func, journal_delete);
+    NOTE(delete_len, delete_len_func, journal_delete_len);
+    if (dbi->begin != NULL && dbi->commit != NULL && dbi->abort != NULL) {
+        iface->begin = (begin_func) journal_begin;
+        iface->commit = (commit_func) journal_commit;
+        iface->abort = (abort_func) journal_abort;
+    }
+
+    *out = iface;
+    return j;
+}
+
+/* Reading and restarting the journal */
+
+static uint64_t
+new_id(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec)
+         ^ (uint64_t) getpid() << 40;
+}
+
+/* Replace the journal of the database at file with an empty one and set
+ * *start to where it begins.
+ */
+static bool
+changes_restart(const char *file, struct position *start) {
+    struct changes_header h;
+    char *path = path_with(file, CHANGES_SUFFIX, "");
+    char *tmp = path_with(file, CHANGES_SUFFIX, ".tmp");
+    bool ok = false;
+    int fd = -1, old;
+
+    if (path == NULL || tmp == NULL
+    ||  (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) < 0)
+        goto done;
+    memcpy(h.magic, CHANGES_MAGIC, sizeof(h.magic));
+    h.id = new_id();
+    if (!io_write(fd, &h, sizeof(h)) || close(fd) != 0) {
+        fd = -1;
+        goto done;
+    }
+    fd = -1;
+
+    /* Writers noting into the old journal finish before it is replaced. */
+    if ((old = open(path, O_RDWR)) >= 0)
+        lock_wait(old, F_WRLCK);
+    ok = rename(tmp, path) == 0;
+    if (old >= 0)
+        close(old);
+    start->id = h.id;
+    start->off = sizeof(h);
+
+done:
+    if (!ok) {
+        fprintf(stderr, "Could not start the change journal \"%s\": %s\n",
+                path ? path : file, strerror(errno));
+        if (tmp != NULL)
+            unlink(tmp);
+    }
+    if (fd >= 0)
+        close(fd);
+    free(path);
+    free(tmp);
+    return ok;
+}
+
+static uint32_t
+hash_key(const char *key, size_t len) {
+    uint32_t h = 2166136261U;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char) key[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/* Read the keys noted in the journal of the database at file since from,
+ * each once, into *keys and *count; they point into *data.  *end is set to
+ * just past the last whole note.
+ */
+static enum ChangesStatus
+changes_since(const char *file, const struct position *from,
+        struct position *end, char **data, struct changed_key **keys,
+        size_t *count) {
+    char *path = path_with(file, CHANGES_SUFFIX, "");
+    struct changes_header h;
+    enum ChangesStatus status = CHANGES_FAILED;
+    uint32_t *slots = NULL;
+    struct stat st;
+    int fd = -1;
+
+    *data = NULL;
+    *keys = NULL;
+    *count = 0;
+    if (path == NULL)
+        goto done;
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        if (errno == ENOENT)
+            status = CHANGES_RESTARTED;
+        else
+            fprintf(stderr, "Could not open \"%s\": %s\n", path,
+                    strerror(errno));
+        goto done;
+    }
+    if (fstat(fd, &st) != 0 || !io_pread(fd, &h, sizeof(h), 0)) {
+        fprintf(stderr, "Could not read \"%s\": %s\n", path, strerror(errno));
+        goto done;
+    }
+    if (memcmp(h.magic, CHANGES_MAGIC, sizeof(h.magic)) != 0
+    ||  h.id != from->id || from->off > (uint64_t) st.st_size) {
+        status = CHANGES_RESTARTED;
+        goto done;
+    }
+
+    size_t size = st.st_size - from->off, max = size / sizeof(uint32_t) + 1;
+    size_t nslots = 16, off = 0;
+    while (nslots < max * 2)
+        nslots *= 2;
+    if ((*data = malloc(size + 1)) == NULL
+    ||  (*keys = malloc(max * sizeof(struct changed_key))) == NULL
+    ||  (slots = calloc(nslots, sizeof(uint32_t))) == NULL) {
+        fprintf(stderr, "backup: malloc failed.\n");
+        goto done;
+    }
+    if (!io_pread(fd, *data, size, from->off)) {
+        fprintf(stderr, "Could not read \"%s\": %s\n", path, strerror(errno));
+        goto done;
+    }
+
+    /* A note still being appended is left for the next backup. */
+    uint32_t klen;
+    while (off + sizeof(klen) <= size) {
+        memcpy(&klen, *data + off, sizeof(klen));
+        if (klen > size - off - sizeof(klen))
+            break;
+        const char *key = *data + off + sizeof(klen);
+        size_t i = hash_key(key, klen) & (nslots - 1);
+        for (; slots[i] != 0; i = (i + 1) & (nslots - 1)) {
+            struct changed_key *k = *keys + slots[i] - 1;
+            if (k->klen == klen && memcmp(k->key, key, klen) == 0)
+                break;
+        }
+        if (slots[i] == 0) {
+            (*keys)[*count].key = key;
+            (*keys)[*count].klen = klen;
+            slots[i] = ++*count;
+        }
+        off += sizeof(klen) + klen;
+    }
+    end->id = from->id;
+    end->off = from->off + off;
+    status = CHANGES_OK;
+
+done:
+    if (status != CHANGES_OK) {
+        free(*data);
+        free(*keys);
+        *data = NULL;
+        *keys = NULL;
+    }
+    if (fd >= 0)
+        close(fd);
+    free(slots);
+    free(path);
+    return status;
+}
+
+/* Backup positions */
+
+static bool
+load_position(const char *path, struct position *pos) {
+    unsigned long long id, off;
+    FILE *f = fopen(path, "r");
+    bool ok;
+
+    if (f == NULL)
+        return false;
+    ok = fscanf(f, "%llx %llu", &id, &off) == 2;
+    fclose(f);
+    pos->id = id;
+    pos->off = off;
+    return ok;
+}
+
+static bool
+save_position(const char *path, const struct position *pos) {
+    char *tmp = path_with(path, ".tmp", "");
+    FILE *f = NULL;
+    int fd = -1;
+    bool ok;
+
+    if (tmp == NULL
+    ||  (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR))
+        == -1
+    ||  (f = fdopen(fd, "w")) == NULL) {
+        if (fd != -1)
+            close(fd);
+        free(tmp);
+        return false;
+    }
+    ok = fprintf(f, "%016llx %llu\n", (unsigned long long) pos->id,
+                 (unsigned long long) pos->off) > 0;
+    ok = fclose(f) == 0 && ok && rename(tmp, path) == 0;
+    if (!ok)
+        unlink(tmp);
+    free(tmp);
+    return ok;
+}
+
+/* Backups */
+
+/* Copy the file at src to dest, through the backend's copy call or record by
+ * record.
+ */
+static bool
+copy_file(struct DbInterface *dbi, const char *src, const char *dest) {
+    void *db, *out;
+    bool ok;
+
+    if ((db = dbi->open(src, DB_READ)) == NULL) {
+        fprintf(stderr, "Could not open database: %s\n:%s\n", src,
+                dbi->strerror(dbi->get_errno(NULL)));
+        return false;
+    }
+    if (dbi->copy != NULL) {
+        if (!(ok = dbi->copy(db, dest)))
+            fprintf(stderr, "Could not copy the database to \"%s\": %s\n",
+                    dest, dbi->strerror(dbi->get_errno(db)));
+    } else if ((out = dbi->open(dest, DB_WRITE)) != NULL) {
+        struct MigrateSum sum;
+        ok = migrate_copy(dbi, db, dbi, out, &sum);
+        ok = dbi->close(out) && ok;
+    } else {
+        fprintf(stderr, "Could not create \"%s\": %s\n", dest,
+                dbi->strerror(dbi->get_errno(NULL)));
+        ok = false;
+    }
+    dbi->close(db);
+    if (!ok)
+        unlink(dest);
+    return ok;
+}
+
+/* A value store is copied after the database, so that it holds every value
+ * the copied records refer to, and moved into place first.
+ */
+static bool
+full_backup(struct DbInterface *dbi, const char *file, const char *copy,
+        const char *posfile) {
+    struct position start;
+    struct timespec began;
+    struct stat st;
+    char *tmp = path_with(copy, ".tmp", "");
+    char *store = path_with(file, DEDUP_SUFFIX, "");
+    char *store_copy = path_with(copy, DEDUP_SUFFIX, "");
+    char *store_tmp = path_with(copy, DEDUP_SUFFIX, ".tmp");
+    bool ok = false, shared;
+
+    clock_gettime(CLOCK_MONOTONIC, &began);
+    if (tmp == NULL || store == NULL || store_copy == NULL
+    ||  store_tmp == NULL || !changes_restart(file, &start))
+        goto done;
+    shared = access(store, F_OK) == 0;
+    if (!copy_file(dbi, file, tmp))
+        goto done;
+    if (shared && !copy_file(dbi, store, store_tmp)) {
+        unlink(tmp);
+        goto done;
+    }
+
+    if ((shared && rename(store_tmp, store_copy) != 0)
+    ||  rename(tmp, copy) != 0) {
+        fprintf(stderr, "Could not move the copy into place in \"%s\": "
+                "%s\n", copy, strerror(errno));
+        unlink(tmp);
+        unlink(store_tmp);
+        goto done;
+    }
+    ok = true;
+    if (!save_position(posfile, &start)) {
+        fprintf(stderr, "Could not write \"%s\"; the next backup will be a "
+                "full one.\n", posfile);
+    }
+    if (stat(copy, &st) != 0)
+        st.st_size = 0;
+    fprintf(stderr, "Copied %lld bytes to %s in %.3fs\n",
+            (long long) st.st_size, copy, seconds_since(&began));
+
+done:
+    free(tmp);
+    free(store);
+    free(store_copy);
+    free(store_tmp);
+    return ok;
+}
+
+static bool
+ship_changes(struct DbInterface *sdbi, void *db, struct DbInterface *dbi,
+        void *out, const struct changed_key *keys, size_t count,
+        size_t *deleted) {
+    size_t pending = 0;
+
+    *deleted = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const struct changed_key *k = keys + i;
+        size_t vlen;
+        char *owned;
+        bool ok;
+
+        if (pending == 0 && dbi->begin && !dbi->begin(out)) {
+            fprintf(stderr, "Could not begin transaction: %s\n",
+                    dbi->strerror(dbi->get_errno(out)));
+            return false;
+        }
+        const char *value = dbi_fetch(sdbi, db, k->key, k->klen, &vlen,
+                                      &owned);
+        if (value != NULL) {
+            ok = dbi_store(dbi, out, k->key, k->klen, value, vlen, true);
+        } else {
+            dbi_delete(dbi, out, k->key, k->klen);  /* may never have been */
+            ok = true;
+            ++*deleted;
+        }
+        free(owned);
+        if (!ok) {
+            fprintf(stderr, "Could not write '%.*s': %s\n", (int) k->klen,
+                    k->key, dbi->strerror(dbi->get_errno(out)));
+            if (dbi->abort)
+                dbi->abort(out);
+            return false;
+        }
+        if (++pending == BACKUP_BATCH) {
+            if (dbi->commit && !dbi->commit(out))
+                return false;
+            pending = 0;
+        }
+    }
+    return pending == 0 || !dbi->commit || dbi->commit(out);
+}
+
+/* Open the database at file with its value store, if it has one.  Sets *out
+ * to the interface to use with the handle, which close_stored releases.
+ */
+static void *
+open_stored(struct DbInterface *dbi, const char *file, enum OpenMode mode,
+        struct DbInterface **out) {
+    struct DbInterface *inner = malloc(sizeof(struct DbInterface));
+    void *db, *dd;
+
+    *out = dbi;
+    if (inner == NULL || (db = dbi->open(file, mode)) == NULL) {
+        free(inner);
+        return NULL;
+    }
+    /* The layer frees the interface beneath it when it is closed. */
+    memcpy(inner, dbi, sizeof(struct DbInterface));
+    if ((dd = dedup_attach(inner, db, file, mode, false, out)) == NULL)
+        dbi->close(db);
+    if (dd != NULL && dd != db)
+        return dd;
+    free(inner);
+    return dd;
+}
+
+static bool
+close_stored(struct DbInterface *dbi, struct DbInterface *layered, void *db) {
+    bool ok = layered->close(db);
+    if (layered != dbi)
+        free(layered);
+    return ok;
+}
+
+static enum ChangesStatus
+incremental_backup(struct DbInterface *dbi, const char *file,
+        const char *copy, const char *posfile, const struct position *from) {
+    struct DbInterface *sdbi, *odbi;
+    struct changed_key *keys;
+    struct position end;
+    struct timespec began;
+    enum ChangesStatus status;
+    size_t count, deleted;
+    char *data;
+    void *db, *out = NULL;
+    bool ok = false;
+
+    clock_gettime(CLOCK_MONOTONIC, &began);
+    status = changes_since(file, from, &end, &data, &keys, &count);
+    if (status != CHANGES_OK)
+        return status;
+
+    /* Values are read whole from the database and shared again in the
+     * copy's own value store, when it has one. */
+    if ((db = open_stored(dbi, file, DB_READ, &sdbi)) == NULL) {
+        fprintf(stderr, "Could not open database: %s\n:%s\n", file,
+                dbi->strerror(dbi->get_errno(NULL)));
+        goto done;
+    }
+    if ((out = open_stored(dbi, copy, DB_WRITE, &odbi)) == NULL) {
+        fprintf(stderr, "Could not open the backup: %s\n:%s\n", copy,
+                dbi->strerror(dbi->get_errno(NULL)));
+        close_stored(dbi, sdbi, db);
+        goto done;
+    }
+    ok = ship_changes(sdbi, db, odbi, out, keys, count, &deleted);
+    close_stored(dbi, sdbi, db);
+    ok = close_stored(dbi, odbi, out) && ok;
+    if (ok && !save_position(posfile, &end)) {
+        fprintf(stderr, "Could not write \"%s\": %s\n", posfile,
+                strerror(errno));
+        ok = false;
+    }
+    if (ok)
+        fprintf(stderr, "Copied %zu changed records (%zu gone) to %s in "
+                "%.3fs\n", count, deleted, copy, seconds_since(&began));
+
+done:
+    free(data);
+    free(keys);
+    return ok ? CHANGES_OK : CHANGES_FAILED;
+}
+
+bool
+backup_db(struct DbInterface *dbi, const char *file, const char *dir,
+        bool full) {
+    const char *slash = strrchr(file, '/');
+    char *copy = path_with(dir, "/", slash ? slash + 1 : file);
+    char *posfile = copy ? path_with(copy, ".position", "") : NULL;
+    struct position from;
+    bool ok = false;
+
+    if (posfile == NULL) {
+        fprintf(stderr, "backup: malloc failed.\n");
+        goto done;
+    }
+    if (mkdir(dir, S_IRWXU) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Could not create \"%s\": %s\n", dir,
+                strerror(errno));
+        goto done;
+    }
+
+    if (!full && access(copy, F_OK) == 0 && load_position(posfile, &from)) {
+        switch (incremental_backup(dbi, file, copy, posfile, &from)) {
+            case CHANGES_OK:
+                ok = true;
+                goto done;
+            case CHANGES_FAILED:
+                goto done;
+            case CHANGES_RESTARTED:
+                fprintf(stderr, "The change journal has been restarted "
+                        "since the last backup to %s.\n", dir);
+                break;
+        }
+    }
+    ok = full_backup(dbi, file, copy, posfile);
+
+done:
+    free(copy);
+    free(posfile);
+    return ok;
+}
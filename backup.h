@@ -0,0 +1,53 @@
+#ifndef BACKUP_H__
+#define BACKUP_H__
+
+/* Backups of a drop database into a directory, for 'drop backup'.
+ *
+ * A full backup has the backend copy its file while it stays open, or copies
+ * record by record for backends that cannot.  It also starts a journal at
+ * file + CHANGES_SUFFIX.  From then on every write to the database notes its
+ * key there, and an incremental backup only copies the records whose keys
+ * were noted since the last one, reading their values from the database as
+ * they are now.  A key whose record is gone is deleted from the copy.
+ *
+ * The journal is struct changes_header followed by a 4 byte key length and
+ * the key for each write.  A position in it, the journal's id and an offset,
+ * is the change sequence: the backup directory keeps the position its copy
+ * is up to date with in DIR/<db name>.position.  A full backup starts a new
+ * journal with a new id, which makes every other backup directory's position
+ * stale and its next backup a full one.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "db.h"
+
+#define CHANGES_SUFFIX ".changes"
+#define CHANGES_MAGIC "DROPCHG1"
+
+struct changes_header {
+    char magic[8];
+    uint64_t id;
+};
+
+/* Layer the journal of the database at file over dbi and db.  Returns the
+ * layer's handle and sets *out to its interface, or returns db unchanged
+ * when out of memory.  A key is noted once its write has been committed, in
+ * the journal as it is then: the layer goes on every writer, even before the
+ * first backup, so that a writer already open when a full backup starts the
+ * journal notes its writes from then on.  A note that cannot be written
+ * removes the journal, so that the next backup is a full one.
+ */
+void *changes_attach(struct DbInterface *dbi, void *db, const char *file,
+                     struct DbInterface **out);
+
+/* Back up the database at file, of the backend dbi, into dir.  The backup is
+ * incremental when dir holds a copy whose position is in the current journal
+ * and full is not set.  The database is opened here, once the journal has
+ * been read or restarted.  Returns false after printing an error.
+ */
+bool backup_db(struct DbInterface *dbi, const char *file, const char *dir,
+               bool full);
+
+#endif /* BACKUP_H__ */
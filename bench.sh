@@ -0,0 +1,94 @@
+#!/bin/sh
+# bench.sh
+# Time whole drop invocations against synthetic stores, for every backend
+# that has been built.  Each result is one JSON line in $BENCH_OUT.
+#
+#   BENCH_SIZES   store sizes, in entries              (default "1000 100000")
+#   BENCH_VALUES  value length, N or MIN-MAX uniform   (default "16-256")
+#   BENCH_RUNS    invocations per measurement          (default 200)
+#   BENCH_OUT     results file          (default bench-<date>.jsonl)
+#   BENCH_DROP    drop binary to measure               (default ./drop)
+#
+# The "startup" rows look up a missing key in an empty store, which is the
+# cost of finding, loading and opening the database with no real work.
+
+set -e
+
+sizes=${BENCH_SIZES:-"1000 100000"}
+values=${BENCH_VALUES:-"16-256"}
+runs=${BENCH_RUNS:-200}
+out=${BENCH_OUT:-bench-$(date +%Y%m%d-%H%M%S).jsonl}
+drop=${BENCH_DROP:-./drop}
+here=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d "${TMPDIR:-/tmp}/drop-bench.XXXXXX")
+trap 'rm -rf "$work"' EXIT INT TERM
+
+export BENCH_ALLOCS="$here/bench_allocs.so"
+export DROP_SOCKET="$work/none.sock"
+unset XDG_RUNTIME_DIR
+
+case $drop in
+    /*) ;;
+    *) drop="$here/${drop#./}" ;;
+esac
+
+# Write "KEY VALUE" lines for n entries with values drawn from $values.
+generate() {
+    awk -v n="$1" -v spec="$values" 'BEGIN {
+        srand(1)
+        if (split(spec, r, "-") == 2) { lo = r[1]; hi = r[2] }
+        else { lo = spec; hi = spec }
+        pad = "abcdefghijklmnopqrstuvwxyz0123456789"
+        while (length(pad) < hi) pad = pad pad
+        for (i = 0; i < n; ++i) {
+            len = lo + int(rand() * (hi - lo + 1))
+            printf "k%08d %s\n", i, substr(pad, 1 + i % 36, len)
+        }
+    }'
+}
+
+# measure LABEL KEYS [INPUT] -- ARGS...
+measure() {
+    label=$1 keys=$2 input=$3
+    shift 4
+    if [ -n "$input" ]; then
+        "$here/bench_run" -n "$runs" -k "$keys" -i "$input" -l "$label" \
+            -- "$drop" "$@"
+    else
+        "$here/bench_run" -n "$runs" -k "$keys" -l "$label" -- "$drop" "$@"
+    fi | sed "s/^{/{\"backend\": \"$backend\", \"entries\": $size, /" >> "$out"
+}
+
+: > "$out"
+for pair in dbm:gdbm tcb:tcbdb log:log; do
+    ext=${pair%%:*}
+    backend=${pair#*:}
+    if [ ! -e "$here/db_$backend.so" ] && [ "${drop##*/}" = drop ]; then
+        echo "Skipping $backend: db_$backend.so is not built." >&2
+        continue
+    fi
+
+    export XDG_DATA_HOME="$work/$backend-0"
+    mkdir -p "$XDG_DATA_HOME"
+    : > "$XDG_DATA_HOME/drop.$ext"
+    size=0
+    measure startup 1 "" -- missing
+
+    for size in $sizes; do
+        export XDG_DATA_HOME="$work/$backend-$size"
+        mkdir -p "$XDG_DATA_HOME"
+        : > "$XDG_DATA_HOME/drop.$ext"
+        generate "$size" > "$work/input"
+        "$drop" import "$work/input" 2>/dev/null
+        echo "$backend, $size entries" >&2
+
+        echo value > "$work/value"
+        measure print "$size" "" -- k%r
+        measure print-miss "$size" "" -- missing
+        measure add "$size" "$work/value" -- add new%n
+        measure delete "$size" "" -- delete new%n
+        measure list "$size" "" -- list
+        measure fulllist "$size" "" -- fulllist
+    done
+done
+echo "Results written to $out" >&2
@@ -0,0 +1,346 @@
+/* bench_db.c
+ * Throughput of a backend driven straight through its DbInterface, with no
+ * drop process around it:
+ *
+ *   bench_db [-n counts] [-k key_lengths] [-v value_sizes] [-t] [-d dir]
+ *            db_<type>.so...
+ *
+ * Each of -n, -k and -v takes a comma separated list, and every combination
+ * is run against every library.  -t wraps each workload in one transaction.
+ * Results are printed one workload per line; a non-zero errors column means
+ * the backend returned something other than what was stored.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <dlfcn.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "db.h"
+
+#define MAX_LIST 16
+
+struct config {
+    unsigned long count;
+    size_t klen;
+    size_t vlen;
+    bool tx;
+};
+
+struct bench {
+    struct DbInterface *dbi;
+    void *db;
+    const char *name;
+    const struct config *cfg;
+    char **keys;
+    char **missing;
+    unsigned long *order;   /* a random permutation of the key indexes */
+    char *value;
+};
+
+static void
+usage(void) {
+    fprintf(stderr, "Usage: bench_db [-n counts] [-k key_lengths] "
+            "[-v value_sizes] [-t] [-d dir] db_<type>.so...\n");
+    exit(EXIT_FAILURE);
+}
+
+static int
+parse_list(const char *arg, unsigned long *out) {
+    char *end;
+    int n = 0;
+    do {
+        if (n == MAX_LIST)
+            usage();
+        out[n++] = strtoul(arg, &end, 10);
+        if (end == arg || (*end != ',' && *end != '\0'))
+            usage();
+        arg = end + 1;
+    } while (*end == ',');
+    return n;
+}
+
+static double
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Keys are the index, zero padded to the key length, with a prefix letter
+ * so that the missing keys never collide with the stored ones.
+ */
+static char **
+make_keys(unsigned long count, size_t klen, char prefix) {
+    char **keys = malloc(count * sizeof(char*));
+    if (keys == NULL)
+        return NULL;
+    for (unsigned long i = 0; i < count; ++i) {
+        size_t len = klen < 24 ? 24 : klen;
+        if ((keys[i] = malloc(len + 2)) == NULL)
+            return NULL;
+        snprintf(keys[i], len + 2, "%c%0*lu", prefix,
+                 (int) (klen > 1 ? klen - 1 : 1), i);
+    }
+    return keys;
+}
+
+static void
+free_keys(char **keys, unsigned long count) {
+    if (keys == NULL)
+        return;
+    for (unsigned long i = 0; i < count; ++i)
+        free(keys[i]);
+    free(keys);
+}
+
+static void
+report(struct bench *b, const char *workload, unsigned long ops,
+        double secs, unsigned long errors) {
+    printf("%-14s %9lu %5zu %7zu  %-16s %12.0f %10.1f %7lu\n", b->name,
+           b->cfg->count, b->cfg->klen, b->cfg->vlen, workload,
+           secs > 0 ? ops / secs : 0.0, secs * 1e9 / (ops ? ops : 1), errors);
+    fflush(stdout);
+}
+
+static void
+begin(struct bench *b) {
+    if (b->cfg->tx && b->dbi->begin != NULL)
+        b->dbi->begin(b->db);
+}
+
+static void
+commit(struct bench *b) {
+    if (b->cfg->tx && b->dbi->commit != NULL)
+        b->dbi->commit(b->db);
+}
+
+/* Store every key, in order or in the shuffled order, with store or
+ * try_store.  expect is whether each call should succeed.
+ */
+static void
+run_store(struct bench *b, const char *workload, char **keys, bool shuffled,
+        bool try, bool expect) {
+    unsigned long errors = 0, n = b->cfg->count;
+    double start = now();
+
+    begin(b);
+    for (unsigned long i = 0; i < n; ++i) {
+        char *key = keys[shuffled ? b->order[i] : i];
+        bool ok = try ? b->dbi->try_store(b->db, key, b->value)
+                      : b->dbi->store(b->db, key, b->value);
+        errors += ok != expect;
+    }
+    commit(b);
+    report(b, workload, n, now() - start, errors);
+}
+
+static void
+run_fetch(struct bench *b, const char *workload, char **keys, bool hit) {
+    unsigned long errors = 0, n = b->cfg->count;
+    double start = now();
+
+    for (unsigned long i = 0; i < n; ++i) {
+        char *value = b->dbi->fetch(b->db, keys[b->order[i]]);
+        if (hit)
+            errors += value == NULL || strlen(value) != b->cfg->vlen;
+        else
+            errors += value != NULL;
+        free(value);
+    }
+    report(b, workload, n, now() - start, errors);
+}
+
+static void
+run_fetch_borrow(struct bench *b) {
+    unsigned long errors = 0, n = b->cfg->count;
+    double start = now();
+
+    for (unsigned long i = 0; i < n; ++i) {
+        const char *key = b->keys[b->order[i]];
+        size_t vlen;
+        const char *value = b->dbi->fetch_borrow(b->db, key, strlen(key),
+                                                 &vlen);
+        errors += value == NULL || vlen != b->cfg->vlen;
+    }
+    report(b, "fetch_borrow", n, now() - start, errors);
+}
+
+static void
+run_scan(struct bench *b) {
+    unsigned long seen = 0;
+    double start = now();
+    void *cur = b->dbi->create_cursor(b->db);
+
+    if (b->dbi->cursor_first(b->db, &cur)) {
+        do {
+            char *key = b->dbi->cursor_key(b->db, &cur);
+            char *value = b->dbi->cursor_value(b->db, &cur);
+            seen += key != NULL && value != NULL;
+            free(key);
+            free(value);
+        } while (b->dbi->cursor_next(b->db, &cur));
+    }
+    b->dbi->destroy_cursor(&cur);
+    report(b, "scan", seen, now() - start,
+           seen > b->cfg->count ? seen - b->cfg->count : b->cfg->count - seen);
+}
+
+static void
+run_batch_scan(struct bench *b) {
+    static struct CursorRecord records[1024];
+    struct CursorBatch batch;
+    unsigned long seen = 0;
+    double start = now();
+    void *cur = b->dbi->create_cursor(b->db);
+
+    memset(&batch, 0, sizeof(batch));
+    batch.arena_len = 1 << 20;
+    batch.records = records;
+    batch.max = sizeof(records) / sizeof(records[0]);
+    batch.values = true;
+    if ((batch.arena = malloc(batch.arena_len)) != NULL
+    &&  b->dbi->cursor_first(b->db, &cur)) {
+        do {
+            if (b->dbi->cursor_batch(b->db, &cur, &batch) == 0
+            &&  !batch.done) {
+                char *bigger = realloc(batch.arena, batch.need);
+                if (bigger == NULL)
+                    break;
+                batch.arena = bigger;
+                batch.arena_len = batch.need;
+                continue;
+            }
+            seen += batch.count;
+        } while (!batch.done);
+    }
+    b->dbi->destroy_cursor(&cur);
+    free(batch.arena);
+    report(b, "scan_batch", seen, now() - start,
+           seen > b->cfg->count ? seen - b->cfg->count : b->cfg->count - seen);
+}
+
+static void
+run_delete(struct bench *b, char **keys) {
+    unsigned long errors = 0, n = b->cfg->count;
+    double start = now();
+
+    begin(b);
+    for (unsigned long i = 0; i < n; ++i)
+        errors += !b->dbi->delete(b->db, keys[b->order[i]]);
+    commit(b);
+    report(b, "delete", n, now() - start, errors);
+}
+
+/* Run every workload for one library and configuration on a fresh file. */
+static bool
+run(const char *lib, const char *dir, const struct config *cfg) {
+    struct bench b;
+    get_interface_func get_interface;
+    char path[4096];
+    void *handle, *sym;
+    bool ok = false;
+
+    memset(&b, 0, sizeof(b));
+    b.cfg = cfg;
+    b.name = strrchr(lib, '/') ? strrchr(lib, '/') + 1 : lib;
+    if ((handle = dlopen(lib, RTLD_NOW)) == NULL
+    ||  (sym = dlsym(handle, "get_interface")) == NULL) {
+        fprintf(stderr, "Could not load %s: %s\n", lib, dlerror());
+        return false;
+    }
+    *(void**) (&get_interface) = sym;
+    if ((b.dbi = get_interface()) == NULL)
+        return false;
+
+    snprintf(path, sizeof(path), "%s/bench_db.%ld", dir, (long) getpid());
+    unlink(path);
+    if ((b.db = b.dbi->open(path, DB_WRITE)) == NULL) {
+        fprintf(stderr, "%s: could not open %s\n", b.name, path);
+        free(b.dbi);
+        return false;
+    }
+
+    b.keys = make_keys(cfg->count, cfg->klen, 'k');
+    b.missing = make_keys(cfg->count, cfg->klen, 'm');
+    b.order = malloc(cfg->count * sizeof(unsigned long));
+    b.value = malloc(cfg->vlen + 1);
+    if (b.keys == NULL || b.missing == NULL || b.order == NULL
+    ||  b.value == NULL) {
+        fprintf(stderr, "bench_db: out of memory.\n");
+        goto out;
+    }
+    for (size_t i = 0; i < cfg->vlen; ++i)
+        b.value[i] = 'a' + i % 26;
+    b.value[cfg->vlen] = '\0';
+    for (unsigned long i = 0; i < cfg->count; ++i)
+        b.order[i] = i;
+    for (unsigned long i = cfg->count; i > 1; --i) {
+        unsigned long j = random() % i, t = b.order[i - 1];
+        b.order[i - 1] = b.order[j];
+        b.order[j] = t;
+    }
+
+    run_store(&b, "store_seq", b.keys, false, false, true);
+    run_store(&b, "store_rand", b.keys, true, false, true);
+    run_store(&b, "try_store_dup", b.keys, true, true, false);
+    run_fetch(&b, "fetch_hit", b.keys, true);
+    if (b.dbi->fetch_borrow != NULL)
+        run_fetch_borrow(&b);
+    run_fetch(&b, "fetch_miss", b.missing, false);
+    run_scan(&b);
+    if (b.dbi->cursor_batch != NULL)
+        run_batch_scan(&b);
+    run_delete(&b, b.keys);
+    run_store(&b, "try_store_new", b.missing, true, true, true);
+    ok = true;
+
+out:
+    b.dbi->close(b.db);
+    unlink(path);
+    free(b.dbi);
+    free_keys(b.keys, cfg->count);
+    free_keys(b.missing, cfg->count);
+    free(b.order);
+    free(b.value);
+    return ok;
+}
+
+int
+main(int argc, char *argv[]) {
+    unsigned long counts[MAX_LIST] = { 100000 }, klens[MAX_LIST] = { 16 },
+                  vlens[MAX_LIST] = { 100 };
+    int ncounts = 1, nklens = 1, nvlens = 1, c;
+    const char *dir = "/tmp";
+    bool tx = false, ok = true;
+
+    while ((c = getopt(argc, argv, "n:k:v:td:")) != -1) {
+        switch (c) {
+            case 'n': ncounts = parse_list(optarg, counts); break;
+            case 'k': nklens = parse_list(optarg, klens); break;
+            case 'v': nvlens = parse_list(optarg, vlens); break;
+            case 't': tx = true; break;
+            case 'd': dir = optarg; break;
+            default: usage();
+        }
+    }
+    if (optind == argc)
+        usage();
+
+    srandom(1);
+    printf("%-14s %9s %5s %7s  %-16s %12s %10s %7s\n", "backend", "keys",
+           "klen", "vlen", "workload", "ops/s", "ns/op", "errors");
+    for (int l = optind; l < argc; ++l)
+        for (int n = 0; n < ncounts; ++n)
+            for (int k = 0; k < nklens; ++k)
+                for (int v = 0; v < nvlens; ++v) {
+                    struct config cfg = { counts[n], klens[k], vlens[v], tx };
+                    ok = run(argv[l], dir, &cfg) && ok;
+                }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
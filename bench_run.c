@@ -0,0 +1,262 @@
+/* bench_run.c
+ * Run a command many times and report how long one invocation takes, as a
+ * line of JSON on stdout:
+ *
+ *   bench_run [-n runs] [-k keys] [-i input] [-l label] -- command [args...]
+ *
+ * In the arguments, %n becomes the run number and %r a random number below
+ * keys, each as eight digits.  stdin comes from input (or /dev/null) and
+ * stdout goes to /dev/null.  One more run is made with $BENCH_ALLOCS
+ * preloaded to count allocations, and one under strace -c to count system
+ * calls, when those are available; neither is included in the timings.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAX_ARGS 64
+
+struct run_opts {
+    const char *input;
+    const char *label;
+    unsigned long keys;
+};
+
+static void
+usage(void) {
+    fprintf(stderr, "Usage: bench_run [-n runs] [-k keys] [-i input] "
+            "[-l label] -- command [args...]\n");
+    exit(EXIT_FAILURE);
+}
+
+/* Expand %n and %r in each argument into argv. */
+static void
+expand(char **tmpl, int count, char **argv, unsigned long run,
+        unsigned long keys) {
+    for (int i = 0; i < count; ++i) {
+        size_t len = strlen(tmpl[i]) * 8 + 1;
+        char *out = malloc(len), *o = out;
+        if (out == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        for (const char *p = tmpl[i]; *p; ++p) {
+            if (p[0] == '%' && (p[1] == 'n' || p[1] == 'r')) {
+                unsigned long v = p[1] == 'n' ? run
+                                : (unsigned long) random() % (keys ? keys : 1);
+                o += sprintf(o, "%08lu", v);
+                ++p;
+            } else {
+                *o++ = *p;
+            }
+        }
+        *o = '\0';
+        argv[i] = out;
+    }
+    argv[count] = NULL;
+}
+
+/* Run argv once with the given extra environment entry (or none).  Returns
+ * the wall time in microseconds, or -1 if it could not be run or failed.
+ */
+static double
+run_once(char **argv, const char *input, const char *env_name,
+        const char *env_value, const char *env2_name,
+        const char *env2_value) {
+    struct timespec start, end;
+    int status;
+    pid_t pid;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((pid = fork()) < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        int in = open(input ? input : "/dev/null", O_RDONLY);
+        int out = open("/dev/null", O_WRONLY);
+        if (in < 0 || out < 0)
+            _exit(127);
+        dup2(in, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        dup2(out, STDERR_FILENO);
+        if (env_name != NULL)
+            setenv(env_name, env_value, 1);
+        if (env2_name != NULL)
+            setenv(env2_name, env2_value, 1);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) == 127)
+        return -1;
+    return (end.tv_sec - start.tv_sec) * 1e6
+         + (end.tv_nsec - start.tv_nsec) / 1e3;
+}
+
+static int
+by_time(const void *a, const void *b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+static double
+percentile(const double *sorted, unsigned long n, double p) {
+    unsigned long i = (unsigned long) (p * (n - 1) + 0.5);
+    return sorted[i < n ? i : n - 1];
+}
+
+/* Count allocations with the preload library the harness built. */
+static long
+count_allocs(char **argv, const struct run_opts *o) {
+    const char *lib = getenv("BENCH_ALLOCS");
+    char log[] = "/tmp/bench_allocs.XXXXXX";
+    long count = -1;
+    int fd;
+    FILE *f;
+
+    if (lib == NULL || *lib == '\0' || (fd = mkstemp(log)) < 0)
+        return -1;
+    close(fd);
+    if (run_once(argv, o->input, "LD_PRELOAD", lib, "BENCH_ALLOC_LOG", log)
+            >= 0
+    &&  (f = fopen(log, "r")) != NULL) {
+        if (fscanf(f, "%ld", &count) != 1)
+            count = -1;
+        fclose(f);
+    }
+    unlink(log);
+    return count;
+}
+
+/* Count system calls with strace -c, taking the calls column of its total. */
+static long
+count_syscalls(char **argv, int argc, const struct run_opts *o) {
+    char log[] = "/tmp/bench_strace.XXXXXX", line[256];
+    char *sargv[MAX_ARGS + 8];
+    long count = -1;
+    int fd, n = 0;
+    FILE *f;
+
+    if ((fd = mkstemp(log)) < 0)
+        return -1;
+    close(fd);
+    sargv[n++] = "strace";
+    sargv[n++] = "-f";
+    sargv[n++] = "-c";
+    sargv[n++] = "-o";
+    sargv[n++] = log;
+    for (int i = 0; i < argc; ++i)
+        sargv[n++] = argv[i];
+    sargv[n] = NULL;
+
+    if (run_once(sargv, o->input, NULL, NULL, NULL, NULL) >= 0
+    &&  (f = fopen(log, "r")) != NULL) {
+        while (fgets(line, sizeof(line), f) != NULL) {
+            double pct, secs;
+            long usecs, calls;
+            char name[64];
+            if (strstr(line, "total") != NULL
+            &&  sscanf(line, "%lf %lf %ld %ld %*s %63s", &pct, &secs, &usecs,
+                       &calls, name) >= 4)
+                count = calls;
+        }
+        fclose(f);
+    }
+    unlink(log);
+    return count;
+}
+
+static void
+print_json_string(const char *s) {
+    putchar('"');
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\')
+            putchar('\\');
+        putchar(*s);
+    }
+    putchar('"');
+}
+
+int
+main(int argc, char *argv[]) {
+    struct run_opts o = { NULL, "run", 1 };
+    unsigned long runs = 100, failed = 0;
+    char *cmd[MAX_ARGS + 1];
+    double *times;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:k:i:l:")) != -1) {
+        switch (c) {
+            case 'n': runs = strtoul(optarg, NULL, 10); break;
+            case 'k': o.keys = strtoul(optarg, NULL, 10); break;
+            case 'i': o.input = optarg; break;
+            case 'l': o.label = optarg; break;
+            default: usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc < 1 || argc > MAX_ARGS || runs == 0)
+        usage();
+    if ((times = malloc(runs * sizeof(double))) == NULL) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+
+    srandom(1);
+    for (unsigned long i = 0; i < runs; ++i) {
+        expand(argv, argc, cmd, i, o.keys);
+        if ((times[i - failed] = run_once(cmd, o.input, NULL, NULL, NULL,
+                                          NULL)) < 0)
+            ++failed;
+        for (int j = 0; j < argc; ++j)
+            free(cmd[j]);
+    }
+    runs -= failed;
+
+    expand(argv, argc, cmd, runs + failed, o.keys);
+    long allocs = count_allocs(cmd, &o);
+    long syscalls = count_syscalls(cmd, argc, &o);
+    for (int j = 0; j < argc; ++j)
+        free(cmd[j]);
+
+    qsort(times, runs, sizeof(double), by_time);
+    double sum = 0;
+    for (unsigned long i = 0; i < runs; ++i)
+        sum += times[i];
+
+    fputs("{\"label\": ", stdout);
+    print_json_string(o.label);
+    printf(", \"runs\": %lu, \"failed\": %lu", runs, failed);
+    if (runs > 0)
+        printf(", \"p50_us\": %.1f, \"p99_us\": %.1f, \"mean_us\": %.1f",
+               percentile(times, runs, 0.50), percentile(times, runs, 0.99),
+               sum / runs);
+    if (allocs >= 0)
+        printf(", \"allocs\": %ld", allocs);
+    else
+        fputs(", \"allocs\": null", stdout);
+    if (syscalls >= 0)
+        printf(", \"syscalls\": %ld", syscalls);
+    else
+        fputs(", \"syscalls\": null", stdout);
+    puts("}");
+
+    free(times);
+    return failed > 0 && runs == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
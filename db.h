@@ -1,23 +1,81 @@
 #ifndef DB_H__
 #define DB_H__
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A record read by cursor_batch.  key and value point into the caller's
+ * arena and are each followed by a NUL. */
+struct CursorRecord {
+    const char *key;
+    size_t klen;
+    const char *value;
+    size_t vlen;
+};
+
+/* Filled by cursor_batch from the caller's arena and record array. */
+struct CursorBatch {
+    char *arena;
+    size_t arena_len;
+    struct CursorRecord *records;
+    size_t max;
+    bool values;        /* copy values as well as keys */
+    size_t count;       /* records filled */
+    bool done;          /* the cursor has passed the last record */
+    size_t need;        /* arena bytes the next record needs, when it alone
+                           did not fit */
+};
+
+/* Access asked of open.  Any number of handles may read a database at once;
+ * a writer has it to itself.  Writes through a handle opened for reading
+ * fail. */
+enum OpenMode { DB_READ, DB_WRITE };
+
+typedef bool  (*abort_func)(void*);
+typedef bool  (*append_func)(void*, const char*, size_t, const char*, size_t);
+typedef bool  (*begin_func)(void*);
 typedef bool  (*close_func)(void*);
+typedef bool  (*commit_func)(void*);
+typedef bool  (*compact_func)(void*);
+typedef bool  (*copy_func)(void*, const char*);
 typedef void *(*create_cursor_func)(void*);
+typedef size_t (*cursor_batch_func)(void*, void*, struct CursorBatch*);
 typedef bool  (*cursor_first_func)(void*, void*);
 typedef bool  (*cursor_next_func)(void*, void*);
+typedef bool  (*cursor_seek_func)(void*, void*, const char*, size_t);
 typedef char *(*cursor_key_func)(void*, void*);
 typedef char *(*cursor_value_func)(void*, void*);
 typedef bool  (*delete_func)(void*, const char*);
+typedef bool  (*delete_len_func)(void*, const char*, size_t);
 typedef void  (*destroy_cursor_func)(void*);
 typedef int   (*errno_func)(void*);
 typedef char *(*fetch_func)(void*, const char*);
-typedef void *(*open_func)(const char*);
+typedef const char *(*fetch_borrow_func)(void*, const char*, size_t, size_t*);
+typedef char *(*fetch_len_func)(void*, const char*, size_t, size_t*);
+typedef bool  (*value_callback)(void*, size_t, const char*, size_t);
+typedef bool  (*fetch_many_func)(void*, size_t, const char *const*,
+                                 const size_t*, value_callback, void*);
+typedef bool  (*setting_callback)(void*, const char*, const char*);
+typedef bool  (*info_func)(void*, setting_callback, void*);
+typedef bool  (*locate_func)(void*, const char*, size_t, int*, uint64_t*,
+                             size_t*);
+typedef bool  (*key_callback)(void*, const char*, size_t);
+typedef void *(*open_func)(const char*, enum OpenMode);
+typedef bool  (*optimize_func)(void*);
+typedef bool  (*search_func)(void*, const char*, size_t, key_callback, void*);
 typedef bool  (*store_func)(void*, char*, char*);
+typedef bool  (*store_len_func)(void*, const char*, size_t, const char*,
+                                size_t);
 typedef const char *(*strerror_func)(int);
 typedef bool  (*try_store_func)(void*, char*, char*);
+typedef bool  (*try_store_len_func)(void*, const char*, size_t, const char*,
+                                    size_t);
 
 struct DbInterface {
-    /* Basic */
+    /* Basic.  Keys and values are NUL-terminated strings; fetch returns a
+     * copy the caller frees.  Kept for backends that predate the
+     * length-aware calls below. */
     open_func open;
     close_func close;
     delete_func delete;
@@ -25,6 +83,30 @@ struct DbInterface {
     try_store_func try_store;
     store_func store;
 
+    /* Length-aware.  Values are arbitrary bytes.  fetch_len returns a copy
+     * the caller frees; fetch_borrow returns the backend's own buffer, which
+     * stays valid only until the next call on the same handle.  Either may
+     * be NULL in older backends. */
+    delete_len_func delete_len;
+    fetch_len_func fetch_len;
+    fetch_borrow_func fetch_borrow;
+    try_store_len_func try_store_len;
+    store_len_func store_len;
+
+    /* Streaming.  append adds bytes to the end of a value, creating it if
+     * needed.  locate reports a descriptor and offset the value can be read
+     * from directly, for backends that keep it contiguous in a file.  Either
+     * may be NULL. */
+    append_func append;
+    locate_func locate;
+
+    /* Vectored lookup.  Calls back once for each of the keys, in order, with
+     * its index and value, or a NULL value when the key is missing.  The
+     * value is only good until the callback returns.  Stops early when the
+     * callback returns false.  Returns false only on an error other than a
+     * missing key.  May be NULL. */
+    fetch_many_func fetch_many;
+
     /* Cursors */
     create_cursor_func create_cursor;
     cursor_first_func cursor_first;
@@ -33,6 +115,38 @@ struct DbInterface {
     cursor_value_func cursor_value;
     destroy_cursor_func destroy_cursor;
 
+    /* Position the cursor at the first key not less than the one given.  Only
+     * backends that keep keys in order provide it. */
+    cursor_seek_func cursor_seek;
+
+    /* Copy records from the cursor's position on into the batch, moving the
+     * cursor past them, and return how many.  Nothing is allocated per
+     * record.  Returns 0 without done set when the next record is larger
+     * than the whole arena.  May be NULL. */
+    cursor_batch_func cursor_batch;
+
+    /* Transactions.  Writes between begin and commit are applied as a unit
+     * where the backend supports it; abort may fail if it does not. */
+    begin_func begin;
+    commit_func commit;
+    abort_func abort;
+
+    /* Maintenance.  compact rewrites the file without the space overwritten
+     * and deleted records still take up.  optimize rewrites it with its
+     * layout fitted to the records it now holds.  info calls back with a
+     * name and value for each of the file's figures and settings.  copy
+     * writes a consistent copy of the file to a new path while the handle,
+     * opened for reading or writing, stays open.  Any may be NULL. */
+    compact_func compact;
+    optimize_func optimize;
+    info_func info;
+    copy_func copy;
+
+    /* Search.  Calls back with every key whose key or value contains the
+     * term, until the callback returns false.  Only databases with a search
+     * index provide it. */
+    search_func search;
+
     /* Errors */
     errno_func get_errno;
     strerror_func strerror;
@@ -42,4 +156,13 @@ typedef void* database;
 typedef void* cursor;
 typedef struct DbInterface *(*get_interface_func)(void);
 
+/* Name of a backend's entry point.  Loadable backends all export
+ * get_interface; those built into drop-static each need a name of their own.
+ */
+#ifdef DROP_STATIC
+#define DB_ENTRY(type) type##_get_interface
+#else
+#define DB_ENTRY(type) get_interface
+#endif
+
 #endif /* DB_H__ */
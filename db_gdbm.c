@@ -1,122 +1,558 @@
 #define _XOPEN_SOURCE 500
 
+#include <fcntl.h>
 #include <gdbm.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/stat.h>
 
 #include "db.h"
+#include "io.h"
+#include "tune.h"
 
-static bool  gdbm_close_func(void*);
-static void *gdbm_create_cursor(void*);
-static bool  gdbm_cursor_first(void*, datum*);
-static char *gdbm_cursor_key(void*, datum*);
-static bool  gdbm_cursor_next(void*, datum*);
-static char *gdbm_cursor_value(void*, datum*);
-static void  gdbm_destroy_cursor(void*);
-static int   gdbm_get_errno(void);
-static void *gdbm_open_func(const char*);
-static bool  gdbm_store_force(void*, char*, char*);
-static bool  gdbm_store_try(void*, char*, char*);
+/* Block sizes optimize picks between; see fit_block_size. */
+#define MIN_BLOCK 4096
+#define MAX_BLOCK 65536
 
-struct DbInterface *get_interface(void);
+/* Keys and values are stored with a terminating NUL, as drop always has, so
+ * stores built with the string calls and the length-aware calls mix freely.
+ */
+struct gdbm_handle {
+    GDBM_FILE dbf;
+    char *path;
+    datum borrowed;     /* last fetch_borrow result, freed on the next */
+    char *scratch;      /* key and value, each with its NUL */
+    size_t scratch_cap;
+};
+
+static bool  gdbm_abort(struct gdbm_handle*);
+static bool  gdbm_begin(struct gdbm_handle*);
+static bool  gdbm_close_func(struct gdbm_handle*);
+static bool  gdbm_commit(struct gdbm_handle*);
+static bool  gdbm_copy(struct gdbm_handle*, const char*);
+static void *gdbm_create_cursor(struct gdbm_handle*);
+static size_t gdbm_cursor_batch(struct gdbm_handle*, datum**,
+                                struct CursorBatch*);
+static bool  gdbm_cursor_first(struct gdbm_handle*, datum**);
+static char *gdbm_cursor_key(struct gdbm_handle*, datum**);
+static bool  gdbm_cursor_next(struct gdbm_handle*, datum**);
+static char *gdbm_cursor_value(struct gdbm_handle*, datum**);
+static bool  gdbm_delete_len(struct gdbm_handle*, const char*, size_t);
+static bool  gdbm_delete_str(struct gdbm_handle*, const char*);
+static void  gdbm_destroy_cursor(datum**);
+static const char *gdbm_fetch_borrow(struct gdbm_handle*, const char*, size_t,
+                                     size_t*);
+static char *gdbm_fetch_len(struct gdbm_handle*, const char*, size_t, size_t*);
+static char *gdbm_fetch_str(struct gdbm_handle*, const char*);
+static int   gdbm_get_errno(struct gdbm_handle*);
+static bool  gdbm_info(struct gdbm_handle*, setting_callback, void*);
+static struct gdbm_handle *gdbm_open_func(const char*, enum OpenMode);
+static bool  gdbm_optimize(struct gdbm_handle*);
+static bool  gdbm_store_force(struct gdbm_handle*, char*, char*);
+static bool  gdbm_store_len(struct gdbm_handle*, const char*, size_t,
+                            const char*, size_t, int);
+static bool  gdbm_store_replace_len(struct gdbm_handle*, const char*, size_t,
+                                    const char*, size_t);
+static bool  gdbm_store_insert_len(struct gdbm_handle*, const char*, size_t,
+                                   const char*, size_t);
+static bool  gdbm_store_try(struct gdbm_handle*, char*, char*);
+static const char *gdbm_strerror_func(int);
+
+struct DbInterface *DB_ENTRY(gdbm)(void);
+
+/* Copy key and, if given, value into the handle's scratch buffer, each
+ * followed by its NUL, and point the datums at them.
+ */
+static bool
+terminate(struct gdbm_handle *h, const char *key, size_t klen,
+        const char *value, size_t vlen, datum *k, datum *v) {
+    size_t need = klen + 1 + (value ? vlen + 1 : 0);
+    if (need > h->scratch_cap) {
+        char *s = realloc(h->scratch, need);
+        if (s == NULL)
+            return false;
+        h->scratch = s;
+        h->scratch_cap = need;
+    }
+    memcpy(h->scratch, key, klen);
+    h->scratch[klen] = '\0';
+    k->dptr = h->scratch;
+    k->dsize = klen + 1;
+    if (value != NULL) {
+        memcpy(h->scratch + klen + 1, value, vlen);
+        h->scratch[klen + 1 + vlen] = '\0';
+        v->dptr = h->scratch + klen + 1;
+        v->dsize = vlen + 1;
+    }
+    return true;
+}
+
+/* A string argument is already terminated in place. */
+static datum
+str_datum(const char *str, size_t len) {
+    datum d;
+    d.dptr = (char*) str;
+    d.dsize = len + 1;
+    return d;
+}
+
+/* gdbm has no rollback; a batch that has been partially written stays. */
+static bool
+gdbm_abort(struct gdbm_handle *h) {
+    (void) h;
+    return false;
+}
+
+/* The file is not opened with GDBM_SYNC, so stores inside a batch are only
+ * written through the bucket cache and there is nothing to start here.  The
+ * batch is made durable on commit.
+ */
+static bool
+gdbm_begin(struct gdbm_handle *h) {
+    (void) h;
+    return true;
+}
 
 static bool
-gdbm_close_func(void *db) {
-    gdbm_close(db);
+gdbm_close_func(struct gdbm_handle *h) {
+    gdbm_close(h->dbf);
+    free(h->borrowed.dptr);
+    free(h->scratch);
+    free(h->path);
+    free(h);
     return true;
 }
 
+static bool
+gdbm_commit(struct gdbm_handle *h) {
+    if (gdbm_sync(h->dbf) == 0)
+        return true;
+    if (gdbm_errno == GDBM_NO_ERROR)
+        gdbm_errno = GDBM_FILE_WRITE_ERROR;
+    return false;
+}
+
+/* gdbm has no copy of its own, but while this handle is open no other
+ * writer is, and a writer syncs before it lets go of the file.  So once this
+ * one has synced, the file as it stands is the database.
+ */
+static bool
+gdbm_copy(struct gdbm_handle *h, const char *dest) {
+    struct stat st;
+    int in, out = -1;
+    bool ok;
+
+    gdbm_sync(h->dbf);
+    if ((in = open(h->path, O_RDONLY)) < 0) {
+        gdbm_errno = GDBM_FILE_OPEN_ERROR;
+        return false;
+    }
+    ok = fstat(in, &st) == 0
+      && (out = open(dest, O_WRONLY | O_CREAT | O_TRUNC,
+                     S_IRUSR | S_IWUSR)) >= 0
+      && io_sendfile(out, in, 0, st.st_size);
+    if (out >= 0 && close(out) != 0)
+        ok = false;
+    close(in);
+    if (!ok)
+        gdbm_errno = GDBM_FILE_WRITE_ERROR;
+    return ok;
+}
+
+/* A cursor is the current key, which gdbm allocates for us. */
 static void *
-gdbm_create_cursor(void *db) {
-    (void) db;
-    return NULL;
+gdbm_create_cursor(struct gdbm_handle *h) {
+    (void) h;
+    return calloc(1, sizeof(datum));
+}
+
+/* gdbm allocates every key and value it returns, so they are copied into
+ * the arena and freed here rather than handed on.
+ */
+static size_t
+gdbm_cursor_batch(struct gdbm_handle *h, datum **gdbm_cursor,
+        struct CursorBatch *b) {
+    datum *cur = *gdbm_cursor;
+    size_t used = 0;
+
+    b->count = 0;
+    b->need = 0;
+    while (cur->dptr != NULL && b->count < b->max) {
+        datum v = { NULL, 0 };
+        size_t klen = cur->dsize > 0 ? cur->dsize - 1 : 0, vlen = 0;
+        struct CursorRecord *r = b->records + b->count;
+
+        if (b->values) {
+            v = gdbm_fetch(h->dbf, *cur);
+            vlen = v.dsize > 0 ? v.dsize - 1 : 0;
+        }
+        size_t need = klen + 1 + (b->values ? vlen + 1 : 0);
+        if (used + need > b->arena_len) {
+            free(v.dptr);
+            if (b->count == 0)
+                b->need = need;
+            break;
+        }
+        r->key = memcpy(b->arena + used, cur->dptr, klen);
+        r->klen = klen;
+        b->arena[used + klen] = '\0';
+        used += klen + 1;
+        r->value = NULL;
+        r->vlen = vlen;
+        if (b->values) {
+            r->value = b->arena + used;
+            if (vlen > 0)
+                memcpy(b->arena + used, v.dptr, vlen);
+            b->arena[used + vlen] = '\0';
+            used += vlen + 1;
+            free(v.dptr);
+        }
+        ++b->count;
+
+        datum next = gdbm_nextkey(h->dbf, *cur);
+        free(cur->dptr);
+        *cur = next;
+    }
+    b->done = cur->dptr == NULL;
+    return b->count;
 }
 
 static bool
-gdbm_cursor_first(void *db, datum *gdbm_cursor) {
-    *gdbm_cursor = gdbm_firstkey(db);
-    return gdbm_cursor->dptr != NULL;
+gdbm_cursor_first(struct gdbm_handle *h, datum **gdbm_cursor) {
+    free((*gdbm_cursor)->dptr);
+    **gdbm_cursor = gdbm_firstkey(h->dbf);
+    return (*gdbm_cursor)->dptr != NULL;
 }
 
 static char *
-gdbm_cursor_key(void *db, datum *gdbm_cursor) {
-    (void) db;
-    return strdup(gdbm_cursor->dptr);
+gdbm_cursor_key(struct gdbm_handle *h, datum **gdbm_cursor) {
+    (void) h;
+    return strdup((*gdbm_cursor)->dptr);
 }
 
 static bool
-gdbm_cursor_next(void *db, datum *gdbm_cursor) {
-    *gdbm_cursor = gdbm_nextkey(db, *gdbm_cursor);
-    return gdbm_cursor->dptr != NULL;
+gdbm_cursor_next(struct gdbm_handle *h, datum **gdbm_cursor) {
+    datum next = gdbm_nextkey(h->dbf, **gdbm_cursor);
+    free((*gdbm_cursor)->dptr);
+    **gdbm_cursor = next;
+    return next.dptr != NULL;
 }
 
 static char *
-gdbm_cursor_value(void *db, datum *gdbm_cursor) {
-    datum ret = gdbm_fetch(db, *gdbm_cursor);
-    return strdup(ret.dptr);
+gdbm_cursor_value(struct gdbm_handle *h, datum **gdbm_cursor) {
+    datum ret = gdbm_fetch(h->dbf, **gdbm_cursor);
+    return ret.dptr;
+}
+
+static bool
+gdbm_delete_len(struct gdbm_handle *h, const char *key, size_t klen) {
+    datum k;
+    return terminate(h, key, klen, NULL, 0, &k, NULL)
+        && gdbm_delete(h->dbf, k) == 0;
+}
+
+static bool
+gdbm_delete_str(struct gdbm_handle *h, const char *key) {
+    return gdbm_delete(h->dbf, str_datum(key, strlen(key))) == 0;
 }
 
 static void
-gdbm_destroy_cursor(void *db) {
-    (void) db;
+gdbm_destroy_cursor(datum **gdbm_cursor) {
+    if (*gdbm_cursor == NULL)
+        return;
+    free((*gdbm_cursor)->dptr);
+    free(*gdbm_cursor);
+    *gdbm_cursor = NULL;
+}
+
+/* gdbm always hands back its own allocation, so borrowing saves the extra
+ * copy and the strlen the caller would otherwise make.
+ */
+static const char *
+gdbm_fetch_borrow(struct gdbm_handle *h, const char *key, size_t klen,
+        size_t *vlen) {
+    free(h->borrowed.dptr);
+    h->borrowed.dptr = gdbm_fetch_len(h, key, klen, vlen);
+    return h->borrowed.dptr;
+}
+
+static char *
+gdbm_fetch_len(struct gdbm_handle *h, const char *key, size_t klen,
+        size_t *vlen) {
+    datum k, v;
+    if (!terminate(h, key, klen, NULL, 0, &k, NULL))
+        return NULL;
+    v = gdbm_fetch(h->dbf, k);
+    if (v.dptr != NULL && vlen != NULL)
+        *vlen = v.dsize > 0 ? (size_t) v.dsize - 1 : 0;
+    return v.dptr;
+}
+
+static char *
+gdbm_fetch_str(struct gdbm_handle *h, const char *key) {
+    return gdbm_fetch(h->dbf, str_datum(key, strlen(key))).dptr;
 }
 
 static int
-gdbm_get_errno() {
+gdbm_get_errno(struct gdbm_handle *h) {
+    (void) h;
     return (int) gdbm_errno;
 }
 
-static void *
-gdbm_open_func(const char *file) {
-    return gdbm_open(file, 0, GDBM_WRCREAT,
-            S_IRUSR | S_IWUSR, NULL);
+/* Apply the settings that can change on an open file.  gdbm takes a
+ * size_t for the sizes and an int for the rest.
+ */
+static void
+apply_tuning(GDBM_FILE dbf, const struct Tuning *t) {
+    size_t size;
+    int flag;
+
+    if ((size = tune_number(t, "cache_size", 0)) > 0)
+        gdbm_setopt(dbf, GDBM_SETCACHESIZE, &size, sizeof(size));
+    if ((size = tune_number(t, "max_map_size", 0)) > 0)
+        gdbm_setopt(dbf, GDBM_SETMAXMAPSIZE, &size, sizeof(size));
+    if ((flag = tune_number(t, "mmap", -1)) >= 0)
+        gdbm_setopt(dbf, GDBM_SETMMAP, &flag, sizeof(flag));
+    if ((flag = tune_number(t, "centfree", -1)) >= 0)
+        gdbm_setopt(dbf, GDBM_SETCENTFREE, &flag, sizeof(flag));
+    if ((flag = tune_number(t, "coalesce", -1)) >= 0)
+        gdbm_setopt(dbf, GDBM_SETCOALESCEBLKS, &flag, sizeof(flag));
+}
+
+/* block_size only counts when the file is created. */
+static struct gdbm_handle *
+gdbm_open_func(const char *file, enum OpenMode mode) {
+    struct gdbm_handle *h = calloc(1, sizeof(struct gdbm_handle));
+    struct Tuning t;
+
+    if (h == NULL)
+        return NULL;
+    if ((h->path = strdup(file)) == NULL) {
+        free(h);
+        return NULL;
+    }
+    tune_load(file, &t);
+    h->dbf = gdbm_open(file, tune_number(&t, "block_size", 0),
+                       mode == DB_READ ? GDBM_READER : GDBM_WRCREAT,
+                       S_IRUSR | S_IWUSR, NULL);
+    if (h->dbf == NULL) {
+        free(h->path);
+        free(h);
+        return NULL;
+    }
+    apply_tuning(h->dbf, &t);
+    return h;
 }
 
 static bool
-gdbm_store_force(void *db, char *key, char *value) {
-    datum k, v;
-    int ret;
-    k.dptr = key;
-    k.dsize = strlen(key) + 1;
-    v.dptr = value;
-    v.dsize = strlen(value) + 1;
-    ret = gdbm_store(db, k, v, GDBM_REPLACE);
-    return ret == 0;
+report(setting_callback cb, void *arg, const char *name, long long value) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%lld", value);
+    return cb(arg, name, buf);
+}
+
+static bool
+gdbm_info(struct gdbm_handle *h, setting_callback cb, void *arg) {
+    struct Tuning t;
+    struct stat st;
+    gdbm_count_t count = 0;
+    size_t cache = 0;
+    int block = 0, mmap = 0;
+
+    gdbm_count(h->dbf, &count);
+    gdbm_setopt(h->dbf, GDBM_GETBLOCKSIZE, &block, sizeof(block));
+    gdbm_setopt(h->dbf, GDBM_GETCACHESIZE, &cache, sizeof(cache));
+    gdbm_setopt(h->dbf, GDBM_GETMMAP, &mmap, sizeof(mmap));
+    if (stat(h->path, &st) != 0)
+        st.st_size = 0;
+    if (!report(cb, arg, "records", count)
+    ||  !report(cb, arg, "file_bytes", st.st_size)
+    ||  !report(cb, arg, "block_size", block)
+    ||  !report(cb, arg, "cache_size", cache)
+    ||  !report(cb, arg, "mmap", mmap))
+        return false;
+
+    tune_load(h->path, &t);
+    for (size_t i = 0; i < t.count; ++i) {
+        char name[sizeof(t.settings[i].name) + 5];
+        snprintf(name, sizeof(name), "tune.%s", t.settings[i].name);
+        if (!cb(arg, name, t.settings[i].value))
+            return false;
+    }
+    return true;
+}
+
+/* A block holds a bucket of the hash directory, and records are packed into
+ * blocks too.  Blocks that fit a handful of average records, and bigger ones
+ * for big files, keep the directory shallow without wasting space on small
+ * files.
+ */
+static int
+fit_block_size(gdbm_count_t count, size_t average) {
+    size_t block = MIN_BLOCK;
+    while (block < MAX_BLOCK && block < average * 8)
+        block *= 2;
+    while (block < MAX_BLOCK && block < count / 64)
+        block *= 2;
+    return block;
+}
+
+/* Copy every record into a new file with the given block size. */
+static bool
+rebuild(struct gdbm_handle *h, const char *tmp, int block) {
+    GDBM_FILE out = gdbm_open(tmp, block, GDBM_NEWDB, S_IRUSR | S_IWUSR,
+                              NULL);
+    bool ok = out != NULL;
+    datum key = gdbm_firstkey(h->dbf);
+
+    while (ok && key.dptr != NULL) {
+        datum value = gdbm_fetch(h->dbf, key);
+        ok = value.dptr != NULL
+          && gdbm_store(out, key, value, GDBM_REPLACE) == 0;
+        free(value.dptr);
+        datum next = gdbm_nextkey(h->dbf, key);
+        free(key.dptr);
+        key = next;
+    }
+    free(key.dptr);
+    if (out != NULL) {
+        ok = ok && gdbm_sync(out) == 0;
+        gdbm_close(out);
+    }
+    return ok;
 }
 
+/* gdbm_reorganize reclaims free space but keeps the block size, so when a
+ * different one fits better the records are copied to a new file instead.
+ * A block_size setting overrides the fitted one.
+ */
 static bool
-gdbm_store_try(void *db, char *key, char *value) {
+gdbm_optimize(struct gdbm_handle *h) {
+    struct Tuning t;
+    gdbm_count_t count = 0;
+    size_t total = 0;
+    int current = 0;
+    datum key;
+
+    if (gdbm_count(h->dbf, &count) != 0
+    ||  gdbm_setopt(h->dbf, GDBM_GETBLOCKSIZE, &current,
+                    sizeof(current)) != 0)
+        return false;
+    for (key = gdbm_firstkey(h->dbf); key.dptr != NULL; ) {
+        datum value = gdbm_fetch(h->dbf, key);
+        total += key.dsize + value.dsize;
+        free(value.dptr);
+        datum next = gdbm_nextkey(h->dbf, key);
+        free(key.dptr);
+        key = next;
+    }
+
+    tune_load(h->path, &t);
+    int block = tune_number(&t, "block_size", 0);
+    if (block <= 0)
+        block = fit_block_size(count, count ? total / count : 0);
+    if (block == current)
+        return gdbm_reorganize(h->dbf) == 0;
+
+    size_t len = strlen(h->path) + sizeof(".optimize");
+    char *tmp = malloc(len);
+    if (tmp == NULL)
+        return false;
+    snprintf(tmp, len, "%s.optimize", h->path);
+
+    /* The new file is opened before it takes the old one's place, so the
+     * handle always has a file to carry on with.
+     */
+    GDBM_FILE dbf = NULL;
+    if (!rebuild(h, tmp, block)
+    ||  (dbf = gdbm_open(tmp, 0, GDBM_WRITER, S_IRUSR | S_IWUSR,
+                         NULL)) == NULL
+    ||  rename(tmp, h->path) != 0) {
+        if (dbf != NULL)
+            gdbm_close(dbf);
+        remove(tmp);
+        free(tmp);
+        return false;
+    }
+    free(tmp);
+    gdbm_close(h->dbf);
+    h->dbf = dbf;
+    apply_tuning(h->dbf, &t);
+    return true;
+}
+
+static bool
+gdbm_store_force(struct gdbm_handle *h, char *key, char *value) {
+    return gdbm_store(h->dbf, str_datum(key, strlen(key)),
+                      str_datum(value, strlen(value)), GDBM_REPLACE) == 0;
+}
+
+/* The value is copied once to gain its terminating NUL. */
+static bool
+gdbm_store_len(struct gdbm_handle *h, const char *key, size_t klen,
+        const char *value, size_t vlen, int flag) {
     datum k, v;
-    int ret;
-    k.dptr = key;
-    k.dsize = strlen(key) + 1;
-    v.dptr = value;
-    v.dsize = strlen(value) + 1;
-    ret = gdbm_store(db, k, v, GDBM_INSERT);
-    return ret == 0;
+    return terminate(h, key, klen, value, vlen, &k, &v)
+        && gdbm_store(h->dbf, k, v, flag) == 0;
+}
+
+static bool
+gdbm_store_replace_len(struct gdbm_handle *h, const char *key, size_t klen,
+        const char *value, size_t vlen) {
+    return gdbm_store_len(h, key, klen, value, vlen, GDBM_REPLACE);
+}
+
+static bool
+gdbm_store_insert_len(struct gdbm_handle *h, const char *key, size_t klen,
+        const char *value, size_t vlen) {
+    return gdbm_store_len(h, key, klen, value, vlen, GDBM_INSERT);
+}
+
+static bool
+gdbm_store_try(struct gdbm_handle *h, char *key, char *value) {
+    return gdbm_store(h->dbf, str_datum(key, strlen(key)),
+                      str_datum(value, strlen(value)), GDBM_INSERT) == 0;
+}
+
+static const char *
+gdbm_strerror_func(int err) {
+    return gdbm_strerror(err);
 }
 
 static struct DbInterface gdbm = {
     .open = (open_func) gdbm_open_func,
     .close = (close_func) gdbm_close_func,
     .get_errno = (errno_func) gdbm_get_errno,
-    .strerror = (strerror_func) gdbm_strerror,
-    .delete = (delete_func) gdbm_delete,
-    .fetch = (fetch_func) gdbm_fetch,
-    .try_store = gdbm_store_try,
-    .store = gdbm_store_force,
+    .strerror = gdbm_strerror_func,
+    .delete = (delete_func) gdbm_delete_str,
+    .fetch = (fetch_func) gdbm_fetch_str,
+    .try_store = (try_store_func) gdbm_store_try,
+    .store = (store_func) gdbm_store_force,
+    .delete_len = (delete_len_func) gdbm_delete_len,
+    .fetch_len = (fetch_len_func) gdbm_fetch_len,
+    .fetch_borrow = (fetch_borrow_func) gdbm_fetch_borrow,
+    .try_store_len = (try_store_len_func) gdbm_store_insert_len,
+    .store_len = (store_len_func) gdbm_store_replace_len,
     .create_cursor = (create_cursor_func) gdbm_create_cursor,
     .destroy_cursor = (destroy_cursor_func) gdbm_destroy_cursor,
     .cursor_first = (cursor_first_func) gdbm_cursor_first,
     .cursor_next = (cursor_next_func) gdbm_cursor_next,
     .cursor_key = (cursor_key_func) gdbm_cursor_key,
-    .cursor_value = (cursor_value_func) gdbm_cursor_value
+    .cursor_value = (cursor_value_func) gdbm_cursor_value,
+    .cursor_batch = (cursor_batch_func) gdbm_cursor_batch,
+    .begin = (begin_func) gdbm_begin,
+    .commit = (commit_func) gdbm_commit,
+    .abort = (abort_func) gdbm_abort,
+    .optimize = (optimize_func) gdbm_optimize,
+    .info = (info_func) gdbm_info,
+    .copy = (copy_func) gdbm_copy
 };
 
 struct DbInterface *
-get_interface() {
+DB_ENTRY(gdbm)() {
     struct DbInterface *dbint = malloc(sizeof(struct DbInterface));
     if (dbint == NULL) {
         return dbint;
@@ -0,0 +1,1172 @@
+/* db_log.c
+ * A log-structured backend.  Every store and delete is appended to the data
+ * file as a record; an in-memory hash table maps each live key to where its
+ * value sits, and fetches read the value straight from there.  Overwritten
+ * and deleted records stay in the file until it is compacted.
+ *
+ *   data file:  log_header, then records (log_record, key, value)
+ *   hint file:  hint_header, then hint_entry and key for every live key
+ *
+ * The hint file, written on close and after compaction, lets open load the
+ * table without reading the values.  Records appended after it was written
+ * are read from the log itself; a torn record at the end is cut off.
+ *
+ * A writer holds a lock on the data file for as long as it is open.  Readers
+ * take none: the file is only ever appended to, a record still being written
+ * fails its checksum and is left alone, and compaction renames a new file
+ * into place, so a reader keeps the file it opened.  The file is read with
+ * pread, never mapped, so a writer cutting off a torn record cannot fault a
+ * reader that was looking at it.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "db.h"
+#include "io.h"
+
+#define LOG_MAGIC "DROPLOG1"
+#define HINT_MAGIC "DROPHNT1"
+#define HINT_SUFFIX ".hint"
+#define COMPACT_SUFFIX ".compact"
+#define TOMBSTONE UINT32_MAX
+#define MIN_SLOTS 1024
+
+/* Writes inside a transaction are gathered and appended in one go at commit,
+ * or sooner once this many bytes are waiting.
+ */
+#define PENDING_MAX (8 << 20)
+#define WRITE_BUFFER (1 << 20)
+
+/* fetch_many reads values that lie close together in the file with a single
+ * pread, taking the gap between them along when it is no bigger than this.
+ */
+#define READ_GAP 4096
+
+/* scan reads the log in pieces of this size, or of the record if larger. */
+#define SCAN_BUFFER (1 << 20)
+
+enum LogError { LOG_OK, LOG_NOTFOUND, LOG_EXISTS, LOG_LOCKED, LOG_BADFILE,
+                LOG_TOOBIG, LOG_READONLY, LOG_SYSTEM };
+
+struct log_header {
+    char magic[8];
+    uint64_t id;        /* changes when compaction replaces the file */
+};
+
+struct log_record {
+    uint32_t sum;       /* FNV-1a of the rest of the record */
+    uint32_t klen;
+    uint32_t vlen;      /* TOMBSTONE for a delete, which has no value */
+};
+
+struct hint_header {
+    char magic[8];
+    uint64_t id;        /* of the data file it describes */
+    uint64_t covered;   /* bytes of the data file it accounts for */
+    uint64_t count;
+    uint64_t dead;
+};
+
+struct hint_entry {
+    uint64_t off;
+    uint32_t klen;
+    uint32_t vlen;
+};
+
+struct slot {
+    char *key;          /* NULL when free, DELETED once removed */
+    uint64_t hash;
+    uint64_t off;       /* of the value in the data file */
+    uint32_t klen;
+    uint32_t vlen;
+};
+
+/* One key of a fetch_many call. */
+struct want {
+    const struct slot *s;   /* NULL when the key is missing */
+    size_t at;              /* of the value in the read buffer */
+};
+
+/* The piece of the data file scan has read. */
+struct window {
+    char *data;
+    size_t cap;
+    uint64_t base;      /* file offset of data[0] */
+    size_t len;
+};
+
+struct logdb {
+    int fd;
+    char *path;
+    uint64_t id;
+    uint64_t size;      /* bytes written to the file */
+    uint64_t dead;      /* of those, bytes no key points at any more */
+    struct slot *slots;
+    size_t cap;         /* a power of two */
+    size_t used;
+    size_t removed;
+    bool readonly;
+    bool batch;
+    bool dirty;         /* written since the hint was */
+    char *pending;      /* records not yet written, at offset size */
+    size_t pending_len;
+    size_t pending_cap;
+    char *borrowed;     /* last fetch_borrow result */
+    size_t borrowed_cap;
+};
+
+static bool  log_abort(struct logdb*);
+static bool  log_begin(struct logdb*);
+static bool  log_close(struct logdb*);
+static bool  log_commit(struct logdb*);
+static bool  log_compact(struct logdb*);
+static bool  log_copy(struct logdb*, const char*);
+static void *log_create_cursor(struct logdb*);
+static size_t log_cursor_batch(struct logdb*, size_t**, struct CursorBatch*);
+static bool  log_cursor_first(struct logdb*, size_t**);
+static char *log_cursor_key(struct logdb*, size_t**);
+static bool  log_cursor_next(struct logdb*, size_t**);
+static char *log_cursor_value(struct logdb*, size_t**);
+static bool  log_delete(struct logdb*, const char*);
+static bool  log_delete_len(struct logdb*, const char*, size_t);
+static void  log_destroy_cursor(size_t**);
+static char *log_fetch(struct logdb*, const char*);
+static const char *log_fetch_borrow(struct logdb*, const char*, size_t,
+                                    size_t*);
+static char *log_fetch_len(struct logdb*, const char*, size_t, size_t*);
+static bool  log_fetch_many(struct logdb*, size_t, const char *const*,
+                            const size_t*, value_callback, void*);
+static int   log_get_errno(struct logdb*);
+static bool  log_info(struct logdb*, setting_callback, void*);
+static bool  log_locate(struct logdb*, const char*, size_t, int*, uint64_t*,
+                        size_t*);
+static struct logdb *log_open(const char*, enum OpenMode);
+static bool  log_store(struct logdb*, char*, char*);
+static bool  log_store_len(struct logdb*, const char*, size_t, const char*,
+                           size_t);
+static const char *log_strerror(int);
+static bool  log_try_store(struct logdb*, char*, char*);
+static bool  log_try_store_len(struct logdb*, const char*, size_t,
+                               const char*, size_t);
+
+struct DbInterface *DB_ENTRY(log)(void);
+
+static int log_errno = LOG_OK;
+static int log_sys_errno = 0;
+static char deleted_key;
+
+#define DELETED (&deleted_key)
+
+static bool
+fail(enum LogError err) {
+    log_errno = err;
+    if (err == LOG_SYSTEM)
+        log_sys_errno = errno;
+    return false;
+}
+
+static uint32_t
+fnv32(uint32_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= p[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static uint32_t
+checksum(const struct log_record *r, const char *key, const char *value) {
+    uint32_t h = 2166136261U;
+    h = fnv32(h, &r->klen, sizeof(r->klen));
+    h = fnv32(h, &r->vlen, sizeof(r->vlen));
+    h = fnv32(h, key, r->klen);
+    if (r->vlen != TOMBSTONE)
+        h = fnv32(h, value, r->vlen);
+    return h;
+}
+
+static uint64_t
+key_hash(const char *key, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char) key[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static uint64_t
+record_size(uint32_t klen, uint32_t vlen) {
+    return sizeof(struct log_record) + klen + (vlen == TOMBSTONE ? 0 : vlen);
+}
+
+static char *
+side_path(const char *path, const char *suffix) {
+    size_t len = strlen(path) + strlen(suffix) + 1;
+    char *p = malloc(len);
+    if (p != NULL)
+        snprintf(p, len, "%s%s", path, suffix);
+    return p;
+}
+
+/* The live slot for key, or the free one it would go in. */
+static struct slot *
+lookup(struct logdb *db, const char *key, size_t klen, uint64_t hash) {
+    size_t mask = db->cap - 1;
+    struct slot *grave = NULL;
+
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        struct slot *s = db->slots + i;
+        if (s->key == NULL)
+            return grave ? grave : s;
+        if (s->key == DELETED) {
+            if (grave == NULL)
+                grave = s;
+        } else if (s->hash == hash && s->klen == klen
+               &&  memcmp(s->key, key, klen) == 0) {
+            return s;
+        }
+    }
+}
+
+static bool
+live(const struct slot *s) {
+    return s->key != NULL && s->key != DELETED;
+}
+
+static bool
+resize(struct logdb *db, size_t cap) {
+    struct slot *old = db->slots;
+    size_t old_cap = db->cap;
+
+    if ((db->slots = calloc(cap, sizeof(struct slot))) == NULL) {
+        db->slots = old;
+        return fail(LOG_SYSTEM);
+    }
+    db->cap = cap;
+    db->removed = 0;
+    for (size_t i = 0; i < old_cap; ++i) {
+        if (live(old + i))
+            *lookup(db, old[i].key, old[i].klen, old[i].hash) = old[i];
+    }
+    free(old);
+    return true;
+}
+
+static void
+clear_index(struct logdb *db) {
+    for (size_t i = 0; i < db->cap; ++i) {
+        if (live(db->slots + i))
+            free(db->slots[i].key);
+    }
+    memset(db->slots, 0, db->cap * sizeof(struct slot));
+    db->used = 0;
+    db->removed = 0;
+    db->dead = 0;
+}
+
+/* Point key at a value; whatever it pointed at before becomes dead. */
+static bool
+index_put(struct logdb *db, const char *key, uint32_t klen, uint64_t off,
+        uint32_t vlen) {
+    uint64_t hash = key_hash(key, klen);
+    struct slot *s;
+
+    if ((db->used + db->removed + 1) * 4 > db->cap * 3
+    &&  !resize(db, db->used * 2 >= db->cap ? db->cap * 2 : db->cap))
+        return false;
+    s = lookup(db, key, klen, hash);
+    if (live(s)) {
+        db->dead += record_size(s->klen, s->vlen);
+    } else {
+        char *copy = malloc(klen ? klen : 1);
+        if (copy == NULL)
+            return fail(LOG_SYSTEM);
+        memcpy(copy, key, klen);
+        if (s->key == DELETED)
+            --db->removed;
+        s->key = copy;
+        s->hash = hash;
+        s->klen = klen;
+        ++db->used;
+    }
+    s->off = off;
+    s->vlen = vlen;
+    return true;
+}
+
+static void
+index_remove(struct logdb *db, struct slot *s) {
+    db->dead += record_size(s->klen, s->vlen);
+    free(s->key);
+    s->key = DELETED;
+    --db->used;
+    ++db->removed;
+}
+
+static struct slot *
+find(struct logdb *db, const char *key, size_t klen) {
+    struct slot *s = lookup(db, key, klen, key_hash(key, klen));
+    return live(s) ? s : NULL;
+}
+
+/* Cut off whatever part of a failed append reached the file, so the next
+ * record does not follow a torn one.
+ */
+static bool
+write_failed(struct logdb *db) {
+    fail(LOG_SYSTEM);
+    while (ftruncate(db->fd, db->size) != 0 && errno == EINTR)
+        ;
+    return false;
+}
+
+static bool
+flush_pending(struct logdb *db) {
+    if (db->pending_len == 0)
+        return true;
+    if (!io_write(db->fd, db->pending, db->pending_len))
+        return write_failed(db);
+    db->size += db->pending_len;
+    db->pending_len = 0;
+    return true;
+}
+
+/* Append a record, or a tombstone when value is NULL.  *value_off is set to
+ * where the value lands.
+ */
+static bool
+append_record(struct logdb *db, const char *key, size_t klen,
+        const char *value, size_t vlen, uint64_t *value_off) {
+    struct log_record r;
+
+    if (db->readonly)
+        return fail(LOG_READONLY);
+    if (klen >= TOMBSTONE || (value != NULL && vlen >= TOMBSTONE))
+        return fail(LOG_TOOBIG);
+    r.klen = klen;
+    r.vlen = value ? vlen : TOMBSTONE;
+    r.sum = checksum(&r, key, value);
+
+    size_t len = record_size(r.klen, r.vlen);
+    *value_off = db->size + db->pending_len + sizeof(r) + klen;
+    db->dirty = true;
+
+    if (db->batch) {
+        if (db->pending_len + len > db->pending_cap) {
+            size_t cap = (db->pending_cap ? db->pending_cap * 2 : 65536) + len;
+            char *p = realloc(db->pending, cap);
+            if (p == NULL)
+                return fail(LOG_SYSTEM);
+            db->pending = p;
+            db->pending_cap = cap;
+        }
+        char *p = db->pending + db->pending_len;
+        memcpy(p, &r, sizeof(r));
+        memcpy(p + sizeof(r), key, klen);
+        if (value != NULL)
+            memcpy(p + sizeof(r) + klen, value, vlen);
+        db->pending_len += len;
+        if (db->pending_len > PENDING_MAX && !flush_pending(db))
+            return false;
+        return true;
+    }
+
+    struct iovec iov[3] = {
+        { &r, sizeof(r) },
+        { (void*) key, klen },
+        { (void*) value, value ? vlen : 0 }
+    };
+    if (!io_writev(db->fd, iov, 3))
+        return write_failed(db);
+    db->size += len;
+    return true;
+}
+
+/* Read a value into dest, from the file or from the writes still pending. */
+static bool
+read_value(struct logdb *db, const struct slot *s, char *dest) {
+    if (s->off >= db->size) {
+        memcpy(dest, db->pending + (s->off - db->size), s->vlen);
+        return true;
+    }
+    return io_pread(db->fd, dest, s->vlen, s->off) || fail(LOG_SYSTEM);
+}
+
+/* Load the table from the hint file.  Returns the offset the log still has
+ * to be read from: where the hint leaves off, or the start if it is missing
+ * or does not belong to this file.
+ */
+static uint64_t
+load_hint(struct logdb *db) {
+    struct hint_header h;
+    struct stat st;
+    char *path = side_path(db->path, HINT_SUFFIX), *buf = NULL;
+    uint64_t from = sizeof(struct log_header);
+    int fd = -1;
+
+    if (path == NULL || (fd = open(path, O_RDONLY)) < 0
+    ||  fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(h)
+    ||  (buf = malloc(st.st_size)) == NULL
+    ||  !io_read(fd, buf, st.st_size))
+        goto out;
+
+    memcpy(&h, buf, sizeof(h));
+    if (memcmp(h.magic, HINT_MAGIC, sizeof(h.magic)) != 0 || h.id != db->id
+    ||  h.covered < from || h.covered > db->size)
+        goto out;
+
+    const char *p = buf + sizeof(h), *end = buf + st.st_size;
+    for (uint64_t i = 0; i < h.count; ++i) {
+        struct hint_entry e;
+        if ((size_t) (end - p) < sizeof(e))
+            break;
+        memcpy(&e, p, sizeof(e));
+        p += sizeof(e);
+        if ((size_t) (end - p) < e.klen || e.off + e.vlen > h.covered
+        ||  !index_put(db, p, e.klen, e.off, e.vlen))
+            break;
+        p += e.klen;
+        if (i + 1 == h.count) {
+            db->dead = h.dead;
+            from = h.covered;
+        }
+    }
+    if (from != h.covered || h.count == 0) {
+        clear_index(db);
+        from = h.count == 0 ? h.covered : sizeof(struct log_header);
+    }
+
+out:
+    if (fd >= 0)
+        close(fd);
+    free(buf);
+    free(path);
+    return from;
+}
+
+/* Make sure bytes off to off + len of the file are in the window, reading
+ * on from off as far as it holds.  len must not run past db->size.
+ */
+static bool
+window_fill(struct logdb *db, struct window *w, uint64_t off, size_t len) {
+    if (off >= w->base && off + len <= w->base + w->len)
+        return true;
+    if (len > w->cap) {
+        char *data = realloc(w->data, len);
+        if (data == NULL)
+            return false;
+        w->data = data;
+        w->cap = len;
+    }
+    w->len = db->size - off < w->cap ? db->size - off : w->cap;
+    w->base = off;
+    if (!io_pread(db->fd, w->data, w->len, off)) {
+        w->len = 0;
+        return false;
+    }
+    return true;
+}
+
+/* Apply the records from off to the end of the file to the table.  A record
+ * that is cut short or does not match its checksum ends the log there; a
+ * writer cuts it off, a reader just stops short of it.  So does a read that
+ * comes up short for a reader, which means a writer has just cut it off.
+ */
+static bool
+scan(struct logdb *db, uint64_t off) {
+    struct window w = { NULL, 0, 0, 0 };
+    bool ok = true;
+
+    if (off >= db->size)
+        return true;
+    if ((w.data = malloc(SCAN_BUFFER)) == NULL)
+        return fail(LOG_SYSTEM);
+    w.cap = SCAN_BUFFER;
+
+    while (db->size - off >= sizeof(struct log_record)) {
+        struct log_record r;
+        if (!window_fill(db, &w, off, sizeof(r))) {
+            ok = db->readonly || fail(LOG_SYSTEM);
+            break;
+        }
+        memcpy(&r, w.data + (off - w.base), sizeof(r));
+        uint64_t len = record_size(r.klen, r.vlen);
+        if (len > db->size - off)
+            break;
+        if (!window_fill(db, &w, off, len)) {
+            ok = db->readonly || fail(LOG_SYSTEM);
+            break;
+        }
+        const char *key = w.data + (off - w.base) + sizeof(r);
+        if (checksum(&r, key, key + r.klen) != r.sum)
+            break;
+        if (r.vlen == TOMBSTONE) {
+            struct slot *s = find(db, key, r.klen);
+            if (s != NULL)
+                index_remove(db, s);
+            db->dead += len;
+        } else if (!index_put(db, key, r.klen, off + sizeof(r) + r.klen,
+                              r.vlen)) {
+            ok = false;
+            break;
+        }
+        off += len;
+    }
+    free(w.data);
+
+    if (!ok)
+        return false;
+    if (off < db->size && db->readonly) {
+        db->size = off;
+    } else if (off < db->size) {
+        if (ftruncate(db->fd, off) != 0)
+            return fail(LOG_SYSTEM);
+        db->size = off;
+        db->dirty = true;
+    }
+    return true;
+}
+
+static bool
+write_hint(struct logdb *db) {
+    struct hint_header h;
+    struct Writer w;
+    char *path = side_path(db->path, HINT_SUFFIX);
+    char *tmp = side_path(db->path, HINT_SUFFIX ".tmp");
+    bool ok = false;
+    int fd = -1;
+
+    if (path == NULL || tmp == NULL
+    ||  (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) < 0
+    ||  !writer_open(&w, fd, WRITE_BUFFER))
+        goto out;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, HINT_MAGIC, sizeof(h.magic));
+    h.id = db->id;
+    h.covered = db->size;
+    h.count = db->used;
+    h.dead = db->dead;
+    writer_put(&w, &h, sizeof(h));
+    for (size_t i = 0; i < db->cap; ++i) {
+        struct slot *s = db->slots + i;
+        struct hint_entry e = { s->off, s->klen, s->vlen };
+        if (!live(s))
+            continue;
+        writer_put(&w, &e, sizeof(e));
+        writer_put(&w, s->key, s->klen);
+    }
+    ok = writer_close(&w) && rename(tmp, path) == 0;
+
+out:
+    if (fd >= 0)
+        close(fd);
+    if (!ok && tmp != NULL)
+        unlink(tmp);
+    free(tmp);
+    free(path);
+    if (ok)
+        db->dirty = false;
+    return ok;
+}
+
+static uint64_t
+new_id(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec)
+         ^ (uint64_t) getpid() << 40;
+}
+
+static bool
+lock_file(int fd) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    return fcntl(fd, F_SETLK, &fl) == 0;
+}
+
+/* Start a new, empty data file on fd. */
+static bool
+write_header(struct logdb *db, int fd) {
+    struct log_header h;
+    memcpy(h.magic, LOG_MAGIC, sizeof(h.magic));
+    h.id = new_id();
+    if (!io_write(fd, &h, sizeof(h)))
+        return fail(LOG_SYSTEM);
+    db->id = h.id;
+    return true;
+}
+
+static struct logdb *
+log_open(const char *file, enum OpenMode mode) {
+    struct logdb *db;
+    struct log_header h;
+    struct stat st;
+
+    if ((db = calloc(1, sizeof(struct logdb))) == NULL
+    ||  (db->path = strdup(file)) == NULL) {
+        free(db);
+        fail(LOG_SYSTEM);
+        return NULL;
+    }
+    db->readonly = mode == DB_READ;
+    db->fd = db->readonly ? open(file, O_RDONLY)
+                          : open(file, O_RDWR | O_CREAT | O_APPEND,
+                                 S_IRUSR | S_IWUSR);
+    if (db->fd < 0) {
+        fail(LOG_SYSTEM);
+        free(db->path);
+        free(db);
+        return NULL;
+    }
+    if (!db->readonly && !lock_file(db->fd)) {
+        fail(errno == EACCES || errno == EAGAIN ? LOG_LOCKED : LOG_SYSTEM);
+        goto bad;
+    }
+    if (fstat(db->fd, &st) != 0) {
+        fail(LOG_SYSTEM);
+        goto bad;
+    }
+
+    if (st.st_size == 0 && db->readonly) {
+        db->size = 0;
+    } else if (st.st_size == 0) {
+        if (!write_header(db, db->fd))
+            goto bad;
+        db->size = sizeof(h);
+        db->dirty = true;
+    } else if ((size_t) st.st_size < sizeof(h)
+           ||  !io_pread(db->fd, &h, sizeof(h), 0)
+           ||  memcmp(h.magic, LOG_MAGIC, sizeof(h.magic)) != 0) {
+        fail(LOG_BADFILE);
+        goto bad;
+    } else {
+        db->id = h.id;
+        db->size = st.st_size;
+    }
+
+    if (!resize(db, MIN_SLOTS) || !scan(db, load_hint(db)))
+        goto bad;
+    return db;
+
+bad:
+    close(db->fd);
+    if (db->slots != NULL)
+        clear_index(db);
+    free(db->slots);
+    free(db->path);
+    free(db);
+    return NULL;
+}
+
+static bool
+log_close(struct logdb *db) {
+    bool ok = flush_pending(db);
+    if (ok && db->dirty)
+        write_hint(db);
+    ok = close(db->fd) == 0 && ok;
+    clear_index(db);
+    free(db->slots);
+    free(db->pending);
+    free(db->borrowed);
+    free(db->path);
+    free(db);
+    return ok;
+}
+
+static bool
+log_begin(struct logdb *db) {
+    db->batch = true;
+    return true;
+}
+
+static bool
+log_commit(struct logdb *db) {
+    db->batch = false;
+    if (!flush_pending(db))
+        return false;
+    return fdatasync(db->fd) == 0 || fail(LOG_SYSTEM);
+}
+
+/* Drop the writes still pending and rebuild the table from what reached the
+ * file.  Anything flushed early because the batch grew large stays.
+ */
+static bool
+log_abort(struct logdb *db) {
+    db->batch = false;
+    db->pending_len = 0;
+    clear_index(db);
+    return scan(db, load_hint(db));
+}
+
+/* The file up to what this handle has read or written is a whole database
+ * of its own: the log is only appended to, so the copy needs no lock and
+ * writers carry on meanwhile.  Writes still pending in a batch are left out.
+ */
+static bool
+log_copy(struct logdb *db, const char *dest) {
+    int fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+
+    if (fd < 0 || !io_sendfile(fd, db->fd, 0, db->size)) {
+        fail(LOG_SYSTEM);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    return close(fd) == 0 || fail(LOG_SYSTEM);
+}
+
+/* Write the live records to a new file, then swap it in and rewrite the
+ * hint.  The new file is locked before it replaces the old one.
+ */
+static bool
+log_compact(struct logdb *db) {
+    char *tmp = side_path(db->path, COMPACT_SUFFIX), *buf = NULL;
+    uint64_t *offs = NULL, size = sizeof(struct log_header), id = db->id;
+    struct Writer w;
+    size_t buf_cap = 0, n = 0;
+    bool ok = false;
+    int fd = -1;
+
+    if (db->readonly) {
+        fail(LOG_READONLY);
+        goto out;
+    }
+    if (!flush_pending(db))
+        goto out;
+    if (tmp == NULL || (offs = malloc(db->used * sizeof(uint64_t) + 1)) == NULL
+    ||  (fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND,
+                   S_IRUSR | S_IWUSR)) < 0) {
+        fail(LOG_SYSTEM);
+        goto out;
+    }
+    if (!lock_file(fd)) {
+        fail(LOG_LOCKED);
+        goto out;
+    }
+    if (!write_header(db, fd) || !writer_open(&w, fd, WRITE_BUFFER)) {
+        fail(LOG_SYSTEM);
+        goto out;
+    }
+
+    for (size_t i = 0; i < db->cap; ++i) {
+        struct slot *s = db->slots + i;
+        struct log_record r;
+        if (!live(s))
+            continue;
+        if (s->vlen > buf_cap) {
+            char *b = realloc(buf, s->vlen);
+            if (b == NULL) {
+                fail(LOG_SYSTEM);
+                writer_close(&w);
+                goto out;
+            }
+            buf = b;
+            buf_cap = s->vlen;
+        }
+        if (!read_value(db, s, buf)) {
+            writer_close(&w);
+            goto out;
+        }
+        r.klen = s->klen;
+        r.vlen = s->vlen;
+        r.sum = checksum(&r, s->key, buf);
+        writer_put(&w, &r, sizeof(r));
+        writer_put(&w, s->key, s->klen);
+        writer_put(&w, buf, s->vlen);
+        offs[n++] = size + sizeof(r) + s->klen;
+        size += record_size(r.klen, r.vlen);
+    }
+    if (!writer_close(&w) || fsync(fd) != 0 || rename(tmp, db->path) != 0) {
+        fail(LOG_SYSTEM);
+        goto out;
+    }
+
+    close(db->fd);
+    db->fd = fd;
+    fd = -1;
+    db->size = size;
+    db->dead = 0;
+    n = 0;
+    for (size_t i = 0; i < db->cap; ++i) {
+        if (live(db->slots + i))
+            db->slots[i].off = offs[n++];
+    }
+    write_hint(db);
+    ok = true;
+
+out:
+    if (fd >= 0) {
+        close(fd);
+        unlink(tmp);
+        db->id = id;
+    }
+    free(tmp);
+    free(buf);
+    free(offs);
+    return ok;
+}
+
+/* A cursor is the index of the current slot; the order is the table's. */
+static void *
+log_create_cursor(struct logdb *db) {
+    (void) db;
+    return calloc(1, sizeof(size_t));
+}
+
+static bool
+next_live(struct logdb *db, size_t *pos) {
+    while (*pos < db->cap && !live(db->slots + *pos))
+        ++*pos;
+    return *pos < db->cap;
+}
+
+static bool
+log_cursor_first(struct logdb *db, size_t **cursor) {
+    **cursor = 0;
+    return next_live(db, *cursor);
+}
+
+static bool
+log_cursor_next(struct logdb *db, size_t **cursor) {
+    ++**cursor;
+    return next_live(db, *cursor);
+}
+
+static char *
+log_cursor_key(struct logdb *db, size_t **cursor) {
+    struct slot *s = db->slots + **cursor;
+    return live(s) ? strndup(s->key, s->klen) : NULL;
+}
+
+static char *
+log_cursor_value(struct logdb *db, size_t **cursor) {
+    struct slot *s = db->slots + **cursor;
+    char *value;
+
+    if (!live(s) || (value = malloc(s->vlen + 1)) == NULL)
+        return NULL;
+    if (!read_value(db, s, value)) {
+        free(value);
+        return NULL;
+    }
+    value[s->vlen] = '\0';
+    return value;
+}
+
+/* Values are read from the file straight into the arena. */
+static size_t
+log_cursor_batch(struct logdb *db, size_t **cursor, struct CursorBatch *b) {
+    size_t used = 0;
+
+    b->count = 0;
+    b->need = 0;
+    while (b->count < b->max && next_live(db, *cursor)) {
+        struct slot *s = db->slots + **cursor;
+        struct CursorRecord *r = b->records + b->count;
+        size_t need = s->klen + 1 + (b->values ? s->vlen + 1 : 0);
+
+        if (used + need > b->arena_len) {
+            if (b->count == 0)
+                b->need = need;
+            break;
+        }
+        r->key = memcpy(b->arena + used, s->key, s->klen);
+        r->klen = s->klen;
+        b->arena[used + s->klen] = '\0';
+        used += s->klen + 1;
+        r->value = NULL;
+        r->vlen = 0;
+        if (b->values) {
+            if (!read_value(db, s, b->arena + used))
+                break;
+            r->value = b->arena + used;
+            r->vlen = s->vlen;
+            b->arena[used + s->vlen] = '\0';
+            used += s->vlen + 1;
+        }
+        ++b->count;
+        ++**cursor;
+    }
+    b->done = !next_live(db, *cursor);
+    return b->count;
+}
+
+static void
+log_destroy_cursor(size_t **cursor) {
+    free(*cursor);
+    *cursor = NULL;
+}
+
+static bool
+log_delete_len(struct logdb *db, const char *key, size_t klen) {
+    struct slot *s = find(db, key, klen);
+    uint64_t off;
+
+    if (s == NULL)
+        return fail(LOG_NOTFOUND);
+    if (!append_record(db, key, klen, NULL, 0, &off))
+        return false;
+    index_remove(db, s);
+    db->dead += record_size(klen, TOMBSTONE);
+    return true;
+}
+
+static bool
+log_delete(struct logdb *db, const char *key) {
+    return log_delete_len(db, key, strlen(key));
+}
+
+static const char *
+log_fetch_borrow(struct logdb *db, const char *key, size_t klen,
+        size_t *vlen) {
+    struct slot *s = find(db, key, klen);
+
+    if (s == NULL) {
+        fail(LOG_NOTFOUND);
+        return NULL;
+    }
+    if (s->vlen + 1 > db->borrowed_cap) {
+        char *b = realloc(db->borrowed, s->vlen + 1);
+        if (b == NULL) {
+            fail(LOG_SYSTEM);
+            return NULL;
+        }
+        db->borrowed = b;
+        db->borrowed_cap = s->vlen + 1;
+    }
+    if (!read_value(db, s, db->borrowed))
+        return NULL;
+    db->borrowed[s->vlen] = '\0';
+    if (vlen != NULL)
+        *vlen = s->vlen;
+    return db->borrowed;
+}
+
+static char *
+log_fetch_len(struct logdb *db, const char *key, size_t klen, size_t *vlen) {
+    size_t len;
+    const char *value = log_fetch_borrow(db, key, klen, &len);
+    char *copy;
+
+    if (value == NULL || (copy = malloc(len + 1)) == NULL)
+        return NULL;
+    memcpy(copy, value, len + 1);
+    if (vlen != NULL)
+        *vlen = len;
+    return copy;
+}
+
+static char *
+log_fetch(struct logdb *db, const char *key) {
+    return log_fetch_len(db, key, strlen(key), NULL);
+}
+
+static int
+by_offset(const void *a, const void *b) {
+    uint64_t x = (*(const struct want *const*) a)->s->off;
+    uint64_t y = (*(const struct want *const*) b)->s->off;
+    return (x > y) - (x < y);
+}
+
+/* Look every key up first, then read the values in file order, joining
+ * neighbours into one read, and hand them back in the order asked for.
+ */
+static bool
+log_fetch_many(struct logdb *db, size_t count, const char *const *keys,
+        const size_t *klens, value_callback cb, void *arg) {
+    struct want *want = malloc(count * sizeof(struct want) + 1);
+    struct want **order = malloc(count * sizeof(struct want*) + 1);
+    char *buf = NULL;
+    size_t n = 0, len = 0;
+    bool ok = false;
+
+    if (want == NULL || order == NULL) {
+        fail(LOG_SYSTEM);
+        goto out;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if ((want[i].s = find(db, keys[i], klens[i])) != NULL)
+            order[n++] = want + i;
+    }
+    if (n > 1)
+        qsort(order, n, sizeof(struct want*), by_offset);
+
+    /* Values still waiting to be written are sorted last and read from the
+     * pending buffer instead.
+     */
+    for (size_t j = 0; j < n && order[j]->s->off < db->size; ) {
+        uint64_t start = order[j]->s->off, end = start;
+        size_t k = j;
+        for (; k < n && order[k]->s->off < db->size
+             && order[k]->s->off <= end + READ_GAP; ++k) {
+            order[k]->at = len + (order[k]->s->off - start);
+            if (order[k]->s->off + order[k]->s->vlen > end)
+                end = order[k]->s->off + order[k]->s->vlen;
+        }
+        char *b = realloc(buf, len + (end - start) + 1);
+        if (b == NULL) {
+            fail(LOG_SYSTEM);
+            goto out;
+        }
+        buf = b;
+        if (!io_pread(db->fd, buf + len, end - start, start)) {
+            fail(LOG_SYSTEM);
+            goto out;
+        }
+        len += end - start;
+        j = k;
+    }
+
+    ok = true;
+    for (size_t i = 0; i < count; ++i) {
+        const struct slot *s = want[i].s;
+        const char *value = s == NULL ? NULL
+                          : s->off >= db->size
+                          ? db->pending + (s->off - db->size)
+                          : buf + want[i].at;
+        if (!cb(arg, i, value, s ? s->vlen : 0))
+            break;
+    }
+
+out:
+    free(buf);
+    free(order);
+    free(want);
+    return ok;
+}
+
+static int
+log_get_errno(struct logdb *db) {
+    (void) db;
+    return log_errno;
+}
+
+static bool
+log_info(struct logdb *db, setting_callback cb, void *arg) {
+    char buf[32];
+
+    snprintf(buf, sizeof(buf), "%zu", db->used);
+    if (!cb(arg, "records", buf))
+        return false;
+    snprintf(buf, sizeof(buf), "%llu",
+             (unsigned long long) (db->size + db->pending_len));
+    if (!cb(arg, "file_bytes", buf))
+        return false;
+    snprintf(buf, sizeof(buf), "%llu", (unsigned long long) db->dead);
+    return cb(arg, "dead_bytes", buf);
+}
+
+/* Values are contiguous in the file once they have been written out. */
+static bool
+log_locate(struct logdb *db, const char *key, size_t klen, int *fd,
+        uint64_t *off, size_t *vlen) {
+    struct slot *s = find(db, key, klen);
+
+    if (s == NULL)
+        return fail(LOG_NOTFOUND);
+    if (s->off >= db->size)
+        return false;
+    *fd = db->fd;
+    *off = s->off;
+    *vlen = s->vlen;
+    return true;
+}
+
+static bool
+log_store_len(struct logdb *db, const char *key, size_t klen,
+        const char *value, size_t vlen) {
+    uint64_t off;
+    return append_record(db, key, klen, value, vlen, &off)
+        && index_put(db, key, klen, off, vlen);
+}
+
+static bool
+log_try_store_len(struct logdb *db, const char *key, size_t klen,
+        const char *value, size_t vlen) {
+    if (find(db, key, klen) != NULL)
+        return fail(LOG_EXISTS);
+    return log_store_len(db, key, klen, value, vlen);
+}
+
+static bool
+log_store(struct logdb *db, char *key, char *value) {
+    return log_store_len(db, key, strlen(key), value, strlen(value));
+}
+
+static bool
+log_try_store(struct logdb *db, char *key, char *value) {
+    return log_try_store_len(db, key, strlen(key), value, strlen(value));
+}
+
+static const char *
+log_strerror(int err) {
+    switch (err) {
+        case LOG_OK:       return "No error";
+        case LOG_NOTFOUND: return "Item not found";
+        case LOG_EXISTS:   return "Item already exists";
+        case LOG_LOCKED:   return "Database is in use by another process";
+        case LOG_BADFILE:  return "Not a drop log";
+        case LOG_TOOBIG:   return "Key or value is too large";
+        case LOG_READONLY: return "Database was opened for reading only";
+        default:           return strerror(log_sys_errno);
+    }
+}
+
+static struct DbInterface logdb = {
+    .open = (open_func) log_open,
+    .close = (close_func) log_close,
+    .get_errno = (errno_func) log_get_errno,
+    .strerror = (strerror_func) log_strerror,
+    .delete = (delete_func) log_delete,
+    .fetch = (fetch_func) log_fetch,
+    .try_store = (try_store_func) log_try_store,
+    .store = (store_func) log_store,
+    .delete_len = (delete_len_func) log_delete_len,
+    .fetch_len = (fetch_len_func) log_fetch_len,
+    .fetch_borrow = (fetch_borrow_func) log_fetch_borrow,
+    .try_store_len = (try_store_len_func) log_try_store_len,
+    .store_len = (store_len_func) log_store_len,
+    .locate = (locate_func) log_locate,
+    .fetch_many = (fetch_many_func) log_fetch_many,
+    .create_cursor = (create_cursor_func) log_create_cursor,
+    .destroy_cursor = (destroy_cursor_func) log_destroy_cursor,
+    .cursor_first = (cursor_first_func) log_cursor_first,
+    .cursor_next = (cursor_next_func) log_cursor_next,
+    .cursor_key = (cursor_key_func) log_cursor_key,
+    .cursor_value = (cursor_value_func) log_cursor_value,
+    .cursor_batch = (cursor_batch_func) log_cursor_batch,
+    .begin = (begin_func) log_begin,
+    .commit = (commit_func) log_commit,
+    .abort = (abort_func) log_abort,
+    .compact = (compact_func) log_compact,
+    .info = (info_func) log_info,
+    .copy = (copy_func) log_copy
+};
+
+struct DbInterface *
+DB_ENTRY(log)() {
+    struct DbInterface *dbint = malloc(sizeof(struct DbInterface));
+    if (dbint == NULL) {
+        return dbint;
+    }
+    memcpy(dbint, &logdb, sizeof(struct DbInterface));
+    return dbint;
+}
@@ -0,0 +1,317 @@
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "db.h"
+#include "snap.h"
+
+enum SnapError { SNAP_OK, SNAP_NOTFOUND, SNAP_READONLY, SNAP_BADFILE,
+                 SNAP_SYSTEM };
+
+struct snap {
+    int fd;
+    const char *map;
+    size_t size;
+    const struct snap_header *hdr;
+    const uint32_t *disp;
+    const struct snap_slot *slots;
+};
+
+static bool  snap_close(struct snap*);
+static void *snap_create_cursor(struct snap*);
+static bool  snap_cursor_first(struct snap*, uint32_t**);
+static char *snap_cursor_key(struct snap*, uint32_t**);
+static bool  snap_cursor_next(struct snap*, uint32_t**);
+static char *snap_cursor_value(struct snap*, uint32_t**);
+static bool  snap_delete(struct snap*, const char*);
+static bool  snap_delete_len(struct snap*, const char*, size_t);
+static bool  snap_locate(struct snap*, const char*, size_t, int*, uint64_t*,
+                         size_t*);
+static void  snap_destroy_cursor(uint32_t**);
+static char *snap_fetch(struct snap*, const char*);
+static const char *snap_fetch_borrow(struct snap*, const char*, size_t,
+                                     size_t*);
+static char *snap_fetch_len(struct snap*, const char*, size_t, size_t*);
+static int   snap_get_errno(struct snap*);
+static struct snap *snap_open(const char*, enum OpenMode);
+static bool  snap_valid(const struct snap*);
+static bool  snap_store(struct snap*, char*, char*);
+static bool  snap_store_len(struct snap*, const char*, size_t, const char*,
+                            size_t);
+static const char *snap_strerror(int);
+
+struct DbInterface *DB_ENTRY(snap)(void);
+
+static int snap_errno = SNAP_OK;
+static int snap_sys_errno = 0;
+
+static bool
+snap_close(struct snap *db) {
+    bool ret = munmap((void*) db->map, db->size) == 0;
+    close(db->fd);
+    free(db);
+    return ret;
+}
+
+/* A cursor is the index of the current slot. */
+static void *
+snap_create_cursor(struct snap *db) {
+    (void) db;
+    return calloc(1, sizeof(uint32_t));
+}
+
+static bool
+snap_cursor_first(struct snap *db, uint32_t **cursor) {
+    **cursor = 0;
+    return db->hdr->count > 0;
+}
+
+static char *
+snap_cursor_key(struct snap *db, uint32_t **cursor) {
+    const struct snap_slot *s = db->slots + **cursor;
+    return strndup(db->map + s->off, s->klen);
+}
+
+static bool
+snap_cursor_next(struct snap *db, uint32_t **cursor) {
+    return ++**cursor < db->hdr->count;
+}
+
+static char *
+snap_cursor_value(struct snap *db, uint32_t **cursor) {
+    const struct snap_slot *s = db->slots + **cursor;
+    return strndup(db->map + s->off + s->klen + 1, s->vlen);
+}
+
+static bool
+snap_delete(struct snap *db, const char *key) {
+    (void) db;
+    (void) key;
+    snap_errno = SNAP_READONLY;
+    return false;
+}
+
+static bool
+snap_delete_len(struct snap *db, const char *key, size_t klen) {
+    (void) klen;
+    return snap_delete(db, key);
+}
+
+static void
+snap_destroy_cursor(uint32_t **cursor) {
+    free(*cursor);
+    *cursor = NULL;
+}
+
+/* One hash, one displacement lookup and one key compare. */
+static const struct snap_slot *
+snap_lookup(struct snap *db, const char *key, size_t len) {
+    const struct snap_header *h = db->hdr;
+
+    if (h->count == 0)
+        return NULL;
+    uint64_t hash = snap_hash(key, len, h->salt);
+    uint32_t seed = db->disp[snap_bucket(hash, h->buckets)];
+    const struct snap_slot *s = db->slots
+                              + snap_slot_index(hash, seed, h->count);
+    if (s->klen != len || memcmp(db->map + s->off, key, len) != 0)
+        return NULL;
+    return s;
+}
+
+static char *
+snap_fetch(struct snap *db, const char *key) {
+    size_t vlen;
+    const char *value = snap_fetch_borrow(db, key, strlen(key), &vlen);
+    return value ? strndup(value, vlen) : NULL;
+}
+
+/* The value is handed out straight from the mapping. */
+static const char *
+snap_fetch_borrow(struct snap *db, const char *key, size_t klen,
+        size_t *vlen) {
+    const struct snap_slot *s = snap_lookup(db, key, klen);
+    if (s == NULL) {
+        snap_errno = SNAP_NOTFOUND;
+        return NULL;
+    }
+    if (vlen != NULL)
+        *vlen = s->vlen;
+    return db->map + s->off + s->klen + 1;
+}
+
+/* Values sit whole in the file, so they can be sent from it directly. */
+static bool
+snap_locate(struct snap *db, const char *key, size_t klen, int *fd,
+        uint64_t *off, size_t *vlen) {
+    const struct snap_slot *s = snap_lookup(db, key, klen);
+    if (s == NULL) {
+        snap_errno = SNAP_NOTFOUND;
+        return false;
+    }
+    *fd = db->fd;
+    *off = s->off + s->klen + 1;
+    *vlen = s->vlen;
+    return true;
+}
+
+static char *
+snap_fetch_len(struct snap *db, const char *key, size_t klen, size_t *vlen) {
+    size_t len;
+    const char *value = snap_fetch_borrow(db, key, klen, &len);
+    char *copy;
+
+    if (value == NULL || (copy = malloc(len + 1)) == NULL)
+        return NULL;
+    memcpy(copy, value, len);
+    copy[len] = '\0';
+    if (vlen != NULL)
+        *vlen = len;
+    return copy;
+}
+
+static int
+snap_get_errno(struct snap *db) {
+    (void) db;
+    return snap_errno;
+}
+
+static struct snap *
+snap_open(const char *file, enum OpenMode mode) {
+    struct snap *db;
+    struct stat st;
+    int fd;
+
+    (void) mode;    /* snapshots are only ever read */
+    if ((fd = open(file, O_RDONLY)) < 0) {
+        snap_errno = SNAP_SYSTEM;
+        snap_sys_errno = errno;
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(struct snap_header)
+    ||  (db = calloc(1, sizeof(struct snap))) == NULL) {
+        snap_errno = SNAP_BADFILE;
+        close(fd);
+        return NULL;
+    }
+
+    db->fd = fd;
+    db->size = st.st_size;
+    db->map = mmap(NULL, db->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (db->map == MAP_FAILED) {
+        snap_errno = SNAP_SYSTEM;
+        snap_sys_errno = errno;
+        close(fd);
+        free(db);
+        return NULL;
+    }
+
+    db->hdr = (const struct snap_header*) db->map;
+    if (!snap_valid(db)) {
+        snap_errno = SNAP_BADFILE;
+        snap_close(db);
+        return NULL;
+    }
+    db->disp = (const uint32_t*) (db->map + db->hdr->disp_off);
+    db->slots = (const struct snap_slot*) (db->map + db->hdr->slot_off);
+    return db;
+}
+
+/* Check that the regions follow one another inside the file, aligned for the
+ * tables read in place, and that every slot's record lies whole in the data
+ * region, so that no lookup can read past the mapping.
+ */
+static bool
+snap_valid(const struct snap *db) {
+    const struct snap_header *h = db->hdr;
+    const struct snap_slot *slots;
+
+    if (memcmp(h->magic, SNAP_MAGIC, sizeof(h->magic)) != 0
+    ||  h->size != db->size || h->buckets == 0
+    ||  h->data_off < sizeof(struct snap_header) || h->data_off > h->disp_off
+    ||  h->disp_off > h->slot_off || h->slot_off > h->size
+    ||  h->disp_off % sizeof(uint32_t) != 0 || h->slot_off % 8 != 0
+    ||  (uint64_t) h->buckets * sizeof(uint32_t) > h->slot_off - h->disp_off
+    ||  (uint64_t) h->count * sizeof(struct snap_slot)
+            > h->size - h->slot_off)
+        return false;
+
+    slots = (const struct snap_slot*) (db->map + h->slot_off);
+    for (uint32_t i = 0; i < h->count; ++i) {
+        const struct snap_slot *s = slots + i;
+        if (s->off < h->data_off || s->off > h->disp_off
+        ||  (uint64_t) s->klen + s->vlen + 2 > h->disp_off - s->off)
+            return false;
+    }
+    return true;
+}
+
+static bool
+snap_store(struct snap *db, char *key, char *value) {
+    (void) db;
+    (void) key;
+    (void) value;
+    snap_errno = SNAP_READONLY;
+    return false;
+}
+
+static bool
+snap_store_len(struct snap *db, const char *key, size_t klen,
+        const char *value, size_t vlen) {
+    (void) key;
+    (void) klen;
+    (void) value;
+    (void) vlen;
+    return snap_store(db, NULL, NULL);
+}
+
+static const char *
+snap_strerror(int err) {
+    switch (err) {
+        case SNAP_OK:       return "No error";
+        case SNAP_NOTFOUND: return "Item not found";
+        case SNAP_READONLY: return "Snapshots are read-only";
+        case SNAP_BADFILE:  return "Not a drop snapshot";
+        default:            return strerror(snap_sys_errno);
+    }
+}
+
+static struct DbInterface snap = {
+    .open = (open_func) snap_open,
+    .close = (close_func) snap_close,
+    .get_errno = (errno_func) snap_get_errno,
+    .strerror = (strerror_func) snap_strerror,
+    .delete = (delete_func) snap_delete,
+    .fetch = (fetch_func) snap_fetch,
+    .try_store = (try_store_func) snap_store,
+    .store = (store_func) snap_store,
+    .delete_len = (delete_len_func) snap_delete_len,
+    .fetch_len = (fetch_len_func) snap_fetch_len,
+    .fetch_borrow = (fetch_borrow_func) snap_fetch_borrow,
+    .try_store_len = (try_store_len_func) snap_store_len,
+    .store_len = (store_len_func) snap_store_len,
+    .locate = (locate_func) snap_locate,
+    .create_cursor = (create_cursor_func) snap_create_cursor,
+    .destroy_cursor = (destroy_cursor_func) snap_destroy_cursor,
+    .cursor_first = (cursor_first_func) snap_cursor_first,
+    .cursor_next = (cursor_next_func) snap_cursor_next,
+    .cursor_key = (cursor_key_func) snap_cursor_key,
+    .cursor_value = (cursor_value_func) snap_cursor_value
+};
+
+struct DbInterface *
+DB_ENTRY(snap)() {
+    struct DbInterface *dbint = malloc(sizeof(struct DbInterface));
+    if (dbint == NULL) {
+        return dbint;
+    }
+    memcpy(dbint, &snap, sizeof(struct DbInterface));
+    return dbint;
+}
@@ -1,19 +1,44 @@
+#include <stdio.h>
 #include <string.h>
 #include <tcutil.h>
 #include <tcbdb.h>
 
 #include "db.h"
+#include "tune.h"
 
+/* Leaves optimize aims for, in bytes of records; see tcdb_optimize. */
+#define LEAF_TARGET 8192
+#define MIN_LMEMB 32
+#define MAX_LMEMB 1024
+#define DEFAULT_BNUM 32749
+
+static bool  tcdb_append(void*, const char*, size_t, const char*, size_t);
 static bool  tcdb_close(void*);
 static void *tcdb_create_cursor(void*);
+static size_t tcdb_cursor_batch(void*, void**, struct CursorBatch*);
 static bool  tcdb_cursor_first(void*, void**);
 static char *tcdb_cursor_key(void*, void**);
 static bool  tcdb_cursor_next(void*, void**);
+static bool  tcdb_cursor_seek(void*, void**, const char*, size_t);
 static char *tcdb_cursor_value(void*, void**);
+static bool  tcdb_delete_len(void*, const char*, size_t);
 static void  tcdb_destroy_cursor(void**);
-static void *tcdb_open(const char*);
+static const char *tcdb_fetch_borrow(void*, const char*, size_t, size_t*);
+static char *tcdb_fetch_len(void*, const char*, size_t, size_t*);
+static bool  tcdb_info(void*, setting_callback, void*);
+static void *tcdb_open(const char*, enum OpenMode);
+static bool  tcdb_optimize(void*);
+static bool  tcdb_store_len(void*, const char*, size_t, const char*, size_t);
+static bool  tcdb_try_store_len(void*, const char*, size_t, const char*,
+                                size_t);
+
+struct DbInterface *DB_ENTRY(tcbdb)(void);
 
-struct DbInterface *get_interface(void);
+static bool
+tcdb_append(void *db, const char *key, size_t klen, const char *value,
+        size_t vlen) {
+    return tcbdbputcat(db, key, klen, value, vlen);
+}
 
 static bool
 tcdb_close(void *db) {
@@ -27,6 +52,55 @@ tcdb_create_cursor(void *db) {
     return tcbdbcurnew(db);
 }
 
+/* Keys and values are read in place from the cursor's leaf page and copied
+ * once, into the arena.
+ */
+static size_t
+tcdb_cursor_batch(void *db, void **cursor, struct CursorBatch *b) {
+    size_t used = 0;
+    const char *key, *value = NULL;
+    int ksize, vsize = 0;
+
+    (void) db;
+    b->count = 0;
+    b->need = 0;
+    b->done = false;
+    while (b->count < b->max) {
+        struct CursorRecord *r = b->records + b->count;
+
+        if ((key = tcbdbcurkey3(*cursor, &ksize)) == NULL
+        ||  (b->values && (value = tcbdbcurval3(*cursor, &vsize)) == NULL)) {
+            b->done = true;
+            break;
+        }
+        size_t need = ksize + 1 + (b->values ? vsize + 1 : 0);
+        if (used + need > b->arena_len) {
+            if (b->count == 0)
+                b->need = need;
+            break;
+        }
+        r->key = memcpy(b->arena + used, key, ksize);
+        r->klen = ksize;
+        b->arena[used + ksize] = '\0';
+        used += ksize + 1;
+        r->value = NULL;
+        r->vlen = 0;
+        if (b->values) {
+            r->value = memcpy(b->arena + used, value, vsize);
+            r->vlen = vsize;
+            b->arena[used + vsize] = '\0';
+            used += vsize + 1;
+        }
+        ++b->count;
+
+        if (!tcbdbcurnext(*cursor)) {
+            b->done = true;
+            break;
+        }
+    }
+    return b->count;
+}
+
 static bool
 tcdb_cursor_first(void *db, void **cursor) {
     (void) db;
@@ -45,26 +119,178 @@ tcdb_cursor_next(void *db, void **cursor) {
     return tcbdbcurnext(*cursor);
 }
 
+static bool
+tcdb_cursor_seek(void *db, void **cursor, const char *key, size_t klen) {
+    (void) db;
+    return tcbdbcurjump(*cursor, key, klen);
+}
+
 static char *
 tcdb_cursor_value(void *db, void **cursor) {
     (void) db;
     return tcbdbcurval2(*cursor);
 }
 
+static bool
+tcdb_delete_len(void *db, const char *key, size_t klen) {
+    return tcbdbout(db, key, klen);
+}
+
 static void
 tcdb_destroy_cursor(void **cursor) {
     tcbdbcurdel(*cursor);
 }
 
+/* tcbdbget3 answers from the leaf cache without copying. */
+static const char *
+tcdb_fetch_borrow(void *db, const char *key, size_t klen, size_t *vlen) {
+    int size;
+    const char *value = tcbdbget3(db, key, klen, &size);
+    if (value != NULL && vlen != NULL)
+        *vlen = size;
+    return value;
+}
+
+static char *
+tcdb_fetch_len(void *db, const char *key, size_t klen, size_t *vlen) {
+    int size;
+    char *value = tcbdbget(db, key, klen, &size);
+    if (value != NULL && vlen != NULL)
+        *vlen = size;
+    return value;
+}
+
+/* The opts bits for the compress and large settings, or UINT8_MAX when
+ * neither is set.
+ */
+static uint8_t
+tune_opts(const struct Tuning *t) {
+    const char *compress = tune_get(t, "compress");
+    uint8_t opts = 0;
+
+    if (compress == NULL && tune_get(t, "large") == NULL)
+        return UINT8_MAX;
+    if (compress == NULL)
+        compress = "none";
+    if (strcmp(compress, "deflate") == 0)
+        opts |= BDBTDEFLATE;
+    else if (strcmp(compress, "bzip") == 0)
+        opts |= BDBTBZIP;
+    else if (strcmp(compress, "tcbs") == 0)
+        opts |= BDBTTCBS;
+    if (tune_number(t, "large", 0) > 0)
+        opts |= BDBTLARGE;
+    return opts;
+}
+
+/* The layout settings only count when the file is created (or optimized);
+ * the cache and mapping sizes apply to every open.
+ */
 static void *
-tcdb_open(const char *file) {
+tcdb_open(const char *file, enum OpenMode mode) {
     TCBDB *db = tcbdbnew();
-    if (!tcbdbopen(db, file, BDBOWRITER | BDBOCREAT | BDBOREADER)) {
+    struct Tuning t;
+    int omode = mode == DB_READ ? BDBOREADER
+                                : BDBOWRITER | BDBOCREAT | BDBOREADER;
+    if (db == NULL)
+        return NULL;
+    tune_load(file, &t);
+    uint8_t opts = tune_opts(&t);
+    tcbdbtune(db, tune_number(&t, "lmemb", 0), tune_number(&t, "nmemb", 0),
+              tune_number(&t, "bnum", 0), tune_number(&t, "apow", -1),
+              tune_number(&t, "fpow", -1), opts == UINT8_MAX ? 0 : opts);
+    tcbdbsetcache(db, tune_number(&t, "lcnum", 0),
+                  tune_number(&t, "ncnum", 0));
+    if (tune_get(&t, "xmsiz") != NULL)
+        tcbdbsetxmsiz(db, tune_number(&t, "xmsiz", 0));
+    if (!tcbdbopen(db, file, omode)) {
+        tcbdbdel(db);
         return NULL;
     }
     return db;
 }
 
+static bool
+report(setting_callback cb, void *arg, const char *name, long long value) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%lld", value);
+    return cb(arg, name, buf);
+}
+
+/* Tokyo Cabinet keeps its layout in the file but has no calls to read it
+ * back, so only the counts and the settings file are reported.
+ */
+static bool
+tcdb_info(void *db, setting_callback cb, void *arg) {
+    struct Tuning t;
+
+    if (!report(cb, arg, "records", tcbdbrnum(db))
+    ||  !report(cb, arg, "file_bytes", tcbdbfsiz(db)))
+        return false;
+    tune_load(tcbdbpath(db), &t);
+    for (size_t i = 0; i < t.count; ++i) {
+        char name[sizeof(t.settings[i].name) + 5];
+        snprintf(name, sizeof(name), "tune.%s", t.settings[i].name);
+        if (!cb(arg, name, t.settings[i].value))
+            return false;
+    }
+    return true;
+}
+
+/* Size the leaves to hold about LEAF_TARGET bytes of the average record, and
+ * the bucket array at twice the leaves it takes to hold every record, as the
+ * Tokyo Cabinet documentation suggests.  Settings in the tune file take
+ * precedence, and the compression options only change when one is given.
+ */
+static bool
+tcdb_optimize(void *db) {
+    struct Tuning t;
+    uint64_t records = tcbdbrnum(db), total = 0;
+    BDBCUR *cur = tcbdbcurnew(db);
+    const char *key, *value;
+    int ksize, vsize;
+
+    if (cur == NULL)
+        return false;
+    if (tcbdbcurfirst(cur)) {
+        do {
+            if ((key = tcbdbcurkey3(cur, &ksize)) != NULL
+            &&  (value = tcbdbcurval3(cur, &vsize)) != NULL)
+                total += ksize + vsize;
+        } while (tcbdbcurnext(cur));
+    }
+    tcbdbcurdel(cur);
+
+    uint64_t average = records ? total / records : 0;
+    int64_t lmemb = average ? LEAF_TARGET / average : MAX_LMEMB;
+    if (lmemb < MIN_LMEMB)
+        lmemb = MIN_LMEMB;
+    if (lmemb > MAX_LMEMB)
+        lmemb = MAX_LMEMB;
+    int64_t bnum = records / lmemb * 2;
+    if (bnum < DEFAULT_BNUM)
+        bnum = DEFAULT_BNUM;
+
+    tune_load(tcbdbpath(db), &t);
+    return tcbdboptimize(db, tune_number(&t, "lmemb", lmemb),
+                         tune_number(&t, "nmemb", 0),
+                         tune_number(&t, "bnum", bnum),
+                         tune_number(&t, "apow", -1),
+                         tune_number(&t, "fpow", -1), tune_opts(&t));
+}
+
+static bool
+tcdb_store_len(void *db, const char *key, size_t klen, const char *value,
+        size_t vlen) {
+    return tcbdbput(db, key, klen, value, vlen);
+}
+
+static bool
+tcdb_try_store_len(void *db, const char *key, size_t klen, const char *value,
+        size_t vlen) {
+    return tcbdbputkeep(db, key, klen, value, vlen);
+}
+
 static struct DbInterface tcbdb = {
     .open = (open_func) tcdb_open,
     .close = (close_func) tcdb_close,
@@ -74,16 +300,30 @@ static struct DbInterface tcbdb = {
     .fetch = (fetch_func) tcbdbget2,
     .try_store = (try_store_func) tcbdbputkeep2,
     .store = (store_func) tcbdbput2,
+    .delete_len = tcdb_delete_len,
+    .fetch_len = tcdb_fetch_len,
+    .fetch_borrow = tcdb_fetch_borrow,
+    .try_store_len = tcdb_try_store_len,
+    .store_len = tcdb_store_len,
+    .append = tcdb_append,
     .create_cursor = (create_cursor_func) tcdb_create_cursor,
     .destroy_cursor = (destroy_cursor_func) tcdb_destroy_cursor,
     .cursor_first = (cursor_first_func) tcdb_cursor_first,
     .cursor_next = (cursor_next_func) tcdb_cursor_next,
     .cursor_key = (cursor_key_func) tcdb_cursor_key,
-    .cursor_value = (cursor_value_func) tcdb_cursor_value
+    .cursor_value = (cursor_value_func) tcdb_cursor_value,
+    .cursor_seek = (cursor_seek_func) tcdb_cursor_seek,
+    .cursor_batch = (cursor_batch_func) tcdb_cursor_batch,
+    .begin = (begin_func) tcbdbtranbegin,
+    .commit = (commit_func) tcbdbtrancommit,
+    .abort = (abort_func) tcbdbtranabort,
+    .optimize = (optimize_func) tcdb_optimize,
+    .info = (info_func) tcdb_info,
+    .copy = (copy_func) tcbdbcopy
 };
 
 struct DbInterface *
-get_interface() {
+DB_ENTRY(tcbdb)() {
     struct DbInterface *dbint = malloc(sizeof(struct DbInterface));
     if (dbint == NULL) {
         return dbint;
@@ -0,0 +1,513 @@
+/* db_trace.c
+ * A backend that loads another one and times every call made to it.
+ *
+ * drop loads it in place of the real backend when $DROP_TRACE is set, and
+ * names the real one in $DROP_TRACE_BACKEND; it is loaded from
+ * db_<type>.so next to this library.  Each call's latency goes into a
+ * log-linear histogram per operation, which is written as one JSON line per
+ * operation when the last database is closed: appended to the file named by
+ * $DROP_TRACE, or to stderr when that is empty or "-".  With
+ * $DROP_TRACE_LOG set, every call is also appended to that file as
+ * "<operation> <nanoseconds> <ok> [key]".
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "db.h"
+
+/* Each power of two is split into 1 << SUB_BITS buckets, so a bucket is
+ * within 1/16 of the values in it.
+ */
+#define SUB_BITS 4
+#define SUB_COUNT (1 << SUB_BITS)
+#define BUCKETS (64 * SUB_COUNT)
+
+enum TraceOp {
+    OP_OPEN, OP_CLOSE, OP_DELETE, OP_FETCH, OP_TRY_STORE, OP_STORE,
+    OP_DELETE_LEN, OP_FETCH_LEN, OP_FETCH_BORROW, OP_TRY_STORE_LEN,
+    OP_STORE_LEN, OP_APPEND, OP_LOCATE, OP_FETCH_MANY, OP_CREATE_CURSOR,
+    OP_CURSOR_FIRST, OP_CURSOR_NEXT, OP_CURSOR_KEY, OP_CURSOR_VALUE,
+    OP_DESTROY_CURSOR, OP_CURSOR_SEEK, OP_CURSOR_BATCH, OP_BEGIN, OP_COMMIT,
+    OP_ABORT, OP_COMPACT, OP_OPTIMIZE, OP_INFO, OP_COPY, OP_SEARCH, OP_COUNT
+};
+
+static const char *op_names[OP_COUNT] = {
+    "open", "close", "delete", "fetch", "try_store", "store", "delete_len",
+    "fetch_len", "fetch_borrow", "try_store_len", "store_len", "append",
+    "locate", "fetch_many", "create_cursor", "cursor_first", "cursor_next",
+    "cursor_key", "cursor_value", "destroy_cursor", "cursor_seek",
+    "cursor_batch", "begin", "commit", "abort", "compact", "optimize", "info",
+    "copy", "search"
+};
+
+struct histogram {
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+    uint64_t buckets[BUCKETS];
+};
+
+struct trace {
+    void *db;
+};
+
+static struct DbInterface *inner;
+static const char *inner_type;
+static struct histogram hists[OP_COUNT];
+static FILE *oplog;
+static int open_count;
+
+static uint64_t
+now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+bucket_of(uint64_t v) {
+    if (v < SUB_COUNT)
+        return (int) v;
+    int mag = 63 - __builtin_clzll(v);
+    int shift = mag - SUB_BITS;
+    return (mag - SUB_BITS + 1) * SUB_COUNT
+         + (int) ((v >> shift) - SUB_COUNT);
+}
+
+/* The largest value that lands in bucket b. */
+static uint64_t
+bucket_top(int b) {
+    if (b < SUB_COUNT)
+        return b;
+    int shift = b / SUB_COUNT - 1;
+    uint64_t sub = SUB_COUNT + b % SUB_COUNT;
+    return ((sub + 1) << shift) - 1;
+}
+
+static uint64_t
+percentile(const struct histogram *h, double p) {
+    uint64_t want = (uint64_t) (p * h->count + 0.999999), seen = 0;
+    if (want == 0)
+        want = 1;
+    for (int b = 0; b < BUCKETS; ++b) {
+        if ((seen += h->buckets[b]) >= want)
+            return bucket_top(b) < h->max ? bucket_top(b) : h->max;
+    }
+    return h->max;
+}
+
+static void
+record(enum TraceOp op, uint64_t start, const char *key, size_t klen,
+        bool ok) {
+    uint64_t ns = now_ns() - start;
+    struct histogram *h = hists + op;
+
+    if (h->count == 0 || ns < h->min)
+        h->min = ns;
+    if (ns > h->max)
+        h->max = ns;
+    h->sum += ns;
+    ++h->count;
+    ++h->buckets[bucket_of(ns)];
+
+    if (oplog != NULL) {
+        fprintf(oplog, "%s %llu %d", op_names[op], (unsigned long long) ns,
+                ok);
+        if (key != NULL) {
+            fputc(' ', oplog);
+            fwrite(key, 1, klen, oplog);
+        }
+        fputc('\n', oplog);
+    }
+}
+
+static void
+dump(void) {
+    const char *path = getenv("DROP_TRACE");
+    FILE *f = stderr;
+
+    if (path != NULL && *path != '\0' && strcmp(path, "-") != 0
+    &&  (f = fopen(path, "a")) == NULL) {
+        perror(path);
+        return;
+    }
+    for (int op = 0; op < OP_COUNT; ++op) {
+        const struct histogram *h = hists + op;
+        if (h->count == 0)
+            continue;
+        fprintf(f, "{\"backend\":\"%s\",\"op\":\"%s\",\"count\":%llu,"
+                "\"mean_ns\":%.0f,\"min_ns\":%llu,\"p50_ns\":%llu,"
+                "\"p90_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,"
+                "\"max_ns\":%llu}\n", inner_type, op_names[op],
+                (unsigned long long) h->count, h->sum / h->count,
+                (unsigned long long) h->min,
+                (unsigned long long) percentile(h, 0.5),
+                (unsigned long long) percentile(h, 0.9),
+                (unsigned long long) percentile(h, 0.99),
+                (unsigned long long) percentile(h, 0.999),
+                (unsigned long long) h->max);
+    }
+    if (f != stderr)
+        fclose(f);
+    memset(hists, 0, sizeof(hists));
+}
+
+static struct trace *
+trace_open(const char *file, enum OpenMode mode) {
+    struct trace *t = malloc(sizeof(struct trace));
+    uint64_t start = now_ns();
+
+    if (t == NULL)
+        return NULL;
+    t->db = inner->open(file, mode);
+    record(OP_OPEN, start, file, strlen(file), t->db != NULL);
+    if (t->db == NULL) {
+        free(t);
+        return NULL;
+    }
+    ++open_count;
+    return t;
+}
+
+static bool
+trace_close(struct trace *t) {
+    uint64_t start = now_ns();
+    bool ok = inner->close(t->db);
+    record(OP_CLOSE, start, NULL, 0, ok);
+    free(t);
+    if (--open_count == 0) {
+        dump();
+        if (oplog != NULL)
+            fflush(oplog);
+    }
+    return ok;
+}
+
+static bool
+trace_delete(struct trace *t, const char *key) {
+    uint64_t start = now_ns();
+    bool ok = inner->delete(t->db, key);
+    record(OP_DELETE, start, key, strlen(key), ok);
+    return ok;
+}
+
+static char *
+trace_fetch(struct trace *t, const char *key) {
+    uint64_t start = now_ns();
+    char *value = inner->fetch(t->db, key);
+    record(OP_FETCH, start, key, strlen(key), value != NULL);
+    return value;
+}
+
+static bool
+trace_try_store(struct trace *t, char *key, char *value) {
+    uint64_t start = now_ns();
+    bool ok = inner->try_store(t->db, key, value);
+    record(OP_TRY_STORE, start, key, strlen(key), ok);
+    return ok;
+}
+
+static bool
+trace_store(struct trace *t, char *key, char *value) {
+    uint64_t start = now_ns();
+    bool ok = inner->store(t->db, key, value);
+    record(OP_STORE, start, key, strlen(key), ok);
+    return ok;
+}
+
+static bool
+trace_delete_len(struct trace *t, const char *key, size_t klen) {
+    uint64_t start = now_ns();
+    bool ok = inner->delete_len(t->db, key, klen);
+    record(OP_DELETE_LEN, start, key, klen, ok);
+    return ok;
+}
+
+static char *
+trace_fetch_len(struct trace *t, const char *key, size_t klen, size_t *vlen) {
+    uint64_t start = now_ns();
+    char *value = inner->fetch_len(t->db, key, klen, vlen);
+    record(OP_FETCH_LEN, start, key, klen, value != NULL);
+    return value;
+}
+
+static const char *
+trace_fetch_borrow(struct trace *t, const char *key, size_t klen,
+        size_t *vlen) {
+    uint64_t start = now_ns();
+    const char *value = inner->fetch_borrow(t->db, key, klen, vlen);
+    record(OP_FETCH_BORROW, start, key, klen, value != NULL);
+    return value;
+}
+
+static bool
+trace_try_store_len(struct trace *t, const char *key, size_t klen,
+        const char *value, size_t vlen) {
+    uint64_t start = now_ns();
+    bool ok = inner->try_store_len(t->db, key, klen, value, vlen);
+    record(OP_TRY_STORE_LEN, start, key, klen, ok);
+    return ok;
+}
+
+static bool
+trace_store_len(struct trace *t, const char *key, size_t klen,
+        const char *value, size_t vlen) {
+    uint64_t start = now_ns();
+    bool ok = inner->store_len(t->db, key, klen, value, vlen);
+    record(OP_STORE_LEN, start, key, klen, ok);
+    return ok;
+}
+
+static bool
+trace_append(struct trace *t, const char *key, size_t klen, const char *value,
+        size_t vlen) {
+    uint64_t start = now_ns();
+    bool ok = inner->append(t->db, key, klen, value, vlen);
+    record(OP_APPEND, start, key, klen, ok);
+    return ok;
+}
+
+static bool
+trace_locate(struct trace *t, const char *key, size_t klen, int *fd,
+        uint64_t *off, size_t *vlen) {
+    uint64_t start = now_ns();
+    bool ok = inner->locate(t->db, key, klen, fd, off, vlen);
+    record(OP_LOCATE, start, key, klen, ok);
+    return ok;
+}
+
+/* Timed as a whole, callbacks included. */
+static bool
+trace_fetch_many(struct trace *t, size_t count, const char *const *keys,
+        const size_t *klens, value_callback cb, void *arg) {
+    uint64_t start = now_ns();
+    bool ok = inner->fetch_many(t->db, count, keys, klens, cb, arg);
+    record(OP_FETCH_MANY, start, NULL, 0, ok);
+    return ok;
+}
+
+static void *
+trace_create_cursor(struct trace *t) {
+    uint64_t start = now_ns();
+    void *cursor = inner->create_cursor(t->db);
+    record(OP_CREATE_CURSOR, start, NULL, 0, cursor != NULL);
+    return cursor;
+}
+
+static bool
+trace_cursor_first(struct trace *t, void *cursor) {
+    uint64_t start = now_ns();
+    bool ok = inner->cursor_first(t->db, cursor);
+    record(OP_CURSOR_FIRST, start, NULL, 0, ok);
+    return ok;
+}
+
+static bool
+trace_cursor_next(struct trace *t, void *cursor) {
+    uint64_t start = now_ns();
+    bool ok = inner->cursor_next(t->db, cursor);
+    record(OP_CURSOR_NEXT, start, NULL, 0, ok);
+    return ok;
+}
+
+static char *
+trace_cursor_key(struct trace *t, void *cursor) {
+    uint64_t start = now_ns();
+    char *key = inner->cursor_key(t->db, cursor);
+    record(OP_CURSOR_KEY, start, key, key ? strlen(key) : 0, key != NULL);
+    return key;
+}
+
+static char *
+trace_cursor_value(struct trace *t, void *cursor) {
+    uint64_t start = now_ns();
+    char *value = inner->cursor_value(t->db, cursor);
+    record(OP_CURSOR_VALUE, start, NULL, 0, value != NULL);
+    return value;
+}
+
+static void
+trace_destroy_cursor(void *cursor) {
+    uint64_t start = now_ns();
+    inner->destroy_cursor(cursor);
+    record(OP_DESTROY_CURSOR, start, NULL, 0, true);
+}
+
+static bool
+trace_cursor_seek(struct trace *t, void *cursor, const char *key,
+        size_t klen) {
+    uint64_t start = now_ns();
+    bool ok = inner->cursor_seek(t->db, cursor, key, klen);
+    record(OP_CURSOR_SEEK, start, key, klen, ok);
+    return ok;
+}
+
+static size_t
+trace_cursor_batch(struct trace *t, void *cursor, struct CursorBatch *b) {
+    uint64_t start = now_ns();
+    size_t n = inner->cursor_batch(t->db, cursor, b);
+    record(OP_CURSOR_BATCH, start, NULL, 0, n > 0 || b->done);
+    return n;
+}
+
+static bool
+trace_begin(struct trace *t) {
+    uint64_t start = now_ns();
+    bool ok = inner->begin(t->db);
+    record(OP_BEGIN, start, NULL, 0, ok);
+    return ok;
+}
+
+static bool
+trace_commit(struct trace *t) {
+    uint64_t start = now_ns();
+    bool ok = inner->commit(t->db);
+    record(OP_COMMIT, start, NULL, 0, ok);
+    return ok;
+}
+
+static bool
+trace_abort(struct trace *t) {
+    uint64_t start = now_ns();
+    bool ok = inner->abort(t->db);
+    record(OP_ABORT, start, NULL, 0, ok);
+    return ok;
+}
+
+static bool
+trace_compact(struct trace *t) {
+    uint64_t start = now_ns();
+    bool ok = inner->compact(t->db);
+    record(OP_COMPACT, start, NULL, 0, ok);
+    return ok;
+}
+
+static bool
+trace_optimize(struct trace *t) {
+    uint64_t start = now_ns();
+    bool ok = inner->optimize(t->db);
+    record(OP_OPTIMIZE, start, NULL, 0, ok);
+    return ok;
+}
+
+static bool
+trace_info(struct trace *t, setting_callback cb, void *arg) {
+    uint64_t start = now_ns();
+    bool ok = inner->info(t->db, cb, arg);
+    record(OP_INFO, start, NULL, 0, ok);
+    return ok;
+}
+
+static bool
+trace_copy(struct trace *t, const char *dest) {
+    uint64_t start = now_ns();
+    bool ok = inner->copy(t->db, dest);
+    record(OP_COPY, start, dest, strlen(dest), ok);
+    return ok;
+}
+
+/* Timed as a whole, callbacks included. */
+static bool
+trace_search(struct trace *t, const char *term, size_t len, key_callback cb,
+        void *arg) {
+    uint64_t start = now_ns();
+    bool ok = inner->search(t->db, term, len, cb, arg);
+    record(OP_SEARCH, start, term, len, ok);
+    return ok;
+}
+
+/* Called on a failed open too, so the handle may be NULL. */
+static int
+trace_get_errno(struct trace *t) {
+    return inner->get_errno(t != NULL ? t->db : NULL);
+}
+
+/* Load db_<type>.so from the directory this library was loaded from. */
+static struct DbInterface *
+load_inner(const char *type) {
+    char path[PATH_MAX];
+    Dl_info info;
+    void *lib, *load;
+    get_interface_func get_interface;
+
+    if (dladdr(&inner, &info) == 0 || info.dli_fname == NULL) {
+        fprintf(stderr, "trace: cannot find where db_trace.so is.\n");
+        return NULL;
+    }
+    const char *slash = strrchr(info.dli_fname, '/');
+    int dirlen = slash ? (int) (slash - info.dli_fname) : 1;
+    snprintf(path, sizeof(path), "%.*s/db_%s.so", dirlen,
+             slash ? info.dli_fname : ".", type);
+
+    if ((lib = dlopen(path, RTLD_LAZY)) == NULL
+    ||  (load = dlsym(lib, "get_interface")) == NULL) {
+        fprintf(stderr, "trace: could not load %s: %s\n", path, dlerror());
+        return NULL;
+    }
+    *(void**) (&get_interface) = load;
+    return get_interface();
+}
+
+#define WRAP(hook, type, fn) \
+    dbint->hook = inner->hook ? (type) fn : NULL
+
+struct DbInterface *
+DB_ENTRY(trace)() {
+    struct DbInterface *dbint;
+    const char *log;
+
+    if ((inner_type = getenv("DROP_TRACE_BACKEND")) == NULL)
+        inner_type = "gdbm";
+    /* drop gives up when it cannot load a backend, so do the same. */
+    if (inner == NULL && (inner = load_inner(inner_type)) == NULL)
+        exit(EXIT_FAILURE);
+    if ((dbint = malloc(sizeof(struct DbInterface))) == NULL)
+        return NULL;
+    if (oplog == NULL && (log = getenv("DROP_TRACE_LOG")) != NULL
+    &&  (oplog = fopen(log, "a")) == NULL)
+        perror(log);
+
+    dbint->open = (open_func) trace_open;
+    dbint->close = (close_func) trace_close;
+    WRAP(delete, delete_func, trace_delete);
+    WRAP(fetch, fetch_func, trace_fetch);
+    WRAP(try_store, try_store_func, trace_try_store);
+    WRAP(store, store_func, trace_store);
+    WRAP(delete_len, delete_len_func, trace_delete_len);
+    WRAP(fetch_len, fetch_len_func, trace_fetch_len);
+    WRAP(fetch_borrow, fetch_borrow_func, trace_fetch_borrow);
+    WRAP(try_store_len, try_store_len_func, trace_try_store_len);
+    WRAP(store_len, store_len_func, trace_store_len);
+    WRAP(append, append_func, trace_append);
+    WRAP(locate, locate_func, trace_locate);
+    WRAP(fetch_many, fetch_many_func, trace_fetch_many);
+    WRAP(create_cursor, create_cursor_func, trace_create_cursor);
+    WRAP(cursor_first, cursor_first_func, trace_cursor_first);
+    WRAP(cursor_next, cursor_next_func, trace_cursor_next);
+    WRAP(cursor_key, cursor_key_func, trace_cursor_key);
+    WRAP(cursor_value, cursor_value_func, trace_cursor_value);
+    WRAP(destroy_cursor, destroy_cursor_func, trace_destroy_cursor);
+    WRAP(cursor_seek, cursor_seek_func, trace_cursor_seek);
+    WRAP(cursor_batch, cursor_batch_func, trace_cursor_batch);
+    WRAP(begin, begin_func, trace_begin);
+    WRAP(commit, commit_func, trace_commit);
+    WRAP(abort, abort_func, trace_abort);
+    WRAP(compact, compact_func, trace_compact);
+    WRAP(optimize, optimize_func, trace_optimize);
+    WRAP(info, info_func, trace_info);
+    WRAP(copy, copy_func, trace_copy);
+    WRAP(search, search_func, trace_search);
+    dbint->get_errno = (errno_func) trace_get_errno;
+    dbint->strerror = inner->strerror;
+    return dbint;
+}
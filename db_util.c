@@ -1,3 +1,6 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
 #include <string.h>
 #include "db_util.h"
 
@@ -9,3 +12,122 @@ normalize_key(const char *key) {
     }
 }
 
+const char *
+dbi_fetch(struct DbInterface *dbi, void *db, const char *key, size_t klen,
+        size_t *vlen, char **owned) {
+    char *value;
+
+    *owned = NULL;
+    if (dbi->fetch_borrow != NULL)
+        return dbi->fetch_borrow(db, key, klen, vlen);
+    if (dbi->fetch_len != NULL)
+        return *owned = dbi->fetch_len(db, key, klen, vlen);
+
+    char *k = strndup(key, klen);
+    if (k == NULL)
+        return NULL;
+    value = dbi->fetch(db, k);
+    free(k);
+    if (value != NULL)
+        *vlen = strlen(value);
+    return *owned = value;
+}
+
+bool
+dbi_fetch_many(struct DbInterface *dbi, void *db, size_t count,
+        const char *const *keys, const size_t *klens, value_callback cb,
+        void *arg) {
+    if (dbi->fetch_many != NULL)
+        return dbi->fetch_many(db, count, keys, klens, cb, arg);
+
+    for (size_t i = 0; i < count; ++i) {
+        size_t vlen = 0;
+        char *owned;
+        const char *value = dbi_fetch(dbi, db, keys[i], klens[i], &vlen,
+                                      &owned);
+        bool more = cb(arg, i, value, vlen);
+        free(owned);
+        if (!more)
+            break;
+    }
+    return true;
+}
+
+/* The fallback reads the record under the cursor and only moves past it once
+ * it has been copied, so one that does not fit is read again next time.
+ */
+size_t
+dbi_cursor_batch(struct DbInterface *dbi, void *db, void *cursor,
+        struct CursorBatch *b) {
+    size_t used = 0;
+
+    if (dbi->cursor_batch != NULL)
+        return dbi->cursor_batch(db, cursor, b);
+
+    b->count = 0;
+    b->need = 0;
+    while (b->count < b->max && !b->done) {
+        struct CursorRecord *r = b->records + b->count;
+        char *key = dbi->cursor_key(db, cursor);
+        char *value = b->values && key ? dbi->cursor_value(db, cursor) : NULL;
+        size_t klen = key ? strlen(key) : 0, vlen = value ? strlen(value) : 0;
+        size_t need = klen + 1 + (b->values ? vlen + 1 : 0);
+
+        if (key != NULL && used + need > b->arena_len) {
+            if (b->count == 0)
+                b->need = need;
+            free(key);
+            free(value);
+            break;
+        }
+        if (key != NULL) {
+            r->key = memcpy(b->arena + used, key, klen + 1);
+            r->klen = klen;
+            used += klen + 1;
+            r->value = NULL;
+            r->vlen = 0;
+            if (b->values) {
+                r->value = memcpy(b->arena + used, value ? value : "",
+                                  vlen + 1);
+                r->vlen = vlen;
+                used += vlen + 1;
+            }
+            ++b->count;
+        }
+        free(key);
+        free(value);
+        b->done = !dbi->cursor_next(db, cursor);
+    }
+    return b->count;
+}
+
+bool
+dbi_store(struct DbInterface *dbi, void *db, const char *key, size_t klen,
+        const char *value, size_t vlen, bool replace) {
+    bool ret;
+
+    if (replace && dbi->store_len != NULL)
+        return dbi->store_len(db, key, klen, value, vlen);
+    if (!replace && dbi->try_store_len != NULL)
+        return dbi->try_store_len(db, key, klen, value, vlen);
+
+    char *k = strndup(key, klen), *v = strndup(value, vlen);
+    ret = k != NULL && v != NULL
+        && (replace ? dbi->store(db, k, v) : dbi->try_store(db, k, v));
+    free(k);
+    free(v);
+    return ret;
+}
+
+bool
+dbi_delete(struct DbInterface *dbi, void *db, const char *key, size_t klen) {
+    bool ret;
+
+    if (dbi->delete_len != NULL)
+        return dbi->delete_len(db, key, klen);
+
+    char *k = strndup(key, klen);
+    ret = k != NULL && dbi->delete(db, k);
+    free(k);
+    return ret;
+}
@@ -1,6 +1,37 @@
 #ifndef DB_UTIL_H__
 #define DB_UTIL_H__
 
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "db.h"
+
 void normalize_key(const char*);
 
+/* Fetch through the cheapest call the backend offers.  The result is borrowed
+ * from the backend when it can be; otherwise *owned is set to the copy, which
+ * the caller frees.  Either way the value is only good until the next call on
+ * the handle.
+ */
+const char *dbi_fetch(struct DbInterface*, void*, const char*, size_t, size_t*,
+                      char**);
+
+/* Fetch many keys through fetch_many, or one at a time for backends without
+ * it.
+ */
+bool dbi_fetch_many(struct DbInterface*, void*, size_t, const char *const*,
+                    const size_t*, value_callback, void*);
+
+/* Fill a cursor batch through cursor_batch, or record by record for backends
+ * without it.  The cursor must have been placed with cursor_first.
+ */
+size_t dbi_cursor_batch(struct DbInterface*, void*, void*, struct CursorBatch*);
+
+/* Store or delete with lengths, falling back to the string calls for
+ * backends that predate them.
+ */
+bool dbi_store(struct DbInterface*, void*, const char*, size_t, const char*,
+               size_t, bool replace);
+bool dbi_delete(struct DbInterface*, void*, const char*, size_t);
+
 #endif /* DB_UTIL_H__ */
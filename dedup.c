@@ -0,0 +1,733 @@
+/* dedup.c
+ * Values kept once by their content, in a second database of the same type
+ * next to the database.  A value of DEDUP_MIN bytes or more is stored there
+ * under "v" and a hash of its bytes, with the number of records referring to
+ * it under "r" and the same hash; the record itself holds REF_MAGIC and the
+ * hash.  A value starting with a NUL byte goes to the store whatever its
+ * size, so that nothing held in a record can be taken for a reference.
+ *
+ * The hash only finds the stored copy: a value is compared with it before
+ * it is shared, and one whose hash is taken by other bytes is kept in its
+ * record instead.
+ *
+ * A value nothing refers to any more stays in the store until compact or
+ * optimize sweeps it out, so a reader that opened the database before its
+ * last reference went, such as a backup, still finds it.  A write is
+ * referred to only once its value is stored, and let go of after.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "db.h"
+#include "db_util.h"
+#include "dedup.h"
+#include "layer.h"
+
+#define HASH_LEN 16
+#define KEY_LEN (1 + HASH_LEN)
+#define REF_MAGIC "\0DROPREF"
+#define REF_MAGIC_LEN 8
+#define REF_LEN (REF_MAGIC_LEN + HASH_LEN)
+
+/* Records and bytes read through a cursor at once while moving values into
+ * the store or counting them.  The arena grows for a record that does not
+ * fit on its own.
+ */
+#define SCAN_RECORDS 1024
+#define SCAN_ARENA (1 << 20)
+
+/* Values moved into the store or swept out of it per transaction. */
+#define DEDUP_BATCH 10000
+
+struct dedup {
+    struct Layer base;
+    void *vdb;          /* the value store, opened through base.dbi */
+    char *path;
+    char *owned;        /* copy behind the value fetched last */
+};
+
+/* The store's figures, and the values a sweep takes out. */
+struct tally {
+    uint64_t values;
+    uint64_t refs;
+    bool collect;
+    unsigned char *dead;
+    size_t ndead;
+    size_t dead_cap;
+};
+
+/* Keys of the records whose values are to be moved into the store, each a
+ * size_t length followed by the key. */
+struct keys {
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+typedef bool (*record_func)(void *arg, const struct CursorRecord *r);
+
+/* Two unrelated 64 bit hashes, so that a pair of values sharing one still
+ * differs in the other. */
+static void
+hash_value(const char *value, size_t len, unsigned char *out) {
+    uint64_t a = 0xcbf29ce484222325ULL, b = len;
+
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char c = value[i];
+        a = (a ^ c) * 0x100000001b3ULL;
+        b = (b + c) * 0x9e3779b97f4a7c15ULL;
+        b ^= b >> 29;
+    }
+    a ^= a >> 33;
+    a *= 0xff51afd7ed558ccdULL;
+    a ^= a >> 33;
+    memcpy(out, &a, sizeof(a));
+    memcpy(out + sizeof(a), &b, sizeof(b));
+}
+
+static bool
+by_content(const char *value, size_t vlen) {
+    return vlen >= DEDUP_MIN || (vlen > 0 && value[0] == '\0');
+}
+
+/* The hash a record's value refers to, or NULL for a value of its own. */
+static const unsigned char *
+ref_hash(const char *value, size_t vlen) {
+    if (vlen != REF_LEN || memcmp(value, REF_MAGIC, REF_MAGIC_LEN) != 0)
+        return NULL;
+    return (const unsigned char*) value + REF_MAGIC_LEN;
+}
+
+static void
+make_ref(char *ref, const unsigned char *h) {
+    memcpy(ref, REF_MAGIC, REF_MAGIC_LEN);
+    memcpy(ref + REF_MAGIC_LEN, h, HASH_LEN);
+}
+
+static void
+store_key(char *k, char kind, const unsigned char *h) {
+    k[0] = kind;
+    memcpy(k + 1, h, HASH_LEN);
+}
+
+static void
+missing(const char *key, size_t klen) {
+    fprintf(stderr, "The value of '%.*s' is missing from the value store.\n",
+            (int) klen, key);
+}
+
+static uint64_t
+get_count(struct dedup *d, const unsigned char *h) {
+    struct DbInterface *dbi = d->base.dbi;
+    char k[KEY_LEN], *owned;
+    uint64_t count = 0;
+    size_t len;
+    const char *v;
+
+    store_key(k, 'r', h);
+    v = dbi_fetch(dbi, d->vdb, k, KEY_LEN, &len, &owned);
+    if (v != NULL && len == sizeof(count))
+        memcpy(&count, v, sizeof(count));
+    free(owned);
+    return count;
+}
+
+static bool
+set_count(struct dedup *d, const unsigned char *h, uint64_t count) {
+    char k[KEY_LEN];
+
+    store_key(k, 'r', h);
+    return dbi_store(d->base.dbi, d->vdb, k, KEY_LEN, (const char*) &count,
+                     sizeof(count), true);
+}
+
+/* Refer to the stored copy of value, storing it first if it is new, and set
+ * h to its hash.  Fails when the hash belongs to other bytes.
+ */
+static bool
+hold(struct dedup *d, const char *value, size_t vlen, unsigned char *h) {
+    struct DbInterface *dbi = d->base.dbi;
+    char k[KEY_LEN], *owned;
+    const char *stored;
+    size_t slen;
+    bool same;
+
+    hash_value(value, vlen, h);
+    store_key(k, 'v', h);
+    stored = dbi_fetch(dbi, d->vdb, k, KEY_LEN, &slen, &owned);
+    same = stored != NULL && slen == vlen && memcmp(stored, value, vlen) == 0;
+    free(owned);
+    if (stored != NULL && !same)
+        return false;
+    if (stored == NULL && !dbi_store(dbi, d->vdb, k, KEY_LEN, value, vlen,
+                                     true))
+        return false;
+    return set_count(d, h, (stored != NULL ? get_count(d, h) : 0) + 1);
+}
+
+static void
+release(struct dedup *d, const unsigned char *h) {
+    uint64_t count = get_count(d, h);
+    if (count > 0)
+        set_count(d, h, count - 1);
+}
+
+/* Whether key has a record, and the hash it refers to in *h if it does.
+ * Returns true only for a reference. */
+static bool
+old_ref(struct dedup *d, const char *key, size_t klen, unsigned char *h,
+        bool *exists) {
+    struct Layer *l = &d->base;
+    const unsigned char *r = NULL;
+    const char *value;
+    char *owned;
+    size_t vlen;
+
+    value = dbi_fetch(l->dbi, l->db, key, klen, &vlen, &owned);
+    *exists = value != NULL;
+    if (value != NULL && (r = ref_hash(value, vlen)) != NULL)
+        memcpy(h, r, HASH_LEN);
+    free(owned);
+    return value != NULL && r != NULL;
+}
+
+/* The value of key, read from the store when the record refers to it.  It
+ * is borrowed until the next call on the layer.
+ */
+static const char *
+fetch_value(struct dedup *d, const char *key, size_t klen, size_t *vlen) {
+    struct Layer *l = &d->base;
+    const unsigned char *h;
+    const char *value;
+    char k[KEY_LEN];
+
+    free(d->owned);
+    value = dbi_fetch(l->dbi, l->db, key, klen, vlen, &d->owned);
+    if (value == NULL || (h = ref_hash(value, *vlen)) == NULL)
+        return value;
+    store_key(k, 'v', h);
+    free(d->owned);
+    if ((value = dbi_fetch(l->dbi, d->vdb, k, KEY_LEN, vlen, &d->owned))
+        == NULL)
+        missing(key, klen);
+    return value;
+}
+
+static const char *
+dedup_fetch_borrow(struct dedup *d, const char *key, size_t klen,
+        size_t *vlen) {
+    return fetch_value(d, key, klen, vlen);
+}
+
+static char *
+dedup_fetch_len(struct dedup *d, const char *key, size_t klen, size_t *vlen) {
+    const char *value = fetch_value(d, key, klen, vlen);
+    char *copy;
+
+    if (value == NULL || (copy = malloc(*vlen + 1)) == NULL)
+        return NULL;
+    memcpy(copy, value, *vlen);
+    copy[*vlen] = '\0';
+    return copy;
+}
+
+static char *
+dedup_fetch(struct dedup *d, const char *key) {
+    size_t vlen;
+    return dedup_fetch_len(d, key, strlen(key), &vlen);
+}
+
+static bool
+write_value(struct dedup *d, const char *key, size_t klen, const char *value,
+        size_t vlen, bool replace) {
+    struct Layer *l = &d->base;
+    unsigned char old[HASH_LEN], h[HASH_LEN];
+    char ref[REF_LEN];
+    bool exists, had = old_ref(d, key, klen, old, &exists);
+
+    /* Left to the database to refuse, the way it would without the store. */
+    if (exists && !replace)
+        return dbi_store(l->dbi, l->db, key, klen, value, vlen, false);
+
+    if (by_content(value, vlen) && hold(d, value, vlen, h)) {
+        make_ref(ref, h);
+        if (!dbi_store(l->dbi, l->db, key, klen, ref, REF_LEN, replace)) {
+            release(d, h);
+            return false;
+        }
+    } else if (vlen > 0 && value[0] == '\0') {
+        return false;
+    } else if (!dbi_store(l->dbi, l->db, key, klen, value, vlen, replace)) {
+        return false;
+    }
+    if (had)
+        release(d, old);
+    return true;
+}
+
+static bool
+dedup_store_len(struct dedup *d, const char *key, size_t klen,
+        const char *value, size_t vlen) {
+    return write_value(d, key, klen, value, vlen, true);
+}
+
+static bool
+dedup_try_store_len(struct dedup *d, const char *key, size_t klen,
+        const char *value, size_t vlen) {
+    return write_value(d, key, klen, value, vlen, false);
+}
+
+static bool
+dedup_delete_len(struct dedup *d, const char *key, size_t klen) {
+    struct Layer *l = &d->base;
+    unsigned char old[HASH_LEN];
+    bool exists, had = old_ref(d, key, klen, old, &exists);
+
+    if (!dbi_delete(l->dbi, l->db, key, klen))
+        return false;
+    if (had)
+        release(d, old);
+    return true;
+}
+
+static bool
+dedup_store(struct dedup *d, char *key, char *value) {
+    return dedup_store_len(d, key, strlen(key), value, strlen(value));
+}
+
+static bool
+dedup_try_store(struct dedup *d, char *key, char *value) {
+    return dedup_try_store_len(d, key, strlen(key), value, strlen(value));
+}
+
+static bool
+dedup_delete(struct dedup *d, const char *key) {
+    return dedup_delete_len(d, key, strlen(key));
+}
+
+static char *
+dedup_cursor_value(struct dedup *d, void *cur) {
+    struct Layer *l = &d->base;
+    char *key = l->dbi->cursor_key(l->db, cur), *value = NULL;
+
+    if (key != NULL) {
+        value = dedup_fetch(d, key);
+        free(key);
+    }
+    return value;
+}
+
+/* Keys only come straight from the database.  With values, records are
+ * read one at a time, each value through the store, and the cursor only
+ * moves past a record once it has been copied into the caller's arena, the
+ * way dbi_cursor_batch falls back for backends without cursor_batch.
+ */
+static size_t
+dedup_cursor_batch(struct dedup *d, void *cur, struct CursorBatch *b) {
+    struct Layer *l = &d->base;
+    size_t used = 0;
+
+    if (!b->values)
+        return l->dbi->cursor_batch(l->db, cur, b);
+
+    b->count = 0;
+    b->need = 0;
+    while (b->count < b->max && !b->done) {
+        struct CursorRecord *r = b->records + b->count;
+        char *key = l->dbi->cursor_key(l->db, cur);
+        size_t klen = key ? strlen(key) : 0, vlen = 0;
+        const char *value = key ? fetch_value(d, key, klen, &vlen) : NULL;
+        size_t need = klen + 1 + (value ? vlen : 0) + 1;
+
+        if (key != NULL && used + need > b->arena_len) {
+            if (b->count == 0)
+                b->need = need;
+            free(key);
+            break;
+        }
+        if (key != NULL) {
+            r->key = memcpy(b->arena + used, key, klen + 1);
+            r->klen = klen;
+            used += klen + 1;
+            r->vlen = value ? vlen : 0;
+            r->value = memcpy(b->arena + used, value ? value : "", r->vlen);
+            b->arena[used + r->vlen] = '\0';
+            used += r->vlen + 1;
+            ++b->count;
+        }
+        free(key);
+        b->done = !l->dbi->cursor_next(l->db, cur);
+    }
+    return b->count;
+}
+
+static bool
+dedup_begin(struct dedup *d) {
+    struct DbInterface *dbi = d->base.dbi;
+    if (!dbi->begin(d->vdb))
+        return false;
+    if (!dbi->begin(d->base.db)) {
+        dbi->abort(d->vdb);
+        return false;
+    }
+    return true;
+}
+
+/* The values go in before the records that refer to them. */
+static bool
+dedup_commit(struct dedup *d) {
+    struct DbInterface *dbi = d->base.dbi;
+    if (!dbi->commit(d->vdb)) {
+        dbi->abort(d->base.db);
+        return false;
+    }
+    return dbi->commit(d->base.db);
+}
+
+/* When the database cannot roll back, the records written stay and need the
+ * values they refer to.
+ */
+static bool
+dedup_abort(struct dedup *d) {
+    struct DbInterface *dbi = d->base.dbi;
+    bool ok = dbi->abort(d->base.db);
+    if (ok)
+        dbi->abort(d->vdb);
+    else
+        dbi->commit(d->vdb);
+    return ok;
+}
+
+static bool
+dedup_close(struct dedup *d) {
+    struct DbInterface *dbi = d->base.dbi;
+    bool ok = dbi->close(d->vdb);
+
+    ok = dbi->close(d->base.db) && ok;
+    free(d->owned);
+    free(d->path);
+    free(dbi);
+    free(d);
+    return ok;
+}
+
+/* Call fn on every record of db, a batch at a time. */
+static bool
+scan(struct DbInterface *dbi, void *db, bool values, record_func fn,
+        void *arg) {
+    struct CursorBatch b;
+    void *cur = dbi->create_cursor(db);
+    bool ok = true;
+
+    memset(&b, 0, sizeof(b));
+    b.arena_len = SCAN_ARENA;
+    b.max = SCAN_RECORDS;
+    b.values = values;
+    if ((b.arena = malloc(b.arena_len)) == NULL
+    ||  (b.records = malloc(b.max * sizeof(struct CursorRecord))) == NULL) {
+        fprintf(stderr, "dedup: malloc failed.\n");
+        ok = false;
+    } else if (!dbi->cursor_first(db, &cur)) {
+        b.done = true;
+    }
+
+    while (ok && !b.done) {
+        if (dbi_cursor_batch(dbi, db, &cur, &b) == 0 && !b.done) {
+            char *bigger = realloc(b.arena, b.need);
+            if (bigger == NULL) {
+                fprintf(stderr, "dedup: malloc failed.\n");
+                ok = false;
+                break;
+            }
+            b.arena = bigger;
+            b.arena_len = b.need;
+            continue;
+        }
+        for (size_t i = 0; ok && i < b.count; ++i)
+            ok = fn(arg, b.records + i);
+    }
+
+    dbi->destroy_cursor(&cur);
+    free(b.arena);
+    free(b.records);
+    return ok;
+}
+
+struct count_arg {
+    struct dedup *d;
+    struct tally *t;
+};
+
+static bool
+count_value(void *arg, const struct CursorRecord *r) {
+    struct count_arg *c = arg;
+    struct tally *t = c->t;
+    const unsigned char *h = (const unsigned char*) r->key + 1;
+    uint64_t count;
+
+    if (r->klen != KEY_LEN || r->key[0] != 'r')
+        return true;
+    if ((count = get_count(c->d, h)) > 0) {
+        ++t->values;
+        t->refs += count;
+        return true;
+    }
+    if (!t->collect)
+        return true;
+    if (t->ndead == t->dead_cap) {
+        size_t cap = t->dead_cap ? t->dead_cap * 2 : 256;
+        unsigned char *dead = realloc(t->dead, cap * HASH_LEN);
+        if (dead == NULL)
+            return false;
+        t->dead = dead;
+        t->dead_cap = cap;
+    }
+    memcpy(t->dead + t->ndead++ * HASH_LEN, h, HASH_LEN);
+    return true;
+}
+
+static bool
+tally_store(struct dedup *d, struct tally *t) {
+    struct count_arg c = { d, t };
+    return scan(d->base.dbi, d->vdb, false, count_value, &c);
+}
+
+/* Take out the values nothing refers to. */
+static bool
+sweep(struct dedup *d) {
+    struct DbInterface *dbi = d->base.dbi;
+    struct tally t;
+    bool ok;
+
+    memset(&t, 0, sizeof(t));
+    t.collect = true;
+    ok = tally_store(d, &t);
+    for (size_t i = 0; ok && i < t.ndead; ++i) {
+        char k[KEY_LEN];
+
+        if (i % DEDUP_BATCH == 0 && dbi->begin != NULL)
+            dbi->begin(d->vdb);
+        store_key(k, 'v', t.dead + i * HASH_LEN);
+        ok = dbi_delete(dbi, d->vdb, k, KEY_LEN);
+        k[0] = 'r';
+        ok = dbi_delete(dbi, d->vdb, k, KEY_LEN) && ok;
+        if ((i + 1 == t.ndead || (i + 1) % DEDUP_BATCH == 0)
+        &&  dbi->commit != NULL)
+            ok = dbi->commit(d->vdb) && ok;
+    }
+    free(t.dead);
+    return ok;
+}
+
+static bool
+dedup_compact(struct dedup *d) {
+    struct DbInterface *dbi = d->base.dbi;
+    return sweep(d) && dbi->compact(d->vdb) && dbi->compact(d->base.db);
+}
+
+static bool
+dedup_optimize(struct dedup *d) {
+    struct DbInterface *dbi = d->base.dbi;
+    return sweep(d) && dbi->optimize(d->vdb) && dbi->optimize(d->base.db);
+}
+
+static bool
+dedup_info(struct dedup *d, setting_callback cb, void *arg) {
+    struct DbInterface *dbi = d->base.dbi;
+    struct tally t;
+    struct stat st;
+    char buf[32];
+
+    if (!dbi->info(d->base.db, cb, arg))
+        return false;
+    memset(&t, 0, sizeof(t));
+    if (!tally_store(d, &t))
+        return false;
+    snprintf(buf, sizeof(buf), "%llu", (unsigned long long) t.values);
+    if (!cb(arg, "shared_values", buf))
+        return true;
+    snprintf(buf, sizeof(buf), "%llu", (unsigned long long) t.refs);
+    if (!cb(arg, "value_refs", buf))
+        return true;
+    if (stat(d->path, &st) != 0)
+        st.st_size = 0;
+    snprintf(buf, sizeof(buf), "%lld", (long long) st.st_size);
+    return cb(arg, "dedup_bytes", buf);
+}
+
+static bool
+add_key(void *arg, const struct CursorRecord *r) {
+    struct keys *k = arg;
+    size_t need = sizeof(size_t) + r->klen;
+
+    if (!by_content(r->value, r->vlen) || ref_hash(r->value, r->vlen) != NULL)
+        return true;
+    if (k->len + need > k->cap) {
+        size_t cap = (k->cap ? k->cap * 2 : 1 << 16) + need;
+        char *buf = realloc(k->buf, cap);
+        if (buf == NULL) {
+            fprintf(stderr, "dedup: malloc failed.\n");
+            return false;
+        }
+        k->buf = buf;
+        k->cap = cap;
+    }
+    memcpy(k->buf + k->len, &r->klen, sizeof(size_t));
+    memcpy(k->buf + k->len + sizeof(size_t), r->key, r->klen);
+    k->len += need;
+    return true;
+}
+
+/* Point the record for key at the stored copy of its value.  The value is
+ * borrowed from the database, which is left alone until it is stored.
+ */
+static bool
+move_in(struct dedup *d, const char *key, size_t klen) {
+    struct Layer *l = &d->base;
+    unsigned char h[HASH_LEN];
+    char ref[REF_LEN], *owned;
+    size_t vlen;
+    const char *value = dbi_fetch(l->dbi, l->db, key, klen, &vlen, &owned);
+    bool ok = true;
+
+    if (value != NULL && ref_hash(value, vlen) == NULL
+    &&  by_content(value, vlen) && hold(d, value, vlen, h)) {
+        make_ref(ref, h);
+        if (!(ok = dbi_store(l->dbi, l->db, key, klen, ref, REF_LEN, true)))
+            release(d, h);
+    }
+    free(owned);
+    return ok;
+}
+
+/* Move every large value still held in a record into the store.  The keys
+ * are gathered first, since the database is not written while a cursor
+ * walks it.
+ */
+static bool
+move_values(struct dedup *d) {
+    struct DbInterface *dbi = d->base.dbi;
+    bool txn = dbi->begin != NULL && dbi->commit != NULL
+            && dbi->abort != NULL;
+    struct keys k = { NULL, 0, 0 };
+    size_t pending = 0;
+    bool ok;
+
+    ok = scan(dbi, d->base.db, true, add_key, &k);
+    for (size_t off = 0; ok && off < k.len; ) {
+        size_t klen;
+
+        memcpy(&klen, k.buf + off, sizeof(size_t));
+        off += sizeof(size_t);
+        if (pending == 0 && txn && !(ok = dedup_begin(d)))
+            break;
+        ok = move_in(d, k.buf + off, klen);
+        off += klen;
+        if (!ok) {
+            if (txn)
+                dedup_abort(d);
+        } else if (txn && (++pending == DEDUP_BATCH || off == k.len)) {
+            ok = dedup_commit(d);
+            pending = 0;
+        }
+    }
+    free(k.buf);
+    return ok;
+}
+
+#define RESOLVE(hook, type, fn) \
+    if (iface->hook != NULL) iface->hook = (type) fn
+
+void *
+dedup_attach(struct DbInterface *dbi, void *db, const char *file,
+        enum OpenMode mode, bool create, struct DbInterface **out) {
+    struct dedup *d;
+    struct DbInterface *iface;
+    size_t len = strlen(file) + sizeof(DEDUP_SUFFIX);
+    bool exists;
+
+    if (dbi->open == NULL)
+        return db;
+    if ((d = calloc(1, sizeof(struct dedup))) == NULL
+    ||  (d->path = malloc(len)) == NULL
+    ||  (iface = malloc(sizeof(struct DbInterface))) == NULL) {
+        fprintf(stderr, "dedup: malloc failed.\n");
+        if (d != NULL)
+            free(d->path);
+        free(d);
+        return NULL;
+    }
+    snprintf(d->path, len, "%s%s", file, DEDUP_SUFFIX);
+
+    exists = access(d->path, F_OK) == 0;
+    if (!exists && !create) {
+        free(iface);
+        free(d->path);
+        free(d);
+        return db;
+    }
+    if ((d->vdb = dbi->open(d->path, exists ? mode : DB_WRITE)) == NULL) {
+        fprintf(stderr, "Could not open the value store: %s\n:%s\n", d->path,
+                dbi->strerror(dbi->get_errno(NULL)));
+        free(iface);
+        free(d->path);
+        free(d);
+        return NULL;
+    }
+    d->base.dbi = dbi;
+    d->base.db = db;
+
+    if (create && !move_values(d)) {
+        fprintf(stderr, "Could not move values into the value store: %s\n",
+                dbi->strerror(dbi->get_errno(db)));
+        dbi->close(d->vdb);
+        if (!exists)
+            unlink(d->path);
+        free(iface);
+        free(d->path);
+        free(d);
+        return NULL;
+    }
+
+    layer_forward(iface, dbi);
+    iface->close = (close_func) dedup_close;
+    iface->delete = (delete_func) dedup_delete;
+    iface->fetch = (fetch_func) dedup_fetch;
+    iface->try_store = (try_store_func) dedup_try_store;
+    iface->store = (store_func) dedup_store;
+    iface->delete_len = (delete_len_func) dedup_delete_len;
+    iface->fetch_len = (fetch_len_func) dedup_fetch_len;
+    iface->fetch_borrow = (fetch_borrow_func) dedup_fetch_borrow;
+    iface->try_store_len = (try_store_len_func) dedup_try_store_len;
+    iface->store_len = (store_len_func) dedup_store_len;
+    iface->cursor_value = (cursor_value_func) dedup_cursor_value;
+    RESOLVE(cursor_batch, cursor_batch_func, dedup_cursor_batch);
+    RESOLVE(compact, compact_func, dedup_compact);
+    RESOLVE(optimize, optimize_func, dedup_optimize);
+    RESOLVE(info, info_func, dedup_info);
+    /* What the database holds for a shared value is only a reference: these
+     * read and write records as the database keeps them, so callers fall
+     * back to whole values instead.  A copy of the file alone would lack the
+     * values it refers to.
+     */
+    iface->append = NULL;
+    iface->locate = NULL;
+    iface->fetch_many = NULL;
+    iface->copy = NULL;
+    if (dbi->begin != NULL && dbi->commit != NULL && dbi->abort != NULL) {
+        iface->begin = (begin_func) dedup_begin;
+        iface->commit = (commit_func) dedup_commit;
+        iface->abort = (abort_func) dedup_abort;
+    }
+
+    *out = iface;
+    return d;
+}
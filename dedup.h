@@ -0,0 +1,29 @@
+#ifndef DEDUP_H__
+#define DEDUP_H__
+
+#include <stdbool.h>
+
+#include "db.h"
+
+#define DEDUP_SUFFIX ".dedup"
+
+/* Values of at least this many bytes are kept once in the value store. */
+#define DEDUP_MIN 128
+
+/* Layer the value store of the database at file over dbi and db.  The store
+ * is a database of the same type at file + DEDUP_SUFFIX holding each large
+ * value once, under a hash of its bytes, with a count of the records that
+ * refer to it; the records themselves only hold the hash.  Reads through the
+ * layer see the values, writes keep the counts, and compact and optimize
+ * drop the values nothing refers to any more.
+ *
+ * When create is set the store is made if it is missing and every large
+ * value still held in the database is moved into it.  Returns the layer's
+ * handle and sets *out to its interface, or returns db unchanged when there
+ * is no store.  Returns NULL, after printing why, when the store cannot be
+ * opened: the database's records are of no use without it.
+ */
+void *dedup_attach(struct DbInterface *dbi, void *db, const char *file,
+                   enum OpenMode mode, bool create, struct DbInterface **out);
+
+#endif /* DEDUP_H__ */
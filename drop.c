@@ -3,16 +3,18 @@
  * Distributed under 3-clause BSD license.  See LICENSE file for the details.
  */
 
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 700
 
 #include <dirent.h>
 #include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <limits.h>
 #include <malloc.h>
 #include <unistd.h>
@@ -21,8 +23,18 @@
 
 #include <readline/readline.h>
 
+#include "backup.h"
 #include "db.h"
 #include "db_util.h"
+#include "dedup.h"
+#include "export.h"
+#include "io.h"
+#include "migrate.h"
+#include "prof.h"
+#include "server.h"
+#include "snap.h"
+#include "stats.h"
+#include "trigram.h"
 
 #ifdef X11
 #include <locale.h>
@@ -31,7 +43,17 @@
 #include <X11/Xatom.h>
 #endif
 
-enum Operation { USAGE, ADD, DELETE, LIST, FULL_LIST, PRINT };
+enum Operation { USAGE, ADD, BACKUP, BATCH, COMPACT, COMPILE, DEDUP, DELETE,
+                 EXPORT, GET, IMPORT, INFO, LIST, FULL_LIST, MIGRATE, OPTIMIZE,
+                 PRINT, REINDEX, SEARCH, SERVE, STALE, TOP };
+/* For --stats, in the order of enum Operation. */
+static const char *operation_names[] = {
+    "usage", "add", "backup", "batch", "compact", "compile", "dedup",
+    "delete", "export", "get", "import", "info", "list", "fulllist",
+    "migrate", "optimize", "print", "reindex", "search", "serve", "stale",
+    "top"
+};
+
 enum TransferType { CONSOLE, READLINE,
 #ifdef X11
 XSELECTION_PRIMARY, XSELECTION_CLIPBOARD
@@ -43,6 +65,17 @@ typedef struct {
     enum Operation operation;
     enum TransferType transfer_type;
     char *key;
+    char **keys;            /* get */
+    int key_count;
+    const char *separator;  /* between get's values, NULL for newlines */
+    size_t separator_len;
+    enum ExportFormat format;
+    bool full;              /* backup everything, not only the changes */
+    struct Hits hits;       /* lookups and deletes to record on exit */
+#ifdef X11
+    char *selection;        /* value to offer once the database is closed */
+    size_t selection_len;
+#endif
 } options;
 
 struct ExtensionMap {
@@ -50,6 +83,11 @@ struct ExtensionMap {
     const char *type;
 };
 
+struct Builtin {
+    const char *type;
+    get_interface_func get_interface;
+};
+
 struct cli_options {
     const char *option;
     enum Operation operation;
@@ -58,22 +96,56 @@ struct cli_options {
 
 
 static void  parse_options(int ct, char **op, options *options);
+static void  run(struct DbInterface*, void*, options*);
 static void  add(struct DbInterface*, void*, options*);
-static void  delete(struct DbInterface*, void*, const char*);
-static void  list(struct DbInterface*, void*, enum ListingType);
+static void  add_stream(struct DbInterface*, void*, const char*);
+static void  batch(struct DbInterface*, void*, options*);
+static void  compact(struct DbInterface*, void*);
+static void  compile(struct DbInterface*, void*);
+static void  delete(struct DbInterface*, void*, options*);
+static void  export(struct DbInterface*, void*, options*);
+static void  get(struct DbInterface*, void*, options*);
+static void  import(struct DbInterface*, void*, const char*);
+static void  info(struct DbInterface*, void*);
+static void  list(struct DbInterface*, void*, enum ListingType, const char*);
+static void  migrate(struct DbInterface*, void*, const char*);
+static void  optimize(struct DbInterface*, void*);
 static void  print(struct DbInterface*, void*, options*);
+static bool  print_value(struct DbInterface*, void*, const char*);
+static void  search(struct DbInterface*, void*, const char*);
+static void  stale(struct DbInterface*, void*, const char*);
+static void  top(const char*);
+static void  record_hits(options*);
+static void *attach_dedup(struct DbInterface**, void*, const char*,
+                          enum Operation);
+static void *attach_index(struct DbInterface**, void*,
+                          const struct DbInterface*, const char*,
+                          enum Operation);
+static bool  read_only(enum Operation);
+static void *open_db(struct DbInterface*, const char*, enum Operation);
 static char *get_db_location(void);
+static const char *extension_type(const char*);
+static char *fresh_snapshot(const char*);
 static void  usage(void);
 
 static get_interface_func load_support(char*);
+static get_interface_func load_backend(const char*);
 static char *get_application_path(void);
 static int is_link(const char*);
 
 #ifdef X11
+/* A selection as it is read in, grown as pieces arrive. */
+struct XBuffer {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
 static void  init_x_win(enum TransferType destination);
 static void  final_x_win(void);
-static char *read_X_selection(options *opt);
-static void  set_X_selection(options *opt, char *text);
+static char *read_X_selection(options *opt, size_t *len);
+static Atom  read_X_property(struct XBuffer *buf, size_t *got);
+static void  set_X_selection(options *opt, const char *text, size_t len);
 static void  xdie(char *message);
 static Time  get_X_timestamp(void);
 
@@ -82,27 +154,92 @@ static Window w = 0;
 static Atom selection_atom;
 static Atom dest_atom;
 static Atom XA_UTF8_STRING;
+static Atom XA_INCR;
+static Atom XA_TARGETS;
+static Atom XA_MULTIPLE;
+static Atom XA_TIMESTAMP;
+static Atom XA_TEXT;
+static Atom XA_ATOM_PAIR;
+
+/* An INCR transfer under way: the rest of the value goes into requestor's
+ * property a piece at a time, each once the last has been deleted.
+ */
+struct XTransfer {
+    Window requestor;
+    Atom property;
+    Atom type;
+    size_t off;
+    bool active;
+};
+
+#define X_TRANSFERS 16
+
+static struct XTransfer transfers[X_TRANSFERS];
+static size_t x_chunk;      /* largest piece put in a property at once */
 #endif
 
 static struct ExtensionMap extension_map[] = {
     { "tcb", "tcbdb" },
-    { "dbm", "gdbm" }
+    { "dbm", "gdbm" },
+    { "log", "log" }
 };
 
+/* Backends compiled into drop-static.  Any other type is still loaded from
+ * db_<type>.so.
+ */
+#ifdef DROP_STATIC
+struct DbInterface *gdbm_get_interface(void);
+struct DbInterface *log_get_interface(void);
+struct DbInterface *snap_get_interface(void);
+struct DbInterface *tcbdb_get_interface(void);
+
+static struct Builtin builtins[] = {
+    { "gdbm",  gdbm_get_interface },
+    { "log",   log_get_interface },
+    { "snap",  snap_get_interface },
+    { "tcbdb", tcbdb_get_interface },
+    { NULL,    NULL }
+};
+#else
+static struct Builtin builtins[] = {
+    { NULL,    NULL }
+};
+#endif
+
 struct cli_options opts[] = {
  /* {"",         LIST,      CONSOLE}, */ // Explicitly checked for
     {"a",        ADD,       READLINE},
     {"add",      ADD,       READLINE},
+    {"backup",   BACKUP,    CONSOLE},
+    {"batch",    BATCH,     CONSOLE},
+    {"c",        COMPILE,   CONSOLE},
+    {"compact",  COMPACT,   CONSOLE},
+    {"compile",  COMPILE,   CONSOLE},
     {"d",        DELETE,    CONSOLE},
+    {"dedup",    DEDUP,     CONSOLE},
     {"delete",   DELETE,    CONSOLE},
+    {"export",   EXPORT,    CONSOLE},
     {"f",        FULL_LIST, CONSOLE},
     {"fulllist", FULL_LIST, CONSOLE},
+    {"g",        GET,       CONSOLE},
+    {"get",      GET,       CONSOLE},
     {"h",        USAGE,     CONSOLE},
     {"-h",       USAGE,     CONSOLE},
     {"help",     USAGE,     CONSOLE},
     {"--help",   USAGE,     CONSOLE},
+    {"i",        IMPORT,    CONSOLE},
+    {"import",   IMPORT,    CONSOLE},
+    {"info",     INFO,      CONSOLE},
     {"l",        LIST,      CONSOLE},
     {"list",     LIST,      CONSOLE},
+    {"migrate",  MIGRATE,   CONSOLE},
+    {"optimize", OPTIMIZE,  CONSOLE},
+    {"reindex",  REINDEX,   CONSOLE},
+    {"s",        SEARCH,    CONSOLE},
+    {"search",   SEARCH,    CONSOLE},
+    {"serve",    SERVE,     CONSOLE},
+    {"stale",    STALE,     CONSOLE},
+    {"top",      TOP,       CONSOLE},
 #ifdef X11
     {"xa",       ADD,       XSELECTION_PRIMARY},
     {"xadd",     ADD,       XSELECTION_PRIMARY},
@@ -126,45 +263,225 @@ main(int argc, char *argv[]) {
     struct DbInterface *dbi;
     progname = argv[0];
 
+    /* --stats[=FILE] comes before the command and reports where the time
+     * went. */
+    if (argc > 1 && strncmp(argv[1], "--stats", 7) == 0
+    &&  (argv[1][7] == '\0' || argv[1][7] == '=')) {
+        prof_enable(argv[1][7] == '=' ? argv[1] + 8 : NULL);
+        argv[1] = argv[0];
+        ++argv;
+        --argc;
+    }
+
     parse_options(argc, argv, &opt);
+    if (opt.operation == USAGE)
+        usage();
+
+    /* Hand the request to a running server when there is one. */
+    if (opt.operation != SERVE) {
+        char *sock = server_socket_path();
+        PROF_BEGIN(PHASE_CONNECT);
+        db = client_connect(sock);
+        PROF_END(PHASE_CONNECT);
+        free(sock);
+        if (db != NULL && opt.operation == REINDEX) {
+            fprintf(stderr, "Stop the drop server before rebuilding the "
+                    "search index.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (db != NULL && opt.operation == BACKUP) {
+            fprintf(stderr, "Stop the drop server before backing up the "
+                    "database.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (db != NULL && (opt.operation == COMPACT
+                        || opt.operation == DEDUP
+                        || opt.operation == MIGRATE
+                        || opt.operation == OPTIMIZE)) {
+            fprintf(stderr, "Stop the drop server before rewriting the "
+                    "database.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (db != NULL && (dbi = client_interface()) != NULL) {
+            db = prof_attach(dbi, db, &dbi);
+            PROF_BEGIN(PHASE_RUN);
+            run(dbi, db, &opt);
+            PROF_END(PHASE_RUN);
+            PROF_BEGIN(PHASE_CLOSE);
+            dbi->close(db);
+            PROF_END(PHASE_CLOSE);
+            free(dbi);
+            record_hits(&opt);
+            prof_report(operation_names[opt.operation]);
+#ifdef X11
+            if (opt.selection != NULL)
+                set_X_selection(&opt, opt.selection, opt.selection_len);
+#endif
+            return EXIT_SUCCESS;
+        }
+    }
 
+    PROF_BEGIN(PHASE_LOCATE);
     file = get_db_location();
-    dbi = load_support(file)();
-    if ((db = dbi->open(file)) == NULL) {
+    PROF_END(PHASE_LOCATE);
+
+    /* A backup opens the database itself, after it has dealt with the change
+     * journal.
+     */
+    if (opt.operation == BACKUP) {
+        dbi = load_support(file)();
+        PROF_BEGIN(PHASE_RUN);
+        bool ok = backup_db(dbi, file, opt.key, opt.full);
+        PROF_END(PHASE_RUN);
+        free(dbi);
+        free(file);
+        prof_report(operation_names[opt.operation]);
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    /* Plain lookups are answered from a compiled snapshot when it is newer
+     * than the database itself.
+     */
+    char *snap = NULL;
+    if (opt.operation == PRINT && (snap = fresh_snapshot(file)) != NULL) {
+        dbi = load_backend("snap")();
+        PROF_BEGIN(PHASE_OPEN);
+        db = dbi->open(snap, DB_READ);
+        PROF_END(PHASE_OPEN);
+        if (db != NULL) {
+            free(file);
+            file = snap;
+        } else {
+            free(dbi);
+            free(snap);
+            snap = NULL;
+        }
+    }
+    if (snap == NULL) {
+        dbi = load_support(file)();
+        PROF_BEGIN(PHASE_OPEN);
+        db = open_db(dbi, file, opt.operation);
+        PROF_END(PHASE_OPEN);
+    }
+    if (db == NULL) {
         int err = dbi->get_errno(db);
         fprintf(stderr, "Could not open database: %s\n:%s\n", file,
             dbi->strerror(err));
         exit(EXIT_FAILURE);
     }
+    if (snap == NULL) {
+        struct DbInterface *backend = dbi;
+        PROF_BEGIN(PHASE_INDEX);
+        db = attach_dedup(&dbi, db, file, opt.operation);
+        db = attach_index(&dbi, db, backend, file, opt.operation);
+        PROF_END(PHASE_INDEX);
+        if (opt.operation == ADD || opt.operation == BATCH
+        ||  opt.operation == DELETE || opt.operation == IMPORT
+        ||  opt.operation == SERVE)
+            db = changes_attach(dbi, db, file, &dbi);
+    }
     free(file);
+    db = prof_attach(dbi, db, &dbi);
+
+    PROF_BEGIN(PHASE_RUN);
+    run(dbi, db, &opt);
+    PROF_END(PHASE_RUN);
 
-    switch (opt.operation) {
+    PROF_BEGIN(PHASE_CLOSE);
+    if (!dbi->close(db)) {
+        fprintf(stderr, "Error closing database. Continuing, since I'm out of "
+                "ideas...\n");
+    }
+    PROF_END(PHASE_CLOSE);
+    free(dbi);
+    record_hits(&opt);
+    prof_report(operation_names[opt.operation]);
+#ifdef X11
+    /* The selection is served with the database closed, so that it can be
+     * written meanwhile. */
+    if (opt.selection != NULL)
+        set_X_selection(&opt, opt.selection, opt.selection_len);
+#endif
+    return EXIT_SUCCESS;
+}
+
+/* Carry out the requested operation against an open database. */
+static void
+run(struct DbInterface *dbi, void *db, options *opt) {
+    switch (opt->operation) {
         case USAGE:
             usage();
             break;
         case ADD:
-            add(dbi, db, &opt);
+            add(dbi, db, opt);
+            break;
+        case BACKUP:    /* in main, before the database is opened */
+            break;
+        case BATCH:
+            batch(dbi, db, opt);
+            break;
+        case COMPACT:
+            compact(dbi, db);
+            break;
+        case COMPILE:
+            compile(dbi, db);
+            break;
+        case DEDUP:     /* values moved as the store was attached */
+            if (dbi->optimize != NULL || dbi->compact != NULL)
+                optimize(dbi, db);
             break;
         case DELETE:
-            delete(dbi, db, opt.key);
+            delete(dbi, db, opt);
+            break;
+        case EXPORT:
+            export(dbi, db, opt);
+            break;
+        case GET:
+            get(dbi, db, opt);
+            break;
+        case IMPORT:
+            import(dbi, db, opt->key);
+            break;
+        case INFO:
+            info(dbi, db);
             break;
         case PRINT:
-            print(dbi, db, &opt);
+            print(dbi, db, opt);
             break;
         case LIST:
-            list(dbi, db, KEYS_ONLY);
+            list(dbi, db, KEYS_ONLY, opt->key);
             break;
         case FULL_LIST:
-            list(dbi, db, KEYS_AND_ENTRIES);
+            list(dbi, db, KEYS_AND_ENTRIES, opt->key);
             break;
+        case MIGRATE:
+            migrate(dbi, db, opt->key);
+            break;
+        case OPTIMIZE:
+            optimize(dbi, db);
+            break;
+        case REINDEX:
+            break;
+        case SEARCH:
+            search(dbi, db, opt->key);
+            break;
+        case STALE:
+            stale(dbi, db, opt->key);
+            break;
+        case TOP:
+            top(opt->key);
+            break;
+        case SERVE: {
+            char *sock = server_socket_path();
+            if (sock == NULL || !serve(dbi, db, sock)) {
+                free(sock);
+                dbi->close(db);
+                exit(EXIT_FAILURE);
+            }
+            free(sock);
+            break;
+        }
     }
-
-    if (!dbi->close(db)) {
-        fprintf(stderr, "Error closing database. Continuing, since I'm out of "
-                "ideas...\n");
-    }
-    free(dbi);
-    return EXIT_SUCCESS;
 }
 
 static void
@@ -193,10 +510,93 @@ parse_options(int argc, char **argv, options *options_out)
         options_out->key = argv[1];
     }
 
+    // export takes an optional --format and output file.
+    if (options_out->operation == EXPORT) {
+        for (int i = 2; i < argc; ++i) {
+            if (strcmp(argv[i], "--format=jsonl") == 0)
+                options_out->format = EXPORT_JSONL;
+            else if (strcmp(argv[i], "--format=bin") == 0)
+                options_out->format = EXPORT_BIN;
+            else if (options_out->key == NULL && argv[i][0] != '-')
+                options_out->key = argv[i];
+            else
+                options_out->operation = USAGE;
+        }
+        return;
+    }
+
+    // backup takes an optional --full and the directory to back up into.
+    if (options_out->operation == BACKUP) {
+        int i = 2;
+        if (i < argc && strcmp(argv[i], "--full") == 0) {
+            options_out->full = true;
+            ++i;
+        }
+        if (i + 1 != argc)
+            options_out->operation = USAGE;
+        options_out->key = argv[i];
+        return;
+    }
+
+    // migrate takes the extension of the database to move to.
+    if (options_out->operation == MIGRATE) {
+        if (argc != 3 || strncmp(argv[2], "--to=", 5) != 0)
+            options_out->operation = USAGE;
+        else
+            options_out->key = argv[2] + 5;
+        return;
+    }
+
+    // get takes its output flags and then any number of keys, or "-" to
+    // read them from stdin.
+    if (options_out->operation == GET) {
+        int i = 2;
+        for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; ++i) {
+            if (strcmp(argv[i], "-0") == 0) {
+                options_out->separator = "";
+                options_out->separator_len = 1;
+            } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+                options_out->separator = argv[++i];
+                options_out->separator_len = strlen(argv[i]);
+            } else if (strcmp(argv[i], "--") == 0) {
+                ++i;
+                break;
+            } else {
+                options_out->operation = USAGE;
+                return;
+            }
+        }
+        if (i == argc)
+            options_out->operation = USAGE;
+        options_out->keys = argv + i;
+        options_out->key_count = argc - i;
+        return;
+    }
+
+    // import takes an optional file name, and the listings an optional
+    // prefix or range, in place of the key.
+    if (options_out->operation == IMPORT
+    ||  options_out->operation == LIST
+    ||  options_out->operation == FULL_LIST
+    ||  options_out->operation == TOP) {
+        if (argc > 3)
+            options_out->operation = USAGE;
+        options_out->key = argv[2];
+        return;
+    }
+
     // Set the key field if it should be there.
     if (options_out->operation != LIST
     &&  options_out->operation != FULL_LIST
-    &&  options_out->operation != PRINT)
+    &&  options_out->operation != PRINT
+    &&  options_out->operation != BATCH
+    &&  options_out->operation != SERVE
+    &&  options_out->operation != COMPACT
+    &&  options_out->operation != COMPILE
+    &&  options_out->operation != DEDUP
+    &&  options_out->operation != INFO
+    &&  options_out->operation != OPTIMIZE
+    &&  options_out->operation != REINDEX)
     {
         if (argc != 3) // The key is missing. Print usage message.
             options_out->operation = USAGE;
@@ -211,211 +611,1543 @@ parse_options(int argc, char **argv, options *options_out)
 
 /* Delete the entry specified by key. */
 static void
-delete(struct DbInterface *dbi, void *db, const char *key) {
+delete(struct DbInterface *dbi, void *db, options *opt) {
+    char *key = opt->key;
     normalize_key(key);
 
-    if (! dbi->delete(db, key)) {
+    if (! dbi_delete(dbi, db, key, strlen(key))) {
         fprintf(stderr, "Could not delete '%s': %s\n", key, 
                 dbi->strerror(dbi->get_errno(db)));
+        return;
+    }
+    stats_note(&opt->hits, key, strlen(key), true);
+}
+
+/* Number of records written per transaction by import. */
+#define IMPORT_BATCH 10000
+
+/* Undo the escapes import accepts in values (\n, \t and \\) in place. */
+static void
+unescape_value(char *value) {
+    char *out = value;
+    for (char *in = value; *in; ++in) {
+        if (*in == '\\' && in[1] != '\0') {
+            switch (*++in) {
+                case 'n': *out++ = '\n'; break;
+                case 't': *out++ = '\t'; break;
+                case '\\': *out++ = '\\'; break;
+                default: *out++ = '\\'; *out++ = *in; break;
+            }
+        } else {
+            *out++ = *in;
+        }
+    }
+    *out = '\0';
+}
+
+/* Load "KEY VALUE" records, one per line, from file (or stdin when file is
+ * NULL or "-").  Existing keys are overwritten.  Records are written in
+ * batches of IMPORT_BATCH, each inside a backend transaction.
+ */
+static void
+import(struct DbInterface *dbi, void *db, const char *file) {
+    FILE *in = stdin;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    unsigned long lineno = 0, count = 0, pending = 0;
+    struct timespec start, end;
+
+    if (file != NULL && strcmp(file, "-") != 0
+    &&  (in = fopen(file, "r")) == NULL) {
+        fprintf(stderr, "Could not open \"%s\": %s\n", file, strerror(errno));
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while ((len = getline(&line, &cap, in)) != -1) {
+        ++lineno;
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (len == 0 || line[0] == '#')
+            continue;
+
+        char *key = line, *value = line + strcspn(line, " \t");
+        if (*value == '\0' || value == key) {
+            fprintf(stderr, "%s:%lu: expected \"KEY VALUE\"\n",
+                    file ? file : "stdin", lineno);
+            continue;
+        }
+        *value++ = '\0';
+        value += strspn(value, " \t");
+        unescape_value(value);
+
+        if (pending == 0 && dbi->begin && !dbi->begin(db)) {
+            fprintf(stderr, "Could not begin transaction: %s\n",
+                    dbi->strerror(dbi->get_errno(db)));
+            break;
+        }
+        if (!dbi_store(dbi, db, key, strlen(key), value, strlen(value),
+                       true)) {
+            fprintf(stderr, "Could not write '%s': %s\n", key,
+                    dbi->strerror(dbi->get_errno(db)));
+            if (dbi->abort && dbi->abort(db))
+                count -= pending;
+            pending = 0;
+            break;
+        }
+        ++count;
+        if (++pending == IMPORT_BATCH) {
+            if (dbi->commit && !dbi->commit(db)) {
+                fprintf(stderr, "Could not commit transaction: %s\n",
+                        dbi->strerror(dbi->get_errno(db)));
+                count -= pending;
+            }
+            pending = 0;
+        }
+    }
+    if (pending > 0 && dbi->commit && !dbi->commit(db)) {
+        fprintf(stderr, "Could not commit transaction: %s\n",
+                dbi->strerror(dbi->get_errno(db)));
+        count -= pending;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double secs = (end.tv_sec - start.tv_sec)
+                + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "Imported %lu records in %.3fs (%.0f records/s)\n", count,
+            secs, secs > 0 ? count / secs : 0.0);
+
+    free(line);
+    if (in != stdin)
+        fclose(in);
+}
+
+/* Dump every record to the file named in opt->key, or stdout, with one
+ * encoding thread per processor.
+ */
+static void
+export(struct DbInterface *dbi, void *db, options *opt) {
+    const char *file = opt->key;
+    struct timespec start, end;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN), count;
+    int fd = STDOUT_FILENO;
+
+    if (file != NULL && strcmp(file, "-") != 0
+    &&  (fd = open(file, O_WRONLY | O_CREAT | O_TRUNC,
+                   S_IRUSR | S_IWUSR)) < 0) {
+        fprintf(stderr, "Could not create \"%s\": %s\n", file,
+                strerror(errno));
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    count = export_db(dbi, db, opt->format, fd, threads > 0 ? threads : 1);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (fd != STDOUT_FILENO && close(fd) != 0 && count >= 0) {
+        fprintf(stderr, "Could not write \"%s\": %s\n", file, strerror(errno));
+        count = -1;
+    }
+    if (count >= 0) {
+        double secs = (end.tv_sec - start.tv_sec)
+                    + (end.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stderr, "Exported %ld records in %.3fs (%.0f records/s)\n",
+                count, secs, secs > 0 ? count / secs : 0.0);
+    }
+}
+
+/* Return the snapshot path for the database at file, or NULL if there is no
+ * snapshot or the database has been written since it was compiled.
+ */
+static char *
+fresh_snapshot(const char *file) {
+    size_t len = strlen(file) + sizeof(SNAP_SUFFIX);
+    char *snap = malloc(len);
+
+    if (snap == NULL)
+        return NULL;
+    snprintf(snap, len, "%s%s", file, SNAP_SUFFIX);
+    if (!snap_fresh(snap, file)) {
+        free(snap);
+        return NULL;
+    }
+    return snap;
+}
+
+/* Rewrite the database file with fn and report how its size changed. */
+static void
+rewrite_db(struct DbInterface *dbi, void *db, bool (*fn)(void*),
+        const char *done) {
+    char *file = get_db_location();
+    struct timespec start, end;
+    struct stat before, after;
+
+    if (stat(file, &before) != 0)
+        before.st_size = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!fn(db)) {
+        fprintf(stderr, "Could not rewrite the database: %s\n",
+                dbi->strerror(dbi->get_errno(db)));
+        free(file);
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (stat(file, &after) != 0)
+        after.st_size = 0;
+    fprintf(stderr, "%s %s from %lld to %lld bytes in %.3fs\n", done, file,
+            (long long) before.st_size, (long long) after.st_size,
+            (end.tv_sec - start.tv_sec)
+            + (end.tv_nsec - start.tv_nsec) / 1e9);
+    free(file);
+}
+
+/* Rewrite the database without its dead records, for the backends that keep
+ * them around.
+ */
+static void
+compact(struct DbInterface *dbi, void *db) {
+    if (dbi->compact == NULL) {
+        fprintf(stderr, "This database does not need compacting.\n");
+        return;
+    }
+    rewrite_db(dbi, db, dbi->compact, "Compacted");
+}
+
+/* Rewrite the database laid out for the records it holds now.  Backends
+ * without a layout to fit are compacted instead.
+ */
+static void
+optimize(struct DbInterface *dbi, void *db) {
+    if (dbi->optimize != NULL)
+        rewrite_db(dbi, db, dbi->optimize, "Optimized");
+    else if (dbi->compact != NULL)
+        rewrite_db(dbi, db, dbi->compact, "Compacted");
+    else
+        fprintf(stderr, "This database cannot be optimized.\n");
+}
+
+static bool
+print_setting(void *arg, const char *name, const char *value) {
+    (void) arg;
+    return printf("%-16s %s\n", name, value) >= 0;
+}
+
+/* Print the database's location and what its backend reports about it. */
+static void
+info(struct DbInterface *dbi, void *db) {
+    char *file = get_db_location();
+    struct stat st;
+
+    print_setting(NULL, "file", file);
+    if (dbi->info != NULL) {
+        if (!dbi->info(db, print_setting, NULL))
+            fprintf(stderr, "Could not read database figures: %s\n",
+                    dbi->strerror(dbi->get_errno(db)));
+    } else if (stat(file, &st) == 0) {
+        char size[32];
+        snprintf(size, sizeof(size), "%lld", (long long) st.st_size);
+        print_setting(NULL, "file_bytes", size);
+    }
+    free(file);
+}
+
+/* The first len bytes of a followed by b and c, in a new string. */
+static char *
+path_of(const char *a, size_t len, const char *b, const char *c) {
+    size_t blen = strlen(b), clen = strlen(c);
+    char *path = malloc(len + blen + clen + 1);
+
+    if (path == NULL) {
+        fprintf(stderr, "migrate: malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(path, a, len);
+    memcpy(path + len, b, blen);
+    memcpy(path + len + blen, c, clen + 1);
+    return path;
+}
+
+/* Move one file from dir to the directory above it. */
+static bool
+move_file_up(const char *dir, const char *name) {
+    char *from = path_of(dir, strlen(dir), "/", name);
+    char *to = path_of(dir, strrchr(dir, '/') - dir, "/", name);
+    bool ok = rename(from, to) == 0;
+
+    free(from);
+    free(to);
+    return ok;
+}
+
+/* Move every file in dir up, the database file itself last so that its side
+ * files are in place when it appears.
+ */
+static bool
+move_up(const char *dir, const char *db_name) {
+    struct dirent *de;
+    bool ok = true;
+    DIR *d;
+
+    if ((d = opendir(dir)) == NULL)
+        return false;
+    while (ok && (de = readdir(d)) != NULL) {
+        if (de->d_name[0] != '.' && strcmp(de->d_name, db_name) != 0)
+            ok = move_file_up(dir, de->d_name);
+    }
+    closedir(d);
+    return ok && move_file_up(dir, db_name);
+}
+
+/* Remove dir and whatever was left in it. */
+static void
+remove_dir(const char *dir) {
+    struct dirent *de;
+    DIR *d;
+
+    if ((d = opendir(dir)) == NULL)
+        return;
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        char *path = path_of(dir, strlen(dir), "/", de->d_name);
+        unlink(path);
+        free(path);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+/* Copy the database into a new one of the backend for ext, check that the
+ * copy holds the same records and put it in place of the original.
+ *
+ * The copy is built in a directory of its own, which get_db_location never
+ * looks in.  The original is held open for writing throughout, so nothing
+ * changes under the copy, and is only renamed aside, to FILE.old, once the
+ * copy has been moved next to it.  Until then every drop opens the original;
+ * in between the two renames both files hold the same records.
+ */
+static void
+migrate(struct DbInterface *dbi, void *db, const char *ext) {
+    char *file = get_db_location();
+    const char *type = extension_type(ext);
+    size_t len = strlen(file), base = strrchr(file, '.') + 1 - file;
+    char *dest = path_of(file, base, ext, "");
+    char *work = path_of(file, len, ".migrate", "");
+    char *copy = path_of(work, strlen(work), strrchr(dest, '/'), "");
+    char *old = path_of(file, len, ".old", "");
+    struct DbInterface *out = NULL;
+    struct MigrateSum sent, stored;
+    struct timespec start, end;
+    void *copy_db;
+    bool ok;
+
+    if (type == NULL) {
+        fprintf(stderr, "There is no backend for \"%s\" databases.\n", ext);
+        goto done;
+    }
+    if (strcmp(dest, file) == 0) {
+        fprintf(stderr, "%s is already a %s database.\n", file, ext);
+        goto done;
+    }
+    if (access(dest, F_OK) == 0) {
+        fprintf(stderr, "\"%s\" is in the way.\n", dest);
+        goto done;
+    }
+
+    remove_dir(work);   /* left by a migration that was stopped */
+    if (mkdir(work, S_IRWXU) != 0) {
+        fprintf(stderr, "Could not create \"%s\": %s\n", work,
+                strerror(errno));
+        goto done;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    out = load_backend(type)();
+    if ((copy_db = out->open(copy, DB_WRITE)) == NULL) {
+        fprintf(stderr, "Could not create \"%s\": %s\n", copy,
+                out->strerror(out->get_errno(NULL)));
+        goto fail;
+    }
+    ok = migrate_copy(dbi, db, out, copy_db, &sent);
+    if (!out->close(copy_db) || !ok)
+        goto fail;
+
+    /* Read the copy back as any other drop would open it. */
+    if ((copy_db = out->open(copy, DB_READ)) == NULL) {
+        fprintf(stderr, "Could not reopen \"%s\": %s\n", copy,
+                out->strerror(out->get_errno(NULL)));
+        goto fail;
+    }
+    ok = migrate_sum(out, copy_db, &stored);
+    out->close(copy_db);
+    if (!ok)
+        goto fail;
+    if (stored.records != sent.records || stored.checksum != sent.checksum) {
+        fprintf(stderr, "The copy does not match: %llu records read with "
+                "checksum %016llx, %llu stored with %016llx.\n", sent.records,
+                (unsigned long long) sent.checksum, stored.records,
+                (unsigned long long) stored.checksum);
+        goto fail;
+    }
+
+    if (!move_up(work, strrchr(dest, '/') + 1)) {
+        fprintf(stderr, "Could not move the copy into place: %s\n",
+                strerror(errno));
+        unlink(dest);
+        goto fail;
+    }
+    if (rename(file, old) != 0) {
+        fprintf(stderr, "Could not move \"%s\" aside: %s\n", file,
+                strerror(errno));
+        unlink(dest);
+        goto fail;
+    }
+    rmdir(work);
+
+    /* Lookup counts are drop's own and go with the records. */
+    char *from = path_of(file, len, STATS_SUFFIX, "");
+    char *to = path_of(dest, strlen(dest), STATS_SUFFIX, "");
+    rename(from, to);
+    free(from);
+    free(to);
+
+    /* The copy holds whole values; the value store stays with the records
+     * that refer to it. */
+    from = path_of(file, len, DEDUP_SUFFIX, "");
+    to = path_of(old, strlen(old), DEDUP_SUFFIX, "");
+    rename(from, to);
+    free(from);
+    free(to);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fprintf(stderr, "Migrated %llu records to %s in %.3fs (checksum "
+            "%016llx)\nThe old database is kept as %s\n", sent.records, dest,
+            (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+            (unsigned long long) sent.checksum, old);
+    goto done;
+
+fail:
+    remove_dir(work);
+done:
+    free(out);
+    free(dest);
+    free(work);
+    free(copy);
+    free(old);
+    free(file);
+}
+
+/* Rebuild the read-only snapshot next to the database. */
+static void
+compile(struct DbInterface *dbi, void *db) {
+    char *file = get_db_location();
+    size_t len = strlen(file) + sizeof(SNAP_SUFFIX);
+    char *snap = malloc(len);
+    struct timespec start, end;
+    long count;
+
+    if (snap == NULL) {
+        fprintf(stderr, "compile: malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(snap, len, "%s%s", file, SNAP_SUFFIX);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((count = snap_compile(dbi, db, file, snap)) >= 0) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        fprintf(stderr, "Compiled %ld records into %s in %.3fs\n", count, snap,
+                (end.tv_sec - start.tv_sec)
+                + (end.tv_nsec - start.tv_nsec) / 1e9);
+    }
+    free(snap);
+    free(file);
+}
+
+/* Layer the value store over the database when it has one, so that every
+ * operation sees whole values.  dedup makes the store first if need be and
+ * moves the values still held in records into it.  Returns the handle to use
+ * from now on.
+ */
+static void *
+attach_dedup(struct DbInterface **dbi, void *db, const char *file,
+        enum Operation op) {
+    struct DbInterface *layered;
+    struct timespec start, end;
+    void *dd;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    dd = dedup_attach(*dbi, db, file, read_only(op) ? DB_READ : DB_WRITE,
+                      op == DEDUP, &layered);
+    if (dd == NULL) {
+        (*dbi)->close(db);
+        exit(EXIT_FAILURE);
+    }
+    if (dd == db)
+        return db;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (op == DEDUP)
+        fprintf(stderr, "Moved values into the value store in %.3fs\n",
+                (end.tv_sec - start.tv_sec)
+                + (end.tv_nsec - start.tv_nsec) / 1e9);
+    *dbi = layered;
+    return dd;
+}
+
+/* Layer the search index over the database for the operations that use it:
+ * writes keep an existing index current, search builds one if it is missing
+ * and reindex always builds it afresh.  The index is opened through backend,
+ * the interface beneath the value store's layer.  Returns the handle to use
+ * from now on.
+ */
+static void *
+attach_index(struct DbInterface **dbi, void *db,
+        const struct DbInterface *backend, const char *file,
+        enum Operation op) {
+    struct DbInterface *layered;
+    struct timespec start, end;
+    void *ix;
+
+    if (op != ADD && op != BATCH && op != DELETE && op != IMPORT
+    &&  op != SERVE && op != SEARCH && op != REINDEX)
+        return db;
+
+    if (op == REINDEX) {
+        size_t len = strlen(file) + sizeof(TRIGRAM_SUFFIX);
+        char *path = malloc(len);
+        if (path == NULL) {
+            fprintf(stderr, "reindex: malloc failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        snprintf(path, len, "%s%s", file, TRIGRAM_SUFFIX);
+        if (unlink(path) != 0 && errno != ENOENT) {
+            fprintf(stderr, "Could not remove \"%s\": %s\n", path,
+                    strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        free(path);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ix = trigram_attach(*dbi, db, backend, file,
+                        op == SEARCH || op == REINDEX, &layered);
+    if (ix == NULL) {
+        if (op == REINDEX) {
+            fprintf(stderr, "Could not rebuild the search index.\n");
+            (*dbi)->close(db);
+            exit(EXIT_FAILURE);
+        }
+        return db;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (op == REINDEX)
+        fprintf(stderr, "Rebuilt the search index in %.3fs\n",
+                (end.tv_sec - start.tv_sec)
+                + (end.tv_nsec - start.tv_nsec) / 1e9);
+    *dbi = layered;
+    return ix;
+}
+
+static bool
+print_key(void *arg, const char *key, size_t len) {
+    (void) arg;
+    return fwrite(key, 1, len, stdout) == len && fputc('\n', stdout) != EOF;
+}
+
+/* List the keys whose key or value contains term.  Without an index, as on a
+ * server started before there was one, every record is read.
+ */
+static void
+search(struct DbInterface *dbi, void *db, const char *term) {
+    size_t len = strlen(term);
+    bool ok = dbi->search != NULL
+            ? dbi->search(db, term, len, print_key, NULL)
+            : trigram_scan(dbi, db, term, len, print_key, NULL);
+
+    if (!ok)
+        fprintf(stderr, "Search failed: %s\n",
+                dbi->strerror(dbi->get_errno(db)));
+}
+
+/* Append this run's lookups and deletes to the access statistics.  They
+ * are advisory, so a failure to write them is not reported.
+ */
+static void
+record_hits(options *opt) {
+    if (opt->hits.len == 0)
+        return;
+    PROF_BEGIN(PHASE_STATS);
+    char *file = get_db_location();
+    stats_flush(&opt->hits, file);
+    free(file);
+    PROF_END(PHASE_STATS);
+}
+
+static void
+put_access(const char *key, size_t klen, unsigned long count, time_t last) {
+    char when[32] = "never";
+    if (last != 0)
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&last));
+    printf("%8lu  %-16s  ", count, when);
+    fwrite(key, 1, klen, stdout);
+    putchar('\n');
+}
+
+static int
+by_count_desc(const void *a, const void *b) {
+    const struct AccessStat *x = a, *y = b;
+    if (x->count != y->count)
+        return (x->count < y->count) - (x->count > y->count);
+    return (x->last < y->last) - (x->last > y->last);
+}
+
+/* List the count most looked up keys, from the statistics alone. */
+static void
+top(const char *arg) {
+    struct AccessStats stats;
+    char *end, *file;
+    long count = 10;
+
+    if (arg != NULL) {
+        count = strtol(arg, &end, 10);
+        if (*arg == '\0' || *end != '\0' || count < 0)
+            usage();
+    }
+    file = get_db_location();
+    if (!stats_load(file, &stats)) {
+        free(file);
+        return;
+    }
+    free(file);
+
+    qsort(stats.items, stats.count, sizeof(*stats.items), by_count_desc);
+    for (size_t i = 0; i < stats.count && i < (size_t) count; ++i)
+        put_access(stats.items[i].key, stats.items[i].klen,
+                   stats.items[i].count, stats.items[i].last);
+    stats_free(&stats);
+}
+
+/* List the keys not looked up in the last days days, or ever, with their
+ * counts.  Only the keys are read from the database.
+ */
+static void
+stale(struct DbInterface *dbi, void *db, const char *arg) {
+    struct AccessStats stats;
+    char *end, *file, *key;
+    double days = strtod(arg, &end);
+    void *cur;
+
+    if (*arg == '\0' || *end != '\0' || days < 0)
+        usage();
+    time_t cutoff = time(NULL) - (time_t) (days * 86400);
+
+    file = get_db_location();
+    if (!stats_load(file, &stats)) {
+        free(file);
+        return;
+    }
+    free(file);
+
+    cur = dbi->create_cursor(db);
+    if (dbi->cursor_first(db, &cur)) {
+        do {
+            if ((key = dbi->cursor_key(db, &cur)) == NULL)
+                continue;
+            size_t klen = strlen(key);
+            const struct AccessStat *a = stats_find(&stats, key, klen);
+            if (a == NULL)
+                put_access(key, klen, 0, 0);
+            else if (a->last < cutoff)
+                put_access(key, klen, a->count, a->last);
+            free(key);
+        } while (dbi->cursor_next(db, &cur));
+    }
+    dbi->destroy_cursor(&cur);
+    stats_free(&stats);
+}
+
+/* Lookups and listings only read, so any number of them can share the
+ * database while it is not being written.  A file that does not exist yet,
+ * or has never been written, holds nothing a reader can open; it is set up
+ * by opening it for writing once.
+ */
+static bool
+read_only(enum Operation op) {
+    return op == PRINT || op == LIST || op == FULL_LIST || op == GET
+        || op == COMPILE || op == EXPORT || op == INFO || op == STALE
+        || op == TOP;
+}
+
+static void *
+open_db(struct DbInterface *dbi, const char *file, enum Operation op) {
+    struct stat st;
+    void *db;
+
+    if (!read_only(op))
+        return dbi->open(file, DB_WRITE);
+    if ((db = dbi->open(file, DB_READ)) == NULL
+    &&  (stat(file, &st) == 0 ? st.st_size == 0 : errno == ENOENT))
+        db = dbi->open(file, DB_WRITE);
+    return db;
+}
+
+/* Database files are named after the prefix plus one of the extensions in
+ * extension_map; anything else next to them (snapshots, indexes) is not a
+ * database.  Returns the backend for ext, or NULL.
+ */
+static const char *
+extension_type(const char *ext) {
+    int items = (sizeof(extension_map) / sizeof(struct ExtensionMap));
+    for (int i = 0; i < items; ++i) {
+        if (strcmp(extension_map[i].ext, ext) == 0)
+            return extension_map[i].type;
+    }
+    return NULL;
+}
+
+/* Create a string for the DB location and fill it. The caller is responsible
+ * for freeing the string.
+ */
+static char *
+get_db_location() {
+    DIR *dir;
+    struct dirent *de;
+    bool found = false;
+    char *location;
+    char *prefix = "drop.";
+    char *dirpath = getenv("XDG_DATA_HOME");
+    size_t len = 0;
+    if (dirpath == NULL) {
+        dirpath = getenv("HOME");
+        prefix = ".drop.";
+    }
+
+    if ((dir = opendir(dirpath)) == NULL) {
+        fprintf(stderr, "Could not open directory: \"%s\": %s\n", dirpath,
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    errno = 0;
+    while ((de = readdir(dir)) != NULL) {
+        char *match = strstr(de->d_name, prefix);
+        if (match != NULL
+        &&  extension_type(match + strlen(prefix)) != NULL) {
+            found = true;
+            break;
+        }
+    }
+
+    if (!found) {
+        if (errno) {
+            fprintf(stderr, "Error while scanning \"%s\": %s\n", dirpath,
+                    strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        prefix = "drop.dbm";
+    } else {
+        prefix = de->d_name;
+    }
+
+    len = strlen(prefix) + strlen(dirpath) + 1;
+    if (len > _POSIX_PATH_MAX) {
+        fprintf(stderr, "get_db_location: path name is impossible.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    ++len; /* pad for a null */
+    if ((location = malloc(len)) == NULL) {
+        fprintf(stderr, "get_db_location: malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    snprintf(location, len, "%s/%s", dirpath, prefix);
+
+    if (closedir(dir) != 0) {
+        fprintf(stderr, "Could not close directory: \"%s\": %s\n", dirpath,
+                strerror(errno));
+    }
+
+    return location;
+}
+
+static void
+add(struct DbInterface *dbi, void *db, options *opt) {
+    char *key = opt->key;
+    enum TransferType dest = opt->transfer_type;
+    char *value = NULL;
+    size_t vlen = 0;
+
+    normalize_key(key);
+
+    if (dest == READLINE && !isatty(STDIN_FILENO)) {
+        add_stream(dbi, db, key);
+        return;
+    }
+
+#ifdef X11
+    if (dest == XSELECTION_PRIMARY || dest == XSELECTION_CLIPBOARD) {
+        value = read_X_selection(opt, &vlen);
+    } else {
+#endif
+        while (! value || ! *value) {
+            value = readline("   : ");
+        }
+        vlen = strlen(value);
+#ifdef X11
+    }
+#endif
+    if (value == NULL) {
+        fprintf(stderr, "Nothing to add.\n");
+        return;
+    }
+
+    size_t klen = strlen(key);
+    if (!dbi_store(dbi, db, key, klen, value, vlen, false)) {
+        int err = dbi->get_errno(db);
+        size_t len;
+        char *owned, *resp;
+        if (! dbi_fetch(dbi, db, key, klen, &len, &owned)) {
+            fprintf(stderr, "Could not write: %s\n", dbi->strerror(err));
+            free(value);
+            return;
+        }
+        free(owned);
+
+        resp = readline("Overwrite? [y/N] ");
+        if (resp && (resp[ 0 ] == 'y' || resp[ 0 ] == 'Y')) {
+            if (!dbi_store(dbi, db, key, klen, value, vlen, true)) {
+                fprintf(stderr, "Could not write: %s\n",
+                        dbi->strerror(dbi->get_errno(db)));
+                return;
+            }
+        }
+        free(resp);
+    }
+
+    free(value);
+}
+
+/* Size of the pieces a piped value is read and written in. */
+#define STREAM_CHUNK (1 << 20)
+
+/* Add the value for key from a non-interactive stdin.  Backends that can
+ * append take it STREAM_CHUNK bytes at a time inside one transaction; others
+ * get it whole.  There is nobody to ask about overwriting, so an existing key
+ * is left alone.
+ */
+static void
+add_stream(struct DbInterface *dbi, void *db, const char *key) {
+    size_t klen = strlen(key), cap = STREAM_CHUNK, len = 0, total = 0;
+    char *buf, *owned;
+    bool ok = true, reported = false, tx = false;
+    ssize_t n;
+
+    if (dbi_fetch(dbi, db, key, klen, &len, &owned) != NULL) {
+        free(owned);
+        fprintf(stderr, "'%s' already exists.\n", key);
+        return;
+    }
+    if ((buf = malloc(cap)) == NULL) {
+        fprintf(stderr, "add: malloc failed.\n");
+        return;
+    }
+    if (dbi->append != NULL && dbi->begin != NULL)
+        tx = dbi->begin(db);
+
+    len = 0;
+    do {
+        if ((n = io_read_some(STDIN_FILENO, buf + len, cap - len)) < 0) {
+            fprintf(stderr, "Could not read value: %s\n", strerror(errno));
+            ok = false;
+            reported = true;
+            break;
+        }
+        len += n;
+        if (dbi->append != NULL && len > 0 && (len == cap || n == 0)) {
+            ok = total == 0 ? dbi_store(dbi, db, key, klen, buf, len, false)
+                            : dbi->append(db, key, klen, buf, len);
+            total += len;
+            len = 0;
+        } else if (len == cap) {
+            char *bigger = realloc(buf, cap * 2);
+            if (bigger == NULL) {
+                fprintf(stderr, "add: value is too large.\n");
+                ok = false;
+                reported = true;
+                break;
+            }
+            buf = bigger;
+            cap *= 2;
+        }
+    } while (ok && n > 0);
+
+    if (ok && dbi->append == NULL && len > 0) {
+        ok = dbi_store(dbi, db, key, klen, buf, len, false);
+        total = len;
+    }
+    if (!ok && !reported)
+        fprintf(stderr, "Could not write: %s\n",
+                dbi->strerror(dbi->get_errno(db)));
+    else if (total == 0)
+        fprintf(stderr, "Nothing to add.\n");
+    if (tx && !(ok ? dbi->commit(db) : dbi->abort(db)) && ok)
+        fprintf(stderr, "Could not commit: %s\n",
+                dbi->strerror(dbi->get_errno(db)));
+    free(buf);
+}
+
+/* Keys selected by a listing: those starting with prefix, or those between
+ * from and to inclusive where either end may be open.
+ */
+struct KeyRange {
+    const char *prefix;
+    size_t prefix_len;
+    char *from;
+    char *to;
+};
+
+/* Parse "PREFIX" or "FROM..TO" into range.  A NULL pattern selects every key.
+ */
+static void
+parse_range(const char *pattern, struct KeyRange *range) {
+    const char *dots;
+
+    memset(range, 0, sizeof(struct KeyRange));
+    if (pattern == NULL)
+        return;
+    if ((dots = strstr(pattern, "..")) == NULL) {
+        range->prefix = pattern;
+        range->prefix_len = strlen(pattern);
+        return;
+    }
+    if (dots > pattern)
+        range->from = strndup(pattern, dots - pattern);
+    if (dots[2] != '\0')
+        range->to = strdup(dots + 2);
+}
+
+/* Compare key against range: negative before it, zero inside, positive past
+ * its end.
+ */
+static int
+range_position(const struct KeyRange *range, const char *key) {
+    if (range->prefix != NULL)
+        return strncmp(key, range->prefix, range->prefix_len);
+    if (range->from != NULL && strcmp(key, range->from) < 0)
+        return -1;
+    if (range->to != NULL && strcmp(key, range->to) > 0)
+        return 1;
+    return 0;
+}
+
+/* Output buffer and cursor batch sizes for listings.  The arena grows if a
+ * single record needs more.
+ */
+#define LIST_BUFFER (1 << 20)
+#define LIST_ARENA (1 << 20)
+#define LIST_BATCH 4096
+
+/* Write one listing line. */
+static void
+list_entry(struct Writer *out, const char *key, size_t klen,
+        const char *value, size_t vlen, enum ListingType full) {
+    writer_put(out, key, klen);
+    if (full == KEYS_AND_ENTRIES && value != NULL) {
+        writer_put(out, ": ", 2);
+        if (klen < 10)
+            writer_fill(out, ' ', 10 - klen);
+        writer_put(out, value, vlen);
+    }
+    writer_put(out, "\n", 1);
+}
+
+/* List through cursor_batch, which copies records into one arena instead of
+ * allocating each key and value.  Returns false if it stopped early.
+ */
+static bool
+list_batched(struct DbInterface *dbi, void *db, void **cur,
+        enum ListingType full, const struct KeyRange *range, bool ordered,
+        struct Writer *out) {
+    struct CursorBatch b;
+    bool ok = true;
+
+    memset(&b, 0, sizeof(b));
+    b.arena_len = LIST_ARENA;
+    b.max = LIST_BATCH;
+    b.values = full == KEYS_AND_ENTRIES;
+    if ((b.arena = malloc(b.arena_len)) == NULL
+    ||  (b.records = malloc(b.max * sizeof(struct CursorRecord))) == NULL) {
+        fprintf(stderr, "list: malloc failed.\n");
+        free(b.arena);
+        return false;
+    }
+
+    do {
+        if (dbi->cursor_batch(db, cur, &b) == 0 && !b.done) {
+            char *bigger = realloc(b.arena, b.need);
+            if (bigger == NULL) {
+                fprintf(stderr, "list: malloc failed.\n");
+                ok = false;
+                break;
+            }
+            b.arena = bigger;
+            b.arena_len = b.need;
+            continue;
+        }
+        for (size_t i = 0; i < b.count; ++i) {
+            struct CursorRecord *r = b.records + i;
+            int pos = range_position(range, r->key);
+            if (pos > 0 && ordered) {
+                b.done = true;
+                break;
+            }
+            if (pos == 0)
+                list_entry(out, r->key, r->klen, r->value, r->vlen, full);
+        }
+    } while (!b.done && !out->failed);
+
+    free(b.arena);
+    free(b.records);
+    return ok;
+}
+
+/* List the keys of the current entries, optionally only those matching a
+ * prefix or range.  Ordered backends seek to the start of the range and stop
+ * at its end; the rest are filtered in a single pass.
+ */
+static void
+list(struct DbInterface *dbi, void *db, enum ListingType full,
+        const char *pattern) {
+    char *key = NULL;
+    char *value = NULL;
+    struct KeyRange range;
+    struct Writer out;
+    bool ordered = false, found;
+    void *cur = dbi->create_cursor(db);
+
+    parse_range(pattern, &range);
+    const char *start = range.prefix ? range.prefix : range.from;
+    if (start != NULL && dbi->cursor_seek != NULL) {
+        found = dbi->cursor_seek(db, &cur, start, strlen(start));
+        ordered = true;
+    } else {
+        found = dbi->cursor_first(db, &cur);
+        if (!found && pattern == NULL)
+            fprintf(stdout, "Database is empty.\n");
+    }
+    if (!found || !writer_open(&out, STDOUT_FILENO, LIST_BUFFER)) {
+        dbi->destroy_cursor(&cur);
+        free(range.from);
+        free(range.to);
+        return;
+    }
+
+    if (dbi->cursor_batch != NULL) {
+        list_batched(dbi, db, &cur, full, &range, ordered, &out);
+    } else {
+        do {
+            if ((key = dbi->cursor_key(db, &cur)) != NULL) {
+                int pos = range_position(&range, key);
+                if (pos > 0 && ordered) {
+                    free(key);
+                    break;
+                }
+                if (pos == 0) {
+                    if (full == KEYS_AND_ENTRIES)
+                        value = dbi->cursor_value(db, &cur);
+                    list_entry(&out, key, strlen(key), value,
+                               value ? strlen(value) : 0, full);
+                    free(value);
+                    value = NULL;
+                }
+                free(key);
+            }
+        } while (!out.failed && dbi->cursor_next(db, &cur));
     }
+    if (!writer_close(&out) && errno != EPIPE)
+        fprintf(stderr, "Could not write listing: %s\n", strerror(errno));
+    dbi->destroy_cursor(&cur);
+    free(range.from);
+    free(range.to);
 }
 
-/* Create a string for the DB location and fill it. The caller is responsible
- * for freeing the string.
+struct GetOutput {
+    struct Writer w;
+    options *opt;
+    char **keys;
+};
+
+/* fetch_many callback: write one value and what follows it.  A missing key
+ * still gets its separator, so values keep their places in the output.
  */
-static char *
-get_db_location() {
-    DIR *dir;
-    struct dirent *de;
-    bool found = false;
-    char *location;
-    char *prefix = "drop.";
-    char *dirpath = getenv("XDG_DATA_HOME");
-    size_t len = 0;
-    if (dirpath == NULL) {
-        dirpath = getenv("HOME");
-        prefix = ".drop.";
-    }
+static bool
+put_value(void *arg, size_t index, const char *value, size_t vlen) {
+    struct GetOutput *out = arg;
 
-    if ((dir = opendir(dirpath)) == NULL) {
-        fprintf(stderr, "Could not open directory: \"%s\": %s\n", dirpath,
-                strerror(errno));
-        exit(EXIT_FAILURE);
+    if (value == NULL) {
+        fprintf(stderr, "'%s' does not exist.\n", out->keys[index]);
+    } else {
+        writer_put(&out->w, value, vlen);
+        stats_note(&out->opt->hits, out->keys[index],
+                   strlen(out->keys[index]), false);
     }
+    if (out->opt->separator != NULL)
+        writer_put(&out->w, out->opt->separator, out->opt->separator_len);
+    else if (value == NULL || vlen == 0 || value[vlen - 1] != '\n')
+        writer_put(&out->w, "\n", 1);
+    return !out->w.failed;
+}
 
-    while ((de = readdir(dir)) != NULL) {
-        if (strstr(de->d_name, prefix) != NULL) {
-            found = true;
-            break;
-        }
-    }
+/* Split everything on stdin into keys at newlines, or at NULs under -0.
+ * Empty keys are skipped.  Returns the number of keys.
+ */
+static size_t
+read_keys(char **input, char ***keys, char delim) {
+    size_t len = 0, cap = 0, count = 0, max = 0;
+    ssize_t n;
+    char *buf = NULL;
 
-    if (!found) {
-        if (errno) {
-            fprintf(stderr, "Error while scanning \"%s\": %s\n", dirpath,
-                    strerror(errno));
+    do {
+        if (len + STREAM_CHUNK + 1 > cap) {
+            char *b = realloc(buf, cap = cap * 2 + STREAM_CHUNK + 1);
+            if (b == NULL) {
+                perror("get");
+                exit(EXIT_FAILURE);
+            }
+            buf = b;
+        }
+        if ((n = io_read_some(STDIN_FILENO, buf + len, STREAM_CHUNK)) < 0) {
+            perror("get");
             exit(EXIT_FAILURE);
         }
-        prefix = "drop.dbm";
-    } else {
-        prefix = de->d_name;
+        len += n;
+    } while (n > 0);
+    buf[len] = '\0';
+
+    *keys = NULL;
+    for (char *p = buf, *end = buf + len; p < end; ) {
+        char *next = memchr(p, delim, end - p);
+        next = next ? next : end;
+        *next = '\0';
+        if (next > p) {
+            if (count == max) {
+                char **k = realloc(*keys, (max = max ? max * 2 : 64)
+                                          * sizeof(char*));
+                if (k == NULL) {
+                    perror("get");
+                    exit(EXIT_FAILURE);
+                }
+                *keys = k;
+            }
+            (*keys)[count++] = p;
+        }
+        p = next + 1;
     }
+    *input = buf;
+    return count;
+}
 
-    len = strlen(prefix) + strlen(dirpath) + 1;
-    if (len > _POSIX_PATH_MAX) {
-        fprintf(stderr, "get_db_location: path name is impossible.\n");
-        exit(EXIT_FAILURE);
+/* Print the values of several keys in one go, through fetch_many so that a
+ * backend or server can answer them all at once.
+ */
+static void
+get(struct DbInterface *dbi, void *db, options *opt) {
+    struct GetOutput out;
+    char *input = NULL, **owned_keys = NULL;
+    size_t count = opt->key_count, *klens;
+
+    out.opt = opt;
+    out.keys = opt->keys;
+    if (count == 1 && strcmp(opt->keys[0], "-") == 0) {
+        bool nul = opt->separator_len == 1 && opt->separator[0] == '\0';
+        count = read_keys(&input, &owned_keys, nul ? '\0' : '\n');
+        out.keys = owned_keys;
     }
-
-    ++len; /* pad for a null */
-    if ((location = malloc(len)) == NULL) {
-        fprintf(stderr, "get_db_location: malloc failed.\n");
+    if ((klens = malloc(count * sizeof(size_t) + 1)) == NULL
+    ||  !writer_open(&out.w, STDOUT_FILENO, LIST_BUFFER)) {
+        perror("get");
         exit(EXIT_FAILURE);
     }
-
-    snprintf(location, len, "%s/%s", dirpath, prefix);
-
-    if (closedir(dir) != 0) {
-        fprintf(stderr, "Could not close directory: \"%s\": %s\n", dirpath,
-                strerror(errno));
+    for (size_t i = 0; i < count; ++i) {
+        normalize_key(out.keys[i]);
+        klens[i] = strlen(out.keys[i]);
     }
 
-    return location;
+    if (!dbi_fetch_many(dbi, db, count, (const char *const*) out.keys, klens,
+                        put_value, &out))
+        fprintf(stderr, "Could not fetch values: %s\n",
+                dbi->strerror(dbi->get_errno(db)));
+    if (!writer_close(&out.w) && errno != EPIPE)
+        fprintf(stderr, "Could not write value: %s\n", strerror(errno));
+    free(klens);
+    free(owned_keys);
+    free(input);
 }
 
-static void
-add(struct DbInterface *dbi, void *db, options *opt) {
-    char *key = opt->key;
-    enum TransferType dest = opt->transfer_type;
-    char *value = NULL;
+/* State of a batch run.  Writes are applied inside a transaction as they
+ * arrive, but answered only once it has been committed.
+ */
+struct Batch {
+    struct DbInterface *dbi;
+    void *db;
+    options *opt;
+    struct Writer out;
+    const char *results[IMPORT_BATCH];  /* NULL for the writes that worked */
+    size_t pending;
+    bool open;                          /* in a transaction */
+    char *in;                           /* unread input */
+    size_t in_start, in_end, in_cap;
+    bool eof;
+};
 
-    normalize_key(key);
+static void
+batch_reply(struct Batch *b, const char *word, const char *detail) {
+    writer_put(&b->out, word, strlen(word));
+    if (detail != NULL) {
+        writer_put(&b->out, " ", 1);
+        writer_put(&b->out, detail, strlen(detail));
+    }
+    writer_put(&b->out, "\n", 1);
+}
 
-#ifdef X11
-    if (dest == XSELECTION_PRIMARY || dest == XSELECTION_CLIPBOARD) {
-        value = read_X_selection(opt);
-    } else {
-#endif
-        while (! value || ! *value) {
-            value = readline("   : ");
-        }
-#ifdef X11
+/* Commit the open transaction and answer the writes made in it.  If the
+ * commit fails, so did every write. */
+static void
+batch_settle(struct Batch *b) {
+    const char *failed = NULL;
+
+    if (b->open && !b->dbi->commit(b->db))
+        failed = b->dbi->strerror(b->dbi->get_errno(b->db));
+    for (size_t i = 0; i < b->pending; ++i) {
+        const char *err = b->results[i] ? b->results[i] : failed;
+        batch_reply(b, err ? "error" : "ok", err);
     }
-#endif
+    b->pending = 0;
+    b->open = false;
+}
 
-    if (!dbi->try_store(db, key, value)) {
-        int err = dbi->get_errno(db);
-        char *resp = dbi->fetch(db, key);
-        if (! resp) {
-            fprintf(stderr, "Could not write: %s\n", dbi->strerror(err));
-            return;
+/* Return the next line of input, without its newline, or NULL at the end.
+ * Before waiting for more input everything asked so far is answered, so a
+ * client can wait for its replies without closing its end.
+ */
+static char *
+batch_line(struct Batch *b) {
+    for (;;) {
+        char *line = b->in + b->in_start;
+        char *nl = memchr(line, '\n', b->in_end - b->in_start);
+        if (nl != NULL || (b->eof && b->in_start < b->in_end)) {
+            if (nl == NULL)
+                nl = b->in + b->in_end;
+            *nl = '\0';
+            b->in_start = nl - b->in + (nl < b->in + b->in_end);
+            return line;
         }
-        free(resp);
-        resp = NULL;
-
-        resp = readline("Overwrite? [y/N] ");
-        if (resp && (resp[ 0 ] == 'y' || resp[ 0 ] == 'Y')) {
-            if (!dbi->store(db, key, value)) {
-                fprintf(stderr, "Could not write: %s\n",
-                        dbi->strerror(dbi->get_errno(db)));
-                return;
+        if (b->eof)
+            return NULL;
+
+        batch_settle(b);
+        writer_flush(&b->out);
+
+        memmove(b->in, line, b->in_end - b->in_start);
+        b->in_end -= b->in_start;
+        b->in_start = 0;
+        if (b->in_end + 1 >= b->in_cap) {
+            char *in = realloc(b->in, b->in_cap * 2);
+            if (in == NULL) {
+                perror("batch");
+                exit(EXIT_FAILURE);
             }
+            b->in = in;
+            b->in_cap *= 2;
         }
-        free(resp);
+        ssize_t n = read(STDIN_FILENO, b->in + b->in_end,
+                         b->in_cap - b->in_end - 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            perror("batch");
+        if (n <= 0)
+            b->eof = true;
+        else
+            b->in_end += n;
     }
+}
 
-    free(value);
+static void
+batch_write(struct Batch *b, bool store, char *key, char *value) {
+    struct DbInterface *dbi = b->dbi;
+    bool ok;
+
+    if (b->pending == 0 && dbi->begin != NULL && dbi->commit != NULL)
+        b->open = dbi->begin(b->db);
+    if (store)
+        ok = dbi_store(dbi, b->db, key, strlen(key), value, strlen(value),
+                       true);
+    else
+        ok = dbi_delete(dbi, b->db, key, strlen(key));
+    b->results[b->pending++] = ok ? NULL
+                             : dbi->strerror(dbi->get_errno(b->db));
+    if (ok && !store)
+        stats_note(&b->opt->hits, key, strlen(key), true);
+    if (b->pending == IMPORT_BATCH)
+        batch_settle(b);
 }
 
-/* List the keys of the current entries. */
 static void
-list(struct DbInterface *dbi, void *db, enum ListingType full) {
-    char *key = NULL;
-    char *value = NULL;
-    void *cur = dbi->create_cursor(db);
-    if (!dbi->cursor_first(db, &cur)) {
-        fprintf(stdout, "Database is empty.\n");
+batch_get(struct Batch *b, const char *key) {
+    size_t vlen;
+    char *owned, head[32];
+    const char *value = dbi_fetch(b->dbi, b->db, key, strlen(key), &vlen,
+                                  &owned);
+
+    if (value == NULL) {
+        batch_reply(b, "missing", NULL);
         return;
     }
+    snprintf(head, sizeof(head), "%zu", vlen);
+    batch_reply(b, "value", head);
+    writer_put(&b->out, value, vlen);
+    writer_put(&b->out, "\n", 1);
+    free(owned);
+    stats_note(&b->opt->hits, key, strlen(key), false);
+}
 
-    do {
-        if ((key = dbi->cursor_key(db, &cur)) != NULL) {
-            fputs(key, stdout);
-            if (full == KEYS_AND_ENTRIES) {
-                if ((value = dbi->cursor_value(db, &cur)) != NULL) {
-                    fputs(": ", stdout);
-                    size_t keylen = strlen(key);
-                    if (keylen < 10) {
-                        for (int i = 10 - keylen; i > 0; --i)
-                            fputc(' ', stdout);
-                    }
-                    fputs(value, stdout);
-                    free(value);
+/* Keys are gathered first, as the reply gives their count before them. */
+static void
+batch_list(struct Batch *b, const char *pattern) {
+    struct KeyRange range;
+    size_t count = 0, len = 0, cap = 0;
+    char *key, *keys = NULL, head[32];
+    bool found, ordered = false;
+    void *cur = b->dbi->create_cursor(b->db);
+
+    parse_range(pattern, &range);
+    const char *start = range.prefix ? range.prefix : range.from;
+    if (start != NULL && b->dbi->cursor_seek != NULL) {
+        found = b->dbi->cursor_seek(b->db, &cur, start, strlen(start));
+        ordered = true;
+    } else {
+        found = b->dbi->cursor_first(b->db, &cur);
+    }
+    while (found) {
+        if ((key = b->dbi->cursor_key(b->db, &cur)) != NULL) {
+            int pos = range_position(&range, key);
+            if (pos > 0 && ordered) {
+                free(key);
+                break;
+            }
+            size_t klen = strlen(key);
+            if (pos == 0 && len + klen + 1 > cap) {
+                cap = (cap ? cap * 2 : 4096) + klen;
+                if ((keys = realloc(keys, cap)) == NULL) {
+                    perror("batch");
+                    exit(EXIT_FAILURE);
                 }
             }
-            fputc('\n', stdout);
+            if (pos == 0) {
+                memcpy(keys + len, key, klen);
+                keys[len + klen] = '\n';
+                len += klen + 1;
+                ++count;
+            }
             free(key);
         }
-    } while (dbi->cursor_next(db, &cur));
-    dbi->destroy_cursor(&cur);
+        found = b->dbi->cursor_next(b->db, &cur);
+    }
+    b->dbi->destroy_cursor(&cur);
+    free(range.from);
+    free(range.to);
+
+    snprintf(head, sizeof(head), "%zu", count);
+    batch_reply(b, "keys", head);
+    if (len > 0)
+        writer_put(&b->out, keys, len);
+    free(keys);
+}
+
+/* Run commands from stdin against the one open database, answering each on
+ * stdout in order:
+ *
+ *   add KEY VALUE  ->  ok | error MESSAGE
+ *   delete KEY     ->  ok | error MESSAGE
+ *   get KEY        ->  value LEN, LEN bytes and a newline | missing
+ *   list [PAT]     ->  keys COUNT, then COUNT lines
+ *
+ * VALUE takes the escapes import does.  Runs of writes share a transaction,
+ * which is committed before a read, every IMPORT_BATCH writes and whenever
+ * the input runs dry.
+ */
+static void
+batch(struct DbInterface *dbi, void *db, options *opt) {
+    struct Batch *b = calloc(1, sizeof(struct Batch));
+    char *line;
+
+    if (b == NULL || (b->in = malloc(LIST_BUFFER)) == NULL
+    ||  !writer_open(&b->out, STDOUT_FILENO, LIST_BUFFER)) {
+        perror("batch");
+        exit(EXIT_FAILURE);
+    }
+    b->dbi = dbi;
+    b->db = db;
+    b->opt = opt;
+    b->in_cap = LIST_BUFFER;
+
+    while ((line = batch_line(b)) != NULL) {
+        char *cmd = line + strspn(line, " \t"), *arg, *value;
+        if (*cmd == '\0' || *cmd == '#')
+            continue;
+        arg = cmd + strcspn(cmd, " \t");
+        if (*arg != '\0')
+            *arg++ = '\0';
+        arg += strspn(arg, " \t");
+
+        if (strcmp(cmd, "add") == 0 || strcmp(cmd, "a") == 0) {
+            value = arg + strcspn(arg, " \t");
+            if (*value == '\0' || value == arg) {
+                batch_settle(b);
+                batch_reply(b, "error", "expected add KEY VALUE");
+                continue;
+            }
+            *value++ = '\0';
+            value += strspn(value, " \t");
+            unescape_value(value);
+            batch_write(b, true, arg, value);
+        } else if (strcmp(cmd, "delete") == 0 || strcmp(cmd, "d") == 0) {
+            normalize_key(arg);
+            batch_write(b, false, arg, NULL);
+        } else if (strcmp(cmd, "get") == 0 || strcmp(cmd, "g") == 0) {
+            batch_settle(b);
+            normalize_key(arg);
+            batch_get(b, arg);
+        } else if (strcmp(cmd, "list") == 0 || strcmp(cmd, "l") == 0) {
+            batch_settle(b);
+            normalize_key(arg);
+            batch_list(b, *arg ? arg : NULL);
+        } else {
+            batch_settle(b);
+            batch_reply(b, "error", "unknown command");
+        }
+    }
+    batch_settle(b);
+    if (!writer_close(&b->out) && errno != EPIPE)
+        fprintf(stderr, "Could not write replies: %s\n", strerror(errno));
+    free(b->in);
+    free(b);
 }
 
 /* Print the entry specified by key to stdout. */
 static void
 print(struct DbInterface *dbi, void *db, options *opt) {
     char *key = opt->key;
-    enum TransferType dest = opt->transfer_type;
-    char *value = NULL;
 
     if (key == NULL){
         return;
     }
     normalize_key(key);
 
-    value = dbi->fetch(db, key);
-    if (! value) {
+#ifdef X11
+    enum TransferType dest = opt->transfer_type;
+    if (dest == XSELECTION_PRIMARY || dest == XSELECTION_CLIPBOARD) {
+        size_t vlen;
+        char *owned;
+        const char *value = dbi_fetch(dbi, db, key, strlen(key), &vlen, &owned);
+        if (! value) {
+            fprintf(stderr, "'%s' does not exist.\n", key);
+            return;
+        }
+        if ((opt->selection = malloc(vlen + 1)) == NULL)
+            xdie("Out of memory.\n");
+        memcpy(opt->selection, value, vlen);
+        opt->selection[vlen] = '\0';
+        opt->selection_len = vlen;
+        free(owned);
+        stats_note(&opt->hits, key, strlen(key), false);
+        return;
+    }
+#endif
+    if (! print_value(dbi, db, key)) {
         fprintf(stderr, "'%s' does not exist.\n", key);
         return;
     }
-#ifdef X11
-    if (dest == XSELECTION_PRIMARY || dest == XSELECTION_CLIPBOARD) {
-        set_X_selection(opt, value);
+    stats_note(&opt->hits, key, strlen(key), false);
+}
+
+/* Write the value at key straight to stdout: from the backend's file with
+ * sendfile() when it can say where the value lives, otherwise from its own
+ * buffer in as few writes as possible.  On a terminal a newline follows
+ * unless the value already ends with one; into a pipe or file the value is
+ * written exactly as it was stored.
+ */
+static bool
+print_value(struct DbInterface *dbi, void *db, const char *key) {
+    size_t klen = strlen(key), vlen;
+    const char *value;
+    char *owned, last = '\0';
+    bool ok, tty = isatty(STDOUT_FILENO);
+    int fd;
+    uint64_t off;
+
+    if (dbi->locate != NULL && dbi->locate(db, key, klen, &fd, &off, &vlen)) {
+        ok = io_sendfile(STDOUT_FILENO, fd, off, vlen);
+        if (tty && vlen > 0 && pread(fd, &last, 1, off + vlen - 1) != 1)
+            last = '\0';
+        if (ok && tty && last != '\n')
+            ok = io_write(STDOUT_FILENO, "\n", 1);
     } else {
-#endif
-        fprintf(stdout, "%s\n", value);
-#ifdef X11
+        if ((value = dbi_fetch(dbi, db, key, klen, &vlen, &owned)) == NULL)
+            return false;
+        struct iovec iov[2] = { { (void*) value, vlen }, { "\n", 1 } };
+        ok = io_writev(STDOUT_FILENO, iov,
+                       !tty || (vlen > 0 && value[vlen - 1] == '\n') ? 1 : 2);
+        free(owned);
     }
-#endif
-    free(value);
+    if (!ok && errno != EPIPE)
+        fprintf(stderr, "Could not write value: %s\n", strerror(errno));
+    return true;
 }
 
 static get_interface_func
 load_support(char *db_file) {
     const char *suffix, *type = NULL;
+
+    if ((suffix = strrchr(db_file, '.')) == NULL
+    ||  (type = extension_type(suffix + 1)) == NULL)
+        type = "gdbm";
+
+    /* Time every call to the backend; see db_trace.c. */
+    if (getenv("DROP_TRACE") != NULL) {
+        setenv("DROP_TRACE_BACKEND", type, 1);
+        type = "trace";
+    }
+
+    return load_backend(type);
+}
+
+/* Use the built in backend for type, or load db_<type>.so from the directory
+ * drop lives in.
+ */
+static get_interface_func
+load_backend(const char *type) {
     char libpath[_POSIX_PATH_MAX];
     void *lib, *load;
     get_interface_func get_interface;
 
-    if ((suffix = strrchr(db_file, '.')) == NULL) {
-        type = "gdbm";
-    } else {
-        int items = (sizeof(extension_map) / sizeof(struct ExtensionMap));
-        ++suffix;
-        for (int i = 0; i < items; ++i) {
-            if (strcmp(extension_map[i].ext, suffix) == 0) {
-                type = extension_map[i].type;
-            }
-        }
-        if (type == NULL) {
-            type= "gdbm";
-        }
+    for (struct Builtin *b = builtins; b->type != NULL; ++b) {
+        if (strcmp(b->type, type) == 0)
+            return b->get_interface;
     }
 
+    PROF_BEGIN(PHASE_APP_PATH);
     char *basepath = get_application_path();
-    snprintf(libpath, 64, "%s/db_%s.so", basepath, type);
+    PROF_END(PHASE_APP_PATH);
+    snprintf(libpath, sizeof(libpath), "%s/db_%s.so", basepath, type);
     free(basepath);
 
-    if ((lib = dlopen(libpath, RTLD_LAZY)) == NULL) {
+    PROF_BEGIN(PHASE_DLOPEN);
+    lib = dlopen(libpath, RTLD_LAZY);
+    PROF_END(PHASE_DLOPEN);
+    if (lib == NULL) {
         fprintf(stderr, "Could not load database support library: %s\n",
                 dlerror());
         exit(EXIT_FAILURE);
@@ -438,8 +2170,10 @@ get_application_path() {
         apath[slash - progname + 1] = '\0';
         return apath;
     }
-    char *path = getenv("PATH");
-    char *p = strtok(path, ":");
+    /* strtok cuts up what it is given, and PATH is read again by the next
+     * backend loaded, as by migrate. */
+    char *path = getenv("PATH") ? strdup(getenv("PATH")) : NULL;
+    char *p = path ? strtok(path, ":") : NULL;
     size_t baselen = strlen(progname);
     while (p != NULL) {
         char *apath = malloc(baselen + strlen(p) + 2);
@@ -468,7 +2202,13 @@ get_application_path() {
         apath = NULL;
         p = strtok(NULL, ":");
     }
-    return strdup(p);
+    apath = p ? strdup(p) : NULL;
+    free(path);
+    if (apath == NULL) {
+        fprintf(stderr, "Could not find %s in PATH.\n", progname);
+        exit(EXIT_FAILURE);
+    }
+    return apath;
 }
 
 static int
@@ -486,22 +2226,55 @@ static void
 usage(void)
 {
     fprintf(stderr,
-        "Usage: %s [command | key]\n"
+        "Usage: %s [--stats[=FILE]] [command | key]\n"
         "\n"
         "If only 'key' is specified, the matching data is printed to stdout.  "
         "If no\n"
         "options are given, a list of keys is printed.\n"
         "\n"
         "\ta[dd]       <KEY> Add an item at KEY\n"
+        "\tbackup [--full] <DIR>\n"
+        "\t                  Copy the database into DIR, or only what changed\n"
+        "\t                  since the last backup there.\n"
+        "\tbatch             Run add, delete, get and list commands from\n"
+        "\t                  stdin over one open database.\n"
+        "\tc[ompile]         Build a read-only snapshot for fast lookups.\n"
+        "\tcompact           Reclaim the space of overwritten and deleted\n"
+        "\t                  items in a log database.\n"
         "\td[elete]    <KEY> Delete item at KEY\n"
-        "\tf[ulllist]        List all keys with their associated data.\n"
+        "\tdedup             Keep large values shared by several keys\n"
+        "\t                  once, in a value store.\n"
+        "\texport [--format=jsonl|bin] [FILE]\n"
+        "\t                  Write every item to FILE or stdout, as JSON\n"
+        "\t                  lines (the default) or a binary dump.\n"
+        "\tf[ulllist] [PAT]  List keys with their associated data.\n"
+        "\tg[et] [-0|-s SEP] <KEY>...\n"
+        "\t                  Print the data at every KEY, each followed by\n"
+        "\t                  SEP, a NUL or by default a newline.  A single\n"
+        "\t                  '-' reads the keys from stdin, one per line or\n"
+        "\t                  NUL separated with -0.\n"
         "\th[elp]            Print this message.\n"
-        "\tl[ist]            List all keys.\n"
+        "\ti[mport]   [FILE] Load \"KEY VALUE\" lines from FILE or stdin.\n"
+        "\tinfo              Print the database's figures and settings.\n"
+        "\tl[ist]     [PAT]  List keys.  PAT is a key prefix or a FROM..TO\n"
+        "\t                  range; either end of the range may be left off.\n"
+        "\tmigrate --to=EXT  Copy the database into a new drop.EXT (tcb, dbm\n"
+        "\t                  or log), check it and switch over to it.\n"
+        "\toptimize          Rewrite the database laid out for its records.\n"
+        "\treindex           Rebuild the search index.\n"
+        "\ts[earch]  <TERM>  List keys whose key or data contains TERM.\n"
+        "\tserve             Keep the database open and answer other drop\n"
+        "\t                  commands over a local socket.\n"
+        "\tstale      <DAYS> List keys not looked up in the last DAYS days.\n"
+        "\ttop         [N]   List the N (10) most looked up keys.\n"
         "\txa[dd][c]   <KEY> Add and item at KEY from an X selection buffers\n"
         "\txp[rint][c] <KEY> Insert the data at KEY an the X selection buffer.\n"
         "\n"
         "For xadd and xprint, the optional trailing 'c' specifies the CLIPBOARD"
         " selection\nbuffer should be used.  Otherwise, PRIMARY is used.\n"
+        "\n"
+        "--stats writes the time each step took and what was read and written\n"
+        "as JSON to stderr, or appends it to FILE.\n"
         "\n",
         progname);
     exit(0);
@@ -528,6 +2301,12 @@ init_x_win(enum TransferType destination)
 
     dest_atom = XInternAtom(d, "DROP_CLIP", False);
     XA_UTF8_STRING = XInternAtom(d, "UTF8_STRING", False);
+    XA_INCR = XInternAtom(d, "INCR", False);
+    XA_TARGETS = XInternAtom(d, "TARGETS", False);
+    XA_MULTIPLE = XInternAtom(d, "MULTIPLE", False);
+    XA_TIMESTAMP = XInternAtom(d, "TIMESTAMP", False);
+    XA_TEXT = XInternAtom(d, "TEXT", False);
+    XA_ATOM_PAIR = XInternAtom(d, "ATOM_PAIR", False);
 
     w = XCreateSimpleWindow(d, RootWindow(d, DefaultScreen(d)), 0, 0, 1, 1, 0,
                             BlackPixel(d, DefaultScreen(d)),
@@ -571,14 +2350,83 @@ get_X_timestamp(void)
     return e.xproperty.time;
 }
 
-/* Read the current X selection in and return it.
+/* Largest piece of a property asked for in one request, in 32-bit units. */
+#define X_CHUNK (1L << 18)
+
+/* Make room for len more bytes, and a NUL after them. */
+static void
+x_reserve(struct XBuffer *buf, size_t len)
+{
+    if (buf->len + len + 1 <= buf->cap)
+        return;
+    size_t cap = buf->cap ? buf->cap : 4096;
+    while (cap < buf->len + len + 1)
+        cap *= 2;
+    char *data = realloc(buf->data, cap);
+    if (data == NULL)
+        xdie("Out of memory reading the selection.\n");
+    buf->data = data;
+    buf->cap = cap;
+}
+
+/* Append the whole of our window's DROP_CLIP property to buf, X_CHUNK at a
+ * time, and return its type.  got is set to the number of bytes added.  An
+ * INCR property adds nothing; its value, the least the transfer will send,
+ * only sizes the buffer.
+ */
+static Atom
+read_X_property(struct XBuffer *buf, size_t *got)
+{
+    long offset = 0;
+    unsigned long num, after;
+    unsigned char *chunk;
+    Atom type;
+    int fmt;
+
+    *got = 0;
+    do
+    {
+        if (XGetWindowProperty(d, w, dest_atom, offset, X_CHUNK, False,
+                               AnyPropertyType, &type, &fmt, &num, &after,
+                               &chunk) != Success)
+            xdie("XGetWindowProperty failed.\n");
+        if (type == None)
+            return None;
+        if (type == XA_INCR)
+        {
+            if (fmt == 32 && num > 0)
+                x_reserve(buf, *(unsigned long *) chunk);
+            XFree(chunk);
+            return type;
+        }
+        if (fmt != 8)
+        {
+            XFree(chunk);
+            xdie("Invalid format size received\n;");
+        }
+        x_reserve(buf, num);
+        memcpy(buf->data + buf->len, chunk, num);
+        buf->len += num;
+        *got += num;
+        offset += num / 4;
+        XFree(chunk);
+    } while (after > 0);
+
+    return type;
+}
+
+/* Read the current X selection in and return it, with its length in len.
+ * Owners with more to give than fits in one property send it with the ICCCM
+ * INCR protocol: a piece is written each time the last one is deleted, and
+ * an empty piece ends the transfer.
  * On an X error, a message will print and the program will exit. With other
  * problems, NULL is returned.  The string returned will be null-terminated.
  */
 static char *
-read_X_selection(options *opt)
+read_X_selection(options *opt, size_t *len)
 {
-    char *data = NULL;
+    struct XBuffer buf = { NULL, 0, 0 };
+    size_t got;
     XEvent e;
     init_x_win(opt->transfer_type);
     Time t = get_X_timestamp();
@@ -596,37 +2444,205 @@ read_X_selection(options *opt)
         return NULL;
     }
 
-    /* Pull out the data */
+    /* Pull out the data; deleting the property starts an INCR transfer */
+    Atom type = read_X_property(&buf, &got);
+    if (type == None) xdie("Property not set after paste notification");
+    XDeleteProperty(d, w, dest_atom);
+
+    while (type == XA_INCR)
+    {
+        do
+        {
+            XNextEvent(d, &e);
+        } while (e.type != PropertyNotify || e.xproperty.atom != dest_atom
+                 || e.xproperty.state != PropertyNewValue);
+        if (read_X_property(&buf, &got) == None)
+            xdie("Property not set during incremental paste");
+        XDeleteProperty(d, w, dest_atom);
+        if (got == 0)
+            break;
+    }
+
+    x_reserve(&buf, 0);
+    buf.data[buf.len] = '\0';
+    *len = buf.len;
+    return buf.data;
+}
+
+/* Requestors may go away mid-transfer; their errors are not ours to die of.
+ */
+static int
+x_ignore_error(Display *dpy, XErrorEvent *err)
+{
+    (void) dpy;
+    (void) err;
+    return 0;
+}
+
+/* Convert the selection to target in the requestor's property.  Text bigger
+ * than x_chunk starts an INCR transfer.  Returns the property, or None when
+ * the target is not supported or no transfer slot is free.
+ */
+static Atom
+x_convert(const char *text, size_t len, Window requestor, Atom target,
+          Atom property, Time t)
+{
+    if (target == XA_TARGETS)
+    {
+        Atom targets[] = { XA_TARGETS, XA_MULTIPLE, XA_TIMESTAMP,
+                           XA_UTF8_STRING, XA_STRING, XA_TEXT };
+        XChangeProperty(d, requestor, property, XA_ATOM, 32, PropModeReplace,
+                        (unsigned char *) targets,
+                        sizeof(targets) / sizeof(targets[0]));
+        return property;
+    }
+    if (target == XA_TIMESTAMP)
+    {
+        long stamp = t;
+        XChangeProperty(d, requestor, property, XA_INTEGER, 32,
+                        PropModeReplace, (unsigned char *) &stamp, 1);
+        return property;
+    }
+    if (target != XA_UTF8_STRING && target != XA_STRING && target != XA_TEXT)
+        return None;
+
+    Atom type = target == XA_TEXT ? XA_UTF8_STRING : target;
+    if (len <= x_chunk)
+    {
+        XChangeProperty(d, requestor, property, type, 8, PropModeReplace,
+                        (const unsigned char *) text, len);
+        return property;
+    }
+
+    for (int i = 0; i < X_TRANSFERS; ++i)
+    {
+        struct XTransfer *x = transfers + i;
+        if (x->active)
+            continue;
+        long size = len;
+        x->requestor = requestor;
+        x->property = property;
+        x->type = type;
+        x->off = 0;
+        x->active = true;
+        XSelectInput(d, requestor, PropertyChangeMask);
+        XChangeProperty(d, requestor, property, XA_INCR, 32,
+                        PropModeReplace, (unsigned char *) &size, 1);
+        return property;
+    }
+    return None;
+}
+
+/* Answer a MULTIPLE request: its property lists target and property pairs,
+ * each converted in turn.  Pairs that fail have their property replaced with
+ * None.
+ */
+static Atom
+x_convert_multiple(const char *text, size_t len, XSelectionRequestEvent *req,
+                   Time t)
+{
+    unsigned long num, after;
+    unsigned char *data;
     Atom type;
     int fmt;
-    unsigned long num, after;
-    int ret = XGetWindowProperty(d, w, dest_atom, 0L, 1024L, False,
-                                 AnyPropertyType, &type, &fmt, &num, &after,
-                                 (unsigned char **) &data);
-    if (ret != Success) xdie("XGetWindowProperty failed.\n");
-    if (type == None) xdie("Property not set after paste notification");
-    if (fmt != 8)
+
+    if (req->property == None
+        || XGetWindowProperty(d, req->requestor, req->property, 0L, X_CHUNK,
+                              False, XA_ATOM_PAIR, &type, &fmt, &num, &after,
+                              &data) != Success)
+        return None;
+    if (type != XA_ATOM_PAIR || fmt != 32)
     {
-        XFree(data);
-        xdie("Invalid format size received\n;");
+        if (data != NULL)
+            XFree(data);
+        return None;
     }
 
-    /* Cleanup */
-    XDeleteProperty(d, w, dest_atom);
-    char *str = strdup(data);
+    Atom *pairs = (Atom *) data;
+    for (unsigned long i = 0; i + 1 < num; i += 2)
+    {
+        if (pairs[i] == XA_MULTIPLE
+            || x_convert(text, len, req->requestor, pairs[i], pairs[i + 1],
+                         t) == None)
+            pairs[i + 1] = None;
+    }
+    XChangeProperty(d, req->requestor, req->property, XA_ATOM_PAIR, 32,
+                    PropModeReplace, data, num);
     XFree(data);
+    return req->property;
+}
+
+/* A requestor deleted a property: send the next piece of its transfer, or
+ * the empty piece that ends it.
+ */
+static void
+x_continue(const char *text, size_t len, XPropertyEvent *pe)
+{
+    if (pe->state != PropertyDelete)
+        return;
+    for (int i = 0; i < X_TRANSFERS; ++i)
+    {
+        struct XTransfer *x = transfers + i;
+        if (!x->active || x->requestor != pe->window
+            || x->property != pe->atom)
+            continue;
+
+        size_t n = len - x->off < x_chunk ? len - x->off : x_chunk;
+        XChangeProperty(d, x->requestor, x->property, x->type, 8,
+                        PropModeReplace,
+                        (const unsigned char *) text + x->off, n);
+        x->off += n;
+        if (n == 0)
+        {
+            x->active = false;
+            bool others = false;
+            for (int j = 0; j < X_TRANSFERS; ++j)
+                others = others || (transfers[j].active
+                                    && transfers[j].requestor == x->requestor);
+            if (!others)
+                XSelectInput(d, x->requestor, NoEventMask);
+        }
+        return;
+    }
+}
 
-    return str;
+static bool
+x_transfers_active(void)
+{
+    for (int i = 0; i < X_TRANSFERS; ++i)
+        if (transfers[i].active)
+            return true;
+    return false;
 }
 
-/* Offer up the contents of the current drop for an X selection
+/* Offer up the contents of the current drop for an X selection.  The work is
+ * done by a child process, which answers every request until another client
+ * takes the selection over; the parent returns once the child owns it.
  */
 static void
-set_X_selection(options *opt, char *text)
+set_X_selection(options *opt, const char *text, size_t len)
 {
     XEvent e;
-    int res;
+    int res, ready[2];
+    bool lost = false;
+    pid_t pid;
+
+    if (pipe(ready) != 0)
+        xdie("pipe failed.\n");
+    if ((pid = fork()) < 0)
+        xdie("fork failed.\n");
+    if (pid > 0)
+    {
+        char c;
+        close(ready[1]);
+        exit(read(ready[0], &c, 1) == 1 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    close(ready[0]);
+    setsid();
+
     init_x_win(opt->transfer_type);
+    XSetErrorHandler(x_ignore_error);
+    x_chunk = (XMaxRequestSize(d) - 100) * 4;
 
     Time t = get_X_timestamp();
 
@@ -636,54 +2652,61 @@ set_X_selection(options *opt, char *text)
         || w != XGetSelectionOwner(d, selection_atom))
         xdie("Could not control X selection.\n");
 
-    /* Process events */
-    for (;;)
+    /* Let the parent go, and stop holding its terminal or pipes open */
+    int null = open("/dev/null", O_RDWR);
+    if (write(ready[1], "", 1) != 1 || null < 0)
+        xdie(NULL);
+    close(ready[1]);
+    dup2(null, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    close(null);
+
+    /* Process events until the selection is lost and the last transfer is
+     * done */
+    while (!lost || x_transfers_active())
     {
         XNextEvent(d, &e);
         if (e.type == SelectionClear)
         {
             if (e.xselectionclear.time > t) /* Lost selection ownership */
-                final_x_win();
-            else
-                continue;
+                lost = true;
+            continue;
+        }
+        if (e.type == PropertyNotify)
+        {
+            x_continue(text, len, &e.xproperty);
+            continue;
         }
-        if (e.type != SelectionRequest) continue; /* Not a selection request */
+        if (e.type != SelectionRequest || lost)
+            continue;
 
         XSelectionRequestEvent *req =
             (XSelectionRequestEvent *) &e.xselectionrequest;
 
-        /* Create respeonse event */
+        /* Create response event */
         XEvent resp;
         resp.xselection.type = SelectionNotify;
         resp.xselection.requestor = req->requestor;
         resp.xselection.selection = req->selection;
         resp.xselection.target = req->target;
         resp.xselection.time = req->time;
-        if (req->property == None)
-            resp.xselection.property = req->target;
-        else
-            resp.xselection.property = req->property;
-
-        /* Send the selection buffer data */
-        res = XChangeProperty(d, resp.xselection.requestor,
-                              resp.xselection.property, resp.xselection.target,
-                              8, PropModeReplace, (unsigned char *)text,
-                              strlen(text) + 1);
-        if (res == BadAlloc || res == BadAtom || res == BadMatch
-            || res == BadValue || res == BadWindow)
-        {
+
+        /* Obsolete clients give no property; use the target's name */
+        Atom property = req->property == None ? req->target : req->property;
+        if (req->time != CurrentTime && req->time < t)
             resp.xselection.property = None;
-            fprintf(stderr, "Foreign XChangeProperty.\n");
-        }
+        else if (req->target == XA_MULTIPLE)
+            resp.xselection.property = x_convert_multiple(text, len, req, t);
+        else
+            resp.xselection.property = x_convert(text, len, req->requestor,
+                                                 req->target, property, t);
 
         /* Send notice to the requesting application */
-        res = XSendEvent(d, resp.xselection.requestor, True, NoEventMask,
-            &resp);
-        if (res == BadValue || res == BadWindow)
-            xdie("XSendEvent failed.\n");
-
-        final_x_win();
+        XSendEvent(d, resp.xselection.requestor, True, NoEventMask, &resp);
+        XFlush(d);
     }
+    final_x_win();
 }
 
 /* Prints an optional error message, cleans up X connection and exits with
@@ -0,0 +1,425 @@
+/* export.c
+ * Dump a drop database as JSON lines or a flat binary file; see export.h for
+ * the formats.
+ *
+ * The backends are not safe to share between threads, so the calling thread
+ * does all the reading, a batch of records at a time.  Worker threads encode
+ * the batches while it reads on, and one more thread writes the encoded
+ * batches out in the order they were read.  Each batch is a job in a ring
+ * that the three stages pass around under one lock.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "db.h"
+#include "db_util.h"
+#include "export.h"
+#include "io.h"
+
+#define EXPORT_ARENA (1 << 20)
+#define EXPORT_BATCH 4096
+#define MAX_WORKERS 64
+
+enum JobState { JOB_FREE, JOB_READ, JOB_ENCODING, JOB_ENCODED };
+
+struct job {
+    enum JobState state;
+    struct CursorBatch batch;
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+};
+
+struct export {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct job *jobs;
+    size_t njobs;
+    unsigned long next_read;    /* batch numbers */
+    unsigned long next_encode;
+    unsigned long next_write;
+    unsigned long read_end;     /* batches in all, once reading is over */
+    enum ExportFormat format;
+    int fd;
+    long written;               /* records */
+    bool failed;
+    int err;                    /* errno of a failed write */
+};
+
+static char *
+put(char *o, const void *s, size_t len) {
+    memcpy(o, s, len);
+    return o + len;
+}
+
+static const char base64_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static bool
+utf8_valid(const unsigned char *s, size_t len) {
+    size_t i = 0;
+
+    while (i < len) {
+        unsigned char c = s[i];
+        size_t n;
+        uint32_t cp;
+
+        if (c < 0x80) {
+            ++i;
+            continue;
+        } else if (c >= 0xc2 && c <= 0xdf) {
+            n = 1;
+            cp = c & 0x1f;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            n = 2;
+            cp = c & 0x0f;
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            n = 3;
+            cp = c & 0x07;
+        } else {
+            return false;
+        }
+        if (len - i <= n)
+            return false;
+        for (size_t j = 1; j <= n; ++j) {
+            if ((s[i + j] & 0xc0) != 0x80)
+                return false;
+            cp = cp << 6 | (s[i + j] & 0x3f);
+        }
+        if ((n == 2 && (cp < 0x800 || (cp >= 0xd800 && cp <= 0xdfff)))
+        ||  (n == 3 && (cp < 0x10000 || cp > 0x10ffff)))
+            return false;
+        i += n + 1;
+    }
+    return true;
+}
+
+/* Append s as the body of a JSON string.  Needs at most 6 bytes per input
+ * byte.
+ */
+static char *
+json_escape(char *o, const unsigned char *s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char c = s[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            *o++ = c;
+            continue;
+        }
+        *o++ = '\\';
+        switch (c) {
+            case '"':  *o++ = '"'; break;
+            case '\\': *o++ = '\\'; break;
+            case '\n': *o++ = 'n'; break;
+            case '\r': *o++ = 'r'; break;
+            case '\t': *o++ = 't'; break;
+            case '\b': *o++ = 'b'; break;
+            case '\f': *o++ = 'f'; break;
+            default:
+                o = put(o, "u00", 3);
+                *o++ = hex[c >> 4];
+                *o++ = hex[c & 0xf];
+                break;
+        }
+    }
+    return o;
+}
+
+static char *
+base64(char *o, const unsigned char *s, size_t len) {
+    size_t i = 0;
+
+    for (; i + 2 < len; i += 3) {
+        uint32_t v = (uint32_t) s[i] << 16 | s[i + 1] << 8 | s[i + 2];
+        *o++ = base64_chars[v >> 18];
+        *o++ = base64_chars[v >> 12 & 0x3f];
+        *o++ = base64_chars[v >> 6 & 0x3f];
+        *o++ = base64_chars[v & 0x3f];
+    }
+    if (i < len) {
+        uint32_t v = (uint32_t) s[i] << 16 | (i + 1 < len ? s[i + 1] << 8 : 0);
+        *o++ = base64_chars[v >> 18];
+        *o++ = base64_chars[v >> 12 & 0x3f];
+        *o++ = i + 1 < len ? base64_chars[v >> 6 & 0x3f] : '=';
+        *o++ = '=';
+    }
+    return o;
+}
+
+/* Append "name": "...", or "name_base64": "..." for bytes that are not
+ * UTF-8.
+ */
+static char *
+json_field(char *o, const char *name, const char *s, size_t len) {
+    bool text = utf8_valid((const unsigned char*) s, len);
+
+    *o++ = '"';
+    o = put(o, name, strlen(name));
+    if (!text)
+        o = put(o, "_base64", 7);
+    o = put(o, "\": \"", 4);
+    o = text ? json_escape(o, (const unsigned char*) s, len)
+             : base64(o, (const unsigned char*) s, len);
+    *o++ = '"';
+    return o;
+}
+
+static char *
+put_u32le(char *o, uint32_t v) {
+    o[0] = v & 0xff;
+    o[1] = v >> 8 & 0xff;
+    o[2] = v >> 16 & 0xff;
+    o[3] = v >> 24 & 0xff;
+    return o + 4;
+}
+
+/* Encode a whole batch into the job's output buffer, sized once for the
+ * worst case.
+ */
+static bool
+encode(struct job *job, enum ExportFormat format) {
+    const struct CursorBatch *b = &job->batch;
+    size_t need = 0;
+    char *o;
+
+    for (size_t i = 0; i < b->count; ++i) {
+        if (format == EXPORT_JSONL)
+            need += 48 + 6 * (b->records[i].klen + b->records[i].vlen);
+        else
+            need += 8 + b->records[i].klen + b->records[i].vlen;
+    }
+    if (need > job->out_cap) {
+        char *out = realloc(job->out, need);
+        if (out == NULL)
+            return false;
+        job->out = out;
+        job->out_cap = need;
+    }
+
+    o = job->out;
+    for (size_t i = 0; i < b->count; ++i) {
+        const struct CursorRecord *r = b->records + i;
+        if (format == EXPORT_JSONL) {
+            *o++ = '{';
+            o = json_field(o, "key", r->key, r->klen);
+            *o++ = ',';
+            *o++ = ' ';
+            o = json_field(o, "value", r->value, r->vlen);
+            *o++ = '}';
+            *o++ = '\n';
+        } else {
+            o = put_u32le(o, r->klen);
+            o = put_u32le(o, r->vlen);
+            o = put(o, r->key, r->klen);
+            o = put(o, r->value, r->vlen);
+        }
+    }
+    job->out_len = o - job->out;
+    return true;
+}
+
+static void
+stop(struct export *e) {
+    e->failed = true;
+    pthread_cond_broadcast(&e->changed);
+}
+
+/* Take the batches in the order they were read and encode them. */
+static void *
+encoder(void *arg) {
+    struct export *e = arg;
+
+    pthread_mutex_lock(&e->lock);
+    for (;;) {
+        while (!e->failed && e->next_encode == e->next_read
+           &&  e->next_encode != e->read_end)
+            pthread_cond_wait(&e->changed, &e->lock);
+        if (e->failed || e->next_encode == e->read_end)
+            break;
+
+        struct job *job = e->jobs + e->next_encode++ % e->njobs;
+        job->state = JOB_ENCODING;
+        pthread_mutex_unlock(&e->lock);
+        bool ok = encode(job, e->format);
+        pthread_mutex_lock(&e->lock);
+        if (!ok) {
+            e->err = ENOMEM;
+            stop(e);
+            break;
+        }
+        job->state = JOB_ENCODED;
+        pthread_cond_broadcast(&e->changed);
+    }
+    pthread_mutex_unlock(&e->lock);
+    return NULL;
+}
+
+/* Write the encoded batches out in order and hand their jobs back. */
+static void *
+writer(void *arg) {
+    struct export *e = arg;
+
+    pthread_mutex_lock(&e->lock);
+    for (;;) {
+        struct job *job = e->jobs + e->next_write % e->njobs;
+        while (!e->failed && e->next_write != e->read_end
+           &&  (e->next_write == e->next_read || job->state != JOB_ENCODED))
+            pthread_cond_wait(&e->changed, &e->lock);
+        if (e->failed || e->next_write == e->read_end)
+            break;
+
+        pthread_mutex_unlock(&e->lock);
+        bool ok = io_write(e->fd, job->out, job->out_len);
+        int err = errno;
+        pthread_mutex_lock(&e->lock);
+        if (!ok) {
+            e->err = err;
+            stop(e);
+            break;
+        }
+        e->written += job->batch.count;
+        job->state = JOB_FREE;
+        ++e->next_write;
+        pthread_cond_broadcast(&e->changed);
+    }
+    pthread_mutex_unlock(&e->lock);
+    return NULL;
+}
+
+/* Fill the next free job from the cursor.  Returns false once the cursor is
+ * used up or the export has failed.
+ */
+static bool
+read_batch(struct export *e, struct DbInterface *dbi, void *db,
+        void **cur) {
+    struct job *job = e->jobs + e->next_read % e->njobs;
+    struct CursorBatch *b = &job->batch;
+    bool done;
+
+    pthread_mutex_lock(&e->lock);
+    while (!e->failed && job->state != JOB_FREE)
+        pthread_cond_wait(&e->changed, &e->lock);
+    bool failed = e->failed;
+    pthread_mutex_unlock(&e->lock);
+    if (failed)
+        return false;
+
+    while (dbi_cursor_batch(dbi, db, cur, b) == 0 && !b->done) {
+        char *bigger = realloc(b->arena, b->need);
+        if (bigger == NULL) {
+            pthread_mutex_lock(&e->lock);
+            e->err = ENOMEM;
+            stop(e);
+            pthread_mutex_unlock(&e->lock);
+            return false;
+        }
+        b->arena = bigger;
+        b->arena_len = b->need;
+    }
+    done = b->done;
+
+    pthread_mutex_lock(&e->lock);
+    job->state = JOB_READ;
+    ++e->next_read;
+    if (done)
+        e->read_end = e->next_read;
+    pthread_cond_broadcast(&e->changed);
+    pthread_mutex_unlock(&e->lock);
+    return !done;
+}
+
+long
+export_db(struct DbInterface *dbi, void *db, enum ExportFormat format,
+        int fd, int threads) {
+    pthread_t workers[MAX_WORKERS], out;
+    struct export e;
+    int started = 0;
+    bool have_writer = false;
+    void *cur;
+
+    if (threads < 1)
+        threads = 1;
+    if (threads > MAX_WORKERS)
+        threads = MAX_WORKERS;
+
+    memset(&e, 0, sizeof(e));
+    e.format = format;
+    e.fd = fd;
+    e.read_end = ULONG_MAX;
+    e.njobs = threads * 2 + 2;
+    if ((e.jobs = calloc(e.njobs, sizeof(struct job))) == NULL) {
+        fprintf(stderr, "export: out of memory.\n");
+        return -1;
+    }
+    for (size_t i = 0; i < e.njobs; ++i) {
+        struct CursorBatch *b = &e.jobs[i].batch;
+        b->arena_len = EXPORT_ARENA;
+        b->max = EXPORT_BATCH;
+        b->values = true;
+        if ((b->arena = malloc(b->arena_len)) == NULL
+        ||  (b->records = malloc(b->max * sizeof(struct CursorRecord)))
+                == NULL) {
+            fprintf(stderr, "export: out of memory.\n");
+            e.failed = true;
+            goto out;
+        }
+    }
+    if (format == EXPORT_BIN && !io_write(fd, EXPORT_MAGIC, 8)) {
+        fprintf(stderr, "Could not write export: %s\n", strerror(errno));
+        e.failed = true;
+        goto out;
+    }
+
+    pthread_mutex_init(&e.lock, NULL);
+    pthread_cond_init(&e.changed, NULL);
+    for (; started < threads; ++started) {
+        if (pthread_create(workers + started, NULL, encoder, &e) != 0)
+            break;
+    }
+    have_writer = started > 0 && pthread_create(&out, NULL, writer, &e) == 0;
+
+    cur = dbi->create_cursor(db);
+    if (!have_writer) {
+        pthread_mutex_lock(&e.lock);
+        e.err = EAGAIN;
+        stop(&e);
+        pthread_mutex_unlock(&e.lock);
+    } else if (!dbi->cursor_first(db, &cur)) {
+        pthread_mutex_lock(&e.lock);
+        e.read_end = 0;
+        pthread_cond_broadcast(&e.changed);
+        pthread_mutex_unlock(&e.lock);
+    } else {
+        while (read_batch(&e, dbi, db, &cur))
+            ;
+    }
+    dbi->destroy_cursor(&cur);
+
+    for (int i = 0; i < started; ++i)
+        pthread_join(workers[i], NULL);
+    if (have_writer)
+        pthread_join(out, NULL);
+    pthread_cond_destroy(&e.changed);
+    pthread_mutex_destroy(&e.lock);
+    if (e.failed)
+        fprintf(stderr, "Could not write export: %s\n", strerror(e.err));
+
+out:
+    for (size_t i = 0; i < e.njobs; ++i) {
+        free(e.jobs[i].batch.arena);
+        free(e.jobs[i].batch.records);
+        free(e.jobs[i].out);
+    }
+    free(e.jobs);
+    return e.failed ? -1 : e.written;
+}
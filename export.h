@@ -0,0 +1,29 @@
+#ifndef EXPORT_H__
+#define EXPORT_H__
+
+/* Dump every record of a database to a file, in cursor order.
+ *
+ * jsonl writes one {"key": ..., "value": ...} object per line.  A key or
+ * value that is not valid UTF-8 is written base64 encoded instead, as
+ * "key_base64" or "value_base64", so nothing is lost.
+ *
+ * bin writes EXPORT_MAGIC and then each record as its key length and value
+ * length, both 4 byte little-endian, followed by the key and value bytes.
+ */
+
+#include <stdbool.h>
+
+#include "db.h"
+
+#define EXPORT_MAGIC "DROPDMP1"
+
+enum ExportFormat { EXPORT_JSONL, EXPORT_BIN };
+
+/* Read records from the cursor on this thread, encode batches of them on
+ * threads worker threads and write the results to fd in order.  Returns the
+ * number of records written, or -1 after printing an error.
+ */
+long export_db(struct DbInterface *dbi, void *db, enum ExportFormat format,
+               int fd, int threads);
+
+#endif /* EXPORT_H__ */
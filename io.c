@@ -0,0 +1,182 @@
+/* io.c
+ * Whole-buffer reads and writes on raw descriptors, and a buffered writer
+ * over them.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "io.h"
+
+#define COPY_CHUNK (1 << 16)
+
+bool
+io_write(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool
+io_writev(int fd, struct iovec *iov, int count) {
+    ssize_t n;
+    while ((n = writev(fd, iov, count)) < 0) {
+        if (errno != EINTR)
+            return false;
+    }
+    for (int i = 0; i < count; ++i) {
+        if ((size_t) n >= iov[i].iov_len) {
+            n -= iov[i].iov_len;
+            continue;
+        }
+        if (!io_write(fd, (char*) iov[i].iov_base + n, iov[i].iov_len - n))
+            return false;
+        n = 0;
+    }
+    return true;
+}
+
+bool
+io_read(int fd, void *buf, size_t len) {
+    return io_read_some(fd, buf, len) == (ssize_t) len;
+}
+
+bool
+io_pread(int fd, void *buf, size_t len, uint64_t off) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        off += n;
+        len -= n;
+    }
+    return true;
+}
+
+ssize_t
+io_read_some(int fd, void *buf, size_t len) {
+    char *p = buf;
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(fd, p + got, len - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        got += n;
+    }
+    return got;
+}
+
+bool
+io_sendfile(int out_fd, int in_fd, uint64_t off, size_t len) {
+#ifdef __linux__
+    off_t pos = off;
+    while (len > 0) {
+        ssize_t n = sendfile(out_fd, in_fd, &pos, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        len -= n;
+    }
+    if (len == 0)
+        return true;
+    off = pos;
+#endif
+    /* No sendfile, or the descriptors do not support it. */
+    char buf[COPY_CHUNK];
+    while (len > 0) {
+        size_t want = len < sizeof(buf) ? len : sizeof(buf);
+        ssize_t n = pread(in_fd, buf, want, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0 || !io_write(out_fd, buf, n))
+            return false;
+        off += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool
+writer_open(struct Writer *w, int fd, size_t cap) {
+    w->fd = fd;
+    w->len = 0;
+    w->cap = cap;
+    w->failed = false;
+    return (w->buf = malloc(cap)) != NULL;
+}
+
+bool
+writer_flush(struct Writer *w) {
+    if (!w->failed && w->len > 0 && !io_write(w->fd, w->buf, w->len))
+        w->failed = true;
+    w->len = 0;
+    return !w->failed;
+}
+
+/* Data that would not fit goes out in the same writev as the buffer. */
+void
+writer_put(struct Writer *w, const void *data, size_t len) {
+    if (w->failed)
+        return;
+    if (w->len + len <= w->cap) {
+        memcpy(w->buf + w->len, data, len);
+        w->len += len;
+        return;
+    }
+    struct iovec iov[2] = { { w->buf, w->len }, { (void*) data, len } };
+    if (!io_writev(w->fd, iov, 2))
+        w->failed = true;
+    w->len = 0;
+}
+
+void
+writer_fill(struct Writer *w, int c, size_t count) {
+    if (w->len + count > w->cap && !writer_flush(w))
+        return;
+    if (count > w->cap) {
+        while (count > 0 && !w->failed) {
+            size_t n = count < w->cap ? count : w->cap;
+            writer_fill(w, c, n);
+            count -= n;
+        }
+        return;
+    }
+    memset(w->buf + w->len, c, count);
+    w->len += count;
+}
+
+bool
+writer_close(struct Writer *w) {
+    bool ok = writer_flush(w);
+    free(w->buf);
+    w->buf = NULL;
+    return ok;
+}
@@ -0,0 +1,43 @@
+#ifndef IO_H__
+#define IO_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Write or read exactly len bytes, retrying short transfers and EINTR. */
+bool io_write(int fd, const void *buf, size_t len);
+bool io_writev(int fd, struct iovec *iov, int count);
+bool io_read(int fd, void *buf, size_t len);
+bool io_pread(int fd, void *buf, size_t len, uint64_t off);
+
+/* Read up to len bytes, stopping early only at end of file.  Returns the
+ * count read, or -1 on error.
+ */
+ssize_t io_read_some(int fd, void *buf, size_t len);
+
+/* Copy len bytes at offset off of in_fd to out_fd, in the kernel where it can
+ * be done there.
+ */
+bool io_sendfile(int out_fd, int in_fd, uint64_t off, size_t len);
+
+/* Output gathered in one large buffer and written in big pieces.  After a
+ * failed write the rest is dropped and writer_close reports it.
+ */
+struct Writer {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t cap;
+    bool failed;
+};
+
+bool writer_open(struct Writer *w, int fd, size_t cap);
+void writer_put(struct Writer *w, const void *data, size_t len);
+void writer_fill(struct Writer *w, int c, size_t count);
+bool writer_flush(struct Writer *w);
+bool writer_close(struct Writer *w);
+
+#endif /* IO_H__ */
@@ -0,0 +1,206 @@
+/* layer.c
+ * Calls that hand everything through to the database beneath a layer.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "db.h"
+#include "layer.h"
+
+static bool
+layer_abort(struct Layer *l) {
+    return l->dbi->abort(l->db);
+}
+
+static bool
+layer_append(struct Layer *l, const char *key, size_t klen, const char *value,
+        size_t vlen) {
+    return l->dbi->append(l->db, key, klen, value, vlen);
+}
+
+static bool
+layer_begin(struct Layer *l) {
+    return l->dbi->begin(l->db);
+}
+
+static bool
+layer_close(struct Layer *l) {
+    bool ok = l->dbi->close(l->db);
+    free(l->dbi);
+    free(l);
+    return ok;
+}
+
+static bool
+layer_commit(struct Layer *l) {
+    return l->dbi->commit(l->db);
+}
+
+static bool
+layer_compact(struct Layer *l) {
+    return l->dbi->compact(l->db);
+}
+
+static bool
+layer_copy(struct Layer *l, const char *dest) {
+    return l->dbi->copy(l->db, dest);
+}
+
+static void *
+layer_create_cursor(struct Layer *l) {
+    return l->dbi->create_cursor(l->db);
+}
+
+static size_t
+layer_cursor_batch(struct Layer *l, void *cursor, struct CursorBatch *b) {
+    return l->dbi->cursor_batch(l->db, cursor, b);
+}
+
+static bool
+layer_cursor_first(struct Layer *l, void *cursor) {
+    return l->dbi->cursor_first(l->db, cursor);
+}
+
+static char *
+layer_cursor_key(struct Layer *l, void *cursor) {
+    return l->dbi->cursor_key(l->db, cursor);
+}
+
+static bool
+layer_cursor_next(struct Layer *l, void *cursor) {
+    return l->dbi->cursor_next(l->db, cursor);
+}
+
+static bool
+layer_cursor_seek(struct Layer *l, void *cursor, const char *key,
+        size_t klen) {
+    return l->dbi->cursor_seek(l->db, cursor, key, klen);
+}
+
+static char *
+layer_cursor_value(struct Layer *l, void *cursor) {
+    return l->dbi->cursor_value(l->db, cursor);
+}
+
+static bool
+layer_delete(struct Layer *l, const char *key) {
+    return l->dbi->delete(l->db, key);
+}
+
+static bool
+layer_delete_len(struct Layer *l, const char *key, size_t klen) {
+    return l->dbi->delete_len(l->db, key, klen);
+}
+
+static char *
+layer_fetch(struct Layer *l, const char *key) {
+    return l->dbi->fetch(l->db, key);
+}
+
+static const char *
+layer_fetch_borrow(struct Layer *l, const char *key, size_t klen,
+        size_t *vlen) {
+    return l->dbi->fetch_borrow(l->db, key, klen, vlen);
+}
+
+static bool
+layer_fetch_many(struct Layer *l, size_t count, const char *const *keys,
+        const size_t *klens, value_callback cb, void *arg) {
+    return l->dbi->fetch_many(l->db, count, keys, klens, cb, arg);
+}
+
+static char *
+layer_fetch_len(struct Layer *l, const char *key, size_t klen, size_t *vlen) {
+    return l->dbi->fetch_len(l->db, key, klen, vlen);
+}
+
+static int
+layer_get_errno(struct Layer *l) {
+    return l->dbi->get_errno(l->db);
+}
+
+static bool
+layer_info(struct Layer *l, setting_callback cb, void *arg) {
+    return l->dbi->info(l->db, cb, arg);
+}
+
+static bool
+layer_locate(struct Layer *l, const char *key, size_t klen, int *fd,
+        uint64_t *off, size_t *vlen) {
+    return l->dbi->locate(l->db, key, klen, fd, off, vlen);
+}
+
+static bool
+layer_optimize(struct Layer *l) {
+    return l->dbi->optimize(l->db);
+}
+
+static bool
+layer_search(struct Layer *l, const char *term, size_t len, key_callback cb,
+        void *arg) {
+    return l->dbi->search(l->db, term, len, cb, arg);
+}
+
+static bool
+layer_store(struct Layer *l, char *key, char *value) {
+    return l->dbi->store(l->db, key, value);
+}
+
+static bool
+layer_store_len(struct Layer *l, const char *key, size_t klen,
+        const char *value, size_t vlen) {
+    return l->dbi->store_len(l->db, key, klen, value, vlen);
+}
+
+static bool
+layer_try_store(struct Layer *l, char *key, char *value) {
+    return l->dbi->try_store(l->db, key, value);
+}
+
+static bool
+layer_try_store_len(struct Layer *l, const char *key, size_t klen,
+        const char *value, size_t vlen) {
+    return l->dbi->try_store_len(l->db, key, klen, value, vlen);
+}
+
+#define FORWARD(hook, type, fn) \
+    out->hook = inner->hook ? (type) fn : NULL
+
+void
+layer_forward(struct DbInterface *out, const struct DbInterface *inner) {
+    out->open = NULL;
+    out->close = (close_func) layer_close;
+    FORWARD(delete, delete_func, layer_delete);
+    FORWARD(fetch, fetch_func, layer_fetch);
+    FORWARD(try_store, try_store_func, layer_try_store);
+    FORWARD(store, store_func, layer_store);
+    FORWARD(delete_len, delete_len_func, layer_delete_len);
+    FORWARD(fetch_len, fetch_len_func, layer_fetch_len);
+    FORWARD(fetch_borrow, fetch_borrow_func, layer_fetch_borrow);
+    FORWARD(try_store_len, try_store_len_func, layer_try_store_len);
+    FORWARD(store_len, store_len_func, layer_store_len);
+    FORWARD(append, append_func, layer_append);
+    FORWARD(locate, locate_func, layer_locate);
+    FORWARD(fetch_many, fetch_many_func, layer_fetch_many);
+    FORWARD(create_cursor, create_cursor_func, layer_create_cursor);
+    FORWARD(cursor_first, cursor_first_func, layer_cursor_first);
+    FORWARD(cursor_next, cursor_next_func, layer_cursor_next);
+    FORWARD(cursor_key, cursor_key_func, layer_cursor_key);
+    FORWARD(cursor_value, cursor_value_func, layer_cursor_value);
+    FORWARD(cursor_seek, cursor_seek_func, layer_cursor_seek);
+    FORWARD(cursor_batch, cursor_batch_func, layer_cursor_batch);
+    FORWARD(begin, begin_func, layer_begin);
+    FORWARD(commit, commit_func, layer_commit);
+    FORWARD(abort, abort_func, layer_abort);
+    FORWARD(compact, compact_func, layer_compact);
+    FORWARD(optimize, optimize_func, layer_optimize);
+    FORWARD(info, info_func, layer_info);
+    FORWARD(copy, copy_func, layer_copy);
+    FORWARD(search, search_func, layer_search);
+    FORWARD(get_errno, errno_func, layer_get_errno);
+
+    /* These never see the handle, so the backend's own will do. */
+    out->destroy_cursor = inner->destroy_cursor;
+    out->strerror = inner->strerror;
+}
@@ -0,0 +1,21 @@
+#ifndef LAYER_H__
+#define LAYER_H__
+
+#include "db.h"
+
+/* A layer sits between drop and an open database and passes every call on to
+ * it, except the ones the layer overrides to do extra work.  A layer's handle
+ * starts with struct Layer.  The layer owns what it wraps: closing it closes
+ * the database beneath and frees its interface.
+ */
+struct Layer {
+    struct DbInterface *dbi;
+    void *db;
+};
+
+/* Fill out with calls forwarding to inner.  Hooks inner lacks are left NULL
+ * so callers still see what the backend beneath can do.
+ */
+void layer_forward(struct DbInterface *out, const struct DbInterface *inner);
+
+#endif /* LAYER_H__ */
@@ -0,0 +1,150 @@
+/* migrate.c
+ * Streaming copy of one drop database into another.  See migrate.h.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "db.h"
+#include "db_util.h"
+#include "migrate.h"
+
+/* Records and bytes read through the cursor at once.  The arena grows for a
+ * record that does not fit on its own.
+ */
+#define MIGRATE_RECORDS 1024
+#define MIGRATE_ARENA (1 << 20)
+
+typedef bool (*record_func)(void *arg, const struct CursorRecord *r);
+
+static uint64_t
+hash_bytes(uint64_t h, const char *s, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char) s[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* The key length goes in first so that moving bytes between the key and the
+ * value changes the hash; the mix at the end keeps the sum from cancelling
+ * out for records that differ in one place.
+ */
+static void
+add_record(struct MigrateSum *sum, const struct CursorRecord *r) {
+    uint64_t len = r->klen;
+    uint64_t h = hash_bytes(0xcbf29ce484222325ULL, (const char *) &len,
+                            sizeof(len));
+    h = hash_bytes(hash_bytes(h, r->key, r->klen), r->value, r->vlen);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    sum->checksum += h;
+    ++sum->records;
+}
+
+/* Call fn on every record of db, with its value, a batch at a time. */
+static bool
+each_record(struct DbInterface *dbi, void *db, record_func fn, void *arg) {
+    struct CursorBatch b;
+    void *cur = dbi->create_cursor(db);
+    bool ok = true;
+
+    memset(&b, 0, sizeof(b));
+    b.arena_len = MIGRATE_ARENA;
+    b.max = MIGRATE_RECORDS;
+    b.values = true;
+    if ((b.arena = malloc(b.arena_len)) == NULL
+    ||  (b.records = malloc(b.max * sizeof(struct CursorRecord))) == NULL) {
+        fprintf(stderr, "migrate: malloc failed.\n");
+        ok = false;
+    } else if (!dbi->cursor_first(db, &cur)) {
+        b.done = true;
+    }
+
+    while (ok && !b.done) {
+        if (dbi_cursor_batch(dbi, db, &cur, &b) == 0 && !b.done) {
+            char *bigger = realloc(b.arena, b.need);
+            if (bigger == NULL) {
+                fprintf(stderr, "migrate: malloc failed.\n");
+                ok = false;
+                break;
+            }
+            b.arena = bigger;
+            b.arena_len = b.need;
+            continue;
+        }
+        for (size_t i = 0; ok && i < b.count; ++i)
+            ok = fn(arg, b.records + i);
+    }
+
+    dbi->destroy_cursor(&cur);
+    free(b.arena);
+    free(b.records);
+    return ok;
+}
+
+struct Copy {
+    struct DbInterface *dbi;
+    void *db;
+    struct MigrateSum *sum;
+    unsigned long pending;      /* writes in the open transaction */
+};
+
+static bool
+commit(struct Copy *c) {
+    if (c->pending > 0 && c->dbi->commit && !c->dbi->commit(c->db)) {
+        fprintf(stderr, "Could not commit transaction: %s\n",
+                c->dbi->strerror(c->dbi->get_errno(c->db)));
+        return false;
+    }
+    c->pending = 0;
+    return true;
+}
+
+static bool
+copy_record(void *arg, const struct CursorRecord *r) {
+    struct Copy *c = arg;
+
+    if (c->pending == 0 && c->dbi->begin && !c->dbi->begin(c->db)) {
+        fprintf(stderr, "Could not begin transaction: %s\n",
+                c->dbi->strerror(c->dbi->get_errno(c->db)));
+        return false;
+    }
+    if (!dbi_store(c->dbi, c->db, r->key, r->klen, r->value, r->vlen, true)) {
+        fprintf(stderr, "Could not write '%.*s': %s\n", (int) r->klen, r->key,
+                c->dbi->strerror(c->dbi->get_errno(c->db)));
+        if (c->dbi->abort)
+            c->dbi->abort(c->db);
+        c->pending = 0;
+        return false;
+    }
+    add_record(c->sum, r);
+    return ++c->pending < MIGRATE_BATCH || commit(c);
+}
+
+bool
+migrate_copy(struct DbInterface *src, void *sdb, struct DbInterface *dst,
+        void *ddb, struct MigrateSum *sum) {
+    struct Copy c = { dst, ddb, sum, 0 };
+
+    memset(sum, 0, sizeof(*sum));
+    return each_record(src, sdb, copy_record, &c) && commit(&c);
+}
+
+static bool
+sum_record(void *arg, const struct CursorRecord *r) {
+    add_record(arg, r);
+    return true;
+}
+
+bool
+migrate_sum(struct DbInterface *dbi, void *db, struct MigrateSum *sum) {
+    memset(sum, 0, sizeof(*sum));
+    return each_record(dbi, db, sum_record, sum);
+}
@@ -0,0 +1,36 @@
+#ifndef MIGRATE_H__
+#define MIGRATE_H__
+
+/* Copy a drop database into another backend, for 'drop migrate'.
+ *
+ * Records are read through the source cursor a batch at a time and written to
+ * the destination in transactions of MIGRATE_BATCH, so memory stays bounded
+ * whatever the size of the database.  Both sides are summed as they are read:
+ * the record count and the sum of a 64-bit hash of each key and value, which
+ * does not depend on the order the backends keep their records in.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "db.h"
+
+#define MIGRATE_BATCH 10000
+
+struct MigrateSum {
+    unsigned long long records;
+    uint64_t checksum;
+};
+
+/* Write every record of src into dst, which should be empty, and sum what
+ * was read.  Returns false after printing an error.
+ */
+bool migrate_copy(struct DbInterface *src, void *sdb, struct DbInterface *dst,
+                  void *ddb, struct MigrateSum *sum);
+
+/* Sum every record of db the way migrate_copy sums the source.  Returns
+ * false after printing an error.
+ */
+bool migrate_sum(struct DbInterface *dbi, void *db, struct MigrateSum *sum);
+
+#endif /* MIGRATE_H__ */
@@ -0,0 +1,311 @@
+/* prof.c
+ * Phase timings and database counters for 'drop --stats'.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <malloc.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "db.h"
+#include "layer.h"
+#include "prof.h"
+
+bool prof_enabled = false;
+
+static const char *report_file;
+
+static const char *phase_names[PHASE_COUNT] = {
+    "connect", "locate", "app_path", "dlopen", "open", "index", "run",
+    "close", "stats"
+};
+
+static struct {
+    struct timespec start;
+    double total;       /* seconds */
+    unsigned long runs;
+} phases[PHASE_COUNT];
+
+/* What passed through the counting layer. */
+static struct {
+    unsigned long long fetches, fetch_bytes;
+    unsigned long long stores, store_bytes;
+    unsigned long long deletes;
+    unsigned long long cursor_records, cursor_bytes;
+} counts;
+
+void
+prof_enable(const char *file) {
+    prof_enabled = true;
+    report_file = file;
+}
+
+void
+prof_begin(enum Phase phase) {
+    clock_gettime(CLOCK_MONOTONIC, &phases[phase].start);
+}
+
+void
+prof_end(enum Phase phase) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    phases[phase].total += (end.tv_sec - phases[phase].start.tv_sec)
+                         + (end.tv_nsec - phases[phase].start.tv_nsec) / 1e9;
+    ++phases[phase].runs;
+}
+
+static char *
+count_fetch(struct Layer *l, const char *key) {
+    char *value = l->dbi->fetch(l->db, key);
+    if (value != NULL) {
+        ++counts.fetches;
+        counts.fetch_bytes += strlen(value);
+    }
+    return value;
+}
+
+static char *
+count_fetch_len(struct Layer *l, const char *key, size_t klen, size_t *vlen) {
+    char *value = l->dbi->fetch_len(l->db, key, klen, vlen);
+    if (value != NULL) {
+        ++counts.fetches;
+        counts.fetch_bytes += *vlen;
+    }
+    return value;
+}
+
+static const char *
+count_fetch_borrow(struct Layer *l, const char *key, size_t klen,
+        size_t *vlen) {
+    const char *value = l->dbi->fetch_borrow(l->db, key, klen, vlen);
+    if (value != NULL) {
+        ++counts.fetches;
+        counts.fetch_bytes += *vlen;
+    }
+    return value;
+}
+
+struct many {
+    value_callback cb;
+    void *arg;
+};
+
+static bool
+count_value(void *arg, size_t index, const char *value, size_t vlen) {
+    struct many *m = arg;
+    if (value != NULL) {
+        ++counts.fetches;
+        counts.fetch_bytes += vlen;
+    }
+    return m->cb(m->arg, index, value, vlen);
+}
+
+static bool
+count_fetch_many(struct Layer *l, size_t count, const char *const *keys,
+        const size_t *klens, value_callback cb, void *arg) {
+    struct many m = { cb, arg };
+    return l->dbi->fetch_many(l->db, count, keys, klens, count_value, &m);
+}
+
+static bool
+count_locate(struct Layer *l, const char *key, size_t klen, int *fd,
+        uint64_t *off, size_t *vlen) {
+    if (!l->dbi->locate(l->db, key, klen, fd, off, vlen))
+        return false;
+    ++counts.fetches;
+    counts.fetch_bytes += *vlen;
+    return true;
+}
+
+static bool
+count_store(struct Layer *l, char *key, char *value) {
+    if (!l->dbi->store(l->db, key, value))
+        return false;
+    ++counts.stores;
+    counts.store_bytes += strlen(value);
+    return true;
+}
+
+static bool
+count_try_store(struct Layer *l, char *key, char *value) {
+    if (!l->dbi->try_store(l->db, key, value))
+        return false;
+    ++counts.stores;
+    counts.store_bytes += strlen(value);
+    return true;
+}
+
+static bool
+count_store_len(struct Layer *l, const char *key, size_t klen,
+        const char *value, size_t vlen) {
+    if (!l->dbi->store_len(l->db, key, klen, value, vlen))
+        return false;
+    ++counts.stores;
+    counts.store_bytes += vlen;
+    return true;
+}
+
+static bool
+count_try_store_len(struct Layer *l, const char *key, size_t klen,
+        const char *value, size_t vlen) {
+    if (!l->dbi->try_store_len(l->db, key, klen, value, vlen))
+        return false;
+    ++counts.stores;
+    counts.store_bytes += vlen;
+    return true;
+}
+
+static bool
+count_append(struct Layer *l, const char *key, size_t klen, const char *value,
+        size_t vlen) {
+    if (!l->dbi->append(l->db, key, klen, value, vlen))
+        return false;
+    ++counts.stores;
+    counts.store_bytes += vlen;
+    return true;
+}
+
+static bool
+count_delete(struct Layer *l, const char *key) {
+    bool ok = l->dbi->delete(l->db, key);
+    counts.deletes += ok;
+    return ok;
+}
+
+static bool
+count_delete_len(struct Layer *l, const char *key, size_t klen) {
+    bool ok = l->dbi->delete_len(l->db, key, klen);
+    counts.deletes += ok;
+    return ok;
+}
+
+/* A record counts as visited when its key is read, alone or in a batch. */
+static char *
+count_cursor_key(struct Layer *l, void *cursor) {
+    char *key = l->dbi->cursor_key(l->db, cursor);
+    if (key != NULL) {
+        ++counts.cursor_records;
+        counts.cursor_bytes += strlen(key);
+    }
+    return key;
+}
+
+static char *
+count_cursor_value(struct Layer *l, void *cursor) {
+    char *value = l->dbi->cursor_value(l->db, cursor);
+    if (value != NULL)
+        counts.cursor_bytes += strlen(value);
+    return value;
+}
+
+static size_t
+count_cursor_batch(struct Layer *l, void *cursor, struct CursorBatch *b) {
+    size_t n = l->dbi->cursor_batch(l->db, cursor, b);
+    counts.cursor_records += n;
+    for (size_t i = 0; i < n; ++i)
+        counts.cursor_bytes += b->records[i].klen + b->records[i].vlen;
+    return n;
+}
+
+#define COUNT(hook, type, fn) \
+    if (iface->hook != NULL) iface->hook = (type) fn
+
+void *
+prof_attach(struct DbInterface *dbi, void *db, struct DbInterface **out) {
+    struct Layer *l;
+    struct DbInterface *iface;
+
+    if (!prof_enabled || (l = malloc(sizeof(struct Layer))) == NULL)
+        return db;
+    if ((iface = malloc(sizeof(struct DbInterface))) == NULL) {
+        free(l);
+        return db;
+    }
+    l->dbi = dbi;
+    l->db = db;
+
+    layer_forward(iface, dbi);
+    COUNT(fetch, fetch_func, count_fetch);
+    COUNT(fetch_len, fetch_len_func, count_fetch_len);
+    COUNT(fetch_borrow, fetch_borrow_func, count_fetch_borrow);
+    COUNT(fetch_many, fetch_many_func, count_fetch_many);
+    COUNT(locate, locate_func, count_locate);
+    COUNT(store, store_func, count_store);
+    COUNT(try_store, try_store_func, count_try_store);
+    COUNT(store_len, store_len_func, count_store_len);
+    COUNT(try_store_len, try_store_len_func, count_try_store_len);
+    COUNT(append, append_func, count_append);
+    COUNT(delete, delete_func, count_delete);
+    COUNT(delete_len, delete_len_func, count_delete_len);
+    COUNT(cursor_key, cursor_key_func, count_cursor_key);
+    COUNT(cursor_value, cursor_value_func, count_cursor_value);
+    COUNT(cursor_batch, cursor_batch_func, count_cursor_batch);
+
+    *out = iface;
+    return l;
+}
+
+/* The bytes the process moved through read and write calls of any kind,
+ * from /proc/self/io where there is one.
+ */
+static void
+process_io(unsigned long long *rchar, unsigned long long *wchar) {
+    char line[64];
+    FILE *f = fopen("/proc/self/io", "r");
+
+    *rchar = *wchar = 0;
+    if (f == NULL)
+        return;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "rchar: %llu", rchar) != 1)
+            sscanf(line, "wchar: %llu", wchar);
+    }
+    fclose(f);
+}
+
+void
+prof_report(const char *command) {
+    unsigned long long rchar, wchar;
+    struct rusage ru;
+    FILE *f = stderr;
+
+    if (!prof_enabled)
+        return;
+    if (report_file != NULL && (f = fopen(report_file, "a")) == NULL) {
+        perror(report_file);
+        return;
+    }
+    process_io(&rchar, &wchar);
+    if (getrusage(RUSAGE_SELF, &ru) != 0)
+        memset(&ru, 0, sizeof(ru));
+    struct mallinfo2 mi = mallinfo2();
+
+    fprintf(f, "{\"command\":\"%s\",\"phases\":{", command);
+    bool first = true;
+    for (int i = 0; i < PHASE_COUNT; ++i) {
+        if (phases[i].runs == 0)
+            continue;
+        fprintf(f, "%s\"%s\":%.6f", first ? "" : ",", phase_names[i],
+                phases[i].total);
+        first = false;
+    }
+    fprintf(f, "},\"db\":{\"fetches\":%llu,\"fetch_bytes\":%llu,"
+            "\"stores\":%llu,\"store_bytes\":%llu,\"deletes\":%llu,"
+            "\"cursor_records\":%llu,\"cursor_bytes\":%llu},",
+            counts.fetches, counts.fetch_bytes, counts.stores,
+            counts.store_bytes, counts.deletes, counts.cursor_records,
+            counts.cursor_bytes);
+    fprintf(f, "\"process\":{\"read_bytes\":%llu,\"write_bytes\":%llu,"
+            "\"heap_bytes\":%zu,\"max_rss_kb\":%ld,\"minor_faults\":%ld,"
+            "\"major_faults\":%ld}}\n",
+            rchar, wchar, mi.uordblks, ru.ru_maxrss, ru.ru_minflt,
+            ru.ru_majflt);
+    if (f != stderr)
+        fclose(f);
+}
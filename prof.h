@@ -0,0 +1,52 @@
+#ifndef PROF_H__
+#define PROF_H__
+
+/* Where a drop invocation spends its time, for 'drop --stats'.  Each phase
+ * is timed on the monotonic clock and adds up over every time it runs; phases
+ * may nest.  A counting layer over the database tallies the records and bytes
+ * that pass through it.  Nothing is timed or counted unless prof_enable was
+ * called, and the layer is only attached then.
+ */
+
+#include <stdbool.h>
+
+#include "db.h"
+
+enum Phase {
+    PHASE_CONNECT,      /* looking for a server */
+    PHASE_LOCATE,       /* get_db_location's directory scan */
+    PHASE_APP_PATH,     /* searching $PATH for the backends */
+    PHASE_DLOPEN,       /* loading a backend */
+    PHASE_OPEN,
+    PHASE_INDEX,        /* attaching the search index */
+    PHASE_RUN,          /* the operation itself */
+    PHASE_CLOSE,
+    PHASE_STATS,        /* recording access statistics */
+    PHASE_COUNT
+};
+
+extern bool prof_enabled;
+
+#define PROF_BEGIN(phase) \
+    do { if (prof_enabled) prof_begin(phase); } while (0)
+#define PROF_END(phase) \
+    do { if (prof_enabled) prof_end(phase); } while (0)
+
+/* Start timing.  The report goes to file, appended as one line, or to
+ * stderr when file is NULL.
+ */
+void prof_enable(const char *file);
+
+void prof_begin(enum Phase phase);
+void prof_end(enum Phase phase);
+
+/* Layer the counters over dbi and db.  Returns the layer's handle and sets
+ * *out to its interface, or returns db unchanged when timing is off or out of
+ * memory.
+ */
+void *prof_attach(struct DbInterface *dbi, void *db, struct DbInterface **out);
+
+/* Write everything measured as a JSON object. */
+void prof_report(const char *command);
+
+#endif /* PROF_H__ */
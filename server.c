@@ -0,0 +1,932 @@
+/* server.c
+ * A long-lived drop process that keeps the database open and answers
+ * requests over a UNIX socket, plus the DbInterface the client side uses to
+ * talk to it.
+ *
+ * Every request is one frame:  op (1 byte), key length (4), value length (4),
+ * key bytes, value bytes.  A response is a status byte followed by items,
+ * each a 4 byte length and that many bytes, ended by ITEM_END.  A failed
+ * request carries its error message as the only item.  Lengths are in host
+ * byte order since both ends always live on the same machine.
+ *
+ * A fetch_many request packs its keys into the key field, each as a 4 byte
+ * length and the key.  The answer has one item per key, in order, with
+ * ITEM_MISSING in place of the length for keys that do not exist.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "db.h"
+#include "db_util.h"
+#include "io.h"
+#include "server.h"
+#include "trigram.h"
+
+enum Request {
+    REQ_FETCH = 'f',
+    REQ_STORE = 's',
+    REQ_TRY_STORE = 't',
+    REQ_DELETE = 'd',
+    REQ_LIST = 'l',
+    REQ_SEARCH = 'q',
+    REQ_FETCH_MANY = 'm'
+};
+enum Status { RESP_OK = 0, RESP_FAIL = 1 };
+
+#define ITEM_END UINT32_MAX
+#define ITEM_MISSING (UINT32_MAX - 1)
+#define MAX_ITEM (1U << 30)
+#define MAX_CLIENTS 64
+#define FRAME_HEAD 9
+#define BUFFER_MIN 4096
+#define BUFFER_KEEP (1 << 20)   /* larger client buffers are freed when idle */
+
+struct conn {
+    int fd;
+    char *borrowed;     /* last fetch_borrow result, freed on the next */
+};
+
+/* A connection the server answers.  What the client sends is gathered in in
+ * until a whole request has arrived, and the response waits in out until the
+ * client has taken all of it.
+ */
+struct client {
+    int fd;
+    char *in;
+    size_t in_len;
+    size_t in_cap;
+    char *out;
+    size_t out_len;
+    size_t out_sent;
+    size_t out_cap;
+    bool failed;        /* out could not grow; the response is incomplete */
+};
+
+struct remote_cursor {
+    char **keys;
+    size_t count;
+    size_t pos;
+};
+
+static bool send_request(int, enum Request, const char*, size_t, const char*,
+                         size_t);
+static bool reserve(char**, size_t*, size_t);
+static void put(struct client*, const void*, size_t);
+static bool send_response(struct client*, enum Status, const char*, size_t);
+static bool send_error(struct client*, struct DbInterface*, void*);
+static bool send_item(struct client*, const char*);
+static bool send_key(void*, const char*, size_t);
+static bool send_end(struct client*);
+static bool send_value(void*, size_t, const char*, size_t);
+static bool answer_fetch_many(struct DbInterface*, void*, struct client*,
+                              const char*, size_t);
+static char *read_item(int, size_t*, bool*);
+static bool read_status(struct conn*);
+static bool handle_request(struct DbInterface*, void*, struct client*,
+                           const char*);
+static bool read_requests(struct DbInterface*, void*, struct client*);
+static bool write_response(struct client*);
+static void drop_client(struct client*);
+static void on_signal(int);
+static bool peer_is_self(int);
+
+static volatile sig_atomic_t stopping = 0;
+static char last_error[256] = "";
+static int last_errno = 0;
+
+char *
+server_socket_path(void) {
+    const char *env = getenv("DROP_SOCKET");
+    char *path;
+    size_t len;
+
+    if (env != NULL && *env) {
+        return strdup(env);
+    }
+    if ((env = getenv("XDG_RUNTIME_DIR")) != NULL && *env) {
+        len = strlen(env) + sizeof("/drop.sock");
+        if ((path = malloc(len)) != NULL)
+            snprintf(path, len, "%s/drop.sock", env);
+        return path;
+    }
+    len = sizeof("/tmp/drop-.sock") + 20;
+    if ((path = malloc(len)) != NULL)
+        snprintf(path, len, "/tmp/drop-%lu.sock", (unsigned long) getuid());
+    return path;
+}
+
+/* Send a request frame.  key and value may be NULL. */
+static bool
+send_request(int fd, enum Request op, const char *key, size_t key_len,
+        const char *value, size_t value_len) {
+    unsigned char head[FRAME_HEAD];
+    uint32_t klen = key ? key_len : 0;
+    uint32_t vlen = value ? value_len : 0;
+    struct iovec iov[3] = {
+        { head, sizeof(head) },
+        { (void*) key, klen },
+        { (void*) value, vlen }
+    };
+
+    if (key_len > MAX_ITEM || value_len > MAX_ITEM) {
+        errno = EMSGSIZE;
+        return false;
+    }
+    head[0] = op;
+    memcpy(head + 1, &klen, 4);
+    memcpy(head + 5, &vlen, 4);
+    return io_writev(fd, iov, 3);
+}
+
+/* Make room for at least want bytes in *buf. */
+static bool
+reserve(char **buf, size_t *cap, size_t want) {
+    size_t n = *cap > BUFFER_MIN / 2 ? *cap * 2 : BUFFER_MIN;
+    char *p;
+
+    if (want <= *cap)
+        return true;
+    if ((p = realloc(*buf, n > want ? n : want)) == NULL)
+        return false;
+    *buf = p;
+    *cap = n > want ? n : want;
+    return true;
+}
+
+/* Add to the client's pending response.  Once the buffer cannot grow the
+ * rest is dropped and the client is let go.
+ */
+static void
+put(struct client *c, const void *data, size_t len) {
+    if (c->failed || !reserve(&c->out, &c->out_cap, c->out_len + len)) {
+        c->failed = true;
+        return;
+    }
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+}
+
+/* Queue a status byte, an optional single item and the end marker. */
+static bool
+send_response(struct client *c, enum Status status, const char *item,
+        size_t item_len) {
+    unsigned char st = status;
+    uint32_t len = item_len;
+    uint32_t end = ITEM_END;
+
+    put(c, &st, 1);
+    if (item != NULL) {
+        put(c, &len, 4);
+        put(c, item, len);
+    }
+    put(c, &end, 4);
+    return !c->failed;
+}
+
+static bool
+send_error(struct client *c, struct DbInterface *dbi, void *db) {
+    const char *msg = dbi->strerror(dbi->get_errno(db));
+    return send_response(c, RESP_FAIL, msg, strlen(msg));
+}
+
+static bool
+send_item(struct client *c, const char *item) {
+    uint32_t len = strlen(item);
+    put(c, &len, 4);
+    put(c, item, len);
+    return !c->failed;
+}
+
+/* Search callback: send each key as an item.  arg points at the client. */
+static bool
+send_key(void *arg, const char *key, size_t len) {
+    struct client *c = arg;
+    uint32_t l = len;
+    put(c, &l, 4);
+    put(c, key, len);
+    return !c->failed;
+}
+
+static bool
+send_end(struct client *c) {
+    uint32_t end = ITEM_END;
+    put(c, &end, 4);
+    return !c->failed;
+}
+
+/* fetch_many callback: add each value to the response as an item.  arg
+ * points at the client.
+ */
+static bool
+send_value(void *arg, size_t index, const char *value, size_t len) {
+    struct client *c = arg;
+    uint32_t l = value ? len : ITEM_MISSING;
+    (void) index;
+    put(c, &l, 4);
+    if (value != NULL)
+        put(c, value, len);
+    return !c->failed;
+}
+
+/* Unpack the keys of a fetch_many request and answer it.  Should the backend
+ * fail part way, the response ends early and the client reports the missing
+ * items as an error.
+ */
+static bool
+answer_fetch_many(struct DbInterface *dbi, void *db, struct client *c,
+        const char *packed, size_t len) {
+    const char **keys = malloc((len / 4 + 1) * sizeof(char*));
+    size_t *klens = malloc((len / 4 + 1) * sizeof(size_t));
+    const char *p = packed, *end = packed + len;
+    unsigned char st = RESP_OK;
+    size_t count = 0;
+    bool ok = false;
+
+    if (keys == NULL || klens == NULL)
+        goto out;
+    while (end - p >= 4) {
+        uint32_t l;
+        memcpy(&l, p, 4);
+        p += 4;
+        if (l > (size_t) (end - p))
+            goto out;
+        keys[count] = p;
+        klens[count++] = l;
+        p += l;
+    }
+    if (p != end)
+        goto out;
+
+    put(c, &st, 1);
+    dbi_fetch_many(dbi, db, count, keys, klens, send_value, c);
+    ok = send_end(c);
+
+out:
+    free(keys);
+    free(klens);
+    return ok;
+}
+
+/* Read one item, terminated with a NUL for convenience.  Returns NULL with
+ * *end set at the end marker, or NULL with *end clear on error.
+ */
+static char *
+read_item(int fd, size_t *item_len, bool *end) {
+    uint32_t len;
+    char *item;
+
+    *end = false;
+    if (!io_read(fd, &len, 4))
+        return NULL;
+    if (len == ITEM_END) {
+        *end = true;
+        return NULL;
+    }
+    if (len > MAX_ITEM || (item = malloc(len + 1)) == NULL)
+        return NULL;
+    if (!io_read(fd, item, len)) {
+        free(item);
+        return NULL;
+    }
+    item[len] = '\0';
+    if (item_len != NULL)
+        *item_len = len;
+    return item;
+}
+
+/* Read a response status.  On failure the error message is kept for
+ * client_strerror() and the rest of the response is consumed.
+ */
+static bool
+read_status(struct conn *c) {
+    unsigned char st;
+    bool end;
+    char *msg;
+
+    if (!io_read(c->fd, &st, 1)) {
+        last_errno = 1;
+        snprintf(last_error, sizeof(last_error), "lost connection to server");
+        return false;
+    }
+    if (st == RESP_OK)
+        return true;
+
+    last_errno = 1;
+    if ((msg = read_item(c->fd, NULL, &end)) != NULL) {
+        snprintf(last_error, sizeof(last_error), "%s", msg);
+        free(msg);
+        read_item(c->fd, NULL, &end);
+    }
+    return false;
+}
+
+/* Answer one whole request frame, queueing the response on the client.
+ * Returns false when the request cannot be answered.
+ */
+static bool
+handle_request(struct DbInterface *dbi, void *db, struct client *c,
+        const char *frame) {
+    uint32_t klen, vlen;
+    char *key = NULL, *value = NULL;
+    bool ok = false;
+
+    memcpy(&klen, frame + 1, 4);
+    memcpy(&vlen, frame + 5, 4);
+    if ((key = malloc(klen + 1)) == NULL || (value = malloc(vlen + 1)) == NULL)
+        goto out;
+    memcpy(key, frame + FRAME_HEAD, klen);
+    memcpy(value, frame + FRAME_HEAD + klen, vlen);
+    key[klen] = '\0';
+    value[vlen] = '\0';
+
+    switch (frame[0]) {
+        case REQ_FETCH: {
+            size_t len;
+            char *owned;
+            const char *v = dbi_fetch(dbi, db, key, klen, &len, &owned);
+            ok = v ? send_response(c, RESP_OK, v, len)
+                   : send_error(c, dbi, db);
+            free(owned);
+            break;
+        }
+        case REQ_STORE:
+        case REQ_TRY_STORE:
+            ok = dbi_store(dbi, db, key, klen, value, vlen,
+                           frame[0] == REQ_STORE)
+               ? send_response(c, RESP_OK, NULL, 0)
+               : send_error(c, dbi, db);
+            break;
+        case REQ_DELETE:
+            ok = dbi_delete(dbi, db, key, klen)
+               ? send_response(c, RESP_OK, NULL, 0)
+               : send_error(c, dbi, db);
+            break;
+        case REQ_LIST: {
+            unsigned char st = RESP_OK;
+            void *cur = dbi->create_cursor(db);
+            put(c, &st, 1);
+            ok = !c->failed;
+            if (ok && dbi->cursor_first(db, &cur)) {
+                do {
+                    char *k = dbi->cursor_key(db, &cur);
+                    if (k != NULL) {
+                        ok = send_item(c, k);
+                        free(k);
+                    }
+                } while (ok && dbi->cursor_next(db, &cur));
+            }
+            dbi->destroy_cursor(&cur);
+            ok = ok && send_end(c);
+            break;
+        }
+        case REQ_FETCH_MANY:
+            ok = answer_fetch_many(dbi, db, c, key, klen);
+            break;
+        case REQ_SEARCH: {
+            unsigned char st = RESP_OK;
+            put(c, &st, 1);
+            if (dbi->search != NULL)
+                dbi->search(db, key, klen, send_key, c);
+            else
+                trigram_scan(dbi, db, key, klen, send_key, c);
+            ok = send_end(c);
+            break;
+        }
+        default:
+            ok = false;
+            break;
+    }
+
+out:
+    free(key);
+    free(value);
+    return ok;
+}
+
+/* Take what the client has sent so far and answer every whole request in
+ * it; a partial frame waits for the rest.  Returns false when the client went
+ * away or sent something that cannot be answered.
+ */
+static bool
+read_requests(struct DbInterface *dbi, void *db, struct client *c) {
+    size_t done = 0;
+    ssize_t n;
+
+    if (!reserve(&c->in, &c->in_cap, c->in_len + 1))
+        return false;
+    while ((n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len)) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return true;
+        if (errno != EINTR)
+            return false;
+    }
+    if (n == 0)
+        return false;
+    c->in_len += n;
+
+    while (c->in_len - done >= FRAME_HEAD) {
+        const char *frame = c->in + done;
+        uint32_t klen, vlen;
+        size_t need;
+
+        memcpy(&klen, frame + 1, 4);
+        memcpy(&vlen, frame + 5, 4);
+        if (klen > MAX_ITEM || vlen > MAX_ITEM)
+            return false;
+        need = FRAME_HEAD + (size_t) klen + vlen;
+        if (c->in_len - done < need)
+            break;
+        if (!handle_request(dbi, db, c, frame))
+            return false;
+        done += need;
+    }
+    memmove(c->in, c->in + done, c->in_len - done);
+    c->in_len -= done;
+    if (c->in_len >= FRAME_HEAD) {
+        uint32_t klen, vlen;
+        memcpy(&klen, c->in + 1, 4);
+        memcpy(&vlen, c->in + 5, 4);
+        return reserve(&c->in, &c->in_cap, FRAME_HEAD + (size_t) klen + vlen);
+    }
+    return true;
+}
+
+/* Write as much of the pending response as the client will take now. */
+static bool
+write_response(struct client *c) {
+    while (c->out_sent < c->out_len) {
+        ssize_t n = write(c->fd, c->out + c->out_sent,
+                          c->out_len - c->out_sent);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return false;
+        c->out_sent += n;
+    }
+    c->out_len = c->out_sent = 0;
+    if (c->out_cap > BUFFER_KEEP) {
+        free(c->out);
+        c->out = NULL;
+        c->out_cap = 0;
+    }
+    return true;
+}
+
+static void
+drop_client(struct client *c) {
+    close(c->fd);
+    free(c->in);
+    free(c->out);
+}
+
+static void
+on_signal(int sig) {
+    (void) sig;
+    stopping = 1;
+}
+
+/* Clients are served one request at a time, but never wait on each other: a
+ * client that stops half way through sending a request or reading a response
+ * only holds up itself.
+ */
+bool
+serve(struct DbInterface *dbi, void *db, const char *path) {
+    struct sockaddr_un addr;
+    struct pollfd fds[MAX_CLIENTS + 1];
+    struct client clients[MAX_CLIENTS + 1];
+    struct sigaction sa;
+    nfds_t nfds = 1;
+    int lfd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path is too long: %s\n", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+
+    /* Refuse to steal the socket from a live server; clear a stale one. */
+    void *other = client_connect(path);
+    if (other != NULL) {
+        fprintf(stderr, "A drop server is already listening on %s\n", path);
+        close(((struct conn*) other)->fd);
+        free(other);
+        return false;
+    }
+    unlink(path);
+
+    if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        return false;
+    }
+    mode_t mask = umask(077);
+    if (bind(lfd, (struct sockaddr*) &addr, sizeof(addr)) != 0
+    ||  listen(lfd, SOMAXCONN) != 0
+    ||  fcntl(lfd, F_SETFL, O_NONBLOCK) != 0) {
+        fprintf(stderr, "Could not listen on %s: %s\n", path, strerror(errno));
+        umask(mask);
+        close(lfd);
+        return false;
+    }
+    umask(mask);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    fds[0].fd = lfd;
+    fds[0].events = POLLIN;
+    while (!stopping) {
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        for (nfds_t i = 1; i < nfds; ++i) {
+            struct client *c = clients + i;
+            bool ok;
+
+            if (fds[i].revents == 0)
+                continue;
+            if (fds[i].revents & POLLOUT)
+                ok = write_response(c);
+            else if (fds[i].revents & POLLIN)
+                ok = read_requests(dbi, db, c) && !c->failed
+                  && write_response(c);
+            else
+                ok = false;
+            if (!ok) {
+                drop_client(c);
+                --nfds;
+                fds[i] = fds[nfds];
+                clients[i--] = clients[nfds];
+                continue;
+            }
+            /* A client waiting on its response sends nothing more. */
+            fds[i].events = c->out_sent < c->out_len ? POLLOUT : POLLIN;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int cfd = accept(lfd, NULL, NULL);
+            if (cfd < 0)
+                continue;
+            if (nfds == MAX_CLIENTS + 1
+            ||  fcntl(cfd, F_SETFL, O_NONBLOCK) != 0) {
+                close(cfd);
+                continue;
+            }
+            memset(clients + nfds, 0, sizeof(struct client));
+            clients[nfds].fd = cfd;
+            fds[nfds].fd = cfd;
+            fds[nfds].events = POLLIN;
+            fds[nfds].revents = 0;
+            ++nfds;
+        }
+    }
+
+    for (nfds_t i = 1; i < nfds; ++i)
+        drop_client(clients + i);
+    close(lfd);
+    unlink(path);
+    return true;
+}
+
+/* Client side */
+
+/* Whether the process at the other end of fd runs as this user.  Anyone may
+ * create the socket under /tmp before the server does, so a server is only
+ * trusted once the kernel vouches for it.
+ */
+static bool
+peer_is_self(int fd) {
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0
+        && cred.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    return getpeereid(fd, &uid, &gid) == 0 && uid == getuid();
+#endif
+}
+
+void *
+client_connect(const char *path) {
+    struct sockaddr_un addr;
+    struct conn *c;
+    int fd;
+
+    if (path == NULL || strlen(path) >= sizeof(addr.sun_path))
+        return NULL;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return NULL;
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0
+    ||  !peer_is_self(fd)
+    ||  (c = calloc(1, sizeof(struct conn))) == NULL) {
+        close(fd);
+        return NULL;
+    }
+    c->fd = fd;
+    return c;
+}
+
+static bool
+client_close(struct conn *c) {
+    bool ok = close(c->fd) == 0;
+    free(c->borrowed);
+    free(c);
+    return ok;
+}
+
+static char *
+client_fetch_len(struct conn *c, const char *key, size_t klen, size_t *vlen) {
+    char *value;
+    bool end;
+
+    if (!send_request(c->fd, REQ_FETCH, key, klen, NULL, 0) || !read_status(c))
+        return NULL;
+    value = read_item(c->fd, vlen, &end);
+    read_item(c->fd, NULL, &end);
+    return value;
+}
+
+static const char *
+client_fetch_borrow(struct conn *c, const char *key, size_t klen,
+        size_t *vlen) {
+    free(c->borrowed);
+    return c->borrowed = client_fetch_len(c, key, klen, vlen);
+}
+
+static char *
+client_fetch(struct conn *c, const char *key) {
+    return client_fetch_len(c, key, strlen(key), NULL);
+}
+
+/* All the keys go out in one request and the values come back in one
+ * response.  Every item is read even once cb has had enough, to keep the
+ * connection in step.
+ */
+static bool
+client_fetch_many(struct conn *c, size_t count, const char *const *keys,
+        const size_t *klens, value_callback cb, void *arg) {
+    size_t len = 0, seen = 0, cap = 0;
+    char *packed, *p, *value = NULL;
+    bool more = true, ok = false;
+    uint32_t l;
+
+    for (size_t i = 0; i < count; ++i)
+        len += 4 + klens[i];
+    if (len > MAX_ITEM) {
+        last_errno = 1;
+        snprintf(last_error, sizeof(last_error), "too many keys");
+        return false;
+    }
+    if ((packed = p = malloc(len + 1)) == NULL)
+        return false;
+    for (size_t i = 0; i < count; ++i) {
+        l = klens[i];
+        memcpy(p, &l, 4);
+        memcpy(p + 4, keys[i], l);
+        p += 4 + l;
+    }
+    ok = send_request(c->fd, REQ_FETCH_MANY, packed, len, NULL, 0)
+      && read_status(c);
+    free(packed);
+    if (!ok)
+        return false;
+
+    while ((ok = io_read(c->fd, &l, 4)) && l != ITEM_END) {
+        if (seen == count) {
+            ok = false;
+            break;
+        }
+        if (l == ITEM_MISSING) {
+            more = more && cb(arg, seen++, NULL, 0);
+            continue;
+        }
+        if (l > MAX_ITEM) {
+            ok = false;
+            break;
+        }
+        if (l + 1 > cap) {
+            char *v = realloc(value, l + 1);
+            if (v == NULL) {
+                ok = false;
+                break;
+            }
+            value = v;
+            cap = l + 1;
+        }
+        if (!(ok = io_read(c->fd, value, l)))
+            break;
+        value[l] = '\0';
+        more = more && cb(arg, seen++, value, l);
+    }
+    free(value);
+    if (ok && seen == count)
+        return true;
+    last_errno = 1;
+    snprintf(last_error, sizeof(last_error), ok
+             ? "server could not read every value"
+             : "lost connection to server");
+    return false;
+}
+
+static bool
+client_simple(struct conn *c, enum Request op, const char *key, size_t klen,
+        const char *value, size_t vlen) {
+    bool end;
+    if (!send_request(c->fd, op, key, klen, value, vlen) || !read_status(c))
+        return false;
+    read_item(c->fd, NULL, &end);
+    return end;
+}
+
+static bool
+client_store_len(struct conn *c, const char *key, size_t klen,
+        const char *value, size_t vlen) {
+    return client_simple(c, REQ_STORE, key, klen, value, vlen);
+}
+
+static bool
+client_try_store_len(struct conn *c, const char *key, size_t klen,
+        const char *value, size_t vlen) {
+    return client_simple(c, REQ_TRY_STORE, key, klen, value, vlen);
+}
+
+static bool
+client_delete_len(struct conn *c, const char *key, size_t klen) {
+    return client_simple(c, REQ_DELETE, key, klen, NULL, 0);
+}
+
+static bool
+client_store(struct conn *c, char *key, char *value) {
+    return client_store_len(c, key, strlen(key), value, strlen(value));
+}
+
+static bool
+client_try_store(struct conn *c, char *key, char *value) {
+    return client_try_store_len(c, key, strlen(key), value, strlen(value));
+}
+
+static bool
+client_delete(struct conn *c, const char *key) {
+    return client_delete_len(c, key, strlen(key));
+}
+
+static void *
+client_create_cursor(struct conn *c) {
+    (void) c;
+    return calloc(1, sizeof(struct remote_cursor));
+}
+
+/* The key listing is read in full up front so that cursor_value can issue
+ * its own fetch on the same connection.
+ */
+static bool
+client_cursor_first(struct conn *c, struct remote_cursor **cur) {
+    struct remote_cursor *rc = *cur;
+    size_t cap = 0;
+    char *key;
+    bool end;
+
+    if (rc == NULL || !send_request(c->fd, REQ_LIST, NULL, 0, NULL, 0)
+    ||  !read_status(c))
+        return false;
+    while ((key = read_item(c->fd, NULL, &end)) != NULL) {
+        if (rc->count == cap) {
+            cap = cap ? cap * 2 : 64;
+            char **keys = realloc(rc->keys, cap * sizeof(char*));
+            if (keys == NULL) {
+                free(key);
+                return false;
+            }
+            rc->keys = keys;
+        }
+        rc->keys[rc->count++] = key;
+    }
+    rc->pos = 0;
+    return end && rc->count > 0;
+}
+
+static bool
+client_cursor_next(struct conn *c, struct remote_cursor **cur) {
+    (void) c;
+    return ++(*cur)->pos < (*cur)->count;
+}
+
+static char *
+client_cursor_key(struct conn *c, struct remote_cursor **cur) {
+    (void) c;
+    return strdup((*cur)->keys[(*cur)->pos]);
+}
+
+static char *
+client_cursor_value(struct conn *c, struct remote_cursor **cur) {
+    return client_fetch(c, (*cur)->keys[(*cur)->pos]);
+}
+
+static void
+client_destroy_cursor(struct remote_cursor **cur) {
+    if (*cur == NULL)
+        return;
+    for (size_t i = 0; i < (*cur)->count; ++i)
+        free((*cur)->keys[i]);
+    free((*cur)->keys);
+    free(*cur);
+    *cur = NULL;
+}
+
+/* Matches arrive as items; the rest are read off even once cb has had enough,
+ * to keep the connection in step.
+ */
+static bool
+client_search(struct conn *c, const char *term, size_t len, key_callback cb,
+        void *arg) {
+    bool more = true, end;
+    size_t klen;
+    char *key;
+
+    if (!send_request(c->fd, REQ_SEARCH, term, len, NULL, 0)
+    ||  !read_status(c))
+        return false;
+    while ((key = read_item(c->fd, &klen, &end)) != NULL) {
+        if (more)
+            more = cb(arg, key, klen);
+        free(key);
+    }
+    return end;
+}
+
+static int
+client_get_errno(struct conn *c) {
+    (void) c;
+    return last_errno;
+}
+
+static const char *
+client_strerror(int err) {
+    (void) err;
+    return last_error;
+}
+
+static struct DbInterface client = {
+    .close = (close_func) client_close,
+    .get_errno = (errno_func) client_get_errno,
+    .strerror = client_strerror,
+    .delete = (delete_func) client_delete,
+    .fetch = (fetch_func) client_fetch,
+    .try_store = (try_store_func) client_try_store,
+    .store = (store_func) client_store,
+    .delete_len = (delete_len_func) client_delete_len,
+    .fetch_len = (fetch_len_func) client_fetch_len,
+    .fetch_borrow = (fetch_borrow_func) client_fetch_borrow,
+    .fetch_many = (fetch_many_func) client_fetch_many,
+    .try_store_len = (try_store_len_func) client_try_store_len,
+    .store_len = (store_len_func) client_store_len,
+    .create_cursor = (create_cursor_func) client_create_cursor,
+    .destroy_cursor = (destroy_cursor_func) client_destroy_cursor,
+    .cursor_first = (cursor_first_func) client_cursor_first,
+    .cursor_next = (cursor_next_func) client_cursor_next,
+    .cursor_key = (cursor_key_func) client_cursor_key,
+    .cursor_value = (cursor_value_func) client_cursor_value,
+    .search = (search_func) client_search
+};
+
+struct DbInterface *
+client_interface(void) {
+    struct DbInterface *dbint = malloc(sizeof(struct DbInterface));
+    if (dbint == NULL) {
+        return dbint;
+    }
+    memcpy(dbint, &client, sizeof(struct DbInterface));
+    return dbint;
+}
@@ -0,0 +1,29 @@
+#ifndef SERVER_H__
+#define SERVER_H__
+
+#include <stdbool.h>
+
+#include "db.h"
+
+/* Return the path of the drop server socket.  $DROP_SOCKET wins, then
+ * $XDG_RUNTIME_DIR/drop.sock, then /tmp/drop-<uid>.sock.  The caller frees it.
+ */
+char *server_socket_path(void);
+
+/* Answer requests on the socket at path over an already opened database
+ * until SIGINT or SIGTERM.  Returns false if the socket could not be set up.
+ */
+bool serve(struct DbInterface *dbi, void *db, const char *path);
+
+/* Connect to a running server.  Returns NULL when none is listening, or when
+ * the one listening runs as another user, in which case the caller should
+ * open the database itself.
+ */
+void *client_connect(const char *path);
+
+/* A DbInterface whose handle is a connection returned by client_connect().
+ * The caller frees it.
+ */
+struct DbInterface *client_interface(void);
+
+#endif /* SERVER_H__ */
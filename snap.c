@@ -0,0 +1,306 @@
+/* snap.c
+ * Compile the contents of a drop database into a read-only snapshot.  See
+ * snap.h for the file layout; db_snap.c reads it back.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "db.h"
+#include "db_util.h"
+#include "snap.h"
+
+#define MAX_SEED (1U << 24)
+#define MAX_SALTS 8
+#define WRITE_BUFFER (1 << 20)
+
+struct entry {
+    uint64_t hash;
+    uint64_t off;       /* of the record in the file */
+    size_t koff;        /* of the key in the key arena */
+    uint32_t klen;
+    uint32_t vlen;
+    uint32_t bucket;
+};
+
+struct bucket_range {
+    uint32_t start;
+    uint32_t len;
+};
+
+static int
+by_bucket(const void *a, const void *b) {
+    const struct entry *x = a, *y = b;
+    return (x->bucket > y->bucket) - (x->bucket < y->bucket);
+}
+
+static int
+by_size_desc(const void *a, const void *b) {
+    const struct bucket_range *x = a, *y = b;
+    return (x->len < y->len) - (x->len > y->len);
+}
+
+/* Find a displacement seed for every bucket so that all entries land in
+ * distinct slots.  On success slot_of[i] is the entry stored in slot i.
+ */
+static bool
+place(struct entry *e, uint32_t n, const char *keys, uint64_t salt,
+        uint32_t buckets, uint32_t *disp, uint32_t *slot_of) {
+    struct bucket_range *ranges;
+    uint32_t nranges = 0, slots[64];
+    bool ok = true;
+
+    for (uint32_t i = 0; i < n; ++i) {
+        e[i].hash = snap_hash(keys + e[i].koff, e[i].klen, salt);
+        e[i].bucket = snap_bucket(e[i].hash, buckets);
+    }
+    qsort(e, n, sizeof(struct entry), by_bucket);
+
+    if ((ranges = malloc(buckets * sizeof(struct bucket_range))) == NULL)
+        return false;
+    for (uint32_t i = 0; i < n; ) {
+        uint32_t j = i;
+        while (j < n && e[j].bucket == e[i].bucket)
+            ++j;
+        ranges[nranges].start = i;
+        ranges[nranges].len = j - i;
+        ++nranges;
+        i = j;
+    }
+    qsort(ranges, nranges, sizeof(struct bucket_range), by_size_desc);
+
+    memset(disp, 0, buckets * sizeof(uint32_t));
+    for (uint32_t i = 0; i < n; ++i)
+        slot_of[i] = UINT32_MAX;
+
+    for (uint32_t r = 0; ok && r < nranges; ++r) {
+        struct entry *members = e + ranges[r].start;
+        uint32_t len = ranges[r].len, seed;
+
+        if (len > sizeof(slots) / sizeof(slots[0])) {
+            ok = false;
+            break;
+        }
+        for (seed = 0; seed < MAX_SEED; ++seed) {
+            uint32_t k;
+            for (k = 0; k < len; ++k) {
+                slots[k] = snap_slot_index(members[k].hash, seed, n);
+                if (slot_of[slots[k]] != UINT32_MAX)
+                    break;
+                uint32_t m;
+                for (m = 0; m < k && slots[m] != slots[k]; ++m)
+                    ;
+                if (m < k)
+                    break;
+            }
+            if (k == len)
+                break;
+        }
+        if (seed == MAX_SEED) {
+            ok = false;
+            break;
+        }
+        disp[members[0].bucket] = seed;
+        for (uint32_t k = 0; k < len; ++k)
+            slot_of[slots[k]] = ranges[r].start + k;
+    }
+
+    free(ranges);
+    return ok;
+}
+
+/* Record which file source is and how it stands in the header. */
+static bool
+stamp(const char *source, struct snap_header *hdr) {
+    struct stat st;
+
+    if (stat(source, &st) != 0)
+        return false;
+    hdr->source_ino = st.st_ino;
+    hdr->source_size = st.st_size;
+    hdr->source_mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    return true;
+}
+
+bool
+snap_fresh(const char *path, const char *source) {
+    struct snap_header hdr, now;
+    int fd;
+    bool ok;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return false;
+    ok = read(fd, &hdr, sizeof(hdr)) == sizeof(hdr);
+    close(fd);
+    return ok && memcmp(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic)) == 0
+        && stamp(source, &now)
+        && hdr.source_ino == now.source_ino
+        && hdr.source_size == now.source_size
+        && hdr.source_mtime == now.source_mtime;
+}
+
+long
+snap_compile(struct DbInterface *dbi, void *db, const char *source,
+        const char *path) {
+    struct snap_header hdr;
+    struct entry *e = NULL;
+    char *keys = NULL, *tmp = NULL;
+    size_t ecap = 0, kcap = 0, klen_total = 0;
+    uint32_t n = 0, *disp = NULL, *slot_of = NULL;
+    uint64_t off = sizeof(hdr);
+    FILE *out = NULL;
+    long ret = -1;
+
+    size_t tlen = strlen(path) + sizeof(".tmp");
+    if ((tmp = malloc(tlen)) == NULL)
+        goto fail;
+    snprintf(tmp, tlen, "%s.tmp", path);
+    /* The snapshot holds every value, so it is as private as the database. */
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1 || (out = fdopen(fd, "wb")) == NULL) {
+        fprintf(stderr, "Could not create \"%s\": %s\n", tmp, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        goto fail;
+    }
+    setvbuf(out, NULL, _IOFBF, WRITE_BUFFER);
+
+    memset(&hdr, 0, sizeof(hdr));
+    fwrite(&hdr, sizeof(hdr), 1, out);
+
+    /* Taken before reading, so a write made from here on shows as one. */
+    if (!stamp(source, &hdr)) {
+        fprintf(stderr, "Could not stat \"%s\": %s\n", source,
+                strerror(errno));
+        goto fail;
+    }
+
+    /* Stream the records into the data region, keeping only the keys. */
+    void *cur = dbi->create_cursor(db);
+    if (dbi->cursor_first(db, &cur)) {
+        do {
+            char *key = dbi->cursor_key(db, &cur), *owned = NULL;
+            const char *value = NULL;
+            size_t kl = key ? strlen(key) : 0, vl;
+
+            /* Values may hold NULs, so fetch them with their length. */
+            if (key != NULL)
+                value = dbi_fetch(dbi, db, key, kl, &vl, &owned);
+            if (value == NULL) {
+                free(key);
+                continue;
+            }
+
+            if (n == ecap) {
+                ecap = ecap ? ecap * 2 : 1024;
+                struct entry *ne = realloc(e, ecap * sizeof(struct entry));
+                if (ne == NULL)
+                    goto oom;
+                e = ne;
+            }
+            if (klen_total + kl > kcap) {
+                kcap = (kcap ? kcap * 2 : 65536) + kl;
+                char *nk = realloc(keys, kcap);
+                if (nk == NULL)
+                    goto oom;
+                keys = nk;
+            }
+            memcpy(keys + klen_total, key, kl);
+            e[n].koff = klen_total;
+            e[n].off = off;
+            e[n].klen = kl;
+            e[n].vlen = vl;
+            klen_total += kl;
+            ++n;
+
+            fwrite(key, kl + 1, 1, out);
+            fwrite(value, vl + 1, 1, out);
+            off += kl + vl + 2;
+            free(key);
+            free(owned);
+            continue;
+oom:
+            free(key);
+            free(owned);
+            dbi->destroy_cursor(&cur);
+            fprintf(stderr, "snap_compile: out of memory.\n");
+            goto fail;
+        } while (dbi->cursor_next(db, &cur));
+    }
+    dbi->destroy_cursor(&cur);
+
+    while (off % 8 != 0) {
+        fputc('\0', out);
+        ++off;
+    }
+
+    memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+    hdr.count = n;
+    hdr.buckets = n / 4 + 1;
+    hdr.data_off = sizeof(hdr);
+    hdr.disp_off = off;
+    hdr.slot_off = off + ((hdr.buckets * sizeof(uint32_t) + 7) & ~7ULL);
+    hdr.size = hdr.slot_off + (uint64_t) n * sizeof(struct snap_slot);
+
+    if ((disp = malloc(hdr.buckets * sizeof(uint32_t))) == NULL
+    ||  (slot_of = malloc((n ? n : 1) * sizeof(uint32_t))) == NULL) {
+        fprintf(stderr, "snap_compile: out of memory.\n");
+        goto fail;
+    }
+
+    int attempt;
+    for (attempt = 0; attempt < MAX_SALTS; ++attempt) {
+        hdr.salt = attempt * 0x9e3779b97f4a7c15ULL;
+        if (place(e, n, keys, hdr.salt, hdr.buckets, disp, slot_of))
+            break;
+    }
+    if (attempt == MAX_SALTS) {
+        fprintf(stderr, "snap_compile: could not build a perfect hash.\n");
+        goto fail;
+    }
+
+    fwrite(disp, sizeof(uint32_t), hdr.buckets, out);
+    for (uint64_t pad = hdr.disp_off + hdr.buckets * sizeof(uint32_t);
+         pad < hdr.slot_off; ++pad)
+        fputc('\0', out);
+    for (uint32_t i = 0; i < n; ++i) {
+        struct entry *x = e + slot_of[i];
+        struct snap_slot s = { x->off, x->klen, x->vlen };
+        fwrite(&s, sizeof(s), 1, out);
+    }
+
+    rewind(out);
+    fwrite(&hdr, sizeof(hdr), 1, out);
+    if (ferror(out) | fclose(out)) {
+        out = NULL;
+        fprintf(stderr, "Could not write \"%s\": %s\n", tmp, strerror(errno));
+        goto fail;
+    }
+    out = NULL;
+    if (rename(tmp, path) != 0) {
+        fprintf(stderr, "Could not rename \"%s\": %s\n", tmp, strerror(errno));
+        goto fail;
+    }
+    ret = n;
+
+fail:
+    if (out != NULL)
+        fclose(out);
+    if (ret < 0 && tmp != NULL)
+        unlink(tmp);
+    free(tmp);
+    free(e);
+    free(keys);
+    free(disp);
+    free(slot_of);
+    return ret;
+}
@@ -0,0 +1,84 @@
+#ifndef SNAP_H__
+#define SNAP_H__
+
+/* On-disk layout of a compiled, read-only drop snapshot.
+ *
+ *   header | data region | displacement table | slot table
+ *
+ * The data region holds each record as "key\0value\0".  Keys are placed with
+ * a minimal perfect hash (hash and displace): the key hash picks a bucket, the
+ * bucket's displacement seed picks the slot, and every slot holds exactly one
+ * record.  A lookup is one hash, one slot read and one key compare.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "db.h"
+
+#define SNAP_MAGIC "DROPSNP2"
+#define SNAP_SUFFIX ".snap"
+
+struct snap_header {
+    char magic[8];
+    uint64_t salt;        /* mixed into every key hash */
+    uint32_t count;       /* records, and slots */
+    uint32_t buckets;     /* displacement table entries */
+    uint64_t data_off;
+    uint64_t disp_off;    /* uint32_t[buckets] */
+    uint64_t slot_off;    /* struct snap_slot[count] */
+    uint64_t size;        /* total file size */
+    uint64_t source_ino;  /* the database file as compiling began */
+    uint64_t source_size;
+    int64_t source_mtime; /* in nanoseconds */
+};
+
+struct snap_slot {
+    uint64_t off;         /* into the file */
+    uint32_t klen;
+    uint32_t vlen;
+};
+
+static inline uint64_t
+snap_hash(const char *key, size_t len, uint64_t salt) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ salt;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char) key[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static inline uint32_t
+snap_bucket(uint64_t hash, uint32_t buckets) {
+    return (uint32_t) ((hash >> 32) % buckets);
+}
+
+static inline uint32_t
+snap_slot_index(uint64_t hash, uint32_t seed, uint32_t count) {
+    uint64_t x = hash ^ (seed * 0x9e3779b97f4a7c15ULL);
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return (uint32_t) (x % count);
+}
+
+/* Write every record reachable through dbi's cursor to a snapshot at path.
+ * source is the database file, whose state before the first record is read
+ * is kept in the header for snap_fresh.  The file is written aside and
+ * renamed into place.  Returns the number of records written, or -1 after
+ * printing an error.
+ */
+long snap_compile(struct DbInterface *dbi, void *db, const char *source,
+                  const char *path);
+
+/* Whether the snapshot at path still matches the database file source: the
+ * file is the one it was compiled from and has not been written since
+ * compiling began, so a write made while it was compiled makes it stale.
+ */
+bool snap_fresh(const char *path, const char *source);
+
+#endif /* SNAP_H__ */
@@ -0,0 +1,280 @@
+/* stats.c
+ * Per-key access counts and times for a drop database, as an append-only log
+ * next to it.  See stats.h for the record layout.
+ *
+ * Appenders take a shared lock on the log and the reader that rewrites it an
+ * exclusive one, so appends never land in the middle of a rewrite.  The
+ * rewrite goes to a new file that is renamed over the old one; an appender
+ * that was waiting on the old file finds it unlinked and opens the new one.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "io.h"
+#include "stats.h"
+
+/* Rewrite the log once it has this many more records than keys. */
+#define REPEATS_SLACK 1024
+
+static uint32_t
+hash_key(const char *key, size_t len) {
+    uint32_t h = 2166136261U;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char) key[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static bool
+append(struct Hits *hits, const char *key, size_t klen, uint32_t count,
+        int64_t last) {
+    struct stats_record r;
+    size_t need = hits->len + sizeof(r) + klen;
+
+    if (need > hits->cap) {
+        size_t cap = hits->cap ? hits->cap : 256;
+        while (cap < need)
+            cap *= 2;
+        char *buf = realloc(hits->buf, cap);
+        if (buf == NULL)
+            return false;
+        hits->buf = buf;
+        hits->cap = cap;
+    }
+    r.klen = klen;
+    r.count = count;
+    r.last = last;
+    memcpy(hits->buf + hits->len, &r, sizeof(r));
+    memcpy(hits->buf + hits->len + sizeof(r), key, klen);
+    hits->len = need;
+    return true;
+}
+
+bool
+stats_note(struct Hits *hits, const char *key, size_t klen, bool forget) {
+    return append(hits, key, klen, forget ? 0 : 1,
+                  forget ? 0 : (int64_t) time(NULL));
+}
+
+static char *
+stats_path(const char *file, const char *extra) {
+    size_t len = strlen(file) + sizeof(STATS_SUFFIX) + strlen(extra);
+    char *path = malloc(len);
+    if (path != NULL)
+        snprintf(path, len, "%s%s%s", file, STATS_SUFFIX, extra);
+    return path;
+}
+
+static bool
+lock_wait(int fd, short type) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    while (fcntl(fd, F_SETLKW, &fl) != 0) {
+        if (errno != EINTR)
+            return false;
+    }
+    return true;
+}
+
+bool
+stats_flush(struct Hits *hits, const char *file) {
+    char *path;
+    struct stat st;
+    bool ok = false;
+    int fd;
+
+    if (hits->len == 0 || (path = stats_path(file, "")) == NULL)
+        goto done;
+    for (;;) {
+        if ((fd = open(path, O_RDWR | O_CREAT | O_APPEND,
+                       S_IRUSR | S_IWUSR)) < 0)
+            break;
+        if (!lock_wait(fd, F_RDLCK) || fstat(fd, &st) != 0) {
+            close(fd);
+            break;
+        }
+        if (st.st_nlink > 0) {
+            ok = io_write(fd, hits->buf, hits->len);
+            close(fd);
+            break;
+        }
+        close(fd);  /* rewritten while we waited */
+    }
+    free(path);
+done:
+    free(hits->buf);
+    hits->buf = NULL;
+    hits->len = hits->cap = 0;
+    return ok;
+}
+
+static const struct AccessStat *
+find(const struct AccessStats *stats, const char *key, size_t klen,
+        size_t *slot) {
+    size_t mask = stats->nslots - 1;
+    size_t i = hash_key(key, klen) & mask;
+
+    for (; stats->slots[i] != 0; i = (i + 1) & mask) {
+        const struct AccessStat *a = stats->items + stats->slots[i] - 1;
+        if (a->klen == klen && memcmp(a->key, key, klen) == 0)
+            break;
+    }
+    *slot = i;
+    return stats->slots[i] ? stats->items + stats->slots[i] - 1 : NULL;
+}
+
+const struct AccessStat *
+stats_find(const struct AccessStats *stats, const char *key, size_t klen) {
+    size_t slot;
+    if (stats->nslots == 0)
+        return NULL;
+    return find(stats, key, klen, &slot);
+}
+
+/* Write the sums back as the whole log.  Failing leaves the old log, which
+ * still adds up to the same thing.
+ */
+static void
+rewrite(const struct AccessStats *stats, const char *file) {
+    struct Hits out = { NULL, 0, 0 };
+    char *path = stats_path(file, ""), *tmp = stats_path(file, ".tmp");
+    bool ok = path != NULL && tmp != NULL;
+    int fd;
+
+    for (size_t i = 0; ok && i < stats->count; ++i) {
+        const struct AccessStat *a = stats->items + i;
+        ok = append(&out, a->key, a->klen,
+                    a->count > UINT32_MAX ? UINT32_MAX : a->count, a->last);
+    }
+    if (ok && (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC,
+                         S_IRUSR | S_IWUSR)) >= 0) {
+        ok = io_write(fd, out.buf, out.len);
+        if (close(fd) != 0 || !ok || rename(tmp, path) != 0)
+            unlink(tmp);
+    }
+    free(out.buf);
+    free(path);
+    free(tmp);
+}
+
+bool
+stats_load(const char *file, struct AccessStats *stats) {
+    char *path = stats_path(file, "");
+    struct stat st;
+    size_t records = 0, off = 0;
+    bool writable = true;
+    int fd;
+
+    memset(stats, 0, sizeof(*stats));
+    if (path == NULL) {
+        fprintf(stderr, "stats: malloc failed.\n");
+        return false;
+    }
+    if ((fd = open(path, O_RDWR)) < 0 && errno != ENOENT) {
+        writable = false;
+        fd = open(path, O_RDONLY);
+    }
+    if (fd < 0) {
+        bool missing = errno == ENOENT;
+        if (!missing)
+            fprintf(stderr, "Could not open \"%s\": %s\n", path,
+                    strerror(errno));
+        free(path);
+        return missing;
+    }
+    if (!lock_wait(fd, writable ? F_WRLCK : F_RDLCK) || fstat(fd, &st) != 0
+    ||  (stats->data = malloc(st.st_size + 1)) == NULL
+    ||  !io_read(fd, stats->data, st.st_size)) {
+        fprintf(stderr, "Could not read \"%s\": %s\n", path, strerror(errno));
+        goto fail;
+    }
+
+    size_t size = st.st_size, max = size / sizeof(struct stats_record) + 1;
+    stats->nslots = 16;
+    while (stats->nslots < max * 2)
+        stats->nslots *= 2;
+    stats->items = malloc(max * sizeof(*stats->items));
+    stats->slots = calloc(stats->nslots, sizeof(*stats->slots));
+    if (stats->items == NULL || stats->slots == NULL) {
+        fprintf(stderr, "stats: malloc failed.\n");
+        goto fail;
+    }
+
+    /* Sum the log.  Forgotten keys keep their item with a count of 0. */
+    struct stats_record r;
+    while (off + sizeof(r) <= size) {
+        memcpy(&r, stats->data + off, sizeof(r));
+        if (r.klen > size - off - sizeof(r))
+            break;
+        const char *key = stats->data + off + sizeof(r);
+        size_t slot;
+        struct AccessStat *a =
+            (struct AccessStat *) find(stats, key, r.klen, &slot);
+        if (a == NULL) {
+            a = stats->items + stats->count++;
+            a->key = key;
+            a->klen = r.klen;
+            a->count = 0;
+            a->last = 0;
+            stats->slots[slot] = stats->count;
+        }
+        if (r.count == 0) {
+            a->count = 0;
+            a->last = 0;
+        } else {
+            a->count += r.count;
+            if (r.last > a->last)
+                a->last = r.last;
+        }
+        off += sizeof(r) + r.klen;
+        ++records;
+    }
+
+    /* Drop the forgotten keys and index the rest again. */
+    size_t kept = 0;
+    for (size_t i = 0; i < stats->count; ++i) {
+        if (stats->items[i].count > 0)
+            stats->items[kept++] = stats->items[i];
+    }
+    stats->count = kept;
+    memset(stats->slots, 0, stats->nslots * sizeof(*stats->slots));
+    for (size_t i = 0; i < kept; ++i) {
+        size_t slot;
+        find(stats, stats->items[i].key, stats->items[i].klen, &slot);
+        stats->slots[slot] = i + 1;
+    }
+
+    if (writable && (off != size || records > kept * 2 + REPEATS_SLACK))
+        rewrite(stats, file);
+    close(fd);
+    free(path);
+    return true;
+
+fail:
+    close(fd);
+    free(path);
+    stats_free(stats);
+    return false;
+}
+
+void
+stats_free(struct AccessStats *stats) {
+    free(stats->items);
+    free(stats->slots);
+    free(stats->data);
+    memset(stats, 0, sizeof(*stats));
+}
@@ -0,0 +1,70 @@
+#ifndef STATS_H__
+#define STATS_H__
+
+/* Access counts for the keys of a drop database, kept apart from it at
+ * file + STATS_SUFFIX so that a lookup never rewrites a record.
+ *
+ * The file is a log of struct stats_record, each followed by its key.  A
+ * lookup appends a record with a count of one; a delete appends one with a
+ * count of zero, which forgets the key.  Reading the file adds up the counts
+ * and keeps the latest time of each key, and rewrites it in that summed form
+ * once it holds mostly repeats.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define STATS_SUFFIX ".stats"
+
+struct stats_record {
+    uint32_t klen;
+    uint32_t count;       /* 0 forgets the key */
+    int64_t last;         /* seconds since the epoch */
+};
+
+/* Records gathered during one run and appended together. */
+struct Hits {
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+struct AccessStat {
+    const char *key;      /* not terminated */
+    size_t klen;
+    unsigned long count;
+    time_t last;
+};
+
+struct AccessStats {
+    struct AccessStat *items;
+    size_t count;
+    uint32_t *slots;      /* index into items + 1, 0 when empty */
+    size_t nslots;
+    char *data;           /* the file, which the keys point into */
+};
+
+/* Note a lookup of key, or with forget set its deletion.  Returns false when
+ * out of memory.
+ */
+bool stats_note(struct Hits *hits, const char *key, size_t klen, bool forget);
+
+/* Append the noted records to the statistics of the database at file and
+ * empty hits.  Statistics are advisory, so the caller need not report a
+ * failure.
+ */
+bool stats_flush(struct Hits *hits, const char *file);
+
+/* Read the statistics of the database at file.  A missing file has none.
+ * Returns false after printing an error.
+ */
+bool stats_load(const char *file, struct AccessStats *stats);
+
+const struct AccessStat *stats_find(const struct AccessStats *stats,
+                                    const char *key, size_t klen);
+
+void stats_free(struct AccessStats *stats);
+
+#endif /* STATS_H__ */
@@ -0,0 +1,146 @@
+#!/bin/sh
+# test.sh
+# Run drop end to end against throwaway databases.  drop and the backends are
+# copied into a directory of their own that is put on PATH, so drop finds
+# them the way an installed drop does rather than through ./drop.
+#
+#   TEST_DROP   drop binary to test                   (default ./drop)
+
+set -e
+
+here=$(cd "$(dirname "$0")" && pwd)
+drop=${TEST_DROP:-$here/drop}
+work=$(mktemp -d "${TMPDIR:-/tmp}/drop-test.XXXXXX")
+trap 'rm -rf "$work"' EXIT INT TERM
+
+mkdir "$work/bin" "$work/data"
+cp "$drop" "$work/bin/drop"
+cp "$here"/db_*.so "$work/bin/"
+PATH=/usr/bin:/bin:$work/bin
+export PATH
+export XDG_DATA_HOME="$work/data"
+export DROP_SOCKET="$work/none.sock"
+unset XDG_RUNTIME_DIR
+
+failed=0
+
+fail() {
+    echo "FAIL: $*" >&2
+    failed=1
+}
+
+# Start a database of the given extension with a few records.  drop makes a
+# gdbm one when there is none.
+fresh() {
+    rm -rf "$work/data"/*
+    [ "$1" = dbm ] || : > "$work/data/drop.$1"
+    printf 'k1 v1\nk2 v2\nk3 v3\n' | drop import 2>/dev/null
+}
+
+# A fresh install has no database until the first command makes one.
+rm -rf "$work/data"/*
+if [ "$(drop 2>&1)" != "Database is empty." ]; then
+    fail "listing without a database"
+fi
+rm -rf "$work/data"/*
+if drop missing 2>&1 | grep -q "Could not open" \
+|| drop get a b 2>&1 | grep -q "Could not open"; then
+    fail "lookups without a database"
+fi
+
+# migrate loads a second backend, finding it through PATH again.
+for to in log dbm; do
+    case $to in log) from=dbm ;; dbm) from=log ;; esac
+    fresh "$from"
+    if ! drop migrate --to=$to 2>/dev/null; then
+        fail "migrate from $from to $to"
+    elif [ "$(drop k2)" != v2 ] || [ -e "$work/data/drop.$from.migrate" ]
+    then
+        fail "migrated $from database reads back wrong"
+    fi
+done
+
+# The search index stays current under the value store's layer.
+fresh dbm
+big=$(awk 'BEGIN { while (n++ < 200) printf "y" }')
+printf 'a1 %s\na2 %s\n' "$big" "$big" | drop import 2>/dev/null
+drop dedup 2>/dev/null
+if ! drop reindex 2>/dev/null; then
+    fail "reindex with a value store"
+fi
+printf 'k4 needle\n' | drop import 2>/dev/null
+if [ "$(drop search needle)" != k4 ] \
+|| ! grep -q k4 "$work/data/drop.dbm.tri" \
+|| [ "$(drop search yyy | tr '\n' ' ')" != "a1 a2 " ]; then
+    fail "search index with a value store"
+fi
+
+# Exporting through the value store gives every record its own value, and
+# the export loads back into a new database unchanged.
+fresh log
+awk 'BEGIN {
+    for (i = 0; i < 200; ++i) pad = pad "z"
+    for (i = 1; i <= 30000; ++i)
+        print "k" i, (i % 3 ? "value" (i % 7) pad : "own" i)
+}' > "$work/in"
+drop import "$work/in" 2>/dev/null
+drop dedup 2>/dev/null
+tolines='s/^{"key": *"\([^"]*\)", *"value": *"\([^"]*\)"}$/\1 \2/'
+drop export 2>/dev/null | sed "$tolines" | sort > "$work/out"
+sort "$work/in" | cmp -s - "$work/out" || fail "export through the value store"
+mkdir "$work/again"
+XDG_DATA_HOME="$work/again" drop import "$work/out" 2>/dev/null
+XDG_DATA_HOME="$work/again" drop export 2>/dev/null | sed "$tolines" | sort \
+    | cmp -s - "$work/out" || fail "re-import of an export through the value store"
+
+# A value piped in comes back out byte for byte.
+fresh dbm
+head -c 100000 /dev/urandom > "$work/value"
+drop add bin < "$work/value" 2>/dev/null
+drop bin > "$work/out"
+cmp -s "$work/value" "$work/out" || fail "binary value changed on the way"
+
+# A snapshot is only read while it matches the database, and one whose slots
+# point outside it is passed over for the database.
+fresh log
+drop compile 2>/dev/null
+printf 'k2 new\n' | drop import 2>/dev/null
+[ "$(drop k2)" = new ] || fail "stale snapshot read"
+drop compile 2>/dev/null
+snap="$work/data/drop.log.snap"
+printf '\377\377\377\377\377\377\377\177' \
+    | dd of="$snap" bs=1 seek=$(($(wc -c < "$snap") - 16)) conv=notrunc \
+      2>/dev/null
+if [ "$(drop k1)$(drop k2)$(drop k3)" != v1newv3 ]; then
+    fail "snapshot with a slot out of bounds"
+fi
+
+# A writer open before the first backup started the journal still notes its
+# writes for the next one.
+fresh log
+mkfifo "$work/fifo"
+drop import < "$work/fifo" 2>/dev/null &
+exec 3> "$work/fifo"
+sleep 1
+drop backup "$work/first" 2>/dev/null
+echo 'late v4' >&3
+exec 3>&-
+wait
+drop backup "$work/first" 2>/dev/null
+if [ "$(XDG_DATA_HOME="$work/first" drop late 2>/dev/null)" != v4 ]; then
+    fail "write of a writer open before the first backup"
+fi
+
+# Files holding values are only readable by their owner.
+private() {
+    [ "$(ls -l "$1" | cut -c1-10)" = "-rw-------" ] || fail "$1 is not private"
+}
+
+fresh dbm
+drop compile 2>/dev/null
+private "$work/data/drop.dbm.snap"
+drop backup "$work/backup" 2>/dev/null
+private "$work/backup/drop.dbm.position"
+
+[ $failed = 0 ] && echo "All tests passed."
+exit $failed
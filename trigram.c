@@ -0,0 +1,755 @@
+/* trigram.c
+ * A trigram index over the keys and values of a drop database, kept in a
+ * second database of the same type next to it.  Each distinct three byte
+ * sequence in a record's key or value maps to a posting list of the keys
+ * holding it, stored as "key\0key\0...".  A search intersects the lists for
+ * the trigrams of the term and reads only the records that survive.
+ *
+ * Values over MAX_INDEXED bytes are not broken up; their keys go on a single
+ * UNINDEXED_KEY list that every search checks.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "db.h"
+#include "db_util.h"
+#include "layer.h"
+#include "trigram.h"
+
+#define MAX_INDEXED (1 << 16)
+#define UNINDEXED (1U << 24)
+#define UNINDEXED_KEY "unindexed"
+#define EMPTY UINT32_MAX
+
+/* Posting list additions are gathered in memory during a transaction and
+ * written once per list when it commits, or sooner past this many bytes.
+ */
+#define PENDING_MAX (32 << 20)
+
+/* A sorted set of trigrams, each three bytes packed into the low 24 bits. */
+struct tset {
+    uint32_t *t;
+    size_t n;
+    size_t cap;
+};
+
+struct pending {
+    uint32_t tri;       /* EMPTY when the slot is free */
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+struct index {
+    struct Layer base;
+    struct DbInterface *tdbi;   /* the backend's own, for the index */
+    void *tdb;          /* the index */
+    char *path;
+    bool batch;
+    struct pending *pend;
+    size_t pend_cap;    /* a power of two */
+    size_t pend_used;
+    size_t pend_bytes;
+    struct tset from;
+    struct tset to;
+    char *entry;        /* "key\0" for the record being updated */
+    size_t entry_cap;
+};
+
+struct postings {
+    char *buf;
+    size_t len;
+};
+
+static bool
+tset_push(struct tset *s, uint32_t t) {
+    if (s->n == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 256;
+        uint32_t *nt = realloc(s->t, cap * sizeof(uint32_t));
+        if (nt == NULL)
+            return false;
+        s->t = nt;
+        s->cap = cap;
+    }
+    s->t[s->n++] = t;
+    return true;
+}
+
+static bool
+tset_add(struct tset *s, const char *str, size_t len) {
+    const unsigned char *p = (const unsigned char*) str;
+    for (size_t i = 0; i + 2 < len; ++i) {
+        if (!tset_push(s, (uint32_t) p[i] << 16 | p[i + 1] << 8 | p[i + 2]))
+            return false;
+    }
+    return true;
+}
+
+static int
+by_trigram(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+    return (x > y) - (x < y);
+}
+
+static void
+tset_finish(struct tset *s) {
+    size_t n = 0;
+    if (s->n == 0)
+        return;
+    qsort(s->t, s->n, sizeof(uint32_t), by_trigram);
+    for (size_t i = 0; i < s->n; ++i) {
+        if (n == 0 || s->t[n - 1] != s->t[i])
+            s->t[n++] = s->t[i];
+    }
+    s->n = n;
+}
+
+/* The trigrams filed under for a record; empty when value is NULL. */
+static bool
+tset_record(struct tset *s, const char *key, size_t klen, const char *value,
+        size_t vlen) {
+    s->n = 0;
+    if (value == NULL)
+        return true;
+    if (vlen > MAX_INDEXED)
+        return tset_push(s, UNINDEXED);
+    if (!tset_add(s, key, klen) || !tset_add(s, value, vlen))
+        return false;
+    tset_finish(s);
+    return true;
+}
+
+static size_t
+posting_key(uint32_t t, char *buf) {
+    if (t == UNINDEXED) {
+        memcpy(buf, UNINDEXED_KEY, sizeof(UNINDEXED_KEY) - 1);
+        return sizeof(UNINDEXED_KEY) - 1;
+    }
+    buf[0] = t >> 16;
+    buf[1] = t >> 8;
+    buf[2] = t;
+    return 3;
+}
+
+static bool
+contains(const char *hay, size_t hlen, const char *needle, size_t nlen) {
+    const char *end = hay + hlen, *p = hay;
+
+    if (nlen == 0)
+        return true;
+    while (nlen <= (size_t) (end - p)
+       &&  (p = memchr(p, needle[0], end - p - nlen + 1)) != NULL) {
+        if (memcmp(p, needle, nlen) == 0)
+            return true;
+        ++p;
+    }
+    return false;
+}
+
+/* Find the entry "key\0" in a posting list. */
+static const char *
+find_entry(const char *list, size_t len, const char *entry, size_t elen) {
+    const char *end = list + len, *p = list, *nul;
+    while (p < end && (nul = memchr(p, '\0', end - p)) != NULL) {
+        if ((size_t) (nul - p) + 1 == elen && memcmp(p, entry, elen) == 0)
+            return p;
+        p = nul + 1;
+    }
+    return NULL;
+}
+
+static bool
+posting_append(struct index *ix, uint32_t t, const char *data, size_t len) {
+    struct DbInterface *dbi = ix->tdbi;
+    char k[16], *owned, *joined;
+    size_t kl = posting_key(t, k), ol;
+    const char *old;
+    bool ok;
+
+    if (dbi->append != NULL)
+        return dbi->append(ix->tdb, k, kl, data, len);
+    if ((old = dbi_fetch(dbi, ix->tdb, k, kl, &ol, &owned)) == NULL)
+        return dbi_store(dbi, ix->tdb, k, kl, data, len, true);
+    if ((joined = malloc(ol + len)) == NULL) {
+        free(owned);
+        return false;
+    }
+    memcpy(joined, old, ol);
+    memcpy(joined + ol, data, len);
+    free(owned);
+    ok = dbi_store(dbi, ix->tdb, k, kl, joined, ol + len, true);
+    free(joined);
+    return ok;
+}
+
+static struct pending *
+pending_find(struct index *ix, uint32_t t) {
+    if (ix->pend_cap == 0)
+        return NULL;
+    size_t mask = ix->pend_cap - 1;
+    for (size_t i = (t * 2654435761U) & mask; ; i = (i + 1) & mask) {
+        if (ix->pend[i].tri == t || ix->pend[i].tri == EMPTY)
+            return ix->pend + i;
+    }
+}
+
+static bool
+pending_grow(struct index *ix) {
+    struct pending *old = ix->pend;
+    size_t old_cap = ix->pend_cap, cap = old_cap ? old_cap * 2 : 4096;
+
+    if ((ix->pend = malloc(cap * sizeof(struct pending))) == NULL) {
+        ix->pend = old;
+        return false;
+    }
+    ix->pend_cap = cap;
+    for (size_t i = 0; i < cap; ++i)
+        ix->pend[i].tri = EMPTY;
+    for (size_t i = 0; i < old_cap; ++i) {
+        if (old[i].tri != EMPTY)
+            *pending_find(ix, old[i].tri) = old[i];
+    }
+    free(old);
+    return true;
+}
+
+static bool
+pending_flush_one(struct index *ix, struct pending *p) {
+    bool ok = p->len == 0 || posting_append(ix, p->tri, p->buf, p->len);
+    ix->pend_bytes -= p->len;
+    p->len = 0;
+    return ok;
+}
+
+/* Write out every gathered addition and empty the table. */
+static bool
+pending_flush(struct index *ix) {
+    bool ok = true;
+    for (size_t i = 0; i < ix->pend_cap; ++i) {
+        struct pending *p = ix->pend + i;
+        if (p->tri == EMPTY)
+            continue;
+        ok = pending_flush_one(ix, p) && ok;
+        free(p->buf);
+        p->tri = EMPTY;
+    }
+    ix->pend_used = 0;
+    ix->pend_bytes = 0;
+    return ok;
+}
+
+static void
+pending_discard(struct index *ix) {
+    for (size_t i = 0; i < ix->pend_cap; ++i) {
+        if (ix->pend[i].tri != EMPTY)
+            free(ix->pend[i].buf);
+        ix->pend[i].tri = EMPTY;
+    }
+    ix->pend_used = 0;
+    ix->pend_bytes = 0;
+}
+
+static bool
+pending_add(struct index *ix, uint32_t t, const char *entry, size_t elen) {
+    struct pending *p;
+
+    if ((ix->pend_used + 1) * 2 > ix->pend_cap && !pending_grow(ix))
+        return false;
+    if ((p = pending_find(ix, t))->tri == EMPTY) {
+        memset(p, 0, sizeof(struct pending));
+        p->tri = t;
+        ++ix->pend_used;
+    }
+    if (p->len + elen > p->cap) {
+        size_t cap = (p->cap ? p->cap * 2 : 64) + elen;
+        char *buf = realloc(p->buf, cap);
+        if (buf == NULL)
+            return false;
+        p->buf = buf;
+        p->cap = cap;
+    }
+    memcpy(p->buf + p->len, entry, elen);
+    p->len += elen;
+    ix->pend_bytes += elen;
+    return true;
+}
+
+static bool
+posting_remove(struct index *ix, uint32_t t, const char *entry, size_t elen) {
+    struct DbInterface *dbi = ix->tdbi;
+    struct pending *p = pending_find(ix, t);
+    char k[16], *owned, *rest;
+    size_t kl = posting_key(t, k), ol;
+    const char *old, *at;
+    bool ok;
+
+    /* An addition still in memory has to land before it can be taken out. */
+    if (p != NULL && p->tri == t && !pending_flush_one(ix, p))
+        return false;
+    if ((old = dbi_fetch(dbi, ix->tdb, k, kl, &ol, &owned)) == NULL)
+        return true;
+    if ((at = find_entry(old, ol, entry, elen)) == NULL) {
+        free(owned);
+        return true;
+    }
+
+    size_t before = at - old, after = ol - before - elen;
+    if (before + after == 0) {
+        free(owned);
+        return dbi_delete(dbi, ix->tdb, k, kl);
+    }
+    if ((rest = malloc(before + after)) == NULL) {
+        free(owned);
+        return false;
+    }
+    memcpy(rest, old, before);
+    memcpy(rest + before, at + elen, after);
+    free(owned);
+    ok = dbi_store(dbi, ix->tdb, k, kl, rest, before + after, true);
+    free(rest);
+    return ok;
+}
+
+/* Move key from the lists in ix->from to those in ix->to. */
+static bool
+index_apply(struct index *ix, const char *key, size_t klen) {
+    size_t i = 0, j = 0, elen = klen + 1;
+    bool ok = true;
+
+    if (elen > ix->entry_cap) {
+        char *e = realloc(ix->entry, elen);
+        if (e == NULL)
+            return false;
+        ix->entry = e;
+        ix->entry_cap = elen;
+    }
+    memcpy(ix->entry, key, klen);
+    ix->entry[klen] = '\0';
+
+    while (ok && (i < ix->from.n || j < ix->to.n)) {
+        if (j == ix->to.n || (i < ix->from.n && ix->from.t[i] < ix->to.t[j]))
+            ok = posting_remove(ix, ix->from.t[i++], ix->entry, elen);
+        else if (i == ix->from.n || ix->to.t[j] < ix->from.t[i])
+            ok = pending_add(ix, ix->to.t[j++], ix->entry, elen);
+        else
+            ++i, ++j;
+    }
+    if (ok && (!ix->batch || ix->pend_bytes > PENDING_MAX))
+        ok = pending_flush(ix);
+    return ok;
+}
+
+static void
+index_stale(void) {
+    fprintf(stderr, "Could not update the search index; run "
+            "\"drop reindex\".\n");
+}
+
+/* Note the lists the stored record for key is on before it is written. */
+static bool
+index_before(struct index *ix, const char *key, size_t klen) {
+    size_t vlen;
+    char *owned;
+    const char *value = dbi_fetch(ix->base.dbi, ix->base.db, key, klen, &vlen,
+                                  &owned);
+    bool ok = tset_record(&ix->from, key, klen, value, vlen);
+    free(owned);
+    return ok;
+}
+
+/* The record has been written, and stays written even when the index cannot
+ * follow it, so this only complains.
+ */
+static void
+index_after(struct index *ix, bool noted, const char *key, size_t klen,
+        const char *value, size_t vlen) {
+    if (!noted || !tset_record(&ix->to, key, klen, value, vlen)
+    ||  !index_apply(ix, key, klen))
+        index_stale();
+}
+
+static bool
+index_store_len(struct index *ix, const char *key, size_t klen,
+        const char *value, size_t vlen) {
+    struct Layer *l = &ix->base;
+    bool noted = index_before(ix, key, klen);
+
+    if (!dbi_store(l->dbi, l->db, key, klen, value, vlen, true))
+        return false;
+    index_after(ix, noted, key, klen, value, vlen);
+    return true;
+}
+
+static bool
+index_try_store_len(struct index *ix, const char *key, size_t klen,
+        const char *value, size_t vlen) {
+    struct Layer *l = &ix->base;
+
+    if (!dbi_store(l->dbi, l->db, key, klen, value, vlen, false))
+        return false;
+    ix->from.n = 0;
+    index_after(ix, true, key, klen, value, vlen);
+    return true;
+}
+
+static bool
+index_delete_len(struct index *ix, const char *key, size_t klen) {
+    struct Layer *l = &ix->base;
+    bool noted = index_before(ix, key, klen);
+
+    if (!dbi_delete(l->dbi, l->db, key, klen))
+        return false;
+    index_after(ix, noted, key, klen, NULL, 0);
+    return true;
+}
+
+static bool
+index_store(struct index *ix, char *key, char *value) {
+    return index_store_len(ix, key, strlen(key), value, strlen(value));
+}
+
+static bool
+index_try_store(struct index *ix, char *key, char *value) {
+    return index_try_store_len(ix, key, strlen(key), value, strlen(value));
+}
+
+static bool
+index_delete(struct index *ix, const char *key) {
+    return index_delete_len(ix, key, strlen(key));
+}
+
+static bool
+index_begin(struct index *ix) {
+    struct DbInterface *dbi = ix->base.dbi;
+    if (!dbi->begin(ix->base.db))
+        return false;
+    if (!ix->tdbi->begin(ix->tdb)) {
+        dbi->abort(ix->base.db);
+        return false;
+    }
+    ix->batch = true;
+    return true;
+}
+
+static bool
+index_commit(struct index *ix) {
+    struct DbInterface *dbi = ix->base.dbi;
+    bool ok = pending_flush(ix) && ix->tdbi->commit(ix->tdb);
+    ix->batch = false;
+    if (!ok)
+        index_stale();
+    return dbi->commit(ix->base.db);
+}
+
+/* When the database cannot roll back, what was written stays and the index
+ * has to keep up with it.
+ */
+static bool
+index_abort(struct index *ix) {
+    struct DbInterface *dbi = ix->base.dbi;
+    bool ok = dbi->abort(ix->base.db);
+    if (ok) {
+        pending_discard(ix);
+        ix->tdbi->abort(ix->tdb);
+    } else {
+        pending_flush(ix);
+        ix->tdbi->commit(ix->tdb);
+    }
+    ix->batch = false;
+    return ok;
+}
+
+static bool
+index_close(struct index *ix) {
+    struct DbInterface *dbi = ix->base.dbi;
+    bool ok = pending_flush(ix);
+
+    ok = ix->tdbi->close(ix->tdb) && ok;
+    free(ix->tdbi);
+    free(ix->pend);
+    free(ix->from.t);
+    free(ix->to.t);
+    free(ix->entry);
+    free(ix->path);
+    dbi->close(ix->base.db);
+    free(dbi);
+    free(ix);
+    return ok;
+}
+
+static bool
+matches(const char *key, size_t klen, const char *value, size_t vlen,
+        const char *term, size_t len) {
+    return contains(key, klen, term, len)
+        || (value != NULL && contains(value, vlen, term, len));
+}
+
+bool
+trigram_scan(struct DbInterface *dbi, void *db, const char *term, size_t len,
+        key_callback cb, void *arg) {
+    void *cur = dbi->create_cursor(db);
+    bool more = true;
+
+    if (dbi->cursor_first(db, &cur)) {
+        do {
+            char *key = dbi->cursor_key(db, &cur), *owned;
+            size_t klen, vlen;
+            const char *value;
+
+            if (key == NULL)
+                continue;
+            klen = strlen(key);
+            value = dbi_fetch(dbi, db, key, klen, &vlen, &owned);
+            if (matches(key, klen, value, vlen, term, len))
+                more = cb(arg, key, klen);
+            free(owned);
+            free(key);
+        } while (more && dbi->cursor_next(db, &cur));
+    }
+    dbi->destroy_cursor(&cur);
+    return true;
+}
+
+static int
+by_length(const void *a, const void *b) {
+    const struct postings *x = a, *y = b;
+    return (x->len > y->len) - (x->len < y->len);
+}
+
+static int
+by_key(const void *a, const void *b) {
+    return strcmp(*(char * const*) a, *(char * const*) b);
+}
+
+static size_t
+count_postings(const struct postings *p) {
+    size_t n = 0;
+    for (size_t i = 0; i < p->len; ++i)
+        n += i == 0 || p->buf[i - 1] == '\0';
+    return n;
+}
+
+/* Point keys at each entry of a posting list, sorted.  Returns the count. */
+static size_t
+split_postings(const struct postings *p, char **keys) {
+    size_t n = 0;
+    for (size_t i = 0; i < p->len; i += strlen(p->buf + i) + 1)
+        keys[n++] = p->buf + i;
+    qsort(keys, n, sizeof(char*), by_key);
+    return n;
+}
+
+/* Copy out a posting list with a NUL after it, so a damaged last entry still
+ * ends.
+ */
+static bool
+fetch_postings(struct index *ix, uint32_t t, struct postings *p) {
+    char k[16], *owned;
+    size_t kl = posting_key(t, k);
+    const char *list = dbi_fetch(ix->tdbi, ix->tdb, k, kl, &p->len, &owned);
+
+    if (list == NULL || (p->buf = malloc(p->len + 1)) == NULL) {
+        free(owned);
+        p->buf = NULL;
+        p->len = 0;
+        return false;
+    }
+    memcpy(p->buf, list, p->len);
+    p->buf[p->len] = '\0';
+    free(owned);
+    return true;
+}
+
+/* Intersect the posting lists of the term's trigrams, smallest first, add the
+ * records too large to index, and check each survivor against the term.
+ */
+static bool
+index_search(struct index *ix, const char *term, size_t len, key_callback cb,
+        void *arg) {
+    struct Layer *l = &ix->base;
+    struct tset s = { NULL, 0, 0 };
+    struct postings *lists = NULL, big = { NULL, 0 };
+    char **cand = NULL, **next = NULL;
+    size_t n = 0, nlists = 0;
+    bool ok = false;
+
+    if (len < 3)
+        return trigram_scan(l->dbi, l->db, term, len, cb, arg);
+    if (!pending_flush(ix) || !tset_add(&s, term, len))
+        goto out;
+    tset_finish(&s);
+    if ((lists = calloc(s.n, sizeof(struct postings))) == NULL)
+        goto out;
+
+    for (nlists = 0; nlists < s.n; ++nlists) {
+        if (!fetch_postings(ix, s.t[nlists], lists + nlists))
+            break;
+    }
+    fetch_postings(ix, UNINDEXED, &big);
+
+    if (nlists == s.n) {
+        qsort(lists, nlists, sizeof(struct postings), by_length);
+        if ((cand = malloc((count_postings(lists) + count_postings(&big) + 1)
+                           * sizeof(char*))) == NULL)
+            goto out;
+        n = split_postings(lists, cand);
+        for (size_t i = 1; i < nlists && n > 0; ++i) {
+            size_t m = count_postings(lists + i), kept = 0, a = 0, b = 0;
+            if ((next = malloc((m + 1) * sizeof(char*))) == NULL)
+                goto out;
+            m = split_postings(lists + i, next);
+            while (a < n && b < m) {
+                int c = strcmp(cand[a], next[b]);
+                if (c == 0)
+                    cand[kept++] = cand[a];
+                a += c <= 0;
+                b += c >= 0;
+            }
+            n = kept;
+            free(next);
+            next = NULL;
+        }
+    } else if ((cand = malloc((count_postings(&big) + 1) * sizeof(char*)))
+               == NULL) {
+        goto out;
+    }
+    n += split_postings(&big, cand + n);
+    qsort(cand, n, sizeof(char*), by_key);
+
+    ok = true;
+    for (size_t i = 0; i < n; ++i) {
+        size_t klen = strlen(cand[i]), vlen;
+        char *owned;
+        const char *value = dbi_fetch(l->dbi, l->db, cand[i], klen, &vlen,
+                                      &owned);
+        bool more = true;
+        if (value != NULL && matches(cand[i], klen, value, vlen, term, len))
+            more = cb(arg, cand[i], klen);
+        free(owned);
+        if (!more)
+            break;
+    }
+
+out:
+    for (size_t i = 0; i < nlists; ++i)
+        free(lists[i].buf);
+    free(lists);
+    free(big.buf);
+    free(cand);
+    free(next);
+    free(s.t);
+    return ok;
+}
+
+/* Fill an empty index from every record in the database. */
+static bool
+index_build(struct index *ix) {
+    struct Layer *l = &ix->base;
+    void *cur = l->dbi->create_cursor(l->db);
+    bool ok = true;
+
+    ix->batch = true;
+    if (ix->tdbi->begin != NULL)
+        ix->tdbi->begin(ix->tdb);
+    if (l->dbi->cursor_first(l->db, &cur)) {
+        do {
+            char *key = l->dbi->cursor_key(l->db, &cur), *owned;
+            size_t klen, vlen;
+            const char *value;
+
+            if (key == NULL)
+                continue;
+            klen = strlen(key);
+            value = dbi_fetch(l->dbi, l->db, key, klen, &vlen, &owned);
+            ix->from.n = 0;
+            ok = tset_record(&ix->to, key, klen, value, vlen)
+              && index_apply(ix, key, klen);
+            free(owned);
+            free(key);
+        } while (ok && l->dbi->cursor_next(l->db, &cur));
+    }
+    l->dbi->destroy_cursor(&cur);
+    ok = pending_flush(ix) && ok;
+    if (ix->tdbi->commit != NULL)
+        ok = ix->tdbi->commit(ix->tdb) && ok;
+    ix->batch = false;
+    return ok;
+}
+
+void *
+trigram_attach(struct DbInterface *dbi, void *db,
+        const struct DbInterface *backend, const char *file, bool create,
+        struct DbInterface **out) {
+    struct index *ix;
+    struct DbInterface *iface;
+    size_t len = strlen(file) + sizeof(TRIGRAM_SUFFIX);
+    bool exists;
+
+    if (backend->open == NULL
+    ||  (ix = calloc(1, sizeof(struct index))) == NULL)
+        return NULL;
+    if ((ix->path = malloc(len)) == NULL
+    ||  (ix->tdbi = malloc(sizeof(struct DbInterface))) == NULL
+    ||  (iface = malloc(sizeof(struct DbInterface))) == NULL) {
+        free(ix->tdbi);
+        free(ix->path);
+        free(ix);
+        return NULL;
+    }
+    memcpy(ix->tdbi, backend, sizeof(struct DbInterface));
+    snprintf(ix->path, len, "%s%s", file, TRIGRAM_SUFFIX);
+
+    exists = access(ix->path, F_OK) == 0;
+    if ((!exists && !create)
+    ||  (ix->tdb = backend->open(ix->path, DB_WRITE)) == NULL) {
+        if (exists || create)
+            fprintf(stderr, "Could not open search index: %s\n", ix->path);
+        free(iface);
+        free(ix->tdbi);
+        free(ix->path);
+        free(ix);
+        return NULL;
+    }
+    ix->base.dbi = dbi;
+    ix->base.db = db;
+
+    if (!exists && !index_build(ix)) {
+        fprintf(stderr, "Could not build search index: %s\n",
+                backend->strerror(backend->get_errno(ix->tdb)));
+        backend->close(ix->tdb);
+        unlink(ix->path);
+        free(iface);
+        free(ix->tdbi);
+        free(ix->path);
+        free(ix);
+        return NULL;
+    }
+
+    layer_forward(iface, dbi);
+    iface->close = (close_func) index_close;
+    iface->delete = (delete_func) index_delete;
+    iface->try_store = (try_store_func) index_try_store;
+    iface->store = (store_func) index_store;
+    iface->delete_len = (delete_len_func) index_delete_len;
+    iface->try_store_len = (try_store_len_func) index_try_store_len;
+    iface->store_len = (store_len_func) index_store_len;
+    iface->search = (search_func) index_search;
+    /* Appended pieces would have to be indexed across their seams, so
+     * callers are made to hand over whole values instead. */
+    iface->append = NULL;
+    if (dbi->begin != NULL && dbi->commit != NULL && dbi->abort != NULL) {
+        iface->begin = (begin_func) index_begin;
+        iface->commit = (commit_func) index_commit;
+        iface->abort = (abort_func) index_abort;
+    }
+
+    *out = iface;
+    return ix;
+}
@@ -0,0 +1,28 @@
+#ifndef TRIGRAM_H__
+#define TRIGRAM_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "db.h"
+
+#define TRIGRAM_SUFFIX ".tri"
+
+/* Layer the trigram index for the database at file over dbi and db.  The
+ * index is a database of the same type at file + TRIGRAM_SUFFIX, opened
+ * through backend, the interface beneath any layers dbi already has; it is
+ * copied, so it need only last the call.  When the index does not exist it
+ * is built from the database if create is set.  Returns the
+ * layer's handle and sets *out to its interface, or NULL when there is no
+ * index to use.  Writes through the layer keep the index current, and its
+ * search call only looks at records holding every trigram of the term.
+ */
+void *trigram_attach(struct DbInterface *dbi, void *db,
+                     const struct DbInterface *backend, const char *file,
+                     bool create, struct DbInterface **out);
+
+/* Search without an index by reading every record. */
+bool trigram_scan(struct DbInterface *dbi, void *db, const char *term,
+                  size_t len, key_callback cb, void *arg);
+
+#endif /* TRIGRAM_H__ */
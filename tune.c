@@ -0,0 +1,83 @@
+/* tune.c
+ * Read the per-database settings file described in tune.h.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tune.h"
+
+bool
+tune_load(const char *file, struct Tuning *t) {
+    char line[256], *path;
+    size_t len = strlen(file) + sizeof(TUNE_SUFFIX);
+    FILE *f;
+
+    t->count = 0;
+    if ((path = malloc(len)) == NULL)
+        return false;
+    snprintf(path, len, "%s%s", file, TUNE_SUFFIX);
+    f = fopen(path, "r");
+    free(path);
+    if (f == NULL)
+        return errno == ENOENT;
+
+    while (fgets(line, sizeof(line), f) != NULL && t->count < TUNE_MAX) {
+        struct Setting *s = t->settings + t->count;
+        char *name = line + strspn(line, " \t"), *value;
+        size_t nlen = strcspn(name, " \t\n");
+
+        if (*name == '#' || nlen == 0 || nlen >= sizeof(s->name))
+            continue;
+        value = name + nlen;
+        value += strspn(value, " \t");
+        size_t vlen = strcspn(value, "\n");
+        while (vlen > 0 && (value[vlen - 1] == ' ' || value[vlen - 1] == '\t'))
+            --vlen;
+        if (vlen == 0 || vlen >= sizeof(s->value))
+            continue;
+
+        memcpy(s->name, name, nlen);
+        s->name[nlen] = '\0';
+        memcpy(s->value, value, vlen);
+        s->value[vlen] = '\0';
+        ++t->count;
+    }
+    fclose(f);
+    return true;
+}
+
+/* Later lines win, so search from the end. */
+const char *
+tune_get(const struct Tuning *t, const char *name) {
+    for (size_t i = t->count; i-- > 0; ) {
+        if (strcmp(t->settings[i].name, name) == 0)
+            return t->settings[i].value;
+    }
+    return NULL;
+}
+
+long long
+tune_number(const struct Tuning *t, const char *name, long long def) {
+    const char *value = tune_get(t, name);
+    char *end;
+    long long n;
+
+    if (value == NULL)
+        return def;
+    errno = 0;
+    n = strtoll(value, &end, 10);
+    if (errno != 0 || end == value)
+        return def;
+    switch (*end) {
+        case 'k': case 'K': n *= 1024LL; ++end; break;
+        case 'm': case 'M': n *= 1024LL * 1024; ++end; break;
+        case 'g': case 'G': n *= 1024LL * 1024 * 1024; ++end; break;
+    }
+    return *end == '\0' ? n : def;
+}
@@ -0,0 +1,39 @@
+#ifndef TUNE_H__
+#define TUNE_H__
+
+/* Per-database settings for the backends, kept in file + TUNE_SUFFIX next to
+ * the database as "name value" lines; '#' starts a comment.  Each backend
+ * applies the names it knows when it opens the file and reports them in its
+ * info call.  A missing file means every setting has its default.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define TUNE_SUFFIX ".tune"
+#define TUNE_MAX 32
+
+struct Setting {
+    char name[32];
+    char value[64];
+};
+
+struct Tuning {
+    struct Setting settings[TUNE_MAX];
+    size_t count;
+};
+
+/* Read the settings for the database at file.  Lines that do not fit are
+ * skipped.  Returns false only when the file exists but cannot be read.
+ */
+bool tune_load(const char *file, struct Tuning *t);
+
+/* The value of name, or NULL when it is not set. */
+const char *tune_get(const struct Tuning *t, const char *name);
+
+/* The value of name as a number, or def when it is not set or not a number.
+ * A k, m or g suffix multiplies by 1024, 1024^2 or 1024^3.
+ */
+long long tune_number(const struct Tuning *t, const char *name, long long def);
+
+#endif /* TUNE_H__ */